@@ -0,0 +1,185 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#include "AmAdmissionCtrl.h"
+
+#include <algorithm>
+
+#include "AmRequest.h"
+#include "PerfTrace.h"
+#include "util/Log.h"
+#include "util/timeutils.h"
+
+namespace fds {
+
+// Weight of a new sample in the smoothed latencies
+static constexpr double ewma_weight = 0.125;
+// What's left of the limit after a decrease
+static constexpr double decrease_factor = 0.7;
+// How many of its SLOs a missed one holds back looser volumes for
+static constexpr fds_uint64_t pressure_slos = 4;
+
+AmAdmissionCtrl::AmAdmissionCtrl(fds_uint64_t const _base_slo_usec,
+                                 size_t const _min_outstanding,
+                                 size_t const _max_outstanding,
+                                 size_t const _max_waiting)
+    : base_slo_usec(_base_slo_usec),
+      min_outstanding(std::max(_min_outstanding, (size_t)1)),
+      max_outstanding(std::max(_max_outstanding, std::max(_min_outstanding, (size_t)1))),
+      max_waiting(_max_waiting)
+{
+}
+
+bool
+AmAdmissionCtrl::controlled(AmRequest const* amReq) {
+    // Only data requests, volume and tx operations are never held back
+    switch (amReq->io_type) {
+        case FDS_GET_BLOB:
+        case FDS_PUT_BLOB:
+        case FDS_PUT_BLOB_ONCE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void
+AmAdmissionCtrl::registerVolume(fds_volid_t const vol_id, fds_uint32_t const priority) {
+    if (!enabled()) return;
+    SCOPEDWRITE(map_lock);
+    auto& vol = volumes[vol_id];
+    if (!vol) {
+        vol.reset(new Volume());
+        vol->limit = max_outstanding;
+    }
+    std::lock_guard<std::mutex> g(vol->lock);
+    vol->slo_usec = base_slo_usec * std::max(priority, 1u);
+    LOGDEBUG << "vol:" << vol_id << " slo:" << vol->slo_usec << " latency slo";
+}
+
+void
+AmAdmissionCtrl::removeVolume(fds_volid_t const vol_id, std::deque<AmRequest*>& waiting) {
+    SCOPEDWRITE(map_lock);
+    auto it = volumes.find(vol_id);
+    if (volumes.end() != it) {
+        waiting.swap(it->second->waiting);
+        volumes.erase(it);
+    }
+}
+
+AmAdmissionCtrl::Admission
+AmAdmissionCtrl::admit(AmRequest* amReq) {
+    amReq->admit_ts = util::getTimeStampNanos();
+    if (!enabled() || !controlled(amReq)) {
+        return Admission::ADMITTED;
+    }
+
+    SCOPEDREAD(map_lock);
+    auto it = volumes.find(amReq->io_vol_id);
+    if (volumes.end() == it) {
+        return Admission::ADMITTED;
+    }
+    auto& vol = *it->second;
+    std::lock_guard<std::mutex> g(vol.lock);
+    if (vol.waiting.empty() && (vol.outstanding < vol.limit)) {
+        ++vol.outstanding;
+        return Admission::ADMITTED;
+    }
+    if (vol.waiting.size() >= max_waiting) {
+        account(PerfEventType::AM_ADMISSION_REJECTED, amReq->io_vol_id, 1, 0);
+        return Admission::REJECTED;
+    }
+    vol.waiting.push_back(amReq);
+    return Admission::WAITING;
+}
+
+void
+AmAdmissionCtrl::decrease(Volume& vol, fds_uint64_t const now, double const rtt_usec) {
+    // Once per round trip, what completes in the meantime was sent before
+    if ((now - vol.last_decrease) > static_cast<fds_uint64_t>(rtt_usec * 1000)) {
+        vol.limit = std::max(min_outstanding, vol.limit * decrease_factor);
+        vol.last_decrease = now;
+    }
+}
+
+void
+AmAdmissionCtrl::complete(AmRequest* amReq, std::vector<AmRequest*>& admitted) {
+    if (!enabled() || !controlled(amReq) || (0 == amReq->admit_ts)) {
+        return;
+    }
+
+    auto const vol_id = amReq->io_vol_id;
+    auto const now = amReq->io_done_ts;
+    double const latency = (now > amReq->admit_ts) ? (now - amReq->admit_ts) / 1000.0 : 0.0;
+    double const service = amReq->io_service_time;
+    double const delay = std::max(latency - service, 0.0);
+    account(PerfEventType::AM_ADMISSION_QUEUE_DELAY, vol_id, delay * 1000, 1);
+    account(PerfEventType::AM_ADMISSION_SERVICE_TIME, vol_id, service * 1000, 1);
+
+    SCOPEDREAD(map_lock);
+    auto it = volumes.find(vol_id);
+    if (volumes.end() == it) {
+        return;
+    }
+    auto& vol = *it->second;
+    std::lock_guard<std::mutex> g(vol.lock);
+    if (0 < vol.outstanding) {
+        --vol.outstanding;
+    }
+    vol.queue_delay += ewma_weight * (delay - vol.queue_delay);
+    vol.service_time += ewma_weight * (service - vol.service_time);
+    auto const rtt = vol.queue_delay + vol.service_time;
+
+    if (latency > vol.slo_usec) {
+        // Missed our SLO, make the looser volumes yield too
+        decrease(vol, now, rtt);
+        auto tightest = pressure_slo.load(std::memory_order_relaxed);
+        if ((now >= pressure_until.load(std::memory_order_relaxed)) || (vol.slo_usec <= tightest)) {
+            pressure_slo.store(vol.slo_usec, std::memory_order_relaxed);
+            pressure_until.store(now + vol.slo_usec * 1000 * pressure_slos,
+                                 std::memory_order_relaxed);
+        }
+    } else if ((vol.slo_usec > pressure_slo.load(std::memory_order_relaxed))
+               && (now < pressure_until.load(std::memory_order_relaxed))) {
+        // Within our SLO, but a tighter one is not
+        decrease(vol, now, rtt);
+    } else {
+        vol.limit = std::min(max_outstanding, vol.limit + (1.0 / vol.limit));
+    }
+    account(PerfEventType::AM_ADMISSION_LIMIT, vol_id, static_cast<uint64_t>(vol.limit), 1);
+    admitWaiting(vol, admitted);
+}
+
+void
+AmAdmissionCtrl::cancel(AmRequest* amReq, std::vector<AmRequest*>& admitted) {
+    if (!enabled() || !controlled(amReq)) {
+        return;
+    }
+    SCOPEDREAD(map_lock);
+    auto it = volumes.find(amReq->io_vol_id);
+    if (volumes.end() != it) {
+        auto& vol = *it->second;
+        std::lock_guard<std::mutex> g(vol.lock);
+        if (0 < vol.outstanding) {
+            --vol.outstanding;
+        }
+        admitWaiting(vol, admitted);
+    }
+}
+
+void
+AmAdmissionCtrl::account(PerfEventType const type, fds_volid_t const vol_id,
+                         uint64_t const val, uint64_t const cnt) {
+    PerfTracer::incr(type, vol_id, val, cnt);
+}
+
+void
+AmAdmissionCtrl::admitWaiting(Volume& vol, std::vector<AmRequest*>& admitted) {
+    while (!vol.waiting.empty() && (vol.outstanding < vol.limit)) {
+        admitted.push_back(vol.waiting.front());
+        vol.waiting.pop_front();
+        ++vol.outstanding;
+    }
+}
+
+}  // namespace fds
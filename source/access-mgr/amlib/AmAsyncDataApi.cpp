@@ -387,6 +387,43 @@ void AmAsyncDataApi::updateBlobOnce(RequestHandle const& requestId,
     amProcessor->enqueueRequest(blobReq);
 }
 
+void AmAsyncDataApi::updateBlobOnceMulti(std::vector<RequestHandle> const& requestIds,
+                                         shared_string_type& domainName,
+                                         shared_string_type& volumeName,
+                                         shared_string_type& blobName,
+                                         shared_int_type& blobMode,
+                                         std::vector<shared_buffer_type> const& objects,
+                                         std::vector<uint64_t> const& objectOffsets,
+                                         shared_meta_type& metadata) {
+    fds_verify(!objects.empty());
+    fds_verify(objects.size() == objectOffsets.size());
+    fds_verify(objects.size() == requestIds.size());
+
+    // Closure for response call, every update shares the outcome
+    auto closure = [p = responseApi, requestIds](UpdateBlobCallback* cb, fpi::ErrorCode const& e) mutable -> void {
+        for (auto const& requestId : requestIds) {
+            p->updateBlobOnceResp(e, requestId);
+        }
+    };
+
+    auto callback = create_async_handler<UpdateBlobCallback>(std::move(closure));
+
+    auto blobReq = new PutBlobReq(invalid_vol_id,
+                                  *volumeName,
+                                  *blobName,
+                                  objectOffsets.front(),
+                                  objects.front()->size(),
+                                  objects.front(),
+                                  *blobMode,
+                                  metadata,
+                                  callback);
+    blobReq->more_objects.reserve(objects.size() - 1);
+    for (size_t i = 1; objects.size() > i; ++i) {
+        blobReq->more_objects.push_back({objectOffsets[i], objects[i], ObjectID()});
+    }
+    amProcessor->enqueueRequest(blobReq);
+}
+
 void AmAsyncDataApi::updateBlob(RequestHandle const& requestId,
                                    shared_string_type& domainName,
                                    shared_string_type& volumeName,
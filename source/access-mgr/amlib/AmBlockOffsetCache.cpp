@@ -0,0 +1,161 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#include "AmBlockOffsetCache.h"
+
+#include <cstring>
+
+#include "fds_process.h"
+
+namespace fds {
+
+AmBlockOffsetCache::AmBlockOffsetCache(size_t const max_volume_bytes)
+    : max_pages(max_volume_bytes / sizeof(Page))
+{
+}
+
+AmBlockOffsetCache::Volume*
+AmBlockOffsetCache::getVolume(fds_volid_t const vol_id) const {
+    auto it = volumes.find(vol_id);
+    return (volumes.end() == it) ? nullptr : it->second.get();
+}
+
+Error
+AmBlockOffsetCache::addVolume(fds_volid_t const vol_id, fds_uint64_t const object_size) {
+    if (!enabled() || 0 == object_size) {
+        return ERR_INVALID;
+    }
+    SCOPEDWRITE(map_lock);
+    if (0 < volumes.count(vol_id)) {
+        return ERR_VOL_DUPLICATE;
+    }
+    volumes[vol_id].reset(new Volume(object_size));
+    LOGDEBUG << "volid:" << vol_id << " pages:" << max_pages << " caching block offsets";
+    return ERR_OK;
+}
+
+void
+AmBlockOffsetCache::removeVolume(fds_volid_t const vol_id) {
+    SCOPEDWRITE(map_lock);
+    volumes.erase(vol_id);
+}
+
+void
+AmBlockOffsetCache::clear(fds_volid_t const vol_id) {
+    SCOPEDREAD(map_lock);
+    auto vol = getVolume(vol_id);
+    if (vol) {
+        std::lock_guard<std::mutex> g(vol->lock);
+        vol->pages.clear();
+        vol->lru.clear();
+    }
+}
+
+bool
+AmBlockOffsetCache::handles(fds_volid_t const vol_id, std::string const& blob_name) const {
+    SCOPEDREAD(map_lock);
+    auto vol = getVolume(vol_id);
+    if (!vol) {
+        return false;
+    }
+    std::lock_guard<std::mutex> g(vol->lock);
+    return vol->blob_name.empty() || (blob_name == vol->blob_name);
+}
+
+Error
+AmBlockOffsetCache::get(fds_volid_t const vol_id,
+                        std::string const& blob_name,
+                        fds_uint64_t const offset,
+                        ObjectID::ptr& obj_id) {
+    SCOPEDREAD(map_lock);
+    auto vol = getVolume(vol_id);
+    if (!vol) {
+        return ERR_VOL_NOT_FOUND;
+    }
+
+    auto const index = offset / vol->object_size;
+    std::lock_guard<std::mutex> g(vol->lock);
+    if (blob_name != vol->blob_name || 0 != (offset % vol->object_size)) {
+        return ERR_NOT_FOUND;
+    }
+    auto it = vol->pages.find(index / page_entries);
+    if (vol->pages.end() == it || !it->second->valid.test(index % page_entries)) {
+        return ERR_NOT_FOUND;
+    }
+    auto& page = *it->second;
+    vol->lru.splice(vol->lru.begin(), vol->lru, page.lru_pos);
+    obj_id = boost::make_shared<ObjectID>(page.digests[index % page_entries]);
+    return ERR_OK;
+}
+
+bool
+AmBlockOffsetCache::add(fds_volid_t const vol_id,
+                        std::string const& blob_name,
+                        fds_uint64_t const offset,
+                        ObjectID const& obj_id,
+                        bool const dirty) {
+    SCOPEDREAD(map_lock);
+    auto vol = getVolume(vol_id);
+    if (!vol) {
+        return false;
+    }
+
+    auto const index = offset / vol->object_size;
+    auto const page_no = index / page_entries;
+    std::lock_guard<std::mutex> g(vol->lock);
+    if (vol->blob_name.empty()) {
+        vol->blob_name = blob_name;
+    } else if (blob_name != vol->blob_name) {
+        return false;
+    }
+    if (0 != (offset % vol->object_size)) {
+        return false;
+    }
+
+    auto it = vol->pages.find(page_no);
+    if (vol->pages.end() == it) {
+        std::unique_ptr<Page> page;
+        if (vol->pages.size() >= max_pages) {
+            // Reuse the least recently used page
+            auto victim = vol->pages.find(vol->lru.back());
+            page.swap(victim->second);
+            vol->pages.erase(victim);
+            vol->lru.pop_back();
+            page->valid.reset();
+            page->clean.reset();
+        } else {
+            page.reset(new Page());
+        }
+        vol->lru.push_front(page_no);
+        page->lru_pos = vol->lru.begin();
+        it = vol->pages.emplace(page_no, std::move(page)).first;
+    } else {
+        vol->lru.splice(vol->lru.begin(), vol->lru, it->second->lru_pos);
+    }
+
+    auto& page = *it->second;
+    auto const slot = index % page_entries;
+    if (dirty && page.clean.test(slot)) {
+        LOGDEBUG << "Skipping cache of dirty entry.";
+        return false;
+    }
+    memcpy(page.digests[slot], obj_id.GetId(), OBJECTID_DIGESTLEN);
+    page.valid.set(slot);
+    page.clean.set(slot, !dirty);
+    return true;
+}
+
+void
+AmBlockOffsetCache::remove(fds_volid_t const vol_id, std::string const& blob_name) {
+    SCOPEDREAD(map_lock);
+    auto vol = getVolume(vol_id);
+    if (vol) {
+        std::lock_guard<std::mutex> g(vol->lock);
+        if (blob_name == vol->blob_name) {
+            vol->pages.clear();
+            vol->lru.clear();
+        }
+    }
+}
+
+}  // namespace fds
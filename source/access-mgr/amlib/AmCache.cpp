@@ -7,7 +7,9 @@
 #include <fds_process.h>
 #include <PerfTrace.h>
 #include <lib/StatsCollector.h>
+#include "AmBlockOffsetCache.h"
 #include "AmDispatcher.h"
+#include "AmReadAhead.h"
 #include "AmTxDescriptor.h"
 #include "requests/AttachVolumeReq.h"
 #include "requests/CommitBlobTxReq.h"
@@ -37,6 +39,13 @@ AmCache::AmCache(AmDataProvider* prev)
     max_metadata_entries = std::min((uint64_t)LLONG_MAX, (uint64_t)conf.get<int64_t>("cache.max_metadata_entries"));
     // This is in terms of MiB
     max_volume_data = Mi * conf.get<fds_uint32_t>("cache.max_volume_data");
+    // Also MiB, 0 keeps block volume offsets in the keyed offset cache
+    block_offset_cache.reset(
+        new AmBlockOffsetCache(Mi * conf.get<fds_uint32_t>("cache.max_block_offset_data", 16)));
+
+    // Window is in objects, 0 disables read ahead
+    read_ahead.reset(new AmReadAhead(conf.get<fds_uint32_t>("cache.readahead.max_window", 16),
+                                     conf.get<fds_uint32_t>("cache.readahead.max_streams", 1024)));
 }
 
 AmCache::~AmCache() = default;
@@ -49,9 +58,31 @@ AmCache::done() {
             return false;
         }
     }
+    if (0 < prefetches_in_flight.load(std::memory_order_acquire)) {
+        return false;
+    }
     return AmDataProvider::done();
 }
 
+void
+AmCache::registerVolume(VolumeDesc const& volDesc) {
+    if (fpi::FDSP_VOL_BLKDEV_TYPE == volDesc.volType || fpi::FDSP_VOL_ISCSI_TYPE == volDesc.volType) {
+        std::lock_guard<std::mutex> g(block_volume_lock);
+        block_volumes.insert(volDesc.volUUID);
+    }
+    AmDataProvider::registerVolume(volDesc);
+}
+
+void
+AmCache::removeVolume(VolumeDesc const& volDesc) {
+    {
+        std::lock_guard<std::mutex> g(block_volume_lock);
+        block_volumes.erase(volDesc.volUUID);
+    }
+    block_offset_cache->removeVolume(volDesc.volUUID);
+    AmDataProvider::removeVolume(volDesc);
+}
+
 BlobDescriptor::ptr
 AmCache::getBlobDescriptor(AmRequest* amReq, Error &error) {
     auto const& volId = amReq->io_vol_id;
@@ -78,8 +109,7 @@ AmCache::getBlobOffsetObjects(GetBlobReq* blobReq) {
          blobReq->blob_offset_end >= cur_off;
          cur_off += blobReq->object_size) {
         ObjectID::ptr obj_id;
-        auto offset_pair = BlobOffsetPair(blobReq->getBlobName(), cur_off);
-        auto err = offset_cache.get(volId, offset_pair, obj_id);
+        auto err = getOffset(volId, blobReq->getBlobName(), cur_off, obj_id);
         if (err == ERR_OK) {
             PerfTracer::incr(PerfEventType::AM_OFFSET_CACHE_HIT, volId);
             LOGDEBUG << "objid:" << *obj_id << " offset:" << cur_off << " cache hit";
@@ -93,6 +123,39 @@ AmCache::getBlobOffsetObjects(GetBlobReq* blobReq) {
     return error;
 }
 
+Error
+AmCache::getOffset(fds_volid_t const vol_id,
+                   std::string const& blob_name,
+                   fds_uint64_t const offset,
+                   ObjectID::ptr& obj_id) {
+    if (block_offset_cache->handles(vol_id, blob_name)) {
+        return block_offset_cache->get(vol_id, blob_name, offset, obj_id);
+    }
+    return offset_cache.get(vol_id, BlobOffsetPair(blob_name, offset), obj_id);
+}
+
+void
+AmCache::addOffset(fds_volid_t const vol_id,
+                   std::string const& blob_name,
+                   fds_uint64_t const offset,
+                   ObjectID::ptr const& obj_id,
+                   bool const dirty) {
+    if (block_offset_cache->handles(vol_id, blob_name)) {
+        block_offset_cache->add(vol_id, blob_name, offset, *obj_id, dirty);
+        return;
+    }
+    offset_cache.add(vol_id, BlobOffsetPair(blob_name, offset), obj_id, dirty);
+}
+
+void
+AmCache::removeOffsets(fds_volid_t const vol_id, std::string const& blob_name) {
+    block_offset_cache->remove(vol_id, blob_name);
+    offset_cache.remove_if(vol_id,
+                           [&blob_name] (BlobOffsetPair const& blob_pair) -> bool {
+                               return (blob_name == blob_pair.getName());
+                           });
+}
+
 void
 AmCache::getObjects(GetBlobReq* blobReq) {
     static boost::shared_ptr<std::string> null_object = boost::make_shared<std::string>(0, '\0');
@@ -253,10 +316,7 @@ AmCache::putTxDescriptor(const std::shared_ptr<AmTxDescriptor> txDesc, fds_uint6
         } else {
             descriptor_cache.remove(txDesc->volId, txDesc->blobName);
         }
-        offset_cache.remove_if(txDesc->volId,
-                               [blobName = txDesc->blobName] (BlobOffsetPair const& blob_pair) -> bool {
-                                   return (blobName == blob_pair.getName());
-                               });
+        removeOffsets(txDesc->volId, txDesc->blobName);
     } else {
         fds_verify(txDesc->opType == FDS_PUT_BLOB);
         LOGTRACE << "volid:" << txDesc->volId << " blob:" << txDesc->blobName
@@ -264,9 +324,10 @@ AmCache::putTxDescriptor(const std::shared_ptr<AmTxDescriptor> txDesc, fds_uint6
 
         for (auto& offset_pair : txDesc->stagedBlobOffsets) {
             auto const& obj_id = offset_pair.second.first;
-            offset_cache.add(txDesc->volId,
-                             offset_pair.first,
-                             boost::make_shared<ObjectID>(obj_id));
+            addOffset(txDesc->volId,
+                      offset_pair.first.getName(),
+                      offset_pair.first.getOffset(),
+                      boost::make_shared<ObjectID>(obj_id));
         }
 
         // Add blob descriptor from tx to descriptor cache
@@ -292,8 +353,10 @@ AmCache::putTxDescriptor(const std::shared_ptr<AmTxDescriptor> txDesc, fds_uint6
 
 void
 AmCache::closeVolume(AmRequest *amReq) {
+    read_ahead->removeVolume(amReq->io_vol_id);
     descriptor_cache.removeVolume(amReq->io_vol_id);
     offset_cache.removeVolume(amReq->io_vol_id);
+    block_offset_cache->removeVolume(amReq->io_vol_id);
     object_cache.removeVolume(amReq->io_vol_id);
     AmDataProvider::closeVolume(amReq);
 }
@@ -336,12 +399,21 @@ AmCache::openVolumeCb(AmRequest* amReq, Error const error) {
     if (ERR_OK != error || !static_cast<AttachVolumeReq*>(amReq)->mode.can_cache) {
         descriptor_cache.clear(vol_uuid);
         offset_cache.clear(vol_uuid);
+        block_offset_cache->removeVolume(vol_uuid);
         if (ERR_OK == error) {
             object_cache.addVolume(vol_uuid, max_volume_data);
         }
     } else if (ERR_VOL_DUPLICATE != descriptor_cache.addVolume(vol_uuid, max_metadata_entries)) {
         offset_cache.addVolume(vol_uuid, max_metadata_entries);
         object_cache.addVolume(vol_uuid, max_volume_data);
+        bool is_block {false};
+        {
+            std::lock_guard<std::mutex> g(block_volume_lock);
+            is_block = (0 < block_volumes.count(vol_uuid));
+        }
+        if (is_block) {
+            block_offset_cache->addVolume(vol_uuid, amReq->object_size);
+        }
         LOGDEBUG << "Created caches for volume: " << amReq->volume_name;
     }
     AmDataProvider::openVolumeCb(amReq, error);
@@ -357,11 +429,8 @@ AmCache::renameBlobCb(AmRequest* amReq, Error const error) {
                              blobReq->new_blob_name,
                              std::dynamic_pointer_cast<RenameBlobCallback>(amReq->cb)->blobDesc);
         // Remove all offsets for the old blob and new blobs
-        offset_cache.remove_if(amReq->io_vol_id,
-                               [blobReq] (BlobOffsetPair const& blob_pair) -> bool {
-                                   return (blobReq->new_blob_name == blob_pair.getName() ||
-                                           blobReq->getBlobName() == blob_pair.getName());
-                                });
+        removeOffsets(amReq->io_vol_id, blobReq->getBlobName());
+        removeOffsets(amReq->io_vol_id, blobReq->new_blob_name);
         // TODO(bszmyd): Sat 14 Nov 2015 02:39:16 AM MST
         // Should we move the offsets to the other blob so we don't have to
         // read them back post-rename?
@@ -387,6 +456,21 @@ void
 AmCache::getBlob(AmRequest *amReq) {
     GetBlobReq *blobReq = static_cast<GetBlobReq *>(amReq);
 
+    // Note the read in its stream before routing it, the request may be
+    // responded to (and gone) by the time we return
+    fds_uint64_t ahead_start {0}, ahead_end {0};
+    bool want_ahead = !blobReq->prefetch
+                      && read_ahead->onRead(blobReq->io_vol_id,
+                                            blobReq->getBlobName(),
+                                            blobReq->blob_offset,
+                                            blobReq->blob_offset_end,
+                                            blobReq->object_size,
+                                            ahead_start,
+                                            ahead_end);
+    if (want_ahead) {
+        readAhead(blobReq, ahead_start, ahead_end);
+    }
+
     // Can we read from cache
     if (!blobReq->forced_unit_access) {
         // Check cache for descriptor on blob
@@ -431,6 +515,32 @@ AmCache::getBlob(AmRequest *amReq) {
     AmDataProvider::getOffsets(blobReq);
 }
 
+void
+AmCache::readAhead(GetBlobReq* blobReq,
+                   fds_uint64_t const ahead_start,
+                   fds_uint64_t const ahead_end) {
+    // Nobody waits on the result, the objects just land in the cache
+    auto cb = create_async_handler<GetObjectCallback>([] (GetObjectCallback*, fpi::ErrorCode const&) {});
+    std::dynamic_pointer_cast<GetObjectCallback>(cb)->return_buffers =
+        boost::make_shared<std::vector<boost::shared_ptr<std::string>>>();
+    auto pfReq = new GetBlobReq(blobReq->io_vol_id,
+                                blobReq->volume_name,
+                                blobReq->getBlobName(),
+                                cb,
+                                ahead_start,
+                                (ahead_end - ahead_start) + blobReq->object_size);
+    pfReq->blob_offset_end = ahead_end;
+    pfReq->object_size = blobReq->object_size;
+    pfReq->page_out_cache = blobReq->page_out_cache;
+    pfReq->forced_unit_access = blobReq->forced_unit_access;
+    pfReq->prefetch = true;
+
+    LOGDEBUG << "blob:" << blobReq->getBlobName() << " volid:" << blobReq->io_vol_id
+             << " start:" << ahead_start << " end:" << ahead_end << " reading ahead";
+    prefetches_in_flight.fetch_add(1, std::memory_order_relaxed);
+    getBlob(pfReq);
+}
+
 void
 AmCache::getOffsetsCb(AmRequest* amReq, Error const error) {
     // If we got the data successfully
@@ -467,8 +577,7 @@ AmCache::getBlobCb(AmRequest *amReq, Error const error) {
                                        blobReq->blobDesc);
             auto iOff = blobReq->blob_offset;
             for (auto const& obj_id : blobReq->object_ids) {
-                auto blob_pair = BlobOffsetPair(blobReq->getBlobName(), iOff);
-                offset_cache.add_dirty(blobReq->io_vol_id, blob_pair, obj_id);
+                addOffset(blobReq->io_vol_id, blobReq->getBlobName(), iOff, obj_id, true);
                 iOff += blobReq->object_size;
             }
         }
@@ -483,6 +592,14 @@ AmCache::getBlobCb(AmRequest *amReq, Error const error) {
         descriptor_cache.add_dirty(blobReq->io_vol_id, blobReq->getBlobName(), nullptr);
     }
 
+    // Read ahead stops here, the data is already in the cache
+    if (blobReq->prefetch) {
+        read_ahead->done(blobReq->io_vol_id, blobReq->getBlobName(), error.ok());
+        delete blobReq;
+        prefetches_in_flight.fetch_sub(1, std::memory_order_release);
+        return;
+    }
+
     AmDataProvider::getBlobCb(blobReq, error);
 }
 
@@ -501,9 +618,10 @@ AmCache::updateCatalogCb(AmRequest * amReq, Error const error) {
     // If this was a PutBlobOnce we can stash the metadata changes
     if (error.ok() && fds::FDS_PUT_BLOB != blobReq->parent->io_type) {
         for (auto const& obj_upd : blobReq->object_list) {
-            offset_cache.add(blobReq->io_vol_id,
-                             BlobOffsetPair(blobReq->getBlobName(), obj_upd.second.first),
-                             boost::make_shared<ObjectID>(obj_upd.first));
+            addOffset(blobReq->io_vol_id,
+                      blobReq->getBlobName(),
+                      obj_upd.second.first,
+                      boost::make_shared<ObjectID>(obj_upd.first));
         }
         auto blobDesc = boost::make_shared<BlobDescriptor>(blobReq->getBlobName(),
                                                            blobReq->io_vol_id.get(),
@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "fds_process.h"
+#include "fdsp/common_constants.h"
 #include "fdsp/dm_api_types.h"
 #include "fdsp/sm_api_types.h"
 
@@ -28,6 +29,26 @@
 
 namespace fds {
 
+/**
+ * Endpoints given explicitly, used to resend to just some of the replicas
+ * of a DLT token group.
+ */
+struct SvcUuidEpProvider : EpIdProvider {
+    explicit SvcUuidEpProvider(std::vector<fpi::SvcUuid> const& eps)
+        : epIds_(eps)
+    { }
+    fpi::SvcUuid getNextEp() override
+    {
+        fds_verify(!"Not impl");
+        return fpi::SvcUuid();
+    }
+    std::vector<fpi::SvcUuid> getEps() override
+    { return epIds_; }
+
+ private:
+    std::vector<fpi::SvcUuid> epIds_;
+};
+
 /**
  * See Serialization enumeration for interpretation.
  */
@@ -160,6 +181,12 @@ AmDispatcher::start() {
 
     numPrimaries = conf.get_abs<fds_uint32_t>("fds.dm.number_of_primary", DmDefaultPrimaryCnt);
 
+    // Objects to remember as stored on SM, 0 always sends the data
+    auto max_stored_objects = conf.get_abs<fds_uint32_t>("fds.am.cache.max_stored_object_ids", 65536);
+    if (0 < max_stored_objects && !stored_objects) {
+        stored_objects.reset(new stored_objects_type("AM stored objects", max_stored_objects));
+    }
+
     /**
      * What request serialization technique will we use?
      */
@@ -563,9 +590,7 @@ AmDispatcher::updateCatalog(AmRequest* amReq) {
     message->txId         = blobReq->tx_desc->getValue();
     message->blob_mode    = blobReq->blob_mode;
 
-    // Setup blob offset updates
-    // TODO(Andrew): Today we only expect one offset update
-    // TODO(Andrew): Remove lastBuf when we have real transactions
+    // Setup blob offset updates, every object of the write is committed at once
     for (auto const& obj_upd : blobReq->object_list) {
         auto const& obj_id = obj_upd.first;
         fpi::FDSP_BlobObjectInfo updBlobInfo;
@@ -1138,6 +1163,15 @@ AmDispatcher::putObject(AmRequest* amReq) {
         return;
     }
 
+    // SM already has the data, just add our reference to it
+    auto const dlt = dltMgr->getDLT();
+    if (storedOnSM(objReq->obj_id, dlt->getVersion())
+        && takesRefs(dlt->getNodes(objReq->obj_id))) {
+        putObjectRef(objReq);
+        return;
+    }
+
+    objReq->by_ref = false;
     auto message(boost::make_shared<fpi::PutObjectMsg>());
     message->volume_id          = objReq->io_vol_id.get();
     message->data_obj.assign(objReq->dataPtr->c_str(), objReq->data_len);
@@ -1149,6 +1183,147 @@ AmDispatcher::putObject(AmRequest* amReq) {
     writeToSM(objReq, message, &AmDispatcher::putObjectCb, message_timeout_io);
 }
 
+bool
+AmDispatcher::storedOnSM(ObjectID const& obj_id, fds_uint64_t const dlt_version) {
+    if (!stored_objects) {
+        return false;
+    }
+    boost::shared_ptr<fds_uint64_t> stored_version;
+    return stored_objects->get(obj_id, stored_version).ok()
+        && (dlt_version == *stored_version);
+}
+
+/**
+ * An SM that predates reference puts ignores data_by_ref and would store
+ * the empty payload, so only send them when every replica advertises it.
+ */
+bool
+AmDispatcher::takesRefs(DltTokenGroupPtr const& token_group) {
+    auto svcMgr = MODULEPROVIDER()->getSvcMgr();
+    auto const& key = fpi::commonConstants().SM_PROP_PUT_BY_REF;
+    for (auto const& sm : token_group->toSvcUuids()) {
+        fpi::SvcInfo info;
+        if (!svcMgr->getSvcInfo(sm, info)) {
+            return false;
+        }
+        auto it = info.props.find(key);
+        if ((info.props.end() == it) || ("true" != it->second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+AmDispatcher::putObjectRef(PutObjectReq* amReq) {
+    auto const dlt = dltMgr->getDLT();
+    amReq->dlt_version = dlt->getVersion();
+    amReq->by_ref = true;
+
+    auto message(boost::make_shared<fpi::PutObjectMsg>());
+    message->volume_id          = amReq->io_vol_id.get();
+    message->data_obj_len       = amReq->data_len;
+    message->data_by_ref        = true;
+    message->data_obj_id.digest = std::string(
+        reinterpret_cast<const char*>(amReq->obj_id.GetId()),
+        amReq->obj_id.GetLen());
+
+    // Every replica has to take the reference, we wait for all of them so
+    // the data can be sent to just those that didn't
+    auto token_group = boost::make_shared<DltObjectIdEpProvider>(dlt->getNodes(amReq->obj_id));
+    auto num_eps = token_group->getEps().size();
+
+    auto requestPool = MODULEPROVIDER()->getSvcMgr()->getSvcRequestMgr();
+    auto quorumReq = requestPool->newQuorumSvcRequest(token_group, amReq->dlt_version);
+    quorumReq->setTimeoutMs((0 < message_timeout_io) ? message_timeout_io : message_timeout_default);
+    quorumReq->setPayload(message_type_id(*message), message);
+    quorumReq->onResponseCb([this, amReq, num_eps] (QuorumSvcRequest* svc,
+                                                    const Error& error,
+                                                    shared_str payload) mutable -> void {
+                                putObjectRefCb(amReq, svc, num_eps, error); });
+    quorumReq->setQuorumCnt(num_eps);
+    quorumReq->setWaitForAllResponses(true);
+    setSerialization(amReq, quorumReq);
+    PerfTracer::tracePointBegin(amReq->sm_perf_ctx);
+    LOGTRACE << "Referencing object: " << amReq->obj_id;
+    quorumReq->invoke();
+}
+
+void
+AmDispatcher::putObjectRefCb(PutObjectReq* amReq,
+                             QuorumSvcRequest* svcReq,
+                             size_t const num_eps,
+                             const Error& error) {
+    PerfTracer::tracePointEnd(amReq->sm_perf_ctx);
+    if (error.ok()) {
+        PerfTracer::incr(PerfEventType::AM_PUT_BY_REF, amReq->io_vol_id);
+        stored_objects->add(amReq->obj_id, amReq->dlt_version);
+        AmDataProvider::putObjectCb(amReq, error);
+        return;
+    }
+
+    // Don't trust what we remember about this object any longer
+    PerfTracer::incr(PerfEventType::AM_PUT_BY_REF_MISS, amReq->io_vol_id);
+    stored_objects->remove(amReq->obj_id);
+
+    if (ERR_IO_DLT_MISMATCH == error) {
+        (void) MODULEPROVIDER()->getSvcMgr()->getDLT();
+        if (amReq->dlt_version != dltMgr->getDLT()->getVersion()) {
+            // Resend the data to the new token group
+            LOGNOTIFY << "updated dlt...retrying:" << amReq->io_req_id;
+            putObject(amReq);
+            return;
+        }
+    }
+
+    // Send the data to the replicas that did not take the reference,
+    // enough of them have to store it to make up a write quorum
+    std::vector<fpi::SvcUuid> missing;
+    for (uint8_t i = 0; num_eps > i; ++i) {
+        if (!svcReq->responseStatus(i).ok()) {
+            missing.push_back(svcReq->ep(i)->getPeerEpId());
+        }
+    }
+    if (missing.empty()) {
+        // Can't tell who has it (e.g. timed out), send the data to everyone
+        putObject(amReq);
+        return;
+    }
+    uint32_t const quorum = (num_eps / 3) + 1;
+    uint32_t const referenced = num_eps - missing.size();
+    LOGDEBUG << "objid:" << amReq->obj_id << " err:" << error
+             << " replicas:" << missing.size() << "/" << num_eps << " sending data";
+    putObjectData(amReq, missing, (quorum > referenced) ? (quorum - referenced) : 1);
+}
+
+void
+AmDispatcher::putObjectData(PutObjectReq* amReq,
+                            std::vector<fpi::SvcUuid> const& eps,
+                            uint32_t const quorum) {
+    amReq->by_ref = false;
+    auto message(boost::make_shared<fpi::PutObjectMsg>());
+    message->volume_id          = amReq->io_vol_id.get();
+    message->data_obj.assign(amReq->dataPtr->c_str(), amReq->data_len);
+    message->data_obj_len       = amReq->data_len;
+    message->data_obj_id.digest = std::string(
+        reinterpret_cast<const char*>(amReq->obj_id.GetId()),
+        amReq->obj_id.GetLen());
+
+    auto requestPool = MODULEPROVIDER()->getSvcMgr()->getSvcRequestMgr();
+    auto quorumReq = requestPool->newQuorumSvcRequest(boost::make_shared<SvcUuidEpProvider>(eps),
+                                                      amReq->dlt_version);
+    quorumReq->setTimeoutMs((0 < message_timeout_io) ? message_timeout_io : message_timeout_default);
+    quorumReq->setPayload(message_type_id(*message), message);
+    quorumReq->onResponseCb([this, amReq] (QuorumSvcRequest* svc,
+                                           const Error& error,
+                                           shared_str payload) mutable -> void {
+                                putObjectCb(amReq, svc, error, payload); });
+    quorumReq->setQuorumCnt(std::min(quorum, static_cast<uint32_t>(eps.size())));
+    setSerialization(amReq, quorumReq);
+    PerfTracer::tracePointBegin(amReq->sm_perf_ctx);
+    quorumReq->invoke();
+}
+
 void
 AmDispatcher::putObjectCb(PutObjectReq* amReq,
                           QuorumSvcRequest* svcReq,
@@ -1163,6 +1338,8 @@ AmDispatcher::putObjectCb(PutObjectReq* amReq,
             putObject(amReq);
             return;
         }
+    } else if (error.ok() && stored_objects) {
+        stored_objects->add(amReq->obj_id, amReq->dlt_version);
     }
     AmDataProvider::putObjectCb(amReq, error);
 }
@@ -3,6 +3,7 @@
  */
 
 #include "AmQoSCtrl.h"
+#include "fds_process.h"
 #include "lib/StatsCollector.h"
 #include "AmTxManager.h"
 #include "AmRequest.h"
@@ -13,9 +14,17 @@ AmQoSCtrl::AmQoSCtrl(AmDataProvider* prev, uint32_t max_thrds, fds_log *log)
     : FDS_QoSControl::FDS_QoSControl(max_thrds, fds::FDS_QoSControl::FDS_DISPATCH_HIER_TOKEN_BUCKET, log, "SH"),
       AmDataProvider(prev, new AmTxManager(this))
 {
+    FdsConfigAccessor conf(g_fdsprocess->get_fds_config(), "fds.am.");
     total_rate = 200000;
-    htb_dispatcher = new QoSHTBDispatcher(this, qos_log, total_rate);
+    htb_dispatcher = new QoSHTBDispatcher(this, qos_log, total_rate,
+                                          conf.get<uint32_t>("qos_dispatchers", 1),
+                                          conf.get<uint32_t>("qos_dispatch_batch", 8));
     dispatcher = htb_dispatcher;
+
+    admission.reset(new AmAdmissionCtrl(conf.get<fds_uint64_t>("admission.slo_usec", 0),
+                                        conf.get<uint32_t>("admission.min_outstanding", 1),
+                                        conf.get<uint32_t>("admission.max_outstanding", 256),
+                                        conf.get<uint32_t>("admission.max_waiting", 4096)));
 }
 
 AmQoSCtrl::~AmQoSCtrl() {
@@ -44,8 +53,11 @@ Error AmQoSCtrl::processIO(FDS_IOType *io) {
     PerfTracer::tracePointEnd(amReq->qos_perf_ctx);
     LOGTRACE << "id:" << amReq->io_req_id << " scheduling request";
     auto vol_id = io->io_vol_id;
-    threadPool->schedule([this] (FDS_IOType* io) mutable -> void
-                         { unknownTypeResume(static_cast<AmRequest*>(io)); }, io);
+    threadPool->schedule([this] (FDS_IOType* io) mutable -> void {
+                             /* Requests sent further down are part of the trace */
+                             RequestTraceScope traceScope(io->trace_id);
+                             unknownTypeResume(static_cast<AmRequest*>(io));
+                         }, io);
     {
         ReadGuard rg(queue_lock);
         auto queue = getQueue(vol_id);
@@ -72,6 +84,14 @@ void AmQoSCtrl::completeRequest(AmRequest* amReq, Error const error) {
         return AmDataProvider::unknownTypeCb(amReq, error);
     }
     auto remaining = htb_dispatcher->markIODone(amReq);
+
+    // Its place may go to a request the volume has waiting
+    std::vector<AmRequest*> admitted;
+    admission->complete(amReq, admitted);
+    for (auto req : admitted) {
+        queueRequest(req);
+    }
+
     // If we were told to stop and have drained the queue, stop
     {
         ReadGuard rg(queue_lock);
@@ -249,6 +269,7 @@ AmQoSCtrl::registerVolume(VolumeDesc const& volDesc) {
                                                  volDesc.iops_throttle,
                                                  volDesc.relativePrio);
         }
+        admission->registerVolume(volDesc.volUUID, volDesc.relativePrio);
     }
     AmDataProvider::registerVolume(volDesc);
 }
@@ -261,6 +282,7 @@ AmQoSCtrl::modifyVolumePolicy(const VolumeDesc& vdesc) {
                                              vdesc.iops_assured,
                                              vdesc.iops_throttle,
                                              vdesc.relativePrio);
+        admission->registerVolume(vdesc.volUUID, vdesc.relativePrio);
     }
     return err;
 }
@@ -270,6 +292,12 @@ AmQoSCtrl::modifyVolumePolicy(const VolumeDesc& vdesc) {
  */
 void
 AmQoSCtrl::removeVolume(VolumeDesc const& volDesc) {
+    std::deque<AmRequest*> waiting;
+    admission->removeVolume(volDesc.volUUID, waiting);
+    for (auto amReq : waiting) {
+        PerfTracer::tracePointEnd(amReq->qos_perf_ctx);
+        AmDataProvider::unknownTypeCb(amReq, ERR_VOL_NOT_FOUND);
+    }
     {
         WriteGuard wg(queue_lock);
         auto queue = getQueue(volDesc.volUUID);
@@ -287,6 +315,21 @@ void AmQoSCtrl::enqueueRequest(AmRequest *amReq) {
     PerfTracer::tracePointBegin(amReq->qos_perf_ctx);
 
     GLOGDEBUG << "id:" << amReq->io_req_id << " entering QoS request";
+    switch (admission->admit(amReq)) {
+        case AmAdmissionCtrl::Admission::WAITING:
+            // Queued once the volume has room for it
+            return;
+        case AmAdmissionCtrl::Admission::REJECTED:
+            GLOGWARN << "vol:" << amReq->volume_name << " too many requests waiting for admission";
+            PerfTracer::tracePointEnd(amReq->qos_perf_ctx);
+            return AmDataProvider::unknownTypeCb(amReq, ERR_NOT_READY);
+        default:
+            break;
+    }
+    queueRequest(amReq);
+}
+
+void AmQoSCtrl::queueRequest(AmRequest *amReq) {
     Error err {ERR_OK};
     {
         ReadGuard rg(queue_lock);
@@ -295,7 +338,12 @@ void AmQoSCtrl::enqueueRequest(AmRequest *amReq) {
     if (ERR_OK != err) {
         GLOGERROR << "vol:" << amReq->volume_name << " err:" << err << " error queueing request";
         PerfTracer::tracePointEnd(amReq->qos_perf_ctx);
+        std::vector<AmRequest*> admitted;
+        admission->cancel(amReq, admitted);
         AmDataProvider::unknownTypeCb(amReq, err);
+        for (auto req : admitted) {
+            queueRequest(req);
+        }
     }
 }
 
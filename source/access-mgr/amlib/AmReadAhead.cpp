@@ -0,0 +1,163 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#include "AmReadAhead.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "PerfTrace.h"
+
+namespace fds {
+
+AmReadAhead::AmReadAhead(size_t const _max_window, size_t const _max_streams)
+    : max_window(_max_window),
+      max_streams(std::max(_max_streams, (size_t)1))
+{
+}
+
+std::string
+AmReadAhead::streamKey(fds_volid_t const vol_id, std::string const& blob_name) {
+    return std::to_string(vol_id.get()) + ":" + blob_name;
+}
+
+bool
+AmReadAhead::onRead(fds_volid_t const vol_id,
+                    std::string const& blob_name,
+                    fds_uint64_t const start,
+                    fds_uint64_t const end,
+                    fds_uint64_t const object_size,
+                    fds_uint64_t& ahead_start,
+                    fds_uint64_t& ahead_end) {
+    if (!enabled() || 0 == object_size) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> g(lock);
+    auto key = streamKey(vol_id, blob_name);
+    auto it = streams.find(key);
+    if (streams.end() == it) {
+        if (streams.size() >= max_streams) {
+            evict();
+        }
+        it = streams.emplace(key, Stream()).first;
+        it->second.vol_id = vol_id;
+        // A first read is not a stream yet
+        it->second.next = ~0ull;
+    }
+    auto& stream = it->second;
+    stream.last_used = ++clock;
+
+    // Anything read ahead that the reader skipped over is wasted
+    auto first_unread = stream.unread.lower_bound(start);
+    auto skipped = std::distance(stream.unread.begin(), first_unread);
+    if (0 < skipped) {
+        account(PerfEventType::AM_READAHEAD_WASTE, vol_id, skipped);
+        stream.unread.erase(stream.unread.begin(), first_unread);
+    }
+    size_t hits = 0;
+    for (auto off = start; end >= off; off += object_size) {
+        hits += stream.unread.erase(off);
+    }
+    if (0 < hits) {
+        account(PerfEventType::AM_READAHEAD_HIT, vol_id, hits);
+    }
+
+    bool sequential = (start == stream.next) || (0 < hits);
+    stream.next = end + object_size;
+    if (!sequential) {
+        reset(stream);
+        return false;
+    }
+
+    // Grow the window while the reader keeps consuming what we read ahead
+    if (0 == stream.window) {
+        stream.window = std::min(max_window, (size_t)2);
+    } else if (0 < hits) {
+        stream.window = std::min(max_window, stream.window * 2);
+    }
+
+    if (stream.in_flight) {
+        return false;
+    }
+
+    // Stay a window ahead, topping up once the reader is half way into it
+    auto target = stream.next + stream.window * object_size;
+    auto from = std::max(stream.ahead_end, stream.next);
+    if ((from >= target)
+        || ((from - stream.next) > (stream.window / 2) * object_size)) {
+        return false;
+    }
+
+    ahead_start = from;
+    ahead_end = target - object_size;
+    for (auto off = from; target > off; off += object_size) {
+        stream.unread.insert(off);
+    }
+    stream.ahead_end = target;
+    stream.in_flight = true;
+    account(PerfEventType::AM_READAHEAD_OBJS, vol_id, (target - from) / object_size);
+    return true;
+}
+
+void
+AmReadAhead::done(fds_volid_t const vol_id, std::string const& blob_name, bool const ok) {
+    std::lock_guard<std::mutex> g(lock);
+    auto it = streams.find(streamKey(vol_id, blob_name));
+    if (streams.end() == it) {
+        return;
+    }
+    it->second.in_flight = false;
+    if (!ok) {
+        // Nothing was read ahead, start over
+        it->second.unread.clear();
+        it->second.ahead_end = 0;
+        it->second.window = 0;
+    }
+}
+
+void
+AmReadAhead::removeVolume(fds_volid_t const vol_id) {
+    std::lock_guard<std::mutex> g(lock);
+    for (auto it = streams.begin(); streams.end() != it;) {
+        if (vol_id == it->second.vol_id) {
+            reset(it->second);
+            it = streams.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void
+AmReadAhead::account(PerfEventType const type, fds_volid_t const vol_id, uint64_t const cnt) {
+    PerfTracer::incr(type, vol_id, cnt);
+}
+
+void
+AmReadAhead::reset(Stream& stream) {
+    if (!stream.unread.empty()) {
+        account(PerfEventType::AM_READAHEAD_WASTE, stream.vol_id, stream.unread.size());
+        stream.unread.clear();
+    }
+    stream.ahead_end = 0;
+    stream.window = 0;
+}
+
+/**
+ * Drop the least recently used stream to make room for a new one.
+ */
+void
+AmReadAhead::evict() {
+    auto victim = std::min_element(streams.begin(), streams.end(),
+                                   [] (decltype(*streams.begin()) const& lhs,
+                                       decltype(*streams.begin()) const& rhs) {
+                                       return lhs.second.last_used < rhs.second.last_used;
+                                   });
+    if (streams.end() != victim) {
+        reset(victim->second);
+        streams.erase(victim);
+    }
+}
+
+}  // namespace fds
@@ -259,7 +259,7 @@ AmTxManager::commitBlobTx(AmRequest *amReq) {
             for (auto const& offset_pair : descriptor->stagedBlobOffsets) {
                 auto const& obj_id = offset_pair.second.first;
                 auto const data_length = offset_pair.second.second;
-                catUpdateReq->object_list.emplace(obj_id,
+                catUpdateReq->object_list.emplace_back(obj_id,
                                    std::make_pair(offset_pair.first.getOffset(), data_length));
             }
 
@@ -450,7 +450,7 @@ AmTxManager::putBlob(AmRequest *amReq) {
     if (!all_atomic_ops) {
         // stage a tx update in DM
         auto catUpdateReq = new UpdateCatalogReq(blobReq, false);
-        catUpdateReq->object_list.emplace(blobReq->obj_id,
+        catUpdateReq->object_list.emplace_back(blobReq->obj_id,
                                           std::make_pair(blobReq->blob_offset, blobReq->data_len));
         // Verify we have a dmt version (and transaction) for this update
         auto err = getTxDmtVersion(*(blobReq->tx_desc), &(catUpdateReq->dmt_version));
@@ -480,8 +480,28 @@ AmTxManager::putBlobOnce(AmRequest *amReq) {
     }
 
     blobReq->setTxId(randNumGen->genNumSafe());
-    auto objReq = new PutObjectReq(blobReq);
-    AmDataProvider::putObject(objReq);
+    if (blobReq->more_objects.empty()) {
+        auto objReq = new PutObjectReq(blobReq);
+        AmDataProvider::putObject(objReq);
+        return;
+    }
+
+    // Every object goes to SM at once, the catalog update waits for them all
+    std::vector<PutObjectReq*> objReqs {new PutObjectReq(blobReq)};
+    for (auto& object : blobReq->more_objects) {
+        object.blob_offset = (object.blob_offset * blobReq->object_size);
+        if (object.dataPtr->empty()) {
+            object.obj_id = ObjectID();
+        } else {
+            SCOPED_PERF_TRACEPOINT_CTX(amReq->hash_perf_ctx);
+            object.obj_id = ObjIdGen::genObjectId(object.dataPtr->c_str(), object.dataPtr->size());
+        }
+        objReqs.push_back(new PutObjectReq(blobReq, object));
+    }
+    blobReq->setResponseCount(objReqs.size());
+    for (auto objReq : objReqs) {
+        AmDataProvider::putObject(objReq);
+    }
 }
 
 void
@@ -516,11 +536,23 @@ AmTxManager::putObjectCb(AmRequest *amReq, Error const error) {
         _putBlobCb(blobReq, err);
         return;
     }
+    if (!blobReq->more_objects.empty()) {
+        bool done {false};
+        std::tie(done, err) = blobReq->notifyResponse(err);
+        if (!done) {
+            return;
+        }
+    }
     if (err.ok()) {
-        // Commit the change to DM
+        // Commit the change to DM, all of the offsets in one transaction
         auto catUpdateReq = new UpdateCatalogReq(blobReq);
-        catUpdateReq->object_list.emplace(blobReq->obj_id,
-                                          std::make_pair(blobReq->blob_offset, blobReq->data_len));
+        catUpdateReq->object_list.emplace_back(blobReq->obj_id,
+                                               std::make_pair(blobReq->blob_offset, blobReq->data_len));
+        for (auto const& object : blobReq->more_objects) {
+            catUpdateReq->object_list.emplace_back(object.obj_id,
+                                                   std::make_pair(object.blob_offset,
+                                                                  object.dataPtr->size()));
+        }
         AmDataProvider::updateCatalog(catUpdateReq);
         return;
     }
@@ -11,8 +11,11 @@
 #include <thread>
 #include <utility>
 
+#include "fds_process.h"
 #include "fds_volume.h"
+#include "PerfTrace.h"
 #include "util/Log.h"
+#include "util/memutils.h"
 
 namespace fds {
 
@@ -24,6 +27,13 @@ namespace fds {
 static std::unordered_map<std::string, std::uint_fast16_t> assoc_map {};
 static std::mutex assoc_map_lock {};
 
+/**
+ * Write backs from the write buffer are tasks we issue to ourselves, give
+ * them handles from a range of their own.
+ */
+static constexpr uint64_t write_back_handle_base {0xFB00000000000000ull};
+static std::atomic<uint64_t> write_back_seq {0};
+
 BlockOperations::BlockOperations(BlockOperations::ResponseIFace* respIface)
         : amAsyncDataApi(nullptr),
           volumeName(nullptr),
@@ -32,6 +42,7 @@ BlockOperations::BlockOperations(BlockOperations::ResponseIFace* respIface)
           blobName(new std::string("BlockBlob")),
           emptyMeta(new std::map<std::string, std::string>()),
           blobMode(new int32_t(0)),
+          discard_buffer(new std::string()),
           sector_map()
 {
 }
@@ -42,7 +53,8 @@ void
 BlockOperations::init(boost::shared_ptr<std::string> vol_name,
                       std::shared_ptr<AmProcessor> processor,
                       BlockTask* resp,
-                      uint32_t const obj_size)
+                      uint32_t const obj_size,
+                      fds_volid_t const vol_id)
 {
     if (!amAsyncDataApi) {
         amAsyncDataApi.reset(new AmAsyncDataApi(processor, shared_from_this()));
@@ -66,11 +78,15 @@ BlockOperations::init(boost::shared_ptr<std::string> vol_name,
     } else {
         fds_assert(!resp); // Shouldn't have a task
         maxObjectSizeInBytes = obj_size;
+        volumeId = vol_id;
         empty_buffer = boost::make_shared<std::string>(maxObjectSizeInBytes, '\0');
 
-        // Reference count this association
-        std::unique_lock<std::mutex> lk(assoc_map_lock);
-        ++assoc_map[*volumeName];
+        {
+            // Reference count this association
+            std::unique_lock<std::mutex> lk(assoc_map_lock);
+            ++assoc_map[*volumeName];
+        }
+        openWriteBuffer();
     }
 }
 
@@ -104,12 +120,16 @@ BlockOperations::attachVolumeResp(const fpi::ErrorCode& error,
             resp->setError(fpi::BAD_REQUEST);
         } else {
             maxObjectSizeInBytes = volDesc->maxObjSizeInBytes;
+            volumeId = volDesc->volUUID;
             empty_buffer = boost::make_shared<std::string>(maxObjectSizeInBytes, '\0');
 
-            // Reference count this association
-            std::unique_lock<std::mutex> lk(assoc_map_lock);
-            ++assoc_map[volDesc->name];
+            {
+                // Reference count this association
+                std::unique_lock<std::mutex> lk(assoc_map_lock);
+                ++assoc_map[volDesc->name];
+            }
             descriptor = volDesc;
+            openWriteBuffer();
         }
     } else {
         resp->setError(error);
@@ -129,6 +149,7 @@ BlockOperations::detachVolume() {
             ul.unlock();
             handle_type reqId{0, 0};
             assoc_map.erase(*volumeName);
+            BlockWriteBuffer::close(*volumeName);
             return amAsyncDataApi->detachVolume(reqId, domainName, volumeName);
         }
         ul.unlock();
@@ -159,10 +180,21 @@ BlockOperations::read(BlockTask* resp) {
     auto length = resp->getLength();
     auto offset = resp->getOffset();
 
+    // Buffered writes the volume does not have yet are applied to the data
+    // as it comes back
+    BlockWriteBuffer::overlay_map_type overlay;
+    uint64_t firstObject = offset / maxObjectSizeInBytes;
+    if (writeBuffer && (0 < length)) {
+        writeBuffer->overlay(firstObject, (offset + length - 1) / maxObjectSizeInBytes, overlay);
+    }
+
     {   // add response that we will fill in with data
         std::unique_lock<std::mutex> l(respLock);
         if (false == responses.emplace(std::make_pair(resp->getHandle(), resp)).second)
             { throw BlockError::connection_closed; }
+        if (!overlay.empty()) {
+            readOverlays[resp->getHandle()] = std::make_pair(firstObject, std::move(overlay));
+        }
     }
 
     // Determine how much data we need to read, we need
@@ -187,6 +219,30 @@ BlockOperations::read(BlockTask* resp) {
 
 void
 BlockOperations::write(typename req_api_type::shared_buffer_type& bytes, task_type* resp) {
+    fds_assert(bytes);
+    updateObjects(bytes, resp);
+}
+
+void
+BlockOperations::discard(task_type* resp) {
+    LOGTRACE << "offset:" << resp->getOffset() << " length:" << resp->getLength() << " discard request";
+    if (0 == resp->getLength()) {
+        // Nothing to unmap
+        return blockResp->respondTask(resp);
+    }
+    updateObjects(nullptr, resp);
+}
+
+/**
+ * Issue an update for every object in the task's range. With no bytes this
+ * is a discard: whole objects get an empty update (the null object) and the
+ * edges are zeroed. Partial objects, and any object the write buffer already
+ * holds, are absorbed by the write buffer if there is one.
+ */
+void
+BlockOperations::updateObjects(typename req_api_type::shared_buffer_type const& bytes,
+                               task_type* resp,
+                               bool const use_buffer) {
     fds_assert(amAsyncDataApi);
     // calculate how many FDS objects we will write
     auto length = resp->getLength();
@@ -202,6 +258,11 @@ BlockOperations::write(typename req_api_type::shared_buffer_type& bytes, task_ty
             { throw BlockError::connection_closed; }
     }
 
+    // Whole objects nobody else is updating are written in one transaction
+    std::vector<handle_type> batchIds;
+    std::vector<boost::shared_ptr<std::string>> batchObjects;
+    std::vector<uint64_t> batchOffsets;
+
     size_t amBytesWritten = 0;
     uint32_t seqId = 0;
     while (amBytesWritten < length) {
@@ -216,8 +277,17 @@ BlockOperations::write(typename req_api_type::shared_buffer_type& bytes, task_ty
 
         LOGTRACE  << "offset: " << curOffset << " length:" << iLength << " write request";
 
-        auto objBuf = (iLength == bytes->length()) ?
-            bytes : boost::make_shared<std::string>(*bytes, amBytesWritten, iLength);
+        boost::shared_ptr<std::string> objBuf;
+        if (!bytes) {
+            objBuf = (iLength == maxObjectSizeInBytes) ?
+                discard_buffer : boost::make_shared<std::string>(iLength, '\0');
+        } else {
+            objBuf = (iLength == bytes->length()) ?
+                bytes : boost::make_shared<std::string>(*bytes, amBytesWritten, iLength);
+            if (iLength == maxObjectSizeInBytes) {
+                elideZeroObject(objBuf);
+            }
+        }
 
         // write an object
         boost::shared_ptr<int32_t> objLength = boost::make_shared<int32_t>(maxObjectSizeInBytes);
@@ -233,7 +303,17 @@ BlockOperations::write(typename req_api_type::shared_buffer_type& bytes, task_ty
         // queue and enqueue it to QoS
         auto partial_write = (iLength != maxObjectSizeInBytes);
         resp->keepBufferForWrite(seqId, objectOff, objBuf);
-        if (sector_type::QueueResult::FirstEntry ==
+        if (use_buffer && writeBuffer
+            && (partial_write || writeBuffer->buffered(objectOff))
+            && writeBuffer->absorb(objectOff,
+                                   objBuf->empty() ? 0 : iOff,
+                                   objBuf->empty() ? empty_buffer->data() : objBuf->data(),
+                                   objBuf->empty() ? maxObjectSizeInBytes : objBuf->length())) {
+            // Journaled, this object is done as far as the client is concerned
+            if (resp->handleWriteResponse(fpi::OK)) {
+                finishResponse(resp);
+            }
+        } else if (sector_type::QueueResult::FirstEntry ==
                 sector_map.queue_update(objectOff, reqId)) {
             if (partial_write) {
                 // For objects that we are only updating a part of, we need to
@@ -247,20 +327,42 @@ BlockOperations::write(typename req_api_type::shared_buffer_type& bytes, task_ty
                                         objLength,
                                         off);
             } else {
-                amAsyncDataApi->updateBlobOnce(reqId,
-                                               domainName,
-                                               volumeName,
-                                               blobName,
-                                               blobMode,
-                                               objBuf,
-                                               objLength,
-                                               off,
-                                               emptyMeta);
+                batchIds.push_back(reqId);
+                batchObjects.push_back(objBuf);
+                batchOffsets.push_back(objectOff);
             }
         }
         amBytesWritten += iLength;
         ++seqId;
     }
+
+    if (1 == batchIds.size()) {
+        auto updLength = boost::make_shared<int32_t>(batchObjects.front()->length());
+        auto off = boost::make_shared<apis::ObjectOffset>();
+        off->value = batchOffsets.front();
+        amAsyncDataApi->updateBlobOnce(batchIds.front(),
+                                       domainName,
+                                       volumeName,
+                                       blobName,
+                                       blobMode,
+                                       batchObjects.front(),
+                                       updLength,
+                                       off,
+                                       emptyMeta);
+    } else if (1 < batchIds.size()) {
+        amAsyncDataApi->updateBlobOnceMulti(batchIds,
+                                            domainName,
+                                            volumeName,
+                                            blobName,
+                                            blobMode,
+                                            batchObjects,
+                                            batchOffsets,
+                                            emptyMeta);
+    }
+
+    if (use_buffer && writeBuffer && writeBuffer->flushWanted()) {
+        flushWriteBuffer(false);
+    }
 }
 
 void
@@ -303,10 +405,13 @@ BlockOperations::getBlobResp(const fpi::ErrorCode &error,
 
     // this is response for read operation,
     if (fpi::OK == error || fpi::MISSING_RESOURCE == error) {
+        applyOverlay(requestId, *bufs, length);
         // Adjust the buffers in our vector so they align and are of the
         // correct length according to the original request
         resp->handleReadResponse(*bufs, empty_buffer, length);
     } else {
+        std::unique_lock<std::mutex> l(respLock);
+        readOverlays.erase(handle);
         resp->setError(error);
     }
     finishResponse(resp);
@@ -387,7 +492,8 @@ BlockOperations::drainUpdateChain(uint64_t const offset,
         }
         if (queued_resp) {
             auto new_data = queued_resp->getBuffer(queued_handle.seq);
-            if (maxObjectSizeInBytes != new_data->length()) {
+            // An empty buffer is a whole object discard, nothing to merge
+            if (!new_data->empty() && maxObjectSizeInBytes != new_data->length()) {
                 std::tie(err, new_data) = queued_resp->handleRMWResponse(buf,
                                                                          maxObjectSizeInBytes,
                                                                          queued_handle.seq,
@@ -421,8 +527,12 @@ BlockOperations::drainUpdateChain(uint64_t const offset,
 
     // Update the blob if we have updates to make
     if (nullptr != last_chained) {
+        // A read-modify-write may have produced a zero object
+        if (maxObjectSizeInBytes == buf->length()) {
+            elideZeroObject(buf);
+        }
         last_chained->setChain(queued_handle.seq, std::move(chain));
-        auto objLength = boost::make_shared<int32_t>(maxObjectSizeInBytes);
+        auto objLength = boost::make_shared<int32_t>(buf->length());
         auto off = boost::make_shared<apis::ObjectOffset>();
         off->value = offset;
         amAsyncDataApi->updateBlobOnce(queued_handle,
@@ -448,7 +558,13 @@ BlockOperations::finishResponse(BlockTask* response) {
         done_responding = responses.empty();
     }
     if (response_removed) {
-        blockResp->respondTask(response);
+        if (!finishWriteBack(response)) {
+            blockResp->respondTask(response);
+        } else if (done_responding) {
+            // The write back may have issued the next one for its object
+            std::unique_lock<std::mutex> l(respLock);
+            done_responding = responses.empty();
+        }
     } else {
         LOGNOTIFY << "handle:" << response->getHandle() << " missing from response map";
     }
@@ -470,6 +586,15 @@ BlockOperations::shutdown()
     if (shutting_down) return;
     shutting_down = true;
     ul.unlock();
+
+    // Write back everything we can before the volume is detached
+    if (writeBackTask) {
+        g_fdsprocess->getTimer()->cancel(writeBackTask);
+    }
+    while (!flushWriteBuffer(true)) {
+        std::this_thread::yield();
+    }
+
     std::unique_lock<std::mutex> l(respLock);
     // If we don't have any outstanding requests, we're done
     if (responses.empty()) {
@@ -477,6 +602,184 @@ BlockOperations::shutdown()
     }
 }
 
+/**
+ * Swap a whole object of zeros for the empty update. AM records that as the
+ * null object without hashing it or storing it on SM, and reads of the
+ * offset are served from the shared zero buffer.
+ */
+bool
+BlockOperations::elideZeroObject(boost::shared_ptr<std::string>& buf) {
+    if (!util::isZeroFilled(buf->data(), buf->length())) {
+        return false;
+    }
+    PerfTracer::incr(PerfEventType::AM_ZERO_ELIDED_BYTES, volumeId, buf->length());
+    buf = discard_buffer;
+    return true;
+}
+
+void
+BlockOperations::openWriteBuffer() {
+    writeBuffer = BlockWriteBuffer::open(*volumeName, maxObjectSizeInBytes);
+    if (!writeBuffer) {
+        return;
+    }
+    LOGNORMAL << "vol:" << *volumeName << " buffering sub-object writes";
+
+    // Objects that are not filled in are written back once they age
+    boost::weak_ptr<BlockOperations> weak_self = shared_from_this();
+    writeBackTask = boost::make_shared<FdsTimerFunctionTask>([weak_self] () {
+        auto self = weak_self.lock();
+        if (self) {
+            self->flushWriteBuffer(false);
+        }
+    });
+    auto interval = std::max(writeBuffer->maxAge() / 2, std::chrono::milliseconds(1));
+    g_fdsprocess->getTimer()->scheduleRepeated(writeBackTask, interval);
+}
+
+/**
+ * Write back the objects the buffer says are due (or all of them). Whole
+ * objects are a single update; otherwise every buffered range is its own
+ * partial update, and since they queue on the same sector they are merged
+ * behind a single read.
+ * \return false if another flush was already running
+ */
+bool
+BlockOperations::flushWriteBuffer(bool const all) {
+    if (!writeBuffer) {
+        return true;
+    }
+    // Only one flusher at a time; completions of the updates we issue can
+    // come back on this thread and will find it busy
+    if (flushActive.test_and_set(std::memory_order_acquire)) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lg(shutdownLock);
+        if (shutting_down && !all) {
+            flushActive.clear(std::memory_order_release);
+            return true;
+        }
+    }
+
+    BlockWriteBuffer::overlay_map_type objects;
+    writeBuffer->takeFlushable(all, objects);
+    for (auto const& object : objects) {
+        auto const& state = object.second;
+        std::vector<std::pair<BlockTask*, boost::shared_ptr<std::string>>> tasks;
+        if (state.complete(maxObjectSizeInBytes)) {
+            auto task = new BlockTask(write_back_handle_base | ++write_back_seq);
+            task->setWrite(object.first * maxObjectSizeInBytes, maxObjectSizeInBytes);
+            tasks.emplace_back(task, state.data);
+        } else {
+            for (auto const& ext : state.extents) {
+                auto task = new BlockTask(write_back_handle_base | ++write_back_seq);
+                task->setWrite(object.first * maxObjectSizeInBytes + ext.first,
+                               ext.second - ext.first);
+                tasks.emplace_back(task,
+                                   boost::make_shared<std::string>(*state.data,
+                                                                   ext.first,
+                                                                   ext.second - ext.first));
+            }
+        }
+        LOGTRACE << "vol:" << *volumeName << " object:" << object.first
+                 << " ranges:" << tasks.size() << " write back";
+
+        auto write_back = std::make_shared<WriteBack>(
+            WriteBack{object.first, static_cast<uint32_t>(tasks.size()), true});
+        {
+            std::unique_lock<std::mutex> l(respLock);
+            for (auto const& task : tasks) {
+                writeBacks.emplace(task.first->getHandle(), write_back);
+            }
+        }
+        for (auto& task : tasks) {
+            updateObjects(task.second, task.first, false);
+        }
+    }
+    flushActive.clear(std::memory_order_release);
+    return true;
+}
+
+/**
+ * Completion of a task from flushWriteBuffer; nobody else to respond to.
+ * \return false if the task is not a write back
+ */
+bool
+BlockOperations::finishWriteBack(task_type* task) {
+    std::shared_ptr<WriteBack> write_back;
+    bool done {false};
+    {
+        std::unique_lock<std::mutex> l(respLock);
+        auto it = writeBacks.find(task->getHandle());
+        if (writeBacks.end() == it) {
+            return false;
+        }
+        write_back = it->second;
+        writeBacks.erase(it);
+        if (fpi::OK != task->getError()) {
+            write_back->ok = false;
+        }
+        done = (0 == --write_back->remaining);
+    }
+    delete task;
+
+    if (done) {
+        writeBuffer->flushed(write_back->objectOff, write_back->ok);
+        // Newer writes to the object may have been waiting on this one,
+        // when shutting down they have to go out now
+        bool all {false};
+        {
+            std::lock_guard<std::mutex> lg(shutdownLock);
+            all = shutting_down;
+        }
+        // A failure stays journaled rather than being retried on shutdown
+        if (!all || write_back->ok) {
+            flushWriteBuffer(all);
+        }
+    }
+    return true;
+}
+
+/**
+ * Lay the buffered data captured when the read was issued over what the
+ * volume returned. Objects the volume has no data for are filled in from
+ * zeros, the length is adjusted for whatever we fill in.
+ */
+void
+BlockOperations::applyOverlay(handle_type const& requestId,
+                              std::vector<boost::shared_ptr<std::string>>& bufs,
+                              size_type& length) {
+    std::pair<uint64_t, BlockWriteBuffer::overlay_map_type> overlay;
+    {
+        std::unique_lock<std::mutex> l(respLock);
+        auto it = readOverlays.find(requestId.handle);
+        if (readOverlays.end() == it) {
+            return;
+        }
+        overlay = std::move(it->second);
+        readOverlays.erase(it);
+    }
+
+    for (auto const& object : overlay.second) {
+        size_t index = object.first - overlay.first;
+        while (bufs.size() <= index) {
+            // Counted as a missing object when the response is handled
+            bufs.push_back(discard_buffer);
+        }
+        auto& buf = bufs[index];
+        size_t returned = buf ? buf->size() : 0;
+        auto merged = (0 < returned) ?
+            boost::make_shared<std::string>(*buf) :
+            boost::make_shared<std::string>(maxObjectSizeInBytes, '\0');
+        merged->resize(maxObjectSizeInBytes, '\0');
+        object.second.apply(*merged);
+        buf = merged;
+        length += maxObjectSizeInBytes - returned;
+    }
+}
+
 /**
  * Calculate number of objects that are contained in a request with length
  * 'length' at offset 'offset'
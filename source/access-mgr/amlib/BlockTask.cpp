@@ -18,6 +18,28 @@ BlockTask::BlockTask(uint64_t const hdl) :
     offVec.reserve(objCount);
 }
 
+void
+BlockTask::reset(uint64_t const hdl) {
+    handle = hdl;
+    operation = OTHER;
+    doneCount = 0;
+    objCount = 1;
+    {
+        std::lock_guard<std::mutex> g(chain_lock);
+        chained_responses.clear();
+    }
+    opError = fpi::OK;
+    // Drops our references to the object buffers, keeps the capacity
+    bufVec.clear();
+    offVec.clear();
+    offset = 0;
+    length = 0;
+    maxObjectSizeInBytes = 0;
+    readStart = 0;
+    readFirstLen = 0;
+    readLastLen = 0;
+}
+
 void
 BlockTask::handleReadResponse(std::vector<boost::shared_ptr<std::string>>& buffers,
                               boost::shared_ptr<std::string>& empty_buffer,
@@ -45,17 +67,14 @@ BlockTask::handleReadResponse(std::vector<boost::shared_ptr<std::string>>& buffe
 
     // Trim the data as needed from the front...
     auto firstObjLen = std::min(length, maxObjectSizeInBytes - iOff);
-    if (maxObjectSizeInBytes != firstObjLen) {
-        bufVec.front() = boost::make_shared<std::string>(bufVec.front()->data() + iOff, firstObjLen);
-    }
+    readStart = iOff;
+    readFirstLen = firstObjLen;
 
     // ...and the back
+    readLastLen = 0;
     if (length > firstObjLen) {
         auto padding = (2 < bufVec.size()) ? (bufVec.size() - 2) * maxObjectSizeInBytes : 0;
-        auto lastObjLen = length - firstObjLen - padding;
-        if (0 < lastObjLen && maxObjectSizeInBytes != lastObjLen) {
-            bufVec.back() = boost::make_shared<std::string>(bufVec.back()->data(), lastObjLen);
-        }
+        readLastLen = length - firstObjLen - padding;
     }
 }
 
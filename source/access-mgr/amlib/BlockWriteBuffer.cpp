@@ -0,0 +1,470 @@
+/*
+ * Copyright 2015 by Formation Data Systems, Inc.
+ */
+
+#include "connector/BlockWriteBuffer.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/make_shared.hpp>
+
+#include "fds_process.h"
+#include "util/Log.h"
+
+namespace fds {
+
+static constexpr size_t Ki { 1024 };
+static constexpr size_t Mi { 1024 * Ki };
+
+/**
+ * Buffers are per volume and shared by every connection to it, keep them
+ * here keyed by volume name like the connection associations.
+ */
+static std::unordered_map<std::string, std::shared_ptr<BlockWriteBuffer>> buffer_map {};
+static std::mutex buffer_map_lock {};
+
+/**
+ * Journal record header, followed by len bytes of data. A tombstone has no
+ * data and drops everything journaled for the object before it.
+ */
+struct __attribute__((packed)) JournalRecord {
+    static constexpr uint32_t MAGIC = 0x4642574a;  // "FBWJ"
+    static constexpr uint32_t TOMBSTONE = 0x46425754;  // "FBWT"
+    uint32_t magic;
+    uint32_t obj_offset;
+    uint64_t object_off;
+    uint32_t len;
+};
+
+void
+BlockWriteBuffer::Overlay::apply(std::string& buf) const {
+    for (auto const& ext : extents) {
+        buf.replace(ext.first, ext.second - ext.first,
+                    data->data() + ext.first, ext.second - ext.first);
+    }
+}
+
+std::shared_ptr<BlockWriteBuffer>
+BlockWriteBuffer::open(std::string const& volume_name, uint32_t const obj_size) {
+    if (!g_fdsprocess || 0 == obj_size) {
+        return nullptr;
+    }
+    FdsConfigAccessor conf(g_fdsprocess->get_fds_config(), "fds.am.connector.write_buffer.");
+    if (!conf.get<bool>("enable", false)) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lg(buffer_map_lock);
+    auto it = buffer_map.find(volume_name);
+    if (buffer_map.end() != it) {
+        return it->second;
+    }
+
+    auto journal_dir = conf.get<std::string>("journal_dir",
+                                             g_fdsprocess->proc_fdsroot()->dir_user_repo()
+                                                 + "am_write_buffer/");
+    FdsRootDir::fds_mkdir(journal_dir.c_str());
+    auto max_bytes = Mi * conf.get<uint32_t>("max_volume_data", 64);
+    auto max_age = std::chrono::milliseconds(conf.get<uint32_t>("max_age_ms", 500));
+    auto buffer = std::make_shared<BlockWriteBuffer>(journal_dir + volume_name + ".journal",
+                                                     obj_size,
+                                                     std::max(max_bytes, (size_t)obj_size),
+                                                     max_age,
+                                                     conf.get<bool>("sync_journal", true));
+    buffer_map.emplace(volume_name, buffer);
+    return buffer;
+}
+
+void
+BlockWriteBuffer::close(std::string const& volume_name) {
+    std::lock_guard<std::mutex> lg(buffer_map_lock);
+    auto it = buffer_map.find(volume_name);
+    if (buffer_map.end() == it) {
+        return;
+    }
+    std::lock_guard<std::mutex> g(it->second->lock);
+    if (it->second->dirty.empty() && it->second->in_flight.empty()
+        && it->second->retired.empty()) {
+        buffer_map.erase(it);
+    }
+}
+
+BlockWriteBuffer::BlockWriteBuffer(std::string const& path,
+                                   uint32_t const obj_size_,
+                                   size_t const max_bytes_,
+                                   std::chrono::milliseconds const max_age_,
+                                   bool const sync_journal_)
+        : obj_size(obj_size_),
+          max_bytes(max_bytes_),
+          max_age(max_age_),
+          sync_journal(sync_journal_),
+          journal_path(path)
+{
+    journal_fd = ::open(journal_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (0 > journal_fd) {
+        LOGERROR << "path:" << journal_path << " errno:" << errno
+                 << " could not open write buffer journal, writes will not be buffered";
+        return;
+    }
+    replay();
+}
+
+BlockWriteBuffer::~BlockWriteBuffer() {
+    if (0 <= journal_fd) {
+        ::close(journal_fd);
+    }
+}
+
+bool
+BlockWriteBuffer::absorb(uint64_t const object_off,
+                         uint32_t const obj_offset,
+                         char const* bytes,
+                         uint32_t const len) {
+    fds_assert(obj_offset + len <= obj_size);
+    std::lock_guard<std::mutex> g(lock);
+    auto it = dirty.find(object_off);
+    bool has_state = (dirty.end() != it)
+        || (in_flight.end() != in_flight.find(object_off))
+        || (retired.end() != retired.find(object_off));
+    if (!has_state && ((0 > journal_fd) || (buffered_bytes + obj_size > max_bytes))) {
+        return false;
+    }
+    if (!journal(object_off, obj_offset, bytes, len)) {
+        if (!has_state) {
+            return false;
+        }
+        // The object must stay ordered behind its buffered state, keep the
+        // data in memory only
+        LOGERROR << "object:" << object_off << " buffering write without journal";
+    }
+    if (dirty.end() == it) {
+        it = dirty.emplace(object_off, Entry{Overlay(), clock_type::now()}).first;
+        buffered_bytes += obj_size;
+    }
+
+    merge(it->second.state, obj_offset, bytes, len);
+    if (it->second.state.complete(obj_size) || (buffered_bytes > (max_bytes / 4) * 3)) {
+        flush_hint = true;
+    }
+    return true;
+}
+
+bool
+BlockWriteBuffer::buffered(uint64_t const object_off) const {
+    std::lock_guard<std::mutex> g(lock);
+    return (dirty.end() != dirty.find(object_off))
+        || (in_flight.end() != in_flight.find(object_off))
+        || (retired.end() != retired.find(object_off));
+}
+
+bool
+BlockWriteBuffer::flushWanted() const {
+    std::lock_guard<std::mutex> g(lock);
+    return flush_hint;
+}
+
+void
+BlockWriteBuffer::overlay(uint64_t const first,
+                          uint64_t const last,
+                          overlay_map_type& out) const {
+    std::lock_guard<std::mutex> g(lock);
+    for (auto it = in_flight.lower_bound(first); in_flight.end() != it && it->first <= last; ++it) {
+        out.emplace(*it);
+    }
+    for (auto it = dirty.lower_bound(first); dirty.end() != it && it->first <= last; ++it) {
+        auto older = out.find(it->first);
+        if (out.end() == older) {
+            out.emplace(it->first, it->second.state);
+            continue;
+        }
+        // Newer writes go on top of the image being written back
+        auto merged = boost::make_shared<std::string>(*older->second.data);
+        it->second.state.apply(*merged);
+        older->second.data = merged;
+        for (auto const& ext : it->second.state.extents) {
+            older->second.extents[ext.first] =
+                std::max(older->second.extents[ext.first], ext.second);
+        }
+    }
+}
+
+void
+BlockWriteBuffer::takeFlushable(bool const all, overlay_map_type& out) {
+    std::lock_guard<std::mutex> g(lock);
+    auto now = clock_type::now();
+    bool over_limit = (buffered_bytes > (max_bytes / 4) * 3);
+    for (auto it = dirty.begin(); dirty.end() != it;) {
+        auto const& entry = it->second;
+        if ((in_flight.end() == in_flight.find(it->first))
+            && (all
+                || over_limit
+                || entry.state.complete(obj_size)
+                || (max_age <= (now - entry.since)))) {
+            in_flight.emplace(it->first, entry.state);
+            out.emplace(it->first, entry.state);
+            it = dirty.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    flush_hint = false;
+}
+
+void
+BlockWriteBuffer::flushed(uint64_t const object_off, bool const ok) {
+    std::lock_guard<std::mutex> g(lock);
+    auto it = in_flight.find(object_off);
+    if (in_flight.end() == it) {
+        return;
+    }
+
+    if (ok) {
+        in_flight.erase(it);
+        buffered_bytes -= obj_size;
+    } else {
+        // Put the object back, underneath anything written since
+        LOGWARN << "object:" << object_off << " write back failed, will retry";
+        auto newer = dirty.find(object_off);
+        if (dirty.end() == newer) {
+            dirty.emplace(object_off, Entry{std::move(it->second), clock_type::now()});
+        } else {
+            auto& state = it->second;
+            for (auto const& ext : newer->second.state.extents) {
+                merge(state, ext.first,
+                      newer->second.state.data->data() + ext.first,
+                      ext.second - ext.first);
+            }
+            newer->second.state = std::move(state);
+            buffered_bytes -= obj_size;
+        }
+        in_flight.erase(it);
+    }
+
+    if (dirty.empty() && in_flight.empty() && truncate()) {
+        return;
+    }
+    if (ok) {
+        retire(object_off);
+    }
+    if (journal_size > 4 * max_bytes) {
+        compact();
+    }
+}
+
+/**
+ * Keep the journal from replaying a written back object over what may be
+ * written to the volume directly from now on. The tombstone also hides the
+ * object's newer buffered writes, so they are journaled again after it.
+ * Failing that, the object stays routed through the buffer until the
+ * journal is rewritten.
+ */
+void
+BlockWriteBuffer::retire(uint64_t const object_off) {
+    bool ok = journal(object_off, 0, nullptr, 0);
+    auto newer = dirty.find(object_off);
+    if (ok && (dirty.end() != newer)) {
+        auto const& state = newer->second.state;
+        for (auto const& ext : state.extents) {
+            ok = ok && journal(object_off, ext.first,
+                               state.data->data() + ext.first, ext.second - ext.first);
+        }
+    }
+    if (ok) {
+        retired.erase(object_off);
+    } else if (!compact()) {
+        retired.insert(object_off);
+    }
+}
+
+/**
+ * Copy the bytes into the object image and record the written range,
+ * coalescing it with any range it touches. The image is shared with reads
+ * and write backs, so it is copied first if anyone else holds it.
+ */
+void
+BlockWriteBuffer::merge(Overlay& state,
+                        uint32_t const obj_offset,
+                        char const* bytes,
+                        uint32_t const len) {
+    if (!state.data) {
+        state.data = boost::make_shared<std::string>(obj_size, '\0');
+    } else if (!state.data.unique()) {
+        state.data = boost::make_shared<std::string>(*state.data);
+    }
+    state.data->replace(obj_offset, len, bytes, len);
+
+    uint32_t start = obj_offset;
+    uint32_t end = obj_offset + len;
+    auto it = state.extents.upper_bound(start);
+    if (state.extents.begin() != it) {
+        auto prev = std::prev(it);
+        if (prev->second >= start) {
+            start = prev->first;
+            end = std::max(end, prev->second);
+            it = state.extents.erase(prev);
+        }
+    }
+    while (state.extents.end() != it && it->first <= end) {
+        end = std::max(end, it->second);
+        it = state.extents.erase(it);
+    }
+    state.extents.emplace(start, end);
+}
+
+bool
+BlockWriteBuffer::journal(uint64_t const object_off,
+                          uint32_t const obj_offset,
+                          char const* bytes,
+                          uint32_t const len) {
+    if (0 > journal_fd) {
+        return false;
+    }
+    JournalRecord rec {bytes ? JournalRecord::MAGIC : JournalRecord::TOMBSTONE,
+                       obj_offset, object_off, len};
+    struct iovec iov[2] = {
+        { &rec, sizeof(rec) },
+        { const_cast<char*>(bytes), len }
+    };
+    ssize_t expected = sizeof(rec) + len;
+    if (expected != ::writev(journal_fd, iov, bytes ? 2 : 1)) {
+        LOGERROR << "path:" << journal_path << " errno:" << errno << " journal write failed";
+        // Drop anything partially written so replay stays consistent
+        if (0 != ::ftruncate(journal_fd, journal_size)) {
+            LOGERROR << "path:" << journal_path << " errno:" << errno << " journal truncate failed";
+        }
+        return false;
+    }
+    if (sync_journal && (0 != ::fdatasync(journal_fd))) {
+        LOGERROR << "path:" << journal_path << " errno:" << errno << " journal sync failed";
+        return false;
+    }
+    journal_size += expected;
+    return true;
+}
+
+/**
+ * Rebuild the buffer from the journal left by a previous run. A torn
+ * record at the tail was never acknowledged and is cut off.
+ */
+void
+BlockWriteBuffer::replay() {
+    std::string contents;
+    char chunk[64 * Ki];
+    ssize_t n;
+    while (0 < (n = ::pread(journal_fd, chunk, sizeof(chunk), contents.size()))) {
+        contents.append(chunk, n);
+    }
+
+    size_t pos = 0;
+    size_t records = 0;
+    while (pos + sizeof(JournalRecord) <= contents.size()) {
+        JournalRecord rec;
+        memcpy(&rec, contents.data() + pos, sizeof(rec));
+        uint64_t const object_off = rec.object_off;
+        if (JournalRecord::TOMBSTONE == rec.magic && 0 == rec.len) {
+            auto it = dirty.find(object_off);
+            if (dirty.end() != it) {
+                dirty.erase(it);
+                buffered_bytes -= obj_size;
+            }
+            pos += sizeof(rec);
+            ++records;
+            continue;
+        }
+        if ((JournalRecord::MAGIC != rec.magic)
+            || (rec.obj_offset + rec.len > obj_size)
+            || (pos + sizeof(rec) + rec.len > contents.size())) {
+            break;
+        }
+        auto it = dirty.find(object_off);
+        if (dirty.end() == it) {
+            it = dirty.emplace(object_off, Entry{Overlay(), clock_type::now()}).first;
+            buffered_bytes += obj_size;
+        }
+        merge(it->second.state, rec.obj_offset, contents.data() + pos + sizeof(rec), rec.len);
+        pos += sizeof(rec) + rec.len;
+        ++records;
+    }
+
+    if (pos != contents.size()) {
+        LOGWARN << "path:" << journal_path << " discarding " << (contents.size() - pos)
+                << " bytes of torn journal";
+        if (0 != ::ftruncate(journal_fd, pos)) {
+            LOGERROR << "path:" << journal_path << " errno:" << errno << " journal truncate failed";
+        }
+    }
+    journal_size = pos;
+    if (!dirty.empty()) {
+        LOGNOTIFY << "path:" << journal_path << " records:" << records
+                  << " objects:" << dirty.size() << " replayed write buffer journal";
+        flush_hint = true;
+    }
+}
+
+/**
+ * The journal only needs to describe what is still buffered; rewrite it
+ * from memory when it has grown well past that.
+ */
+bool
+BlockWriteBuffer::compact() {
+    auto tmp_path = journal_path + ".tmp";
+    int old_fd = journal_fd;
+    size_t old_size = journal_size;
+    journal_fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (0 > journal_fd) {
+        LOGERROR << "path:" << tmp_path << " errno:" << errno << " could not compact journal";
+        journal_fd = old_fd;
+        return false;
+    }
+    journal_size = 0;
+
+    bool ok = true;
+    auto write_state = [this, &ok] (uint64_t const object_off, Overlay const& state) {
+        for (auto const& ext : state.extents) {
+            ok = ok && journal(object_off, ext.first,
+                               state.data->data() + ext.first, ext.second - ext.first);
+        }
+    };
+    for (auto const& obj : in_flight) {
+        write_state(obj.first, obj.second);
+    }
+    for (auto const& obj : dirty) {
+        write_state(obj.first, obj.second.state);
+    }
+
+    if (ok && (0 == ::fdatasync(journal_fd)) && (0 == ::rename(tmp_path.c_str(), journal_path.c_str()))) {
+        ::close(old_fd);
+        retired.clear();
+        return true;
+    }
+    LOGERROR << "path:" << journal_path << " errno:" << errno << " journal compaction failed";
+    ::close(journal_fd);
+    ::unlink(tmp_path.c_str());
+    journal_fd = old_fd;
+    journal_size = old_size;
+    return false;
+}
+
+bool
+BlockWriteBuffer::truncate() {
+    if ((0 <= journal_fd) && (0 < journal_size)) {
+        if (0 != ::ftruncate(journal_fd, 0)) {
+            LOGERROR << "path:" << journal_path << " errno:" << errno << " journal truncate failed";
+            return false;
+        }
+        journal_size = 0;
+    }
+    retired.clear();
+    return true;
+}
+
+}  // namespace fds
@@ -4,6 +4,7 @@
 
 #include "connector/nbd/NbdConnection.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <string>
 #include <type_traits>
@@ -19,8 +20,10 @@ extern "C" {
 #include <ev++.h>
 
 #include "connector/nbd/NbdConnector.h"
+#include "connector/nbd/NbdExport.h"
 #include "fds_process.h"
 #include "fds_volume.h"
+#include "PerfTrace.h"
 #include "fdsp/config_types_types.h"
 
 
@@ -38,6 +41,7 @@ static constexpr int16_t NBD_FLAG_SEND_FLUSH    = 0b000100;
 static constexpr int16_t NBD_FLAG_SEND_FUA      = 0b001000;
 static constexpr int16_t NBD_FLAG_ROTATIONAL    = 0b010000;
 static constexpr int16_t NBD_FLAG_SEND_TRIM     = 0b100000;
+static constexpr int16_t NBD_FLAG_CAN_MULTI_CONN = 0b100000000;
 static constexpr int32_t NBD_CMD_READ           = 0;
 static constexpr int32_t NBD_CMD_WRITE          = 1;
 static constexpr int32_t NBD_CMD_DISC           = 2;
@@ -84,7 +88,8 @@ NbdConnection::NbdConnection(NbdConnector* server,
                              std::shared_ptr<AmProcessor> processor)
         : amProcessor(processor),
           nbd_server(server),
-          nbdOps(boost::make_shared<BlockOperations>(this)),
+          nbdExport(nullptr),
+          nbdOps(nullptr),
           clientSocket(clientsd),
           volume_size{0},
           object_size{0},
@@ -93,8 +98,7 @@ NbdConnection::NbdConnection(NbdConnector* server,
           response(nullptr),
           total_blocks(0ull),
           write_offset(-1ll),
-          readyResponses(4000),
-          current_response(nullptr)
+          readyResponses(4000)
 {
     memset(&attach, '\0', sizeof(attach));
     memset(&request, '\0', sizeof(request));
@@ -102,6 +106,16 @@ NbdConnection::NbdConnection(NbdConnector* server,
     FdsConfigAccessor config(g_fdsprocess->get_conf_helper());
     standalone_mode = config.get_abs<bool>("fds.am.testing.standalone", false);
 
+    // Enough tasks for the requests a client usually keeps in flight
+    auto ring_size = config.get_abs<uint32_t>("fds.am.connector.nbd.options.task_ring", 256);
+    task_pool.reserve(ring_size);
+    task_ring.reserve(ring_size);
+    for (uint32_t i = 0; ring_size > i; ++i) {
+        task_pool.emplace_back(new NbdTask(this));
+        task_ring.push_back(task_pool.back().get());
+    }
+    replying.reserve(IOV_MAX / 3);
+
     ioWatcher = std::unique_ptr<ev::io>(new ev::io());
     ioWatcher->set(*loop);
     ioWatcher->set<NbdConnection, &NbdConnection::ioEvent>(this);
@@ -249,8 +263,9 @@ bool NbdConnection::option_request(ev::io &watcher) {
         nbd_state = NbdProtoState::SENDOPTS;
         asyncWatcher->send();
     } else {
-        auto task = new BlockTask(0ull);
-        nbdOps->init(volumeName, amProcessor, task);
+        // Connections to the same volume share its export
+        nbdExport = nbd_server->joinExport(volumeName, this, amProcessor);
+        nbdOps = nbdExport->operations();
     }
 
     return true;
@@ -260,7 +275,7 @@ bool
 NbdConnection::option_reply(ev::io &watcher) {
     static char const zeros[124]{0};  // NOLINT
     static int16_t const optFlags =
-        ntohs(NBD_FLAG_HAS_FLAGS);
+        ntohs(NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM | NBD_FLAG_CAN_MULTI_CONN);
     static iovec const vectors[] = {
         { nullptr,             sizeof(volume_size) },
         { to_iovec(&optFlags), sizeof(optFlags)    },
@@ -299,7 +314,9 @@ bool NbdConnection::io_request(ev::io &watcher) {
         request.header.offset = __builtin_bswap64(request.header.offset);
         request.header.length = ntohl(request.header.length);
 
-        if (max_block_size < request.header.length) {
+        // TRIM carries no payload, so it isn't bound by the block size
+        if (NBD_CMD_TRIM != request.header.opType &&
+            max_block_size < request.header.length) {
             LOGWARN << "blocksize:" << request.header.length
                     << " maxblocksize:" << max_block_size
                     << " client used larger blocksize than supported";
@@ -335,58 +352,62 @@ NbdConnection::io_reply(ev::io &watcher) {
     static int32_t const error_ok = htonl(0);
     static int32_t const error_bad = htonl(-1);
 
-    // We can reuse this from now on since we don't go to any state from here
+    // We can reuse this from now on since we don't go to any state from here,
+    // room for a batch of replies or the largest read on its own
     if (!response) {
-        response = resp_vector_type(new iovec[(max_block_size / object_size) + 3]);
-        response[0].iov_base = to_iovec(NBD_RESPONSE_MAGIC);
-        response[0].iov_len = sizeof(NBD_RESPONSE_MAGIC);
-        response[1].iov_base = to_iovec(&error_ok); response[1].iov_len = sizeof(error_ok);
-        response[2].iov_base = nullptr; response[2].iov_len = 0;
-        response[3].iov_base = nullptr; response[3].iov_len = 0ull;
+        response_blocks = std::max(static_cast<size_t>(IOV_MAX),
+                                   (max_block_size / object_size) + 5);
+        response = resp_vector_type(new iovec[response_blocks]);
     }
 
-    Error err = ERR_OK;
     if (write_offset == -1) {
-        if (readyResponses.empty())
-            { return false; }
-
-        total_blocks = 3;
-
-        BlockTask* resp = nullptr;
-        ensure(readyResponses.pop(resp));
-        current_response.reset(resp);
-
-        response[2].iov_base = &current_response->handle;
-        response[2].iov_len = sizeof(current_response->handle);
-        response[1].iov_base = to_iovec(&error_ok);
-        if (fpi::OK != current_response->getError()) {
-            err = current_response->getError();
-            response[1].iov_base = to_iovec(&error_bad);
-            LOGERROR << "returning error:" << err;
-        } else if (current_response->isRead()) {
-            fds_uint32_t context = 0;
-            boost::shared_ptr<std::string> buf = current_response->getNextReadBuffer(context);
-            while (buf != NULL) {
-                LOGDEBUG << "handle:" << current_response->handle
-                         << " size:" << buf->length()
-                         << " buffer:" << context;
-                response[total_blocks].iov_base = to_iovec(buf->c_str());
-                response[total_blocks].iov_len = buf->length();
-                ++total_blocks;
-                // get next buffer
-                buf = current_response->getNextReadBuffer(context);
+        // Gather as many ready replies as fit into a single write, reads
+        // point straight into the object buffers
+        total_blocks = 0;
+        while (next_reply || readyResponses.pop(next_reply)) {
+            bool const has_data = (fpi::OK == next_reply->getError()) && next_reply->isRead();
+            auto blocks = 3 + (has_data ? next_reply->getReadSegmentCount() : 0);
+            if (!replying.empty() && (IOV_MAX < total_blocks + blocks)) {
+                break;
+            }
+            auto resp = next_reply;
+            next_reply = nullptr;
+            replying.push_back(resp);
+
+            response[total_blocks++] = { to_iovec(NBD_RESPONSE_MAGIC), sizeof(NBD_RESPONSE_MAGIC) };
+            response[total_blocks++] = { to_iovec(&error_ok), sizeof(error_ok) };
+            if (fpi::OK != resp->getError()) {
+                response[total_blocks - 1].iov_base = to_iovec(&error_bad);
+                LOGERROR << "returning error:" << resp->getError();
+            }
+            response[total_blocks++] = { &resp->client_handle, sizeof(resp->client_handle) };
+            if (has_data) {
+                fds_uint32_t context = 0;
+                char const* data = nullptr;
+                size_t len = 0;
+                while (resp->getNextReadSegment(context, data, len)) {
+                    LOGDEBUG << "handle:" << resp->client_handle
+                             << " size:" << len
+                             << " buffer:" << context;
+                    response[total_blocks++] = { to_iovec(data), len };
+                }
             }
         }
+        if (replying.empty()) {
+            return false;
+        }
         write_offset = 0;
     }
-    fds_assert(response[2].iov_base != nullptr);
-    // Try and write the response, if it fails to write ALL
+
+    // Try and write the replies, if it fails to write ALL
     // the data we'll continue later
     if (!write_response()) {
         return false;
     }
-    response[2].iov_base = nullptr;
-    current_response.reset();
+    for (auto resp : replying) {
+        releaseTask(resp);
+    }
+    replying.clear();
 
     return true;
 }
@@ -397,22 +418,34 @@ NbdConnection::dispatchOp() {
     auto& offset = request.header.offset;
     auto& length = request.header.length;
 
+    // The client's handle is only unique on this connection, the export
+    // gives the task one that is unique across all of them
     switch (request.header.opType) {
         case NBD_CMD_READ:
             {
-                auto task = new BlockTask(handle);
+                auto task = acquireTask(handle);
                 task->setRead(offset, length);
+                taskIssued();
                 nbdOps->read(task);
             }
             break;
         case NBD_CMD_WRITE:
             {
                 fds_assert(request.data);
-                auto task = new BlockTask(handle);
+                auto task = acquireTask(handle);
                 task->setWrite(offset, length);
+                taskIssued();
                 nbdOps->write(request.data, task);
             }
             break;
+        case NBD_CMD_TRIM:
+            {
+                auto task = acquireTask(handle);
+                task->setDiscard(offset, length);
+                taskIssued();
+                nbdOps->discard(task);
+            }
+            break;
         case NBD_CMD_FLUSH:
             break;
         case NBD_CMD_DISC:
@@ -424,17 +457,46 @@ NbdConnection::dispatchOp() {
     return ERR_OK;
 }
 
+NbdTask*
+NbdConnection::acquireTask(int64_t const client_handle) {
+    NbdTask* task = nullptr;
+    if (task_ring.empty()) {
+        // More requests in flight than we have tasks, grow the pool
+        task_pool.emplace_back(new NbdTask(this));
+        task = task_pool.back().get();
+        PerfTracer::incr(PerfEventType::AM_NBD_TASK_ALLOC, volume_id);
+    } else {
+        task = task_ring.back();
+        task_ring.pop_back();
+        PerfTracer::incr(PerfEventType::AM_NBD_TASK_REUSED, volume_id);
+    }
+    task->reset(nbdExport->nextHandle());
+    task->client_handle = client_handle;
+    return task;
+}
+
 void
 NbdConnection::wakeupCb(ev::async &watcher, int revents) {
     if (processing_) return;
     if (ConnectionState::RUNNING != state_) {
-        nbdOps->shutdown();                             // We are shutting down
+        if (!leaving) {                                 // We are shutting down
+            leaving = true;
+            last_connection = nbdExport && nbd_server->leaveExport(nbdExport, this);
+        }
+        if (!last_connection) {
+            // Others still use the export, we only wait for our own tasks
+            std::lock_guard<std::mutex> g(respond_lock);
+            if (0 == outstanding) {
+                state_ = ConnectionState::STOPPED;
+            }
+        }
         if (ConnectionState::STOPPED == state_ ||
             ConnectionState::DRAINED == state_) {
-            asyncWatcher->stop();                       // We are not responding
-            ioWatcher->stop();
+            ioWatcher->stop();                          // We are not responding
             if (ConnectionState::STOPPED == state_) {
+                asyncWatcher->stop();                   // Nothing left to wait for
                 nbdOps.reset();
+                nbdExport.reset();
                 nbd_server->deviceDone(clientSocket);   // We are FIN!
                 return;
             }
@@ -443,7 +505,7 @@ NbdConnection::wakeupCb(ev::async &watcher, int revents) {
 
     // It's ok to keep writing responses if we've been shutdown
     auto writting = (nbd_state == NbdProtoState::SENDOPTS ||
-                     current_response ||
+                     next_reply || !replying.empty() ||
                      !readyResponses.empty()) ? ev::WRITE : ev::NONE;
 
     ioWatcher->set(writting | ev::READ);
@@ -459,8 +521,6 @@ NbdConnection::ioEvent(ev::io &watcher, int revents) {
 
     ioWatcher->stop();
     processing_ = true;
-    // Unblocks the next thread to listen on the ev loop
-    nbd_server->process();
 
     try {
     if (revents & EV_READ) {
@@ -518,17 +578,20 @@ NbdConnection::ioEvent(ev::io &watcher, int revents) {
     // Unblocks the ev loop to handle events again on this connection
     processing_ = false;
     asyncWatcher->send();
-    nbd_server->follow();
 }
 
 void
 NbdConnection::respondTask(BlockTask* response) {
+    // Held until we are done with ourselves, once the last outstanding task
+    // is answered a connection draining on its own may go away
+    std::lock_guard<std::mutex> g(respond_lock);
     // add to quueue
-    if (response->isRead() || response->isWrite()) {
-        readyResponses.push(response);
+    if (response->isRead() || response->isWrite() || response->isDiscard()) {
+        readyResponses.push(static_cast<NbdTask*>(response));
     } else {
         delete response;
     }
+    --outstanding;
 
     // We have something to write, so poke the loop
     asyncWatcher->send();
@@ -542,9 +605,11 @@ NbdConnection::attachResp(boost::shared_ptr<VolumeDesc> const& volDesc) {
                   << " objsize:" << volDesc->maxObjSizeInBytes
                   << " attached to volume";
         object_size = volDesc->maxObjSizeInBytes;
+        volume_id = volDesc->volUUID;
         volume_size = __builtin_bswap64(volDesc->capacity * Mi);
     }
     nbd_state = NbdProtoState::SENDOPTS;
+    asyncWatcher->send();
 }
 
 ssize_t retry_read(int fd, void* buf, size_t count) {
@@ -1,6 +1,8 @@
 /*
  * Copyright 2014 by Formation Data Systems, Inc.
  */
+#include <algorithm>
+#include <deque>
 #include <set>
 #include <string>
 #include <thread>
@@ -17,10 +19,36 @@ extern "C" {
 
 #include "connector/nbd/NbdConnector.h"
 #include "connector/nbd/NbdConnection.h"
+#include "connector/nbd/NbdExport.h"
 #include "fds_process.h"
 
 namespace fds {
 
+/**
+ * One of the loops connections are served on, accepted sockets are queued
+ * here and the loop woken to create their connections on its own thread.
+ */
+struct NbdConnector::EventLoop {
+    explicit EventLoop(NbdConnector* server)
+        : nbd_server(server),
+          loop(new ev::dynamic_loop()),
+          asyncWatcher(new ev::async())
+    {
+        asyncWatcher->set(*loop);
+        asyncWatcher->set<EventLoop, &EventLoop::wakeupCb>(this);
+        asyncWatcher->start();
+    }
+
+    void wakeupCb(ev::async &watcher, int revents)
+    { nbd_server->addConnections(*this); }
+
+    NbdConnector* nbd_server;
+    std::shared_ptr<ev::dynamic_loop> loop;
+    std::unique_ptr<ev::async> asyncWatcher;
+    std::mutex lock;
+    std::deque<int> accepted;
+};
+
 // The singleton
 std::unique_ptr<NbdConnector> NbdConnector::instance_ {nullptr};
 
@@ -30,10 +58,14 @@ void NbdConnector::start(std::weak_ptr<AmProcessor> processor) {
     std::call_once(init, [processor] () mutable
     {
         FdsConfigAccessor conf(g_fdsprocess->get_fds_config(), "fds.am.connector.nbd.");
-        auto threads = conf.get<uint32_t>("threads", 1);
-        instance_.reset(new NbdConnector(processor, threads - 1));
+        // One event loop per core unless told otherwise
+        auto threads = conf.get<uint32_t>("threads", 0);
+        if (0 == threads) {
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        instance_.reset(new NbdConnector(processor, threads));
         // Start the main server thread
-        auto t = std::thread(&NbdConnector::follow, instance_.get());
+        auto t = std::thread(&NbdConnector::runLoop, instance_.get(), instance_->evLoop);
         t.detach();
     });
 }
@@ -45,11 +77,15 @@ void NbdConnector::stop() {
 }
 
 NbdConnector::NbdConnector(std::weak_ptr<AmProcessor> processor,
-                           size_t const followers)
-        : LeaderFollower(followers, false),
-          nbdPort(10809),
+                           size_t const loops)
+        : nbdPort(10809),
           amProcessor(processor) {
-    LOGDEBUG << "followers:" << followers << " initialized server";
+    for (size_t i = 0; loops > i; ++i) {
+        ioLoops.emplace_back(new EventLoop(this));
+        auto t = std::thread(&NbdConnector::runLoop, this, ioLoops.back()->loop);
+        t.detach();
+    }
+    LOGDEBUG << "loops:" << loops << " initialized server";
     initialize();
 }
 
@@ -114,6 +150,38 @@ NbdConnector::deviceDone(int const socket) {
     connection_map.erase(it);
 }
 
+std::shared_ptr<NbdExport>
+NbdConnector::joinExport(boost::shared_ptr<std::string> const& vol_name,
+                         NbdConnection* conn,
+                         std::shared_ptr<AmProcessor> processor) {
+    std::lock_guard<std::mutex> g(export_lock);
+    auto& exp = exports[*vol_name];
+    if (!exp) {
+        exp = std::make_shared<NbdExport>(vol_name);
+    }
+    exp->join(conn, processor);
+    return exp;
+}
+
+bool
+NbdConnector::leaveExport(std::shared_ptr<NbdExport> const& exp, NbdConnection* conn) {
+    {
+        std::lock_guard<std::mutex> g(export_lock);
+        if (!exp->leave(conn)) {
+            return false;
+        }
+        // Connections from now on attach the volume anew
+        for (auto it = exports.begin(); exports.end() != it; ++it) {
+            if (exp == it->second) {
+                exports.erase(it);
+                break;
+            }
+        }
+    }
+    exp->operations()->shutdown();
+    return true;
+}
+
 void NbdConnector::reset() {
     if (0 <= nbdSocket) {
         evIoWatcher->stop();
@@ -194,15 +262,16 @@ NbdConnector::nbdAcceptCb(ev::io &watcher, int revents) {
         } while ((0 > clientsd) && (EINTR == errno));
 
         if (0 <= clientsd) {
-            std::lock_guard<std::mutex> g(connection_lock);
             // Setup some TCP options on the socket
             configureSocket(clientsd);
 
-            // Create a handler for this NBD connection
-            // Will delete itself when connection dies
-            auto client = new NbdConnection(this, evLoop, clientsd, processor);
-            connection_map[clientsd].reset(client);
-            LOGNORMAL << "created client connection";
+            // Hand it to the next loop, which creates the connection
+            auto& io_loop = *ioLoops[next_loop++ % ioLoops.size()];
+            {
+                std::lock_guard<std::mutex> g(io_loop.lock);
+                io_loop.accepted.push_back(clientsd);
+            }
+            io_loop.asyncWatcher->send();
         } else {
             switch (errno) {
             case ENOTSOCK:
@@ -255,14 +324,38 @@ NbdConnector::createNbdSocket() {
 }
 
 void
-NbdConnector::lead() {
+NbdConnector::addConnections(EventLoop& io_loop) {
+    std::deque<int> sockets;
+    {
+        std::lock_guard<std::mutex> g(io_loop.lock);
+        sockets.swap(io_loop.accepted);
+    }
+
+    auto processor = amProcessor.lock();
+    std::lock_guard<std::mutex> g(connection_lock);
+    for (auto clientsd : sockets) {
+        if (stopping || !processor) {
+            shutdown(clientsd, SHUT_RDWR);
+            close(clientsd);
+            continue;
+        }
+        // Create a handler for this NBD connection on the loop's thread
+        // Will delete itself when connection dies
+        auto client = new NbdConnection(this, io_loop.loop, clientsd, processor);
+        connection_map[clientsd].reset(client);
+        LOGNORMAL << "created client connection";
+    }
+}
+
+void
+NbdConnector::runLoop(std::shared_ptr<ev::dynamic_loop> loop) {
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGPIPE);
     if (0 != pthread_sigmask(SIG_BLOCK, &set, nullptr)) {
         LOGWARN << "failed to enable SIGPIPE mask on NBD server";
     }
-    evLoop->run(0);
+    loop->run(0);
 }
 
 }  // namespace fds
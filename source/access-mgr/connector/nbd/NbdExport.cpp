@@ -0,0 +1,81 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+
+#include "connector/nbd/NbdExport.h"
+
+#include <string>
+
+#include "connector/nbd/NbdConnection.h"
+#include "util/Log.h"
+
+namespace fds
+{
+
+NbdExport::NbdExport(boost::shared_ptr<std::string> const& vol_name)
+        : volumeName(vol_name),
+          ops(boost::make_shared<BlockOperations>(this))
+{
+}
+
+void
+NbdExport::join(NbdConnection* conn, std::shared_ptr<AmProcessor> processor) {
+    std::unique_lock<std::mutex> l(lock);
+    connections.insert(conn);
+    LOGDEBUG << "vol:" << *volumeName << " connections:" << connections.size() << " joined export";
+    switch (state) {
+        case AttachState::DETACHED:
+            {
+                // First connection, attach the volume on its behalf
+                state = AttachState::ATTACHING;
+                auto task = new NbdTask(conn, 0ll, nextHandle());
+                conn->taskIssued();
+                l.unlock();
+                ops->init(volumeName, processor, task);
+            }
+            break;
+        case AttachState::ATTACHED:
+            conn->attachResp(descriptor);
+            break;
+        default:
+            // Will be answered along with the first
+            break;
+    }
+}
+
+bool
+NbdExport::leave(NbdConnection* conn) {
+    std::lock_guard<std::mutex> g(lock);
+    if ((1 == connections.size()) && (0 < connections.count(conn))) {
+        return true;
+    }
+    connections.erase(conn);
+    return false;
+}
+
+void
+NbdExport::respondTask(BlockTask* response) {
+    auto task = static_cast<NbdTask*>(response);
+    task->connection->respondTask(task);
+}
+
+void
+NbdExport::attachResp(boost::shared_ptr<VolumeDesc> const& volDesc) {
+    std::lock_guard<std::mutex> g(lock);
+    state = AttachState::ATTACHED;
+    descriptor = volDesc;
+    for (auto conn : connections) {
+        conn->attachResp(descriptor);
+    }
+}
+
+void
+NbdExport::terminate() {
+    std::lock_guard<std::mutex> g(lock);
+    for (auto conn : connections) {
+        conn->terminate();
+    }
+    connections.clear();
+}
+
+}  // namespace fds
@@ -19,6 +19,7 @@
 
 #include "connector/scst/ScstDisk.h"
 
+#include <algorithm>
 #include <string>
 
 extern "C" {
@@ -42,6 +43,7 @@ extern "C" {
 
 #include "connector/scst/ScstTask.h"
 #include "connector/scst/ScstMode.h"
+#include "connector/scst/ScstInquiry.h"
 
 /// Some useful constants for us
 /// ******************************************
@@ -49,6 +51,8 @@ static constexpr size_t Ki = 1024;
 static constexpr size_t Mi = Ki * Ki;
 static constexpr size_t Gi = Ki * Mi;
 static constexpr ssize_t max_block_size = 8 * Mi;
+// Largest single UNMAP/WRITE SAME we accept, keeps the task length in range
+static constexpr size_t max_discard_size = 1 * Gi;
 /// ******************************************
 
 namespace fds
@@ -68,12 +72,63 @@ ScstDisk::ScstDisk(VolumeDesc const& vol_desc,
 
     // capacity is in MB
     volume_size = (vol_desc.capacity * Mi);
+    volume_id = vol_desc.volUUID;
     physical_block_size = vol_desc.maxObjSizeInBytes;
 
     setupModePages(logical_block_size, physical_block_size, volume_size);
+    setupProvisioningPages(logical_block_size, physical_block_size);
     registerDevice(TYPE_DISK, logical_block_size);
 }
 
+void ScstDisk::setupProvisioningPages(size_t const lba_size, size_t const pba_size)
+{
+    uint32_t blocks_per_object = pba_size / lba_size;
+    uint32_t max_discard_blocks = max_discard_size / lba_size;
+
+    // Write the Block Limits (0xB0) Page
+    BlockLimitsParameters limits;
+    limits.setWriteSameNonZero();
+    limits.setOptimalTransferGranularity(blocks_per_object);
+    limits.setMaxTransferLength(max_block_size / lba_size);
+    limits.setMaxUnmapLength(max_discard_blocks, 1);
+    limits.setUnmapGranularity(blocks_per_object);
+    limits.setMaxWriteSameLength(max_discard_blocks);
+    VPDPage limits_page;
+    limits_page.writePage(0xB0, &limits, sizeof(BlockLimitsParameters));
+    inquiry_handler->addVPDPage(limits_page);
+
+    // Write the Logical Block Provisioning (0xB2) Page, we are thin and
+    // unmapped blocks read back as zeros
+    ProvisioningParameters provisioning;
+    provisioning &= ProvisioningParameters::UnmapSupport;
+    provisioning &= ProvisioningParameters::WriteSameUnmapSupport;
+    provisioning &= ProvisioningParameters::UnmappedReadsZero;
+    provisioning &= ProvisioningParameters::ThinProvisioned;
+    VPDPage provisioning_page;
+    provisioning_page.writePage(0xB2, &provisioning, sizeof(ProvisioningParameters));
+    inquiry_handler->addVPDPage(provisioning_page);
+}
+
+void ScstDisk::discard(ScstTask* task, uint64_t const lba, uint64_t const blocks)
+{
+    uint64_t const last_lba = volume_size / logical_block_size;
+    if (last_lba < lba || (last_lba - lba) < blocks) {
+        task->checkCondition(SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+        return readyResponses.push(task);
+    }
+    if (max_discard_size / logical_block_size < blocks) {
+        task->checkCondition(SCST_LOAD_SENSE(scst_sense_invalid_field_in_parm_list));
+        return readyResponses.push(task);
+    }
+
+    task->setDiscard(lba * logical_block_size, blocks * logical_block_size);
+    try {
+    scstOps->discard(task);
+    } catch (BlockError const e) {
+        throw ScstError::scst_error;
+    }
+}
+
 void ScstDisk::setupModePages(size_t const lba_size, size_t const pba_size, size_t const volume_size)
 {
     mode_handler->setBlockDescriptor((volume_size / lba_size), lba_size);
@@ -104,7 +159,7 @@ void ScstDisk::execSessionCmd() {
     try {
     if (attaching) {
         auto volName = boost::make_shared<std::string>(getName());
-        scstOps->init(volName, amProcessor, nullptr, physical_block_size);
+        scstOps->init(volName, amProcessor, nullptr, physical_block_size, volume_id);
     } else {
         scstOps->detachVolume();
     }
@@ -199,6 +254,8 @@ void ScstDisk::execDeviceCmd(ScstTask* task) {
                 *reinterpret_cast<uint32_t*>(&buffer[8]) = htobe32(logical_block_size);
                 // Number of logic blocks per object as a power of 2
                 buffer[13] = (uint8_t)__builtin_ctz(blocks_per_object) & 0xFF;
+                // LBPME (we unmap) and LBPRZ (unmapped reads are zeros)
+                buffer[14] = 0x80 | 0x40;
                 task->setResponseLength(32);
             } else {
                 task->checkCondition(SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
@@ -243,6 +300,63 @@ void ScstDisk::execDeviceCmd(ScstTask* task) {
             return;
         }
         break;
+    case UNMAP:
+        {
+            // Parameter list is an 8 byte header followed by 16 byte block
+            // descriptors; we advertise a single descriptor per command
+            if (8 > buflen) {
+                // No descriptors, nothing to do
+                break;
+            }
+            size_t desc_len = be16toh(*reinterpret_cast<uint16_t*>(&buffer[2]));
+            desc_len = std::min(desc_len, buflen - 8);
+            if (0 == desc_len) {
+                break;
+            } else if (16 != desc_len) {
+                task->checkCondition(SCST_LOAD_SENSE(scst_sense_invalid_field_in_parm_list));
+                continue;
+            }
+            uint64_t lba = be64toh(*reinterpret_cast<uint64_t*>(&buffer[8]));
+            uint32_t blocks = be32toh(*reinterpret_cast<uint32_t*>(&buffer[16]));
+
+            LOGIO << "iotype:unmap"
+                  << " lba:" << lba
+                  << " blocks:" << blocks
+                  << " handle:" << cmd.cmd_h;
+
+            if (0 == blocks) {
+                break;
+            }
+            return discard(task, lba, blocks);
+        }
+        break;
+    case WRITE_SAME:
+    case WRITE_SAME_16:
+        {
+            bool unmap = (0x00 != (scsi_cmd.cdb[1] & 0x08));
+            uint32_t blocks = (WRITE_SAME == op_code) ?
+                be16toh(*reinterpret_cast<uint16_t*>(&scsi_cmd.cdb[7])) :
+                be32toh(*reinterpret_cast<uint32_t*>(&scsi_cmd.cdb[10]));
+
+            LOGIO << "iotype:writesame"
+                  << " lba:" << scsi_cmd.lba
+                  << " blocks:" << blocks
+                  << " unmap:" << unmap
+                  << " handle:" << cmd.cmd_h;
+
+            // We only support writing zeros, which is the same as unmapping
+            // since unmapped blocks read back as zeros
+            bool zeros = (logical_block_size <= buflen);
+            for (size_t i = 0; zeros && i < logical_block_size; ++i) {
+                zeros = (0x00 == buffer[i]);
+            }
+            if (0 == blocks || !zeros) {
+                task->checkCondition(SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
+                continue;
+            }
+            return discard(task, scsi_cmd.lba, blocks);
+        }
+        break;
     default:
         LOGDEBUG << "iotype:unsupported"
                  << "opcode:" << (uint32_t)(op_code)
@@ -262,7 +376,7 @@ void ScstDisk::attachResp(boost::shared_ptr<VolumeDesc> const& volDesc) {
 
 void ScstDisk::respondTask(BlockTask* response) {
     auto scst_response = static_cast<ScstTask*>(response);
-    if (scst_response->isRead() || scst_response->isWrite()) {
+    if (scst_response->isRead() || scst_response->isWrite() || scst_response->isDiscard()) {
         respondDeviceTask(scst_response);
     } else if (fpi::OK != scst_response->getError()) {
         scst_response->setResult(scst_response->getError());
@@ -290,8 +404,8 @@ ScstDisk::respondDeviceTask(ScstTask* task) {
                         << " length:" << task->getLength()
                         << " had critical failure.";
             task->checkCondition(SCST_LOAD_SENSE(scst_sense_read_error));
-        } else if (task->isWrite() && fpi::MISSING_RESOURCE == err) {
-            LOGCRITICAL << "iotype:write"
+        } else if (!task->isRead() && fpi::MISSING_RESOURCE == err) {
+            LOGCRITICAL << "iotype:" << (task->isWrite() ? "write" : "discard")
                         << " handle:" << task->getHandle()
                         << " offset:" << task->getOffset()
                         << " length:" << task->getLength()
@@ -306,13 +420,14 @@ ScstDisk::respondDeviceTask(ScstTask* task) {
             task->checkCondition(SCST_LOAD_SENSE(scst_sense_rebuild_in_progress));
         }
     } else if (task->isRead()) {
+        // Straight from the object buffers into the one SCST gave us
         auto buffer = task->getResponseBuffer();
         fds_uint32_t i = 0, context = 0;
-        boost::shared_ptr<std::string> buf = task->getNextReadBuffer(context);
-        while (buf != NULL) {
-            memcpy(buffer + i, buf->c_str(), buf->length());
-            i += buf->length();
-            buf = task->getNextReadBuffer(context);
+        char const* data = nullptr;
+        size_t len = 0;
+        while (task->getNextReadSegment(context, data, len)) {
+            memcpy(buffer + i, data, len);
+            i += len;
         }
         task->setResponseLength(i);
     }
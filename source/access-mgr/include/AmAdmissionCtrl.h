@@ -0,0 +1,105 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#ifndef SOURCE_ACCESS_MGR_INCLUDE_AMADMISSIONCTRL_H_
+#define SOURCE_ACCESS_MGR_INCLUDE_AMADMISSIONCTRL_H_
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "fds_volume.h"
+#include "PerfTypes.h"
+#include "concurrency/RwLock.h"
+
+namespace fds {
+
+struct AmRequest;
+
+/**
+ * Latency based admission control in front of the QoS dispatcher. Each
+ * volume has a latency SLO (the base SLO scaled by its relative priority, so
+ * priority 1 is the tightest) and a limit on the data requests it may have
+ * in QoS at once. Requests over the limit wait here instead of in the
+ * dispatcher's queues.
+ *
+ * The limit is adjusted AIMD style as requests complete: it grows by about
+ * one per round trip while latency is within the SLO and is cut
+ * multiplicatively, at most once per round trip, when it is not. When a
+ * volume misses its SLO, volumes with looser SLOs are cut as well, so they
+ * give way before the tighter one's queue builds.
+ */
+class AmAdmissionCtrl {
+  public:
+    enum class Admission { ADMITTED, WAITING, REJECTED };
+
+    AmAdmissionCtrl(fds_uint64_t const base_slo_usec,
+                    size_t const min_outstanding,
+                    size_t const max_outstanding,
+                    size_t const max_waiting);
+    AmAdmissionCtrl(AmAdmissionCtrl const&) = delete;
+    AmAdmissionCtrl& operator=(AmAdmissionCtrl const&) = delete;
+    virtual ~AmAdmissionCtrl() = default;
+
+    bool enabled() const { return 0 < base_slo_usec; }
+
+    /// Add the volume or update its SLO
+    void registerVolume(fds_volid_t const vol_id, fds_uint32_t const priority);
+
+    /// Forget the volume, returning the requests still waiting
+    void removeVolume(fds_volid_t const vol_id, std::deque<AmRequest*>& waiting);
+
+    /// Ask to send the request on, if it WAITS it is returned by complete later
+    Admission admit(AmRequest* amReq);
+
+    /**
+     * Account an admitted request's completion. Requests that may now be
+     * sent on in its place are appended to admitted.
+     */
+    void complete(AmRequest* amReq, std::vector<AmRequest*>& admitted);
+
+    /// An admitted request never made it to QoS, give its place back
+    void cancel(AmRequest* amReq, std::vector<AmRequest*>& admitted);
+
+  protected:
+    /// Add val (over cnt samples) to the volume's admission counter of the given type
+    virtual void account(PerfEventType const type, fds_volid_t const vol_id,
+                         uint64_t const val, uint64_t const cnt);
+
+  private:
+    struct Volume {
+        fds_uint64_t slo_usec {0};
+        double limit {0.0};
+        size_t outstanding {0};
+        std::deque<AmRequest*> waiting;
+        // smoothed, in usec
+        double queue_delay {0.0};
+        double service_time {0.0};
+        fds_uint64_t last_decrease {0};    // nsec
+        std::mutex lock;
+    };
+
+    static bool controlled(AmRequest const* amReq);
+    void decrease(Volume& vol, fds_uint64_t const now, double const rtt_usec);
+    void admitWaiting(Volume& vol, std::vector<AmRequest*>& admitted);
+
+    fds_uint64_t const base_slo_usec;
+    double const min_outstanding;
+    double const max_outstanding;
+    size_t const max_waiting;
+
+    // Tightest SLO recently missed, and until when volumes with looser
+    // SLOs should yield to it
+    std::atomic<fds_uint64_t> pressure_slo {0};
+    std::atomic<fds_uint64_t> pressure_until {0};
+
+    fds_rwlock map_lock;
+    std::unordered_map<fds_volid_t, std::unique_ptr<Volume>> volumes;
+};
+
+}  // namespace fds
+
+#endif  // SOURCE_ACCESS_MGR_INCLUDE_AMADMISSIONCTRL_H_
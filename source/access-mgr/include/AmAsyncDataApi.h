@@ -144,6 +144,21 @@ class AmAsyncDataApi {
                         shared_offset_type& objectOffset,
                         shared_meta_type& metadata);
 
+    /**
+     * Update several objects of a blob in one catalog transaction. The
+     * objects are written in parallel and their offsets committed together,
+     * so either all of them are updated or none is. updateBlobOnceResp is
+     * called for each of the request ids with the one result.
+     */
+    void updateBlobOnceMulti(std::vector<handle_type> const& requestIds,
+                             shared_string_type& domainName,
+                             shared_string_type& volumeName,
+                             shared_string_type& blobName,
+                             shared_int_type& blobMode,
+                             std::vector<shared_buffer_type> const& objects,
+                             std::vector<uint64_t> const& objectOffsets,
+                             shared_meta_type& metadata);
+
     void updateBlob(handle_type const& requestId,
                     shared_string_type& domainName,
                     shared_string_type& volumeName,
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#ifndef SOURCE_ACCESS_MGR_INCLUDE_AMBLOCKOFFSETCACHE_H_
+#define SOURCE_ACCESS_MGR_INCLUDE_AMBLOCKOFFSETCACHE_H_
+
+#include <bitset>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "fds_error.h"
+#include "fds_types.h"
+#include "fds_volume.h"
+#include "concurrency/RwLock.h"
+
+namespace fds {
+
+/**
+ * An offset to object ID cache for block volumes. These have a single blob
+ * whose offsets are dense, so rather than keep a (blob name, offset) keyed
+ * entry per object we keep pages of raw digests indexed by object number.
+ * A page is the unit of allocation and eviction; each volume keeps at most
+ * max_volume_bytes worth of pages and drops the least recently used one
+ * when it needs another.
+ */
+class AmBlockOffsetCache {
+  public:
+    /// Offsets kept per page
+    static constexpr size_t page_entries = 1024;
+
+    explicit AmBlockOffsetCache(size_t const max_volume_bytes);
+    AmBlockOffsetCache(AmBlockOffsetCache const&) = delete;
+    AmBlockOffsetCache& operator=(AmBlockOffsetCache const&) = delete;
+    ~AmBlockOffsetCache() = default;
+
+    bool enabled() const { return 0 < max_pages; }
+
+    /// Start caching offsets of the volume, ERR_VOL_DUPLICATE if we already are
+    Error addVolume(fds_volid_t const vol_id, fds_uint64_t const object_size);
+    void removeVolume(fds_volid_t const vol_id);
+    void clear(fds_volid_t const vol_id);
+
+    /**
+     * True if offsets of the blob are kept here. A volume's cache belongs to
+     * the first blob that is added to it.
+     */
+    bool handles(fds_volid_t const vol_id, std::string const& blob_name) const;
+
+    Error get(fds_volid_t const vol_id,
+              std::string const& blob_name,
+              fds_uint64_t const offset,
+              ObjectID::ptr& obj_id);
+
+    /**
+     * Cache the object at the offset. Like the SharedKvCache a dirty entry
+     * (one read back from DM) does not replace a clean one (one we wrote).
+     */
+    bool add(fds_volid_t const vol_id,
+             std::string const& blob_name,
+             fds_uint64_t const offset,
+             ObjectID const& obj_id,
+             bool const dirty = false);
+
+    bool add_dirty(fds_volid_t const vol_id,
+                   std::string const& blob_name,
+                   fds_uint64_t const offset,
+                   ObjectID const& obj_id)
+    { return add(vol_id, blob_name, offset, obj_id, true); }
+
+    /// Forget every offset of the blob
+    void remove(fds_volid_t const vol_id, std::string const& blob_name);
+
+    /// What a page takes out of max_volume_bytes
+    static size_t page_bytes() { return sizeof(Page); }
+
+  private:
+    struct Page {
+        std::bitset<page_entries> valid;
+        std::bitset<page_entries> clean;
+        uint8_t digests[page_entries][OBJECTID_DIGESTLEN];
+        std::list<fds_uint64_t>::iterator lru_pos;
+    };
+
+    struct Volume {
+        explicit Volume(fds_uint64_t const _object_size) : object_size(_object_size) {}
+        fds_uint64_t const object_size;
+        mutable std::mutex lock;
+        std::string blob_name;
+        std::unordered_map<fds_uint64_t, std::unique_ptr<Page>> pages;
+        std::list<fds_uint64_t> lru;    // most recently used page first
+    };
+
+    Volume* getVolume(fds_volid_t const vol_id) const;
+
+    size_t const max_pages;
+
+    mutable fds_rwlock map_lock;
+    std::unordered_map<fds_volid_t, std::unique_ptr<Volume>> volumes;
+};
+
+}  // namespace fds
+
+#endif  // SOURCE_ACCESS_MGR_INCLUDE_AMBLOCKOFFSETCACHE_H_
@@ -4,7 +4,10 @@
 #ifndef SOURCE_ACCESS_MGR_INCLUDE_AMCACHE_H_
 #define SOURCE_ACCESS_MGR_INCLUDE_AMCACHE_H_
 
+#include <atomic>
+#include <memory>
 #include <string>
+#include <unordered_set>
 
 #include "AmAsyncDataApi.h"
 #include "AmDataProvider.h"
@@ -13,6 +16,8 @@
 
 namespace fds {
 
+class AmBlockOffsetCache;
+class AmReadAhead;
 struct AmTxDescriptor;
 struct GetBlobReq;
 struct GetObjectReq;
@@ -57,6 +62,8 @@ class AmCache :
      * Everything else is pass-thru.
      */
     bool done() override;
+    void registerVolume(VolumeDesc const& volDesc) override;
+    void removeVolume(VolumeDesc const& volDesc) override;
     void closeVolume(AmRequest *amReq) override;
     void statBlob(AmRequest * amReq) override;
     void getBlob(AmRequest * amReq) override;
@@ -80,10 +87,19 @@ class AmCache :
     offset_cache_type offset_cache;
     object_cache_type object_cache;
 
+    /// Dense offset cache for the single blob of block volumes
+    std::unique_ptr<AmBlockOffsetCache> block_offset_cache;
+    std::unordered_set<fds_volid_t> block_volumes;
+    std::mutex block_volume_lock;
+
     typedef std::unique_ptr<std::deque<GetObjectReq*>> queue_type;  // NOLINT
     std::unordered_map<ObjectID, queue_type, ObjectHash> obj_get_queue;
     std::mutex obj_get_lock;
 
+    /// Sequential stream detection and read ahead
+    std::unique_ptr<AmReadAhead> read_ahead;
+    std::atomic<size_t> prefetches_in_flight {0};
+
     /**
      * FEATURE TOGGLE: Cache missing catalog entries
      * Sat Jan 30 11:37:00 2016
@@ -110,6 +126,21 @@ class AmCache :
      */
     Error getBlobOffsetObjects(GetBlobReq* amReq);
 
+    /**
+     * Offset cache accessors, these pick the dense cache for block volumes
+     * and the keyed offset cache for everything else.
+     */
+    Error getOffset(fds_volid_t const vol_id,
+                    std::string const& blob_name,
+                    fds_uint64_t const offset,
+                    ObjectID::ptr& obj_id);
+    void addOffset(fds_volid_t const vol_id,
+                   std::string const& blob_name,
+                   fds_uint64_t const offset,
+                   ObjectID::ptr const& obj_id,
+                   bool const dirty = false);
+    void removeOffsets(fds_volid_t const vol_id, std::string const& blob_name);
+
     /**
      * Retrieves object data from cache for given volume and object ids.
      * Returns hit_cnt, miss_cnt
@@ -122,6 +153,15 @@ class AmCache :
     void getObject(GetBlobReq* blobReq,
                    ObjectID::ptr const& obj_id,
                    boost::shared_ptr<std::string>& buf);
+
+    /**
+     * Read [ahead_start, ahead_end] of the blob into the cache on behalf of
+     * the sequential stream blobReq belongs to. Issued below QoS, so not
+     * charged to the volume.
+     */
+    void readAhead(GetBlobReq* blobReq,
+                   fds_uint64_t const ahead_start,
+                   fds_uint64_t const ahead_end);
 };
 
 }  // namespace fds
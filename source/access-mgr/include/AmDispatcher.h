@@ -11,6 +11,7 @@
 #include "AmDataProvider.h"
 #include <net/SvcRequest.h>
 #include "concurrency/RwLock.h"
+#include "cache/SharedKvCache.h"
 
 /* Forward declarations */
 namespace FDS_ProtocolInterface {
@@ -160,6 +161,21 @@ struct AmDispatcher : public AmDataProvider
     std::mutex tx_map_lock;
     tx_map_barrier_type tx_map_barrier;
 
+    /**
+     * Objects recently stored on SM and the DLT version they were stored
+     * under. While that version is current, puts of these objects only send
+     * a reference; a replica that no longer has the object gets the data.
+     */
+    using stored_objects_type = SharedKvCache<ObjectID, fds_uint64_t, ObjectHash>;
+    std::unique_ptr<stored_objects_type> stored_objects;
+
+    bool storedOnSM(ObjectID const& obj_id, fds_uint64_t const dlt_version);
+    bool takesRefs(DltTokenGroupPtr const& token_group);
+    void putObjectRef(PutObjectReq* amReq);
+    void putObjectData(PutObjectReq* amReq,
+                       std::vector<fpi::SvcUuid> const& eps,
+                       uint32_t const quorum);
+
     template<typename CbMeth, typename MsgPtr, typename ReqPtr>
     void readFromDM(ReqPtr request, MsgPtr message, CbMeth cb_func, uint32_t const timeout=0);
 
@@ -262,6 +278,11 @@ struct AmDispatcher : public AmDataProvider
                      const Error& error,
                      shared_str payload);
 
+    void putObjectRefCb(PutObjectReq* amReq,
+                        QuorumSvcRequest* svcReq,
+                        size_t const num_eps,
+                        const Error& error);
+
     void getObjectCb(AmRequest* amReq,
                      FailoverSvcRequest* svcReq,
                      const Error& error,
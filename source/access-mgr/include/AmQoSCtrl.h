@@ -5,9 +5,12 @@
 #ifndef SOURCE_ACCESS_MGR_INCLUDE_AMQOSCTRL_H_
 #define SOURCE_ACCESS_MGR_INCLUDE_AMQOSCTRL_H_
 
+#include <memory>
+
 #include "qos_ctrl.h"
 #include "fds_qos.h"
 #include "../lib/qos_htb.h"
+#include "AmAdmissionCtrl.h"
 #include "AmDataProvider.h"
 
 #include <util/Log.h>
@@ -116,7 +119,11 @@ class AmQoSCtrl :
     mutable fds_rwlock queue_lock;
     bool stopping {false};
 
+    // Holds back a volume's requests when its latency is over the SLO
+    std::unique_ptr<AmAdmissionCtrl> admission;
+
     void enqueueRequest(AmRequest *amReq);
+    void queueRequest(AmRequest *amReq);
     void completeRequest(AmRequest* amReq, Error const error);
 };
 
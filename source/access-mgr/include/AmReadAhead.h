@@ -0,0 +1,84 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#ifndef SOURCE_ACCESS_MGR_INCLUDE_AMREADAHEAD_H_
+#define SOURCE_ACCESS_MGR_INCLUDE_AMREADAHEAD_H_
+
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include "fds_volume.h"
+#include "PerfTypes.h"
+
+namespace fds {
+
+/**
+ * Detects sequential read streams per volume and blob and decides what
+ * the cache should read ahead for them. The window (in objects) starts
+ * small, doubles each time the stream moves into what was read ahead and
+ * collapses when the stream is broken. Offsets that were read ahead are
+ * remembered so hits and waste can be accounted per volume.
+ *
+ * Read ahead is issued by the cache itself, so it is not charged to the
+ * volume's QoS: a volume streaming sequentially reads up to max_window
+ * objects more than its rate limit accounts for.
+ */
+class AmReadAhead {
+  public:
+    AmReadAhead(size_t const max_window, size_t const max_streams);
+    AmReadAhead(AmReadAhead const&) = delete;
+    AmReadAhead& operator=(AmReadAhead const&) = delete;
+    virtual ~AmReadAhead() = default;
+
+    bool enabled() const { return 0 < max_window; }
+
+    /**
+     * Record a read of the object offsets [start, end] (in bytes). Returns
+     * true and the byte range to read ahead if the stream wants more.
+     */
+    bool onRead(fds_volid_t const vol_id,
+                std::string const& blob_name,
+                fds_uint64_t const start,
+                fds_uint64_t const end,
+                fds_uint64_t const object_size,
+                fds_uint64_t& ahead_start,
+                fds_uint64_t& ahead_end);
+
+    /// The read ahead issued for the stream completed
+    void done(fds_volid_t const vol_id, std::string const& blob_name, bool const ok);
+
+    /// Forget every stream of the volume
+    void removeVolume(fds_volid_t const vol_id);
+
+  protected:
+    /// Add cnt to the volume's read ahead counter of the given type
+    virtual void account(PerfEventType const type, fds_volid_t const vol_id, uint64_t const cnt);
+
+  private:
+    struct Stream {
+        fds_volid_t vol_id;
+        fds_uint64_t next {0};         // offset a sequential read continues at
+        fds_uint64_t ahead_end {0};    // one past the last offset read ahead
+        size_t window {0};             // objects to stay ahead by
+        fds_uint64_t last_used {0};    // for eviction
+        bool in_flight {false};
+        std::set<fds_uint64_t> unread; // offsets read ahead, not read yet
+    };
+
+    static std::string streamKey(fds_volid_t const vol_id, std::string const& blob_name);
+    void reset(Stream& stream);
+    void evict();
+
+    size_t const max_window;
+    size_t const max_streams;
+
+    std::mutex lock;
+    fds_uint64_t clock {0};
+    std::unordered_map<std::string, Stream> streams;
+};
+
+}  // namespace fds
+
+#endif  // SOURCE_ACCESS_MGR_INCLUDE_AMREADAHEAD_H_
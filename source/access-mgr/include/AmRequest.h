@@ -10,6 +10,7 @@
 
 #include "fds_volume.h"
 #include "PerfTrace.h"
+#include "fds_trace.h"
 #include "AsyncResponseHandlers.h"
 
 namespace fds
@@ -23,6 +24,9 @@ struct AmRequest : public FDS_IOType {
     PerfContext    dm_perf_ctx;
     PerfContext    sm_perf_ctx;
 
+    // When the request asked QoS for admission (nsec)
+    fds_uint64_t   admit_ts {0};
+
     // Table version used to message Catalog Service
     fds_uint64_t   dmt_version;
 
@@ -62,6 +66,12 @@ struct AmRequest : public FDS_IOType {
         io_req_id = 0;
         io_type   = _op;
         setVolId(_vol_id);
+        // Requests made for another request are part of its trace
+        trace_id = RequestTracer::current();
+        if (!trace_id) {
+            trace_id = RequestTracer::sample();
+        }
+        RequestTracer::record(trace_id, TraceStage::AM_START, io_type);
     }
 
     void setVolId(fds_volid_t const vol_id) {
@@ -73,8 +83,10 @@ struct AmRequest : public FDS_IOType {
         sm_perf_ctx.reset_volid(io_vol_id);
     }
 
-    virtual ~AmRequest()
-    { fds::PerfTracer::tracePointEnd(e2e_req_perf_ctx); }
+    virtual ~AmRequest() {
+        fds::PerfTracer::tracePointEnd(e2e_req_perf_ctx);
+        RequestTracer::record(trace_id, TraceStage::AM_DONE, io_type);
+    }
 
     bool isCompleted()
     { return !completed.load(std::memory_order_relaxed); }
@@ -4,7 +4,9 @@
 #ifndef SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_BLOCKOPERATIONS_H_
 #define SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_BLOCKOPERATIONS_H_
 
+#include <atomic>
 #include <map>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -15,7 +17,9 @@
 
 #include "fdsp/common_types.h"
 #include "AmAsyncDataApi.h"
+#include "fds_timer.h"
 #include "connector/BlockTask.h"
+#include "connector/BlockWriteBuffer.h"
 #include "connector/SectorLockMap.h"
 
 namespace fds {
@@ -27,11 +31,15 @@ enum class BlockError : uint8_t {
 
 /**
  * The BlockOperations class provides a simple interface to a dynamic connector
- * allowing block like semantics. The interface consists of three main calls to
- * attach the volume, read data and write data. The RMW logic and operation
+ * allowing block like semantics. The interface consists of four main calls to
+ * attach the volume, read data, write data and discard data. The RMW logic and operation
  * rollup all happens in here allowing block connectors to issue their requests
  * as fast as possible without having to deal with consistency themselves and
  * map I/O to AmAsyncDataApi calls.
+ *
+ * When the volume has a BlockWriteBuffer, sub-object writes are absorbed by
+ * it and acknowledged once journaled; the buffered objects are written back
+ * later with tasks we issue to ourselves.
  */
 class BlockOperations
     :   public boost::enable_shared_from_this<BlockOperations>,
@@ -73,10 +81,17 @@ class BlockOperations
     void init(req_api_type::shared_string_type vol_name,
               std::shared_ptr<AmProcessor> processor,
               task_type* resp,
-              uint32_t const obj_size = 0);
+              uint32_t const obj_size = 0,
+              fds_volid_t const vol_id = invalid_vol_id);
 
     void read(task_type* resp);
     void write(req_api_type::shared_buffer_type& bytes, task_type* resp);
+    /**
+     * Unmaps the task's range. Whole objects are mapped to the null object
+     * so their data can be reclaimed; partial objects at the edges are
+     * zeroed with a read-modify-write.
+     */
+    void discard(task_type* resp);
 
     void attachVolumeResp(const error_type &error,
                           handle_type const& requestId,
@@ -101,6 +116,10 @@ class BlockOperations
   private:
     void finishResponse(task_type* response);
 
+    void updateObjects(req_api_type::shared_buffer_type const& bytes,
+                       task_type* resp,
+                       bool const use_buffer = true);
+
     void drainUpdateChain(uint64_t const offset,
                           boost::shared_ptr<std::string> buf,
                           handle_type const* queued_handle_ptr,
@@ -108,10 +127,22 @@ class BlockOperations
 
     uint32_t getObjectCount(uint32_t length, uint64_t offset);
 
+    bool elideZeroObject(boost::shared_ptr<std::string>& buf);
+
+    void openWriteBuffer();
+    bool flushWriteBuffer(bool const all);
+    bool finishWriteBack(task_type* task);
+    void applyOverlay(handle_type const& requestId,
+                      std::vector<boost::shared_ptr<std::string>>& bufs,
+                      size_type& length);
+
     // api we've built
     std::unique_ptr<req_api_type> amAsyncDataApi;
     boost::shared_ptr<std::string> volumeName;
+    fds_volid_t volumeId {invalid_vol_id};
     boost::shared_ptr<std::string> empty_buffer;
+    // zero length update, maps an object to the null object
+    boost::shared_ptr<std::string> discard_buffer;
     uint32_t maxObjectSizeInBytes;
 
     // interface to respond to block passed down in constructor
@@ -131,6 +162,20 @@ class BlockOperations
 
     sector_type sector_map;
 
+    // write back buffer shared by the volume's connections, if enabled
+    struct WriteBack {
+        uint64_t objectOff;
+        uint32_t remaining;
+        bool ok;
+    };
+    std::shared_ptr<BlockWriteBuffer> writeBuffer;
+    FdsTimerTaskPtr writeBackTask;
+    std::atomic_flag flushActive = ATOMIC_FLAG_INIT;
+    // protected by respLock: write back tasks in flight and the buffered
+    // data reads have to apply to what they get back
+    std::unordered_map<int64_t, std::shared_ptr<WriteBack>> writeBacks;
+    std::unordered_map<int64_t, std::pair<uint64_t, BlockWriteBuffer::overlay_map_type>> readOverlays;
+
     // AmAsyncResponseApi un-implemented responses
     void abortBlobTxResp       (const error_type &, handle_type const&) override {}
     void commitBlobTxResp      (const error_type &, handle_type const&) override {}
@@ -21,7 +21,7 @@ namespace fds
 namespace fpi = FDS_ProtocolInterface;
 
 /**
- * A BlockTask represents a single READ/WRITE operation from a storage
+ * A BlockTask represents a single READ/WRITE/DISCARD operation from a storage
  * interface to a block device. The operation may encompass less than or
  * greater than a single object. This class helps deal with the buffers and
  * offset/length calculations needed during asynchronous i/o
@@ -35,12 +35,16 @@ struct BlockTask {
     enum BlockOp {
         OTHER = 0,
         READ = 1,
-        WRITE = 2
+        WRITE = 2,
+        DISCARD = 3
     };
 
     explicit BlockTask(uint64_t const hdl);
     virtual ~BlockTask() = default;
 
+    /// Make the task fit for reuse under a new handle
+    void reset(uint64_t const hdl);
+
     /// Setup task params
     void setRead(uint64_t const off, uint32_t const bytes) {
         operation = READ;
@@ -54,9 +58,17 @@ struct BlockTask {
         length = bytes;
     }
 
+    /// A discard (TRIM/UNMAP) unmaps the range; later reads return zeros
+    void setDiscard(uint64_t const off, uint32_t const bytes) {
+        operation = DISCARD;
+        offset = off;
+        length = bytes;
+    }
+
     /// Task getters
     bool isRead() const         { return (operation == READ); }
     bool isWrite() const        { return (operation == WRITE); }
+    bool isDiscard() const      { return (operation == DISCARD); }
     uint64_t getHandle() const  { return handle; }
     uint64_t getOffset() const  { return offset; }
     uint32_t getLength() const  { return length; }
@@ -77,11 +89,29 @@ struct BlockTask {
     buffer_ptr_type getBuffer(sequence_type const seqId) const   { return bufVec[seqId]; }
 
     /// Buffer operations
-    buffer_ptr_type getNextReadBuffer(uint32_t& context) {
+    size_t getReadSegmentCount() const { return bufVec.size(); }
+
+    /**
+     * The read data in order, one segment per object. Segments point into
+     * the object buffers we were given (shared with the cache), the ends
+     * of the range are trimmed by offset and length rather than copied.
+     */
+    bool getNextReadSegment(uint32_t& context, char const*& data, size_t& len) const {
         if (context >= bufVec.size()) {
-            return nullptr;
+            return false;
         }
-        return bufVec[context++];
+        auto const& buf = bufVec[context];
+        size_t start = 0;
+        len = buf->size();
+        if (0 == context) {
+            start = readStart;
+            len = readFirstLen;
+        } else if ((bufVec.size() - 1 == context) && (0 < readLastLen)) {
+            len = readLastLen;
+        }
+        data = buf->data() + start;
+        ++context;
+        return true;
     }
 
     void keepBufferForWrite(sequence_type const seqId,
@@ -148,6 +178,12 @@ struct BlockTask {
     uint64_t offset {0};
     uint32_t length {0};
     uint32_t maxObjectSizeInBytes {0};
+
+    // where the read data starts in the first buffer, how much of it and of
+    // the last buffer is ours (0 for all of it)
+    uint32_t readStart {0};
+    uint32_t readFirstLen {0};
+    uint32_t readLastLen {0};
 };
 
 
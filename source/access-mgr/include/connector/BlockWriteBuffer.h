@@ -0,0 +1,143 @@
+/*
+ * Copyright 2015 by Formation Data Systems, Inc.
+ */
+#ifndef SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_BLOCKWRITEBUFFER_H_
+#define SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_BLOCKWRITEBUFFER_H_
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+namespace fds {
+
+/**
+ * The BlockWriteBuffer absorbs sub-object writes to a block volume so that
+ * they do not each cost a read-modify-write against DM and SM. Writes are
+ * merged into an in-memory image of their object and appended to a local
+ * journal before they are acknowledged; whole objects are later written
+ * back through the normal update path.
+ *
+ * The buffer is shared by every connection to a volume. Once an object has
+ * buffered state all writes to it must go through the buffer, which is what
+ * keeps the write back of an object ordered with respect to newer writes.
+ * At most one write back per object is in flight; reads overlay whatever
+ * is buffered or in flight on top of the data returned from DM.
+ *
+ * A written back object's records stay in the journal until it is truncated
+ * or compacted, so a tombstone is journaled after them; replay drops the
+ * object's state there and later writes may go straight to the volume.
+ */
+class BlockWriteBuffer {
+  public:
+    using buffer_ptr_type = boost::shared_ptr<std::string>;
+    using clock_type = std::chrono::steady_clock;
+
+    /**
+     * The buffered state of one object: an image of the object and the
+     * byte ranges (offset -> end) in it that hold written data.
+     */
+    struct Overlay {
+        buffer_ptr_type data;
+        std::map<uint32_t, uint32_t> extents;
+
+        bool complete(uint32_t const obj_size) const {
+            return (1 == extents.size())
+                && (0 == extents.begin()->first)
+                && (obj_size == extents.begin()->second);
+        }
+        void apply(std::string& buf) const;
+    };
+    using overlay_map_type = std::map<uint64_t, Overlay>;
+
+    /**
+     * Return the buffer for the volume, creating it (and replaying its
+     * journal) on first use. nullptr if write buffering is not enabled.
+     */
+    static std::shared_ptr<BlockWriteBuffer> open(std::string const& volume_name,
+                                                  uint32_t const obj_size);
+    /// Forget the volume's buffer if nothing is left in it
+    static void close(std::string const& volume_name);
+
+    BlockWriteBuffer(std::string const& journal_path,
+                     uint32_t const obj_size,
+                     size_t const max_bytes,
+                     std::chrono::milliseconds const max_age,
+                     bool const sync_journal);
+    BlockWriteBuffer(BlockWriteBuffer const&) = delete;
+    BlockWriteBuffer& operator=(BlockWriteBuffer const&) = delete;
+    ~BlockWriteBuffer();
+
+    /**
+     * Merge len bytes at obj_offset inside object object_off and journal
+     * them. Returns false, leaving the buffer untouched, if the object has
+     * no buffered state and the buffer is full; the caller then writes
+     * through to the volume as usual.
+     */
+    bool absorb(uint64_t const object_off,
+                uint32_t const obj_offset,
+                char const* bytes,
+                uint32_t const len);
+
+    /**
+     * Objects with buffered state must be written through the buffer, as
+     * must written back objects whose tombstone could not be journaled.
+     */
+    bool buffered(uint64_t const object_off) const;
+
+    /// True if there are objects ready to be written back
+    bool flushWanted() const;
+
+    /// Collect the state of buffered objects in [first, last] for a read
+    void overlay(uint64_t const first, uint64_t const last, overlay_map_type& out) const;
+
+    /**
+     * Move objects that are due to be written back (all of them if all is
+     * set) to the in flight set and return them.
+     */
+    void takeFlushable(bool const all, overlay_map_type& out);
+
+    /// A write back finished; on failure the object is buffered again
+    void flushed(uint64_t const object_off, bool const ok);
+
+    std::chrono::milliseconds maxAge() const { return max_age; }
+
+  private:
+    struct Entry {
+        Overlay state;
+        clock_type::time_point since;
+    };
+
+    void merge(Overlay& state, uint32_t const obj_offset, char const* bytes, uint32_t const len);
+    bool journal(uint64_t const object_off, uint32_t const obj_offset,
+                 char const* bytes, uint32_t const len);
+    void retire(uint64_t const object_off);
+    void replay();
+    bool compact();
+    bool truncate();
+
+    uint32_t const obj_size;
+    size_t const max_bytes;
+    std::chrono::milliseconds const max_age;
+    bool const sync_journal;
+
+    mutable std::mutex lock;
+    std::map<uint64_t, Entry> dirty;
+    overlay_map_type in_flight;
+    /// Written back, but their records are still live in the journal
+    std::set<uint64_t> retired;
+    size_t buffered_bytes {0};
+    bool flush_hint {false};
+
+    std::string journal_path;
+    int journal_fd {-1};
+    size_t journal_size {0};
+};
+
+}  // namespace fds
+
+#endif  // SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_BLOCKWRITEBUFFER_H_
@@ -6,9 +6,12 @@
 #define SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_NBD_NBDCONNECTION_H_
 
 #include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include <boost/lockfree/queue.hpp>
 
@@ -21,6 +24,8 @@ namespace fds
 
 struct AmProcessor;
 struct NbdConnector;
+struct NbdExport;
+struct NbdTask;
 
 #pragma pack(push)
 #pragma pack(1)
@@ -69,6 +74,12 @@ struct NbdConnection : public BlockOperations::ResponseIFace {
 
     void startShutdown();
 
+    /// A task of ours was handed to the export's operations
+    void taskIssued() {
+        std::lock_guard<std::mutex> g(respond_lock);
+        ++outstanding;
+    }
+
   private:
     template<typename T>
     using unique = std::unique_ptr<T>;
@@ -86,21 +97,40 @@ struct NbdConnection : public BlockOperations::ResponseIFace {
     int clientSocket;
     size_t volume_size;
     size_t object_size;
+    fds_volid_t volume_id {invalid_vol_id};
 
     std::shared_ptr<AmProcessor> amProcessor;
     NbdConnector* nbd_server;
+    std::shared_ptr<NbdExport> nbdExport;
     BlockOperations::shared_ptr nbdOps;
 
+    // Tasks issued and not yet responded to, a connection that leaves an
+    // export others still use has to wait for these before it goes away
+    std::mutex respond_lock;
+    size_t outstanding {0};
+    bool leaving {false};
+    bool last_connection {false};
+
     message<attach_header, std::array<char, 1024>> attach;
     message<handshake_header, std::nullptr_t> handshake;
     message<request_header, boost::shared_ptr<std::string>> request;
 
     resp_vector_type response;
+    size_t response_blocks {0};
     size_t total_blocks;
     ssize_t write_offset;
 
-    boost::lockfree::queue<BlockTask*> readyResponses;
-    std::unique_ptr<BlockTask> current_response;
+    boost::lockfree::queue<NbdTask*> readyResponses;
+    // replies in the write under way, and one that didn't fit in it
+    std::vector<NbdTask*> replying;
+    NbdTask* next_reply {nullptr};
+
+    // Tasks are reused rather than allocated per request, the ring holds
+    // the ones not in use and the pool owns them all
+    std::vector<unique<NbdTask>> task_pool;
+    std::vector<NbdTask*> task_ring;
+    NbdTask* acquireTask(int64_t const client_handle);
+    void releaseTask(NbdTask* task) { task_ring.push_back(task); }
 
     std::unique_ptr<ev::io> ioWatcher;
     std::unique_ptr<ev::async> asyncWatcher;
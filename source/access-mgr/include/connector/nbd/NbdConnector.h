@@ -4,10 +4,16 @@
 #ifndef SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_NBD_NBDCONNECTOR_H_
 #define SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_NBD_NBDCONNECTOR_H_
 
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
 
 #include "connector/nbd/common.h"
-#include "concurrency/LeaderFollower.h"
 
 #include "fds_volume.h"
 
@@ -15,9 +21,14 @@ namespace fds {
 
 struct AmProcessor;
 struct NbdConnection;
+struct NbdExport;
 
+/**
+ * The NbdConnector accepts NBD clients on its own event loop and hands each
+ * connection to one of a pool of event loops, one thread each, that serves
+ * it for its lifetime. Connections to the same volume share an NbdExport.
+ */
 struct NbdConnector
-    : public LeaderFollower
 {
     NbdConnector(NbdConnector const& rhs) = delete;
     NbdConnector& operator=(NbdConnector const& rhs) = delete;
@@ -30,10 +41,21 @@ struct NbdConnector
 
     void deviceDone(int const socket);
 
- protected:
-    void lead() override;
+    /// Add the connection to the volume's export, creating it if need be
+    std::shared_ptr<NbdExport> joinExport(boost::shared_ptr<std::string> const& vol_name,
+                                          NbdConnection* conn,
+                                          std::shared_ptr<AmProcessor> processor);
+
+    /**
+     * Remove the connection from the export. Returns true if it was the
+     * last one, the export's operations are then shutdown and will
+     * terminate the connection once drained.
+     */
+    bool leaveExport(std::shared_ptr<NbdExport> const& exp, NbdConnection* conn);
 
  private:
+    struct EventLoop;
+
     uint32_t nbdPort;
     int32_t nbdSocket {-1};
     bool cfg_no_delay {true};
@@ -52,19 +74,28 @@ struct NbdConnector
     std::mutex connection_lock;
     map_type connection_map;
 
+    std::mutex export_lock;
+    std::unordered_map<std::string, std::shared_ptr<NbdExport>> exports;
+
+    // Serve the connections, accepted ones are assigned round-robin
+    std::vector<std::unique_ptr<EventLoop>> ioLoops;
+    size_t next_loop {0};
+
     std::shared_ptr<ev::dynamic_loop> evLoop;
     std::unique_ptr<ev::io> evIoWatcher;
     std::unique_ptr<ev::async> asyncWatcher;
     std::weak_ptr<AmProcessor> amProcessor;
 
     NbdConnector(std::weak_ptr<AmProcessor> processor,
-                 size_t const followers);
+                 size_t const loops);
 
     int createNbdSocket();
     void configureSocket(int fd) const;
     void initialize();
     void reset();
     void nbdAcceptCb(ev::io &watcher, int revents);
+    void addConnections(EventLoop& io_loop);
+    void runLoop(std::shared_ptr<ev::dynamic_loop> loop);
     void startShutdown();
 };
 
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+
+#ifndef SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_NBD_NBDEXPORT_H_
+#define SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_NBD_NBDEXPORT_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+#include "connector/BlockOperations.h"
+
+namespace fds
+{
+
+struct AmProcessor;
+struct NbdConnection;
+
+/**
+ * A task issued by one of an export's connections. The handle BlockOperations
+ * keys its responses on has to be unique across all of them, so the one the
+ * client gave us is kept aside to be echoed back in the reply.
+ */
+struct NbdTask : public BlockTask {
+    explicit NbdTask(NbdConnection* conn)
+        : NbdTask(conn, 0ll, 0ull)
+    {}
+    NbdTask(NbdConnection* conn, int64_t const client_hdl, uint64_t const hdl)
+        : BlockTask(hdl),
+          connection(conn),
+          client_handle(client_hdl)
+    {}
+    ~NbdTask() override = default;
+
+    NbdConnection* const connection;
+    int64_t client_handle;
+};
+
+/**
+ * An NbdExport is a volume attached over NBD. Clients that negotiate
+ * NBD_FLAG_CAN_MULTI_CONN may open several connections to it (one per hw
+ * queue), all of which share a single BlockOperations so they see each
+ * other's writes and the volume is only attached and detached once. Task
+ * responses are routed back to the connection that issued them.
+ */
+struct NbdExport : public BlockOperations::ResponseIFace {
+    explicit NbdExport(boost::shared_ptr<std::string> const& vol_name);
+    NbdExport(NbdExport const& rhs) = delete;
+    NbdExport& operator=(NbdExport const& rhs) = delete;
+    ~NbdExport() = default;
+
+    BlockOperations::shared_ptr operations() const { return ops; }
+
+    /// Next handle for a task of one of our connections
+    uint64_t nextHandle() { return ++handle_seq; }
+
+    /// Add the connection, it gets an attachResp once the volume is attached
+    void join(NbdConnection* conn, std::shared_ptr<AmProcessor> processor);
+
+    /**
+     * Remove the connection. Returns false if others remain, the connection
+     * then drains its own tasks and terminates itself. The last connection
+     * stays until the operations are shutdown and we terminate it.
+     */
+    bool leave(NbdConnection* conn);
+
+    // implementation of BlockOperations::ResponseIFace
+    void respondTask(BlockTask* response) override;
+    void attachResp(boost::shared_ptr<VolumeDesc> const& volDesc) override;
+    void terminate() override;
+
+  private:
+    enum class AttachState { DETACHED, ATTACHING, ATTACHED };
+
+    boost::shared_ptr<std::string> volumeName;
+    BlockOperations::shared_ptr ops;
+    std::atomic<uint64_t> handle_seq {0};
+
+    std::mutex lock;
+    AttachState state {AttachState::DETACHED};
+    boost::shared_ptr<VolumeDesc> descriptor;
+    std::set<NbdConnection*> connections;
+};
+
+}  // namespace fds
+
+#endif  // SOURCE_ACCESS_MGR_INCLUDE_CONNECTOR_NBD_NBDEXPORT_H_
@@ -48,11 +48,14 @@ struct ScstDisk : public ScstDevice,
 
   private:
     size_t volume_size {0};
+    fds_volid_t volume_id {invalid_vol_id};
     uint32_t logical_block_size {0};
     uint32_t physical_block_size {0};
     BlockOperations::shared_ptr scstOps;
 
     void setupModePages(size_t const lba_size, size_t const pba_size, size_t const volume_size);
+    void setupProvisioningPages(size_t const lba_size, size_t const pba_size);
+    void discard(ScstTask* task, uint64_t const lba, uint64_t const blocks);
 
     void execSessionCmd() override;
     void execDeviceCmd(ScstTask* task) override;
@@ -113,6 +113,57 @@ struct __attribute__((__packed__)) ExtVPDParameters {
 };
 static_assert(60 == sizeof(ExtVPDParameters), "Size of ExtVPDParameters has changed!");
 
+struct __attribute__((__packed__)) BlockLimitsParameters {
+    BlockLimitsParameters() { std::memset(this, '\0', sizeof(BlockLimitsParameters)); }
+
+    void setOptimalTransferGranularity(uint16_t const blocks) { _opt_xfer_granularity = htobe16(blocks); }
+    void setMaxTransferLength(uint32_t const blocks) { _max_xfer_length = htobe32(blocks); }
+    void setMaxUnmapLength(uint32_t const blocks, uint32_t const descriptors) {
+        _max_unmap_lba_count = htobe32(blocks);
+        _max_unmap_descriptor_count = htobe32(descriptors);
+    }
+    void setUnmapGranularity(uint32_t const blocks) { _opt_unmap_granularity = htobe32(blocks); }
+    void setMaxWriteSameLength(uint64_t const blocks) { _max_write_same_length = htobe64(blocks); }
+    /// A WRITE SAME with no block count is an error, not "to the end"
+    void setWriteSameNonZero() { _wsnz = 1; }
+
+ private:
+    uint8_t _wsnz : 1, : 0;
+    uint8_t _max_compare_and_write_length;
+    uint16_t _opt_xfer_granularity;
+    uint32_t _max_xfer_length;
+    uint32_t _opt_xfer_length;
+    uint32_t _max_prefetch_length;
+    uint32_t _max_unmap_lba_count;
+    uint32_t _max_unmap_descriptor_count;
+    uint32_t _opt_unmap_granularity;
+    uint32_t _unmap_granularity_alignment;
+    uint64_t _max_write_same_length;
+    uint8_t _reserved[20];
+};
+static_assert(60 == sizeof(BlockLimitsParameters), "Size of BlockLimitsParameters has changed!");
+
+struct __attribute__((__packed__)) ProvisioningParameters {
+    enum LBPU : bool { NoUnmapSupport, UnmapSupport };
+    enum LBPWS : bool { NoWriteSameUnmapSupport, WriteSameUnmapSupport };
+    enum LBPRZ : bool { UnmappedUndefined, UnmappedReadsZero };
+    enum Type : uint8_t { FullProvisioned, ResourceProvisioned, ThinProvisioned };
+
+    ProvisioningParameters() { std::memset(this, '\0', sizeof(ProvisioningParameters)); }
+
+    void operator &=(LBPU const unmap) { _lbpu = to_underlying(unmap); }
+    void operator &=(LBPWS const write_same) { _lbpws = _lbpws10 = to_underlying(write_same); }
+    void operator &=(LBPRZ const read_zero) { _lbprz = to_underlying(read_zero); }
+    void operator &=(Type const type) { _provisioning_type = to_underlying(type); }
+
+ private:
+    uint8_t _threshold_exponent;
+    uint8_t _dp : 1, _anc_sup : 1, _lbprz : 1, : 2, _lbpws10 : 1, _lbpws : 1, _lbpu : 1;
+    uint8_t _provisioning_type : 3, : 0;
+    uint8_t _reserved;
+};
+static_assert(4 == sizeof(ProvisioningParameters), "Size of ProvisioningParameters has changed!");
+
 struct __attribute__((__packed__)) DesignatorHeader {
     enum Assoc : uint8_t { LUNAssociation, PortAssociation, TargetAssociation };
     enum CodeSet : uint8_t { BinaryCodeSet = 1, ASCIICodeSet, UTF8CodeSet };
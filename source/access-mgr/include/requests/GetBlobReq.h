@@ -18,6 +18,9 @@ struct GetBlobReq: public AmMultiReq {
 
     fds_bool_t metadata_cached;
 
+    // Issued by the cache to read ahead of a sequential stream
+    fds_bool_t prefetch {false};
+
     BlobDescriptor::ptr blobDesc;
 
     // IDs used to provide a consistent read across objects
@@ -6,6 +6,7 @@
 #define SOURCE_ACCESS_MGR_INCLUDE_REQUESTS_PUTBLOBREQ_H_
 
 #include <string>
+#include <vector>
 
 #include "AmRequest.h"
 
@@ -26,6 +27,15 @@ struct PutBlobReq
     boost::shared_ptr< std::map<std::string, std::string> > metadata;
     fds_int32_t blob_mode;
 
+    /// Further objects of a multi-object putBlobOnce, committed to the
+    /// catalog in the same transaction as the one above.
+    struct ObjectUpdate {
+        fds_uint64_t blob_offset;
+        boost::shared_ptr<std::string> dataPtr;
+        ObjectID obj_id;
+    };
+    std::vector<ObjectUpdate> more_objects;
+
     /// Constructor used on regular putBlob requests.
     inline PutBlobReq(fds_volid_t _volid,
                const std::string& _volumeName,
@@ -25,7 +25,11 @@ struct PutObjectReq: public AmRequest {
     // Parent PutBlob request
     PutBlobReq* parent;
 
+    // Sent as a reference to an object SM already stores
+    bool by_ref {false};
+
     explicit inline PutObjectReq(PutBlobReq* blobReq);
+    inline PutObjectReq(PutBlobReq* blobReq, PutBlobReq::ObjectUpdate const& object);
 
     ~PutObjectReq() override = default;
 };
@@ -51,6 +55,27 @@ PutObjectReq::PutObjectReq(PutBlobReq* blobReq)
     fds::PerfTracer::tracePointBegin(e2e_req_perf_ctx);
 }
 
+PutObjectReq::PutObjectReq(PutBlobReq* blobReq, PutBlobReq::ObjectUpdate const& object)
+    : AmRequest(FDS_SM_PUT_OBJECT,
+                blobReq->io_vol_id,
+                blobReq->volume_name,
+                "",
+                nullptr,
+                object.blob_offset,
+                object.dataPtr->size()),
+      obj_id(object.obj_id),
+      dataPtr(object.dataPtr),
+      parent(blobReq)
+{
+    qos_perf_ctx.type = PerfEventType::AM_PUT_QOS;
+    hash_perf_ctx.type = PerfEventType::AM_PUT_HASH;
+    dm_perf_ctx.type = PerfEventType::AM_PUT_DM;
+    sm_perf_ctx.type = PerfEventType::AM_PUT_SM;
+
+    e2e_req_perf_ctx.type = PerfEventType::AM_PUT_SM;
+    fds::PerfTracer::tracePointBegin(e2e_req_perf_ctx);
+}
+
 
 }  // namespace fds
 
@@ -19,8 +19,9 @@ struct UpdateCatalogReq: public AmRequest,
 {
     using buffer_type = boost::shared_ptr<std::string>;
 
-    // ID for object
-    std::unordered_map<ObjectID, std::pair<uint64_t, size_t>, ObjectHash> object_list;
+    // Object ID and (offset, length) of every offset to update; several
+    // offsets may well refer to the same object
+    std::vector<std::pair<ObjectID, std::pair<uint64_t, size_t>>> object_list;
 
     // Metadata changes
     template <typename T>
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#define GTEST_USE_OWN_TR1_TUPLE 0
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "AmAdmissionCtrl.h"
+#include "AmRequest.h"
+#include "fds_process.h"
+
+namespace fds {
+
+using Admission = AmAdmissionCtrl::Admission;
+
+static constexpr fds_uint64_t slo_usec = 1000;
+static constexpr size_t min_limit = 2;
+static constexpr size_t max_limit = 16;
+static constexpr size_t max_waiting = 4;
+
+/// Keeps what would go to the perf counters
+struct CountingAdmissionCtrl : AmAdmissionCtrl {
+    using AmAdmissionCtrl::AmAdmissionCtrl;
+
+    void account(PerfEventType const type, fds_volid_t const vol_id,
+                 uint64_t const val, uint64_t const cnt) override {
+        if (PerfEventType::AM_ADMISSION_LIMIT == type) {
+            limits[vol_id.get()] = val;
+        }
+        counts[std::make_pair(vol_id.get(), type)] += val;
+    }
+
+    uint64_t count(PerfEventType const type, fds_uint64_t const vol = 1) {
+        return counts[std::make_pair(vol, type)];
+    }
+
+    /// The volume's limit after its last completion, rounded down
+    uint64_t limit(fds_uint64_t const vol = 1) {
+        return limits[vol];
+    }
+
+    std::map<fds_uint64_t, uint64_t> limits;
+    std::map<std::pair<fds_uint64_t, PerfEventType>, uint64_t> counts;
+};
+
+struct AmAdmissionCtrlTest : ::testing::Test {
+    void SetUp() override {
+        ctrl.registerVolume(fds_volid_t(1), 1);
+    }
+
+    /**
+     * A data request of the volume. Ending an AmRequest ends its perf trace,
+     * which needs the process' counters, so requests are never freed; those
+     * done with are handed out again.
+     */
+    AmRequest* request(fds_uint64_t const vol) {
+        static std::vector<AmRequest*> pool;
+        AmRequest* amReq;
+        if (!done.empty()) {
+            amReq = done.back();
+            done.pop_back();
+        } else {
+            if (pool.size() == used) {
+                pool.push_back(new AmRequest(FDS_GET_BLOB, fds_volid_t(vol), "vol", "blob", nullptr));
+            }
+            amReq = pool[used++];
+        }
+        amReq->setVolId(fds_volid_t(vol));
+        amReq->admit_ts = 0;
+        return amReq;
+    }
+
+    /// Ask to admit a new request of the volume
+    Admission admit(fds_uint64_t const vol = 1) {
+        auto amReq = request(vol);
+        auto const admission = ctrl.admit(amReq);
+        switch (admission) {
+            case Admission::ADMITTED:
+                outstanding.push_back(amReq);
+                break;
+            case Admission::WAITING:
+                waiting.push_back(amReq);
+                break;
+            case Admission::REJECTED:
+                done.push_back(amReq);
+                break;
+        }
+        return admission;
+    }
+
+    /**
+     * Complete an outstanding request that took latency_usec, all of it in
+     * service, the requests admitted in its place
+     */
+    std::vector<AmRequest*> complete(AmRequest* amReq, fds_uint64_t const latency_usec) {
+        amReq->admit_ts = now - latency_usec * 1000;
+        amReq->io_done_ts = now;
+        amReq->io_service_time = latency_usec;
+        std::vector<AmRequest*> admitted;
+        ctrl.complete(amReq, admitted);
+        outstanding.erase(std::find(outstanding.begin(), outstanding.end(), amReq));
+        done.push_back(amReq);
+        for (auto next : admitted) {
+            waiting.erase(std::find(waiting.begin(), waiting.end(), next));
+            outstanding.push_back(next);
+        }
+        return admitted;
+    }
+
+    /// Admit and complete a request of the volume
+    void roundTrip(fds_uint64_t const latency_usec, fds_uint64_t const vol = 1) {
+        ASSERT_EQ(Admission::ADMITTED, admit(vol));
+        complete(outstanding.back(), latency_usec);
+    }
+
+    /// Move the clock past any round trip and SLO pressure
+    void later() {
+        now += 100 * slo_usec * 1000;
+    }
+
+    CountingAdmissionCtrl ctrl {slo_usec, min_limit, max_limit, max_waiting};
+    fds_uint64_t now {1000000000000};
+    size_t used {0};
+    std::vector<AmRequest*> done;
+    std::vector<AmRequest*> outstanding;
+    std::vector<AmRequest*> waiting;
+};
+
+TEST_F(AmAdmissionCtrlTest, additiveIncrease) {
+    // Starts at the ceiling, a miss brings it down to 11.2
+    roundTrip(2 * slo_usec);
+    EXPECT_EQ(11u, ctrl.limit());
+
+    // Within the SLO it grows by about one per limit requests completed
+    for (size_t i = 0; 11 > i; ++i) {
+        roundTrip(slo_usec);
+    }
+    EXPECT_EQ(12u, ctrl.limit());
+    for (size_t i = 0; 12 > i; ++i) {
+        roundTrip(slo_usec / 2);
+    }
+    EXPECT_EQ(13u, ctrl.limit());
+}
+
+TEST_F(AmAdmissionCtrlTest, multiplicativeDecrease) {
+    roundTrip(2 * slo_usec);
+    EXPECT_EQ(11u, ctrl.limit());
+
+    // At most once per round trip, what misses meanwhile was sent before the cut
+    roundTrip(2 * slo_usec);
+    roundTrip(2 * slo_usec);
+    EXPECT_EQ(11u, ctrl.limit());
+
+    // 7.84, then 5.488
+    later();
+    roundTrip(2 * slo_usec);
+    EXPECT_EQ(7u, ctrl.limit());
+    later();
+    roundTrip(2 * slo_usec);
+    EXPECT_EQ(5u, ctrl.limit());
+
+    // Other volumes keep their own limit
+    ctrl.registerVolume(fds_volid_t(2), 1);
+    later();
+    roundTrip(slo_usec, 2);
+    EXPECT_EQ(max_limit, ctrl.limit(2));
+}
+
+TEST_F(AmAdmissionCtrlTest, limitBounds) {
+    // Never below the floor however often the SLO is missed
+    for (size_t i = 0; 20 > i; ++i) {
+        later();
+        roundTrip(2 * slo_usec);
+        ASSERT_LE(min_limit, ctrl.limit());
+    }
+    EXPECT_EQ(min_limit, ctrl.limit());
+
+    // Where only that many are admitted at once
+    ASSERT_EQ(Admission::ADMITTED, admit());
+    ASSERT_EQ(Admission::ADMITTED, admit());
+    ASSERT_EQ(Admission::WAITING, admit());
+    complete(outstanding.front(), slo_usec);
+    complete(outstanding.front(), slo_usec);
+    complete(outstanding.front(), slo_usec);
+
+    // Never above the ceiling however long the SLO is met
+    later();
+    for (size_t i = 0; 1000 > i; ++i) {
+        roundTrip(slo_usec / 2);
+        ASSERT_GE(max_limit, ctrl.limit());
+    }
+    EXPECT_EQ(max_limit, ctrl.limit());
+}
+
+TEST_F(AmAdmissionCtrlTest, rejectOnlyAboveLimit) {
+    // Up to the limit is admitted, then up to max_waiting wait
+    for (size_t i = 0; max_limit > i; ++i) {
+        ASSERT_EQ(Admission::ADMITTED, admit());
+    }
+    for (size_t i = 0; max_waiting > i; ++i) {
+        ASSERT_EQ(Admission::WAITING, admit());
+    }
+    EXPECT_EQ(0u, ctrl.count(PerfEventType::AM_ADMISSION_REJECTED));
+
+    // Only past both is a request rejected
+    EXPECT_EQ(Admission::REJECTED, admit());
+    EXPECT_EQ(1u, ctrl.count(PerfEventType::AM_ADMISSION_REJECTED));
+
+    // A completion lets the oldest waiting in, which makes room to wait again
+    auto oldest = waiting.front();
+    auto admitted = complete(outstanding.front(), slo_usec);
+    ASSERT_EQ(1u, admitted.size());
+    EXPECT_EQ(oldest, admitted.front());
+    EXPECT_EQ(Admission::WAITING, admit());
+    EXPECT_EQ(Admission::REJECTED, admit());
+    EXPECT_EQ(2u, ctrl.count(PerfEventType::AM_ADMISSION_REJECTED));
+
+    // Lower the limit on another volume: fewer admitted, none rejected until the wait is full
+    ctrl.registerVolume(fds_volid_t(2), 1);
+    roundTrip(2 * slo_usec, 2);
+    EXPECT_EQ(11u, ctrl.limit(2));
+    for (size_t i = 0; 12 > i; ++i) {
+        ASSERT_EQ(Admission::ADMITTED, admit(2));
+    }
+    for (size_t i = 0; max_waiting > i; ++i) {
+        ASSERT_EQ(Admission::WAITING, admit(2));
+    }
+    EXPECT_EQ(0u, ctrl.count(PerfEventType::AM_ADMISSION_REJECTED, 2));
+    EXPECT_EQ(Admission::REJECTED, admit(2));
+    EXPECT_EQ(1u, ctrl.count(PerfEventType::AM_ADMISSION_REJECTED, 2));
+}
+
+}  // namespace fds
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    fds::g_fdslog = new fds::fds_log("am_admission_ctrl_test");
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#define GTEST_USE_OWN_TR1_TUPLE 0
+
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "AmBlockOffsetCache.h"
+#include "fds_process.h"
+
+namespace fds {
+
+static constexpr fds_uint64_t obj_size = 4096;
+static constexpr fds_uint64_t page_entries = AmBlockOffsetCache::page_entries;
+
+/// An object id made of n, so each object number has its own
+ObjectID objectId(uint32_t const n) {
+    uint8_t digest[OBJECTID_DIGESTLEN];
+    memset(digest, 0xa5, sizeof(digest));
+    memcpy(digest, &n, sizeof(n));
+    return ObjectID(digest);
+}
+
+struct AmBlockOffsetCacheTest : ::testing::Test {
+    void SetUp() override {
+        ASSERT_EQ(ERR_OK, cache.addVolume(fds_volid_t(1), obj_size));
+    }
+
+    /// Cache object n at its offset
+    bool add(fds_uint64_t const n, std::string const& blob = "blob") {
+        return cache.add(fds_volid_t(1), blob, n * obj_size, objectId(n));
+    }
+
+    /// Object n is cached at its offset, with its id
+    bool hit(fds_uint64_t const n) {
+        ObjectID::ptr obj_id;
+        if (ERR_OK != cache.get(fds_volid_t(1), "blob", n * obj_size, obj_id)) {
+            return false;
+        }
+        EXPECT_EQ(objectId(n), *obj_id) << "object " << n;
+        return true;
+    }
+
+    /// Room for two pages
+    AmBlockOffsetCache cache {2 * AmBlockOffsetCache::page_bytes()};
+};
+
+TEST_F(AmBlockOffsetCacheTest, pageOnFirstTouch) {
+    // Filling a page takes just that page, so two full pages fit
+    for (fds_uint64_t n = 0; 2 * page_entries > n; ++n) {
+        ASSERT_TRUE(add(n));
+    }
+    for (fds_uint64_t n = 0; 2 * page_entries > n; ++n) {
+        ASSERT_TRUE(hit(n)) << "object " << n;
+    }
+
+    // Touching a third page takes the least recently used one's place
+    EXPECT_TRUE(hit(5));
+    EXPECT_TRUE(add(10 * page_entries));
+    EXPECT_TRUE(hit(10 * page_entries));
+    EXPECT_TRUE(hit(5));
+    EXPECT_FALSE(hit(page_entries));
+    EXPECT_FALSE(hit(2 * page_entries - 1));
+
+    // The reused page has nothing of the evicted one
+    EXPECT_TRUE(add(page_entries + 7));
+    EXPECT_TRUE(hit(page_entries + 7));
+    EXPECT_FALSE(hit(page_entries + 8));
+    EXPECT_FALSE(hit(10 * page_entries));
+}
+
+TEST_F(AmBlockOffsetCacheTest, pageBoundary) {
+    // The last slot of a page and the first of the next
+    EXPECT_TRUE(add(page_entries - 1));
+    EXPECT_TRUE(add(page_entries));
+    EXPECT_TRUE(hit(page_entries - 1));
+    EXPECT_TRUE(hit(page_entries));
+    EXPECT_FALSE(hit(page_entries - 2));
+    EXPECT_FALSE(hit(page_entries + 1));
+
+    // Replacing one leaves the other
+    EXPECT_TRUE(cache.add(fds_volid_t(1), "blob", page_entries * obj_size, objectId(7)));
+    ObjectID::ptr obj_id;
+    ASSERT_EQ(ERR_OK, cache.get(fds_volid_t(1), "blob", page_entries * obj_size, obj_id));
+    EXPECT_EQ(objectId(7), *obj_id);
+    EXPECT_TRUE(hit(page_entries - 1));
+
+    // Offsets between objects are not cached
+    EXPECT_FALSE(cache.add(fds_volid_t(1), "blob", page_entries * obj_size - 1, objectId(1)));
+    EXPECT_EQ(ERR_NOT_FOUND,
+              cache.get(fds_volid_t(1), "blob", page_entries * obj_size - 1, obj_id));
+}
+
+TEST_F(AmBlockOffsetCacheTest, invalidation) {
+    EXPECT_TRUE(add(1));
+    EXPECT_TRUE(add(page_entries + 1));
+
+    // A read back entry does not replace one we wrote
+    EXPECT_FALSE(cache.add_dirty(fds_volid_t(1), "blob", obj_size, objectId(2)));
+    EXPECT_TRUE(hit(1));
+    EXPECT_TRUE(cache.add_dirty(fds_volid_t(1), "blob", 3 * obj_size, objectId(3)));
+    EXPECT_TRUE(cache.add(fds_volid_t(1), "blob", 3 * obj_size, objectId(3)));
+    EXPECT_TRUE(hit(3));
+
+    // The volume belongs to the first blob added
+    EXPECT_FALSE(cache.handles(fds_volid_t(1), "other"));
+    EXPECT_FALSE(add(4, "other"));
+    cache.remove(fds_volid_t(1), "other");
+    EXPECT_TRUE(hit(1));
+
+    // Removing the blob forgets every page
+    cache.remove(fds_volid_t(1), "blob");
+    EXPECT_FALSE(hit(1));
+    EXPECT_FALSE(hit(3));
+    EXPECT_FALSE(hit(page_entries + 1));
+    EXPECT_TRUE(add(1));
+    EXPECT_TRUE(hit(1));
+
+    cache.clear(fds_volid_t(1));
+    EXPECT_FALSE(hit(1));
+    EXPECT_TRUE(add(1));
+
+    cache.removeVolume(fds_volid_t(1));
+    ObjectID::ptr obj_id;
+    EXPECT_EQ(ERR_VOL_NOT_FOUND, cache.get(fds_volid_t(1), "blob", obj_size, obj_id));
+    EXPECT_FALSE(add(1));
+    EXPECT_EQ(ERR_OK, cache.addVolume(fds_volid_t(1), obj_size));
+    EXPECT_FALSE(hit(1));
+}
+
+TEST_F(AmBlockOffsetCacheTest, unmappedMiss) {
+    ObjectID::ptr obj_id;
+    EXPECT_EQ(ERR_NOT_FOUND, cache.get(fds_volid_t(1), "blob", 0, obj_id));
+    EXPECT_EQ(ERR_VOL_NOT_FOUND, cache.get(fds_volid_t(2), "blob", 0, obj_id));
+
+    // Only what was added to a page is there, misses take no page
+    EXPECT_TRUE(add(0));
+    EXPECT_TRUE(add(page_entries));
+    for (fds_uint64_t n = 1; page_entries > n; ++n) {
+        ASSERT_FALSE(hit(n)) << "object " << n;
+    }
+    for (fds_uint64_t page = 2; 100 > page; ++page) {
+        ASSERT_FALSE(hit(page * page_entries)) << "page " << page;
+    }
+    EXPECT_FALSE(hit(~0ull / obj_size));
+    EXPECT_TRUE(hit(0));
+    EXPECT_TRUE(hit(page_entries));
+}
+
+TEST(AmBlockOffsetCache, disabled) {
+    AmBlockOffsetCache off {AmBlockOffsetCache::page_bytes() - 1};
+    EXPECT_FALSE(off.enabled());
+    EXPECT_EQ(ERR_INVALID, off.addVolume(fds_volid_t(1), obj_size));
+    EXPECT_FALSE(off.add(fds_volid_t(1), "blob", 0, objectId(0)));
+}
+
+}  // namespace fds
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    fds::g_fdslog = new fds::fds_log("am_block_offset_cache_test");
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#define GTEST_USE_OWN_TR1_TUPLE 0
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "AmReadAhead.h"
+#include "fds_process.h"
+
+namespace fds {
+
+static constexpr fds_uint64_t obj_size = 4096;
+static constexpr size_t max_window = 8;
+
+/// Keeps what would go to the perf counters
+struct CountingReadAhead : AmReadAhead {
+    using AmReadAhead::AmReadAhead;
+
+    void account(PerfEventType const type, fds_volid_t const vol_id, uint64_t const cnt) override {
+        counts[std::make_pair(vol_id.get(), type)] += cnt;
+    }
+
+    uint64_t count(PerfEventType const type, fds_uint64_t const vol = 1) {
+        return counts[std::make_pair(vol, type)];
+    }
+
+    std::map<std::pair<fds_uint64_t, PerfEventType>, uint64_t> counts;
+};
+
+struct AmReadAheadTest : ::testing::Test {
+    /// Read objects [first, last] of the blob, the object range to read ahead if any
+    bool read(std::string const& blob, fds_uint64_t const first, fds_uint64_t const last,
+              fds_uint64_t const vol = 1) {
+        fds_uint64_t ahead_start {0}, ahead_end {0};
+        ahead_first = ahead_last = 0;
+        if (!read_ahead.onRead(fds_volid_t(vol), blob, first * obj_size, last * obj_size,
+                               obj_size, ahead_start, ahead_end)) {
+            return false;
+        }
+        ahead_first = ahead_start / obj_size;
+        ahead_last = ahead_end / obj_size;
+        return true;
+    }
+
+    bool read(fds_uint64_t const obj) {
+        return read("blob", obj, obj);
+    }
+
+    /// The read ahead went through
+    void done(std::string const& blob = "blob", fds_uint64_t const vol = 1) {
+        read_ahead.done(fds_volid_t(vol), blob, true);
+    }
+
+    CountingReadAhead read_ahead {max_window, 4};
+    fds_uint64_t ahead_first {0};
+    fds_uint64_t ahead_last {0};
+};
+
+TEST_F(AmReadAheadTest, sequential) {
+    // A first read is not a stream yet, the next one continuing it is
+    EXPECT_FALSE(read(0));
+    EXPECT_TRUE(read(1));
+    EXPECT_EQ(2u, ahead_first);
+    EXPECT_EQ(3u, ahead_last);
+
+    // Nothing more while that is in flight
+    EXPECT_FALSE(read(2));
+    done();
+
+    // Reads of several objects continue a stream as well
+    EXPECT_FALSE(read("other", 0, 3));
+    EXPECT_TRUE(read("other", 4, 7));
+    EXPECT_EQ(8u, ahead_first);
+    EXPECT_EQ(9u, ahead_last);
+}
+
+TEST_F(AmReadAheadTest, windowGrowth) {
+    EXPECT_FALSE(read(0));
+
+    // Doubles as the reader consumes what was read ahead, up to max_window
+    std::vector<std::pair<fds_uint64_t, fds_uint64_t>> aheads;
+    fds_uint64_t next_ahead = 2;
+    for (fds_uint64_t obj = 1; 64 > obj; ++obj) {
+        if (read(obj)) {
+            aheads.emplace_back(ahead_first, ahead_last);
+            // Each object is read ahead once, never more than max_window past the reader
+            EXPECT_EQ(next_ahead, ahead_first);
+            ASSERT_LE(ahead_last, obj + max_window);
+            next_ahead = ahead_last + 1;
+            done();
+        }
+        // Always ahead of the reader
+        EXPECT_GT(next_ahead, obj + 1);
+    }
+    ASSERT_LE(3u, aheads.size());
+    EXPECT_EQ(3u, aheads[0].second);
+    EXPECT_EQ(6u, aheads[1].second);
+    EXPECT_EQ(11u, aheads[2].second);
+    // Topped up once the reader is half way into the full window
+    for (size_t i = 3; aheads.size() > i; ++i) {
+        EXPECT_EQ(max_window / 2, aheads[i].second - aheads[i].first + 1);
+    }
+
+    // Everything read ahead was read
+    EXPECT_EQ(read_ahead.count(PerfEventType::AM_READAHEAD_OBJS), next_ahead - 2);
+    EXPECT_EQ(read_ahead.count(PerfEventType::AM_READAHEAD_HIT),
+              std::min(next_ahead - 2, (fds_uint64_t)62));
+    EXPECT_EQ(0u, read_ahead.count(PerfEventType::AM_READAHEAD_WASTE));
+
+    // Breaking the stream starts it over at the smallest window
+    EXPECT_FALSE(read(1000));
+    EXPECT_TRUE(read(1001));
+    EXPECT_EQ(1002u, ahead_first);
+    EXPECT_EQ(1003u, ahead_last);
+}
+
+TEST_F(AmReadAheadTest, random) {
+    // Never continues the last read
+    for (fds_uint64_t i = 0; 1000 > i; ++i) {
+        auto obj = (i * 7) % 101;
+        EXPECT_FALSE(read("blob", obj, obj + (i % 3)));
+    }
+    EXPECT_EQ(0u, read_ahead.count(PerfEventType::AM_READAHEAD_OBJS));
+}
+
+TEST_F(AmReadAheadTest, evictStreams) {
+    // Streams of four blobs, the first one the least recently used
+    for (auto blob : {"a", "b", "c", "d"}) {
+        EXPECT_FALSE(read(blob, 0, 0));
+        EXPECT_TRUE(read(blob, 1, 1));
+        done(blob);
+    }
+
+    // A fifth makes room by dropping the first, what it read ahead is wasted
+    EXPECT_FALSE(read("e", 0, 0));
+    EXPECT_EQ(2u, read_ahead.count(PerfEventType::AM_READAHEAD_WASTE));
+
+    // The others are still streams, "a" starts over
+    EXPECT_TRUE(read("b", 2, 2));
+    EXPECT_FALSE(read("a", 2, 2));
+    EXPECT_TRUE(read("a", 3, 3));
+}
+
+TEST_F(AmReadAheadTest, waste) {
+    EXPECT_FALSE(read(0));
+    EXPECT_TRUE(read(1));
+    done();
+    EXPECT_TRUE(read(2));
+    EXPECT_EQ(4u, ahead_first);
+    EXPECT_EQ(6u, ahead_last);
+    done();
+
+    // Skipping an object read ahead wastes it, the stream goes on
+    EXPECT_TRUE(read(4));
+    EXPECT_EQ(7u, ahead_first);
+    EXPECT_EQ(12u, ahead_last);
+    done();
+    EXPECT_EQ(1u, read_ahead.count(PerfEventType::AM_READAHEAD_WASTE));
+    EXPECT_EQ(2u, read_ahead.count(PerfEventType::AM_READAHEAD_HIT));
+
+    // Breaking the stream wastes the rest, 5 to 12
+    EXPECT_FALSE(read(100));
+    EXPECT_EQ(9u, read_ahead.count(PerfEventType::AM_READAHEAD_WASTE));
+    EXPECT_EQ(11u, read_ahead.count(PerfEventType::AM_READAHEAD_OBJS));
+
+    // A failed read ahead read nothing, so wastes nothing
+    EXPECT_TRUE(read(101));
+    read_ahead.done(fds_volid_t(1), "blob", false);
+    EXPECT_FALSE(read(500));
+    EXPECT_EQ(9u, read_ahead.count(PerfEventType::AM_READAHEAD_WASTE));
+
+    // Closing a volume wastes what its streams read ahead, and only theirs
+    EXPECT_FALSE(read("blob", 0, 0, 2));
+    EXPECT_TRUE(read("blob", 1, 1, 2));
+    done("blob", 2);
+    read_ahead.removeVolume(fds_volid_t(2));
+    EXPECT_EQ(2u, read_ahead.count(PerfEventType::AM_READAHEAD_WASTE, 2));
+    EXPECT_EQ(9u, read_ahead.count(PerfEventType::AM_READAHEAD_WASTE));
+    EXPECT_FALSE(read("blob", 2, 2, 2));
+}
+
+TEST_F(AmReadAheadTest, disabled) {
+    CountingReadAhead off {0, 4};
+    fds_uint64_t ahead_start, ahead_end;
+    for (fds_uint64_t obj = 0; 10 > obj; ++obj) {
+        EXPECT_FALSE(off.onRead(fds_volid_t(1), "blob", obj * obj_size, obj * obj_size,
+                                obj_size, ahead_start, ahead_end));
+    }
+}
+
+}  // namespace fds
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    fds::g_fdslog = new fds::fds_log("am_read_ahead_test");
+    return RUN_ALL_TESTS();
+}
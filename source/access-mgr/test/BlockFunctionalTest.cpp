@@ -105,7 +105,7 @@ class NbdOpsProc : public BlockOperations::ResponseIFace {
 
     // implementation of NbdOperationsResponseIface
     void respondTask(BlockTask* response) override {
-        if (!response->isRead() && !response->isWrite()) return; // Non-io response
+        if (!response->isRead() && !response->isWrite() && !response->isDiscard()) return; // Non-io response
         fds_uint32_t cdone = atomic_fetch_add(&opsDone, (fds_uint32_t)1);
         GLOGDEBUG << "Read? " << response->isRead()
                   << " response for handle " << response->handle
@@ -113,6 +113,8 @@ class NbdOpsProc : public BlockOperations::ResponseIFace {
                   << " opsDone " << cdone;
         if (response->isRead()) {
             fds_uint32_t context = 0;
+            char const* data = nullptr;
+            size_t len = 0;
             boost::shared_ptr<std::string> dataWritten;
             if (verifyData) {
                 fds_uint64_t off = response->getOffset();
@@ -121,13 +123,11 @@ class NbdOpsProc : public BlockOperations::ResponseIFace {
                 dataWritten = offData[off];
             }
             size_t pos = 0;
-            boost::shared_ptr<std::string> buf = response->getNextReadBuffer(context);
-            while (buf != NULL) {
+            while (response->getNextReadSegment(context, data, len)) {
                 GLOGDEBUG << "Handle " << response->handle << "....Buffer # " << context;
                 if (verifyData) {
-                    dataWritten->compare(pos, 4096, buf->c_str(), 4096);
+                    dataWritten->compare(pos, 4096, data, 4096);
                 }
-                buf = response->getNextReadBuffer(context);
             }
         }
         // free response
@@ -156,7 +156,8 @@ class NbdOpsProc : public BlockOperations::ResponseIFace {
 
     enum TaskOps {
         PUT,
-        GET
+        GET,
+        TRIM
     };
 
     void task(int id, TaskOps opType) {
@@ -192,6 +193,19 @@ class NbdOpsProc : public BlockOperations::ResponseIFace {
                 } catch(fpi::ApiException fdsE) {
                     fds_panic("read failed");
                 }
+            } else if (opType == TRIM) {
+                try {
+                    auto task = new BlockTask(++handle);
+                    task->setDiscard(offset, objSize);
+                    nbdOps->discard(task);
+                    if (verifyData) {
+                        // Discarded blocks read back as zeros
+                        fds_mutex::scoped_lock l(verifyMutex);
+                        offData[offset] = boost::make_shared<std::string>(objSize, '\0');
+                    }
+                } catch(fpi::ApiException fdsE) {
+                    fds_panic("discard failed");
+                }
             } else {
                 fds_panic("Unknown op type");
             }
@@ -301,6 +315,16 @@ TEST(BlockOperations, read) {
     nbdOpsProc->runAsyncTask(NbdOpsProc::GET);
 }
 
+TEST(BlockOperations, discard) {
+    GLOGDEBUG << "Testing discard";
+    nbdOpsProc->runAsyncTask(NbdOpsProc::TRIM);
+}
+
+TEST(BlockOperations, readAfterDiscard) {
+    GLOGDEBUG << "Testing read of discarded blocks";
+    nbdOpsProc->runAsyncTask(NbdOpsProc::GET);
+}
+
 int
 main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
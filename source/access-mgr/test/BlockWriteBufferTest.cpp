@@ -0,0 +1,201 @@
+/*
+ * Copyright 2015 Formation Data Systems, Inc.
+ */
+#define GTEST_USE_OWN_TR1_TUPLE 0
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "connector/BlockWriteBuffer.h"
+#include "fds_process.h"
+
+namespace fds {
+
+static constexpr uint32_t obj_size = 4096;
+
+struct BlockWriteBufferTest : ::testing::Test {
+    void SetUp() override {
+        journal_path = "/tmp/block_write_buffer_test." + std::to_string(getpid()) + ".journal";
+        ::unlink(journal_path.c_str());
+        reopen();
+    }
+
+    void TearDown() override {
+        buffer.reset();
+        ::unlink(journal_path.c_str());
+    }
+
+    /// Drop the buffer without writing anything back, as a crash would
+    void reopen() {
+        buffer.reset();
+        buffer.reset(new BlockWriteBuffer(journal_path, obj_size, 1024 * 1024,
+                                          std::chrono::hours(1), true));
+    }
+
+    bool write(uint64_t const object_off, uint32_t const offset, std::string const& bytes) {
+        return buffer->absorb(object_off, offset, bytes.data(), bytes.size());
+    }
+
+    /// The buffered image of object_off, '-' where nothing was written
+    std::string image(uint64_t const object_off) {
+        BlockWriteBuffer::overlay_map_type overlays;
+        buffer->overlay(object_off, object_off, overlays);
+        auto it = overlays.find(object_off);
+        if (overlays.end() == it) {
+            return std::string();
+        }
+        std::string buf(obj_size, '-');
+        it->second.apply(buf);
+        return buf;
+    }
+
+    off_t journalSize() {
+        struct stat st;
+        EXPECT_EQ(0, ::stat(journal_path.c_str(), &st));
+        return st.st_size;
+    }
+
+    std::string journal_path;
+    std::unique_ptr<BlockWriteBuffer> buffer;
+};
+
+TEST_F(BlockWriteBufferTest, absorb) {
+    EXPECT_FALSE(buffer->buffered(0));
+    EXPECT_TRUE(write(0, 10, "aaaa"));
+    EXPECT_TRUE(write(0, 12, "bbbb"));
+    EXPECT_TRUE(buffer->buffered(0));
+    EXPECT_FALSE(buffer->buffered(obj_size));
+    EXPECT_FALSE(buffer->flushWanted());
+
+    auto img = image(0);
+    EXPECT_EQ(std::string(10, '-') + "aabbbb" + std::string(obj_size - 16, '-'), img);
+
+    // Filling the object makes it ready to be written back
+    EXPECT_TRUE(write(0, 0, std::string(obj_size, 'c')));
+    EXPECT_TRUE(buffer->flushWanted());
+    EXPECT_EQ(std::string(obj_size, 'c'), image(0));
+}
+
+TEST_F(BlockWriteBufferTest, flush) {
+    EXPECT_TRUE(write(0, 0, "aaaa"));
+    EXPECT_TRUE(write(obj_size, 0, std::string(obj_size, 'b')));
+
+    // Only the complete object is due
+    BlockWriteBuffer::overlay_map_type flushing;
+    buffer->takeFlushable(false, flushing);
+    ASSERT_EQ(1u, flushing.size());
+    EXPECT_EQ(obj_size, flushing.begin()->first);
+
+    // In flight data is still seen by reads and routes writes
+    EXPECT_TRUE(buffer->buffered(obj_size));
+    EXPECT_EQ(std::string(obj_size, 'b'), image(obj_size));
+
+    buffer->flushed(obj_size, true);
+    EXPECT_FALSE(buffer->buffered(obj_size));
+    EXPECT_TRUE(image(obj_size).empty());
+
+    // A failed write back is buffered again, under newer writes
+    flushing.clear();
+    buffer->takeFlushable(true, flushing);
+    ASSERT_EQ(1u, flushing.size());
+    EXPECT_TRUE(write(0, 2, "cc"));
+    buffer->flushed(0, false);
+    EXPECT_EQ("aacc" + std::string(obj_size - 4, '-'), image(0));
+
+    flushing.clear();
+    buffer->takeFlushable(true, flushing);
+    buffer->flushed(0, true);
+    EXPECT_FALSE(buffer->buffered(0));
+
+    // Nothing is left, so neither is the journal
+    EXPECT_EQ(0, journalSize());
+}
+
+TEST_F(BlockWriteBufferTest, replay) {
+    EXPECT_TRUE(write(0, 0, "aaaa"));
+    EXPECT_TRUE(write(2 * obj_size, 100, "bbbb"));
+    EXPECT_TRUE(write(0, 2, "cc"));
+
+    reopen();
+    EXPECT_TRUE(buffer->buffered(0));
+    EXPECT_TRUE(buffer->buffered(2 * obj_size));
+    EXPECT_TRUE(buffer->flushWanted());
+    EXPECT_EQ("aacc" + std::string(obj_size - 4, '-'), image(0));
+    EXPECT_EQ(std::string(100, '-') + "bbbb" + std::string(obj_size - 104, '-'),
+              image(2 * obj_size));
+}
+
+TEST_F(BlockWriteBufferTest, flushedNotResurrected) {
+    EXPECT_TRUE(write(0, 0, "aaaa"));
+    EXPECT_TRUE(write(obj_size, 0, "bbbb"));
+
+    // Write back the first object while the second stays buffered, so the
+    // journal is not simply truncated
+    BlockWriteBuffer::overlay_map_type flushing;
+    buffer->takeFlushable(true, flushing);
+    ASSERT_EQ(2u, flushing.size());
+    EXPECT_TRUE(write(obj_size, 8, "dddd"));
+    buffer->flushed(0, true);
+    EXPECT_FALSE(buffer->buffered(0));
+    EXPECT_GT(journalSize(), 0);
+
+    // The next write to it goes straight to the volume; a crash now must
+    // not bring back the written back bytes over it
+    reopen();
+    EXPECT_FALSE(buffer->buffered(0));
+    EXPECT_TRUE(image(0).empty());
+    EXPECT_EQ("bbbb----dddd" + std::string(obj_size - 12, '-'), image(obj_size));
+}
+
+TEST_F(BlockWriteBufferTest, newerWritesSurviveWriteBack) {
+    EXPECT_TRUE(write(0, 0, "aaaa"));
+    EXPECT_TRUE(write(obj_size, 0, "bbbb"));
+
+    BlockWriteBuffer::overlay_map_type flushing;
+    buffer->takeFlushable(true, flushing);
+    EXPECT_TRUE(write(0, 8, "cccc"));
+    buffer->flushed(0, true);
+
+    // Written since the write back started, so still buffered after it
+    EXPECT_TRUE(buffer->buffered(0));
+    reopen();
+    EXPECT_EQ(std::string(8, '-') + "cccc" + std::string(obj_size - 12, '-'), image(0));
+}
+
+TEST_F(BlockWriteBufferTest, tornTail) {
+    EXPECT_TRUE(write(0, 0, "aaaa"));
+    auto good_size = journalSize();
+
+    // Part of a record header, as left by a crash in the middle of a write
+    {
+        int fd = ::open(journal_path.c_str(), O_WRONLY | O_APPEND);
+        ASSERT_LE(0, fd);
+        char const partial[] = { 0x4a, 0x57, 0x42, 0x46, 0x00, 0x00 };
+        EXPECT_EQ(static_cast<ssize_t>(sizeof(partial)), ::write(fd, partial, sizeof(partial)));
+        ::close(fd);
+    }
+
+    reopen();
+    EXPECT_EQ("aaaa" + std::string(obj_size - 4, '-'), image(0));
+    EXPECT_EQ(good_size, journalSize());
+
+    // New records land right after the good ones
+    EXPECT_TRUE(write(0, 4, "bbbb"));
+    reopen();
+    EXPECT_EQ("aaaabbbb" + std::string(obj_size - 8, '-'), image(0));
+}
+
+}  // namespace fds
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    fds::g_fdslog = new fds::fds_log("block_write_buffer_test");
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#define GTEST_USE_OWN_TR1_TUPLE 0
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+}
+
+#include "boost/program_options.hpp"
+#include <gtest/gtest.h>
+
+/**
+ * A fio style load generator for the NBD connector. Each job opens its own
+ * connection to the export and keeps iodepth requests in flight on it, the
+ * way the kernel client drives one connection per hw queue when the server
+ * allows multiple connections.
+ */
+namespace {
+
+constexpr uint8_t NBD_REQUEST_MAGIC[]    = { 0x25, 0x60, 0x95, 0x13 };
+constexpr uint8_t NBD_RESPONSE_MAGIC[]   = { 0x67, 0x44, 0x66, 0x98 };
+constexpr uint8_t NBD_OPT_MAGIC[]        = { 0x49, 0x48, 0x41, 0x56, 0x45, 0x4F, 0x50, 0x54 };
+constexpr int32_t NBD_OPT_EXPORT         = 1;
+constexpr int32_t NBD_CMD_READ           = 0;
+constexpr int32_t NBD_CMD_WRITE          = 1;
+constexpr int32_t NBD_CMD_DISC           = 2;
+constexpr uint16_t NBD_FLAG_CAN_MULTI_CONN = 0b100000000;
+
+struct Options {
+    std::string host;
+    uint32_t port;
+    std::string volume;
+    uint32_t jobs;
+    uint32_t iodepth;
+    uint32_t bsize;
+    uint64_t size;
+    uint32_t runtime;
+    std::string rw;
+} opts;
+
+struct JobStats {
+    uint64_t ops {0};
+    uint64_t bytes {0};
+    uint64_t errors {0};
+    std::vector<uint64_t> latencies;   // usec
+    uint16_t flags {0};
+};
+
+bool send_all(int fd, void const* buf, size_t len) {
+    auto p = static_cast<char const*>(buf);
+    while (0 < len) {
+        auto n = send(fd, p, len, MSG_NOSIGNAL);
+        if (0 > n) {
+            if (EINTR == errno) continue;
+            return false;
+        }
+        p += n; len -= n;
+    }
+    return true;
+}
+
+bool recv_all(int fd, void* buf, size_t len) {
+    auto p = static_cast<char*>(buf);
+    while (0 < len) {
+        auto n = recv(fd, p, len, MSG_WAITALL);
+        if (0 >= n) {
+            if ((0 > n) && (EINTR == errno)) continue;
+            return false;
+        }
+        p += n; len -= n;
+    }
+    return true;
+}
+
+int nbd_connect(uint64_t& export_size, uint16_t& flags) {
+    addrinfo hints {}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (0 != getaddrinfo(opts.host.c_str(), std::to_string(opts.port).c_str(), &hints, &res)) {
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if ((0 > fd) || (0 != connect(fd, res->ai_addr, res->ai_addrlen))) {
+        freeaddrinfo(res);
+        if (0 <= fd) close(fd);
+        return -1;
+    }
+    freeaddrinfo(res);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Server greeting: NBDMAGIC, IHAVEOPT, handshake flags
+    char greeting[18];
+    uint32_t ack = 0;
+    if (!recv_all(fd, greeting, sizeof(greeting)) || !send_all(fd, &ack, sizeof(ack))) {
+        close(fd);
+        return -1;
+    }
+
+    // Ask for the export
+    int32_t opt = htonl(NBD_OPT_EXPORT);
+    int32_t len = htonl(opts.volume.size());
+    char reply[8 + 2 + 124];
+    if (!send_all(fd, NBD_OPT_MAGIC, sizeof(NBD_OPT_MAGIC)) ||
+        !send_all(fd, &opt, sizeof(opt)) ||
+        !send_all(fd, &len, sizeof(len)) ||
+        !send_all(fd, opts.volume.data(), opts.volume.size()) ||
+        !recv_all(fd, reply, sizeof(reply))) {
+        close(fd);
+        return -1;
+    }
+    memcpy(&export_size, reply, sizeof(export_size));
+    export_size = __builtin_bswap64(export_size);
+    memcpy(&flags, reply + 8, sizeof(flags));
+    flags = ntohs(flags);
+    return fd;
+}
+
+void job(uint32_t const id, JobStats& stats) {
+    uint64_t export_size = 0;
+    int fd = nbd_connect(export_size, stats.flags);
+    if (0 > fd) {
+        ++stats.errors;
+        return;
+    }
+
+    auto const blocks = std::max<uint64_t>(std::min(opts.size, export_size) / opts.bsize, 1);
+    bool const random = (0 == opts.rw.compare(0, 4, "rand"));
+    bool const mixed = (opts.rw == "randrw" || opts.rw == "rw");
+    bool const writing = (std::string::npos != opts.rw.find("write"));
+    std::mt19937_64 gen(id);
+    std::uniform_int_distribution<uint64_t> block_dist(0, blocks - 1);
+    // Sequential jobs each start on their own part of the export
+    uint64_t next_block = (blocks / opts.jobs) * id;
+
+    std::string payload(opts.bsize, static_cast<char>('a' + (id % 26)));
+    std::string read_buf(opts.bsize, '\0');
+    using clock = std::chrono::steady_clock;
+    std::unordered_map<uint64_t, std::pair<int32_t, clock::time_point>> in_flight;
+    uint64_t handle = 0;
+    auto const end = clock::now() + std::chrono::seconds(opts.runtime);
+
+    auto issue = [&] () -> bool {
+        int32_t type = writing ? NBD_CMD_WRITE : NBD_CMD_READ;
+        if (mixed) type = (gen() & 1) ? NBD_CMD_WRITE : NBD_CMD_READ;
+        uint64_t block = random ? block_dist(gen) : (next_block++ % blocks);
+        struct __attribute__((packed)) {
+            uint8_t magic[4];
+            int32_t type;
+            uint64_t handle;
+            uint64_t offset;
+            int32_t length;
+        } req;
+        memcpy(req.magic, NBD_REQUEST_MAGIC, sizeof(req.magic));
+        req.type = htonl(type);
+        req.handle = ++handle;
+        req.offset = __builtin_bswap64(block * opts.bsize);
+        req.length = htonl(opts.bsize);
+        in_flight[req.handle] = std::make_pair(type, clock::now());
+        return send_all(fd, &req, sizeof(req)) &&
+               ((NBD_CMD_WRITE != type) || send_all(fd, payload.data(), payload.size()));
+    };
+
+    auto complete = [&] () -> bool {
+        struct __attribute__((packed)) {
+            uint8_t magic[4];
+            int32_t error;
+            uint64_t handle;
+        } rep;
+        if (!recv_all(fd, &rep, sizeof(rep)) ||
+            (0 != memcmp(rep.magic, NBD_RESPONSE_MAGIC, sizeof(rep.magic)))) {
+            return false;
+        }
+        auto it = in_flight.find(rep.handle);
+        if (in_flight.end() == it) {
+            return false;
+        }
+        if (0 != rep.error) {
+            ++stats.errors;
+        } else if ((NBD_CMD_READ == it->second.first) && !recv_all(fd, &read_buf[0], opts.bsize)) {
+            return false;
+        }
+        stats.latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                clock::now() - it->second.second).count());
+        ++stats.ops;
+        stats.bytes += opts.bsize;
+        in_flight.erase(it);
+        return true;
+    };
+
+    bool ok = true;
+    while (ok && (in_flight.size() < opts.iodepth)) {
+        ok = issue();
+    }
+    while (ok && !in_flight.empty()) {
+        ok = complete() && ((clock::now() >= end) || issue());
+    }
+    if (!ok) {
+        ++stats.errors;
+    }
+
+    struct __attribute__((packed)) {
+        uint8_t magic[4];
+        int32_t type;
+        uint64_t handle;
+        uint64_t offset;
+        int32_t length;
+    } disc {{0}, static_cast<int32_t>(htonl(NBD_CMD_DISC)), 0, 0, 0};
+    memcpy(disc.magic, NBD_REQUEST_MAGIC, sizeof(disc.magic));
+    send_all(fd, &disc, sizeof(disc));
+    close(fd);
+}
+
+}  // namespace
+
+TEST(NbdMultiConn, load) {
+    std::vector<JobStats> stats(opts.jobs);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; opts.jobs > i; ++i) {
+        threads.emplace_back(job, i, std::ref(stats[i]));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    JobStats total;
+    for (uint32_t i = 0; opts.jobs > i; ++i) {
+        auto& s = stats[i];
+        EXPECT_EQ(0u, s.errors) << "job:" << i;
+        if (1 < opts.jobs) {
+            EXPECT_TRUE(s.flags & NBD_FLAG_CAN_MULTI_CONN) << "job:" << i;
+        }
+        total.ops += s.ops;
+        total.bytes += s.bytes;
+        total.latencies.insert(total.latencies.end(), s.latencies.begin(), s.latencies.end());
+        std::cout << "job:" << i << " ops:" << s.ops << " errors:" << s.errors << std::endl;
+    }
+    ASSERT_LT(0u, total.ops);
+
+    std::sort(total.latencies.begin(), total.latencies.end());
+    uint64_t sum = 0;
+    for (auto l : total.latencies) sum += l;
+    std::cout << opts.rw << ": jobs=" << opts.jobs << " iodepth=" << opts.iodepth
+              << " bs=" << opts.bsize << std::endl
+              << "  iops=" << std::fixed << total.ops / secs
+              << " bw=" << (total.bytes / secs) / (1024 * 1024) << "MiB/s" << std::endl
+              << "  lat (usec): avg=" << sum / total.latencies.size()
+              << " p50=" << total.latencies[total.latencies.size() / 2]
+              << " p99=" << total.latencies[(total.latencies.size() * 99) / 100]
+              << " max=" << total.latencies.back() << std::endl;
+}
+
+int
+main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    namespace po = boost::program_options;
+    po::options_description desc("NBD multi-connection load test");
+    desc.add_options()
+            ("help,h", "Print this help message")
+            ("host", po::value<std::string>(&opts.host)->default_value("localhost"),
+             "NBD server host")
+            ("port", po::value<uint32_t>(&opts.port)->default_value(10809),
+             "NBD server port")
+            ("volume", po::value<std::string>(&opts.volume)->default_value("volume_0"),
+             "Export (volume) name")
+            ("numjobs,j", po::value<uint32_t>(&opts.jobs)->default_value(4),
+             "Connections to the export, one thread each")
+            ("iodepth,q", po::value<uint32_t>(&opts.iodepth)->default_value(32),
+             "Requests in flight per connection")
+            ("bs,b", po::value<uint32_t>(&opts.bsize)->default_value(4096),
+             "Request size in bytes")
+            ("size,s", po::value<uint64_t>(&opts.size)->default_value(1ull << 30),
+             "Bytes of the export to use")
+            ("runtime,t", po::value<uint32_t>(&opts.runtime)->default_value(30),
+             "Seconds to run for")
+            ("rw", po::value<std::string>(&opts.rw)->default_value("randread"),
+             "read, write, rw, randread, randwrite or randrw");
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).allow_unregistered().run(), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    opts.jobs = std::max(opts.jobs, 1u);
+    opts.iodepth = std::max(opts.iodepth, 1u);
+
+    return RUN_ALL_TESTS();
+}
@@ -1149,6 +1149,7 @@ void DataMgr::initHandlers() {
     handlers[FDS_DM_MIG_DELTA_BLOB] = new dm::DmMigrationDeltaBlobHandler(*this);
     handlers[FDS_DM_MIG_TX_STATE] = new dm::DmMigrationTxStateHandler(*this);
     handlers[FDS_DM_MIG_REQ_TX_STATE] = new dm::DmMigrationRequestTxStateHandler(*this);
+    handlers[FDS_DM_MIG_BULK_CATALOG] = new dm::DmMigrationBulkCatalogHandler(*this);
     new dm::SimpleHandler(*this);
 }
 
@@ -1609,7 +1610,7 @@ DataMgr::getAllVolumeDescriptors()
     return err;
 }
 
-DmPersistVolDB::ptr DataMgr::getPersistDB(fds_volid_t volId) {
+DmPersistVolCat::ptr DataMgr::getPersistVolCat(fds_volid_t volId) {
     // get the correct catalog
     DmVolumeCatalog::ptr volDirPtr =  boost::dynamic_pointer_cast
             <DmVolumeCatalog>(timeVolCat_->queryIface());
@@ -1624,8 +1625,13 @@ DmPersistVolDB::ptr DataMgr::getPersistDB(fds_volid_t volId) {
         LOGERROR << "unable to get the persist vol dir ptr for vol:" << volId;
         return NULL;
     }
+    return persistVolDirPtr;
+}
 
-    DmPersistVolDB::ptr voldDBPtr = boost::dynamic_pointer_cast <DmPersistVolDB>(persistVolDirPtr);
+DmPersistVolDB::ptr DataMgr::getPersistDB(fds_volid_t volId) {
+    // NULL for block volumes backed by the flat catalog
+    DmPersistVolDB::ptr voldDBPtr =
+            boost::dynamic_pointer_cast <DmPersistVolDB>(getPersistVolCat(volId));
     return voldDBPtr;
 }
 
@@ -1817,6 +1823,10 @@ Error DataMgr::copyVolumeToTargetDM(fpi::SvcUuid dmUuid, fds_volid_t volId, bool
 Error DataMgr::archiveTargetVolume(fds_volid_t volId) {
     Error err;
     auto persistDB = getPersistDB(volId);
+    if (persistDB.get() == NULL) {
+        LOGWARN << "unable to get vol-db for vol:" << volId;
+        return ERR_VOL_NOT_FOUND;
+    }
 
     /* Archive old volume */
     std::string archiveDir = dmutil::getTempDir();
@@ -2009,6 +2019,7 @@ Error DataMgr::dmQosCtrl::processIO(FDS_IOType* _io) {
         case FDS_DM_MIG_FINISH_VOL_RESYNC:
         case FDS_DM_MIG_REQ_TX_STATE:
         case FDS_DM_MIG_TX_STATE:
+        case FDS_DM_MIG_BULK_CATALOG:
             if (parentDm->features.isVolumegroupingEnabled()) {
                 schedule(scheduleOnId, true,
                          std::bind(&dm::Handler::handleQueueItem,
@@ -4,6 +4,11 @@
 
 #include <DataMgr.h>
 #include <DmMigrationClient.h>
+#include <dmutil.h>
+#include <dm-vol-cat/DmPersistVolDB.h>
+#include <net/filetransferservice.h>
+#include <util/path.h>
+#include <boost/filesystem.hpp>
 
 namespace fds {
 
@@ -36,6 +41,11 @@ DmMigrationClient::DmMigrationClient(DataMgr& _dataMgr,
     seqNumBlobs = ATOMIC_VAR_INIT(0UL);
     seqNumBlobDescs = ATOMIC_VAR_INIT(0UL);
     dmtVersion = dataMgr.getModuleProvider()->getSvcMgr()->getDMTVersion();
+
+    auto config = dataMgr.getModuleProvider()->get_fds_config();
+    bulkCatalog = config->get<bool>("fds.dm.migration.migration_bulk_catalog", false);
+    bulkCatalogMinBlobs = config->get<int64_t>("fds.dm.migration.migration_bulk_catalog_min_blobs",
+                                               10000);
 }
 
 DmMigrationClient::~DmMigrationClient()
@@ -200,15 +210,40 @@ DmMigrationClient::processBlobDiff()
         return ERR_DM_CAT_MIGRATION_DIFF_FAILED;
     }
 
+    // On a full resync ship the catalog files first. The destination then
+    // holds the copy, so the diff below only yields the catch-up delta
+    // between the copy and our snapshot.
+    const std::map<std::string, int64_t>* destBlobMap = &ribfsm->blobFilterMap;
+    std::map<std::string, int64_t> copyBlobMap;
+    if (shouldSendBulkCatalog(localBlobMap.size())) {
+        std::string archiveFileName;
+        err = transferCatalogCopy(archiveFileName, copyBlobMap);
+        if (ERR_OK == err) {
+            err = sendBulkCatalog(archiveFileName);
+            if (ERR_OK != err) {
+                LOGERROR << logString() << "Destination failed to load catalog copy for volume="
+                         << volId << " with error=" << err;
+                return err;
+            }
+            destBlobMap = &copyBlobMap;
+        } else {
+            // destination is untouched, send everything as delta sets
+            LOGWARN << logString() << "Catalog copy transfer failed for volume=" << volId
+                    << " with error=" << err << ", falling back to blob delta sets";
+            err = ERR_OK;
+        }
+    }
+
     // using the destination DM's blob descs with seq id and
     // source DM's blob desc with seq ids, generate the list of blobs
     // to be updated or deleted on the destination side.
     std::vector<std::string> blobUpdateList;
     std::vector<std::string> blobDeleteList;
-    err = diffBlobLists(ribfsm->blobFilterMap,
+    err = diffBlobLists(*destBlobMap,
                         localBlobMap,
                         blobUpdateList,
-                        blobDeleteList);
+                        blobDeleteList,
+                        abortFlag);
     if (ERR_OK != err) {
         LOGERROR << logString() << "Failed to get blob update list and blob delete list for volume=" << volId
             << " with error=" << err;
@@ -230,6 +265,87 @@ DmMigrationClient::processBlobDiff()
     return err;
 }
 
+fds_bool_t
+DmMigrationClient::shouldSendBulkCatalog(size_t numBlobs)
+{
+    // Volume group migrations take a different destination path
+    return bulkCatalog &&
+            !dataMgr.features.isVolumegroupingEnabled() &&
+            ribfsm->blobFilterMap.empty() &&
+            numBlobs >= bulkCatalogMinBlobs &&
+            dataMgr.getPersistDB(volId) != nullptr;
+}
+
+Error
+DmMigrationClient::transferCatalogCopy(std::string& archiveFileName,
+                                       std::map<std::string, int64_t>& copyBlobMap)
+{
+    Error err(ERR_OK);
+    auto volDB = dataMgr.getPersistDB(volId);
+    if (volDB == nullptr) {
+        return ERR_VOL_NOT_FOUND;
+    }
+
+    std::string archiveDir = dmutil::getTempDir();
+    archiveFileName = util::strformat("%ld.migration.%ld.tgz", volId.get(), migrationId);
+    err = volDB->archive(archiveDir, archiveFileName, &copyBlobMap);
+    if (!err.ok()) {
+        LOGWARN << logString() << "archiving failed for vol:" << volId << " error:" << err;
+        return err;
+    }
+    std::string archiveFile = archiveDir + std::string("/") + archiveFileName;
+
+    LOGMIGRATE << logString() << "Sending catalog copy of volume=" << volId
+               << " with " << copyBlobMap.size() << " blobs as " << archiveFile;
+
+    auto transferCb = [](fds::net::FileTransferService::Handle::ptr handle, const Error& err,
+                         SHPTR<concurrency::TaskStatus> taskStatus) {
+        taskStatus->error = err;
+        taskStatus->done();
+    };
+    SHPTR<concurrency::TaskStatus> taskStatus(new concurrency::TaskStatus());
+    if (!dataMgr.fileTransfer->send(destDmUuid.toSvcUuid(), archiveFile, archiveFileName,
+                                    std::bind(transferCb, PH_ARG1, PH_ARG2, taskStatus))) {
+        err = ERR_DUPLICATE;
+    } else if (!taskStatus->await(10*60*1000)) {  // 10 minutes
+        LOGWARN << logString() << "filetransfer did not complete in expected time: ["
+                << archiveFile << "]";
+        err = ERR_SVC_REQUEST_TIMEOUT;
+    } else {
+        err = taskStatus->error;
+    }
+    if (!abortFlag && err.ok()) {
+        dataMgr.counters->totalSizeOfDataMigrated.incr(boost::filesystem::file_size(archiveFile));
+    } else if (abortFlag) {
+        err = ERR_DM_MIGRATION_ABORTED;
+    }
+
+    boost::filesystem::remove(archiveFile);
+    return err;
+}
+
+Error
+DmMigrationClient::sendBulkCatalog(const std::string& archiveFileName)
+{
+    fpi::CtrlNotifyBulkCatalogMsgPtr bulkMsg(new fpi::CtrlNotifyBulkCatalogMsg());
+    bulkMsg->volume_id = volId.get();
+    bulkMsg->DMT_version = migrationId;
+    bulkMsg->version = version;
+    bulkMsg->filename = archiveFileName;
+
+    // Synchronous, no delta set may reach the destination before the
+    // copy is in place
+    auto bulkReq = requestMgr->newEPSvcRequest(destDmUuid.toSvcUuid());
+    bulkReq->setPayload(FDSP_MSG_TYPEID(fpi::CtrlNotifyBulkCatalogMsg), bulkMsg);
+    // set 5 minute timeout, same as a load from archive
+    bulkReq->setTimeoutMs(5*60*1000);
+    SvcRequestCbTask<EPSvcRequest, fpi::CtrlNotifyBulkCatalogRspMsg> waiter;
+    bulkReq->onResponseCb(waiter.cb);
+    bulkReq->invoke();
+    waiter.await();
+    return waiter.error;
+}
+
 Error
 DmMigrationClient::generateUpdateBlobDeltaSets(const std::vector<std::string>& updateBlobs)
 {
@@ -12,6 +12,10 @@
 #include "fds_module_provider.h"
 #include <net/SvcMgr.h>
 #include <net/SvcRequestPool.h>
+#include <net/filetransferservice.h>
+#include <dm-vol-cat/DmVolumeCatalog.h>
+#include <util/path.h>
+#include <boost/filesystem.hpp>
 
 namespace fds {
 
@@ -175,6 +179,96 @@ DmMigrationExecutor::processInitialBlobFilterSet()
     return err;
 }
 
+Error
+DmMigrationExecutor::unpackCatalog(const std::string& archiveFile, std::string& stageDir)
+{
+    Error err(ERR_OK);
+
+    // Unpack next to the archive, the swap then only moves the db dir into place
+    stageDir = archiveFile + "-XXXXXX";
+    if (NULL == mkdtemp(const_cast<char*>(stageDir.c_str()))) {
+        LOGERROR << "unable to create a tempdir:[" << stageDir << "]"
+                 << " error " << errno;
+        stageDir.clear();
+        boost::filesystem::remove(archiveFile);
+        return ERR_DISK_WRITE_FAILED;
+    }
+
+    std::ostringstream oss;
+    oss << "tar -zxf " << archiveFile << " --directory=" << stageDir;
+    LOGDEBUG << "about to exec:[" << oss.str() << "]";
+    auto exitCode = std::system(oss.str().c_str());
+    if (exitCode != 0) {
+        LOGERROR << "unable to untar vol-db:[" << oss.str() << "]"
+                 << " exit:" << exitCode;
+        boost::filesystem::remove_all(stageDir);
+        stageDir.clear();
+        err = ERR_NOT_FOUND;
+    }
+
+    boost::filesystem::remove(archiveFile);
+    return err;
+}
+
+Error
+DmMigrationExecutor::unpackBulkCatalog(fpi::CtrlNotifyBulkCatalogMsgPtr& msg,
+                                       std::string& stageDir)
+{
+    fds_verify(volumeUuid == fds_volid_t(msg->volume_id));
+    lastUpdateFromClientTsSec_ = util::getTimeStampSeconds();
+
+    std::string archiveFile = dataMgr.fileTransfer->getFullPath(msg->filename);
+    LOGMIGRATE << logString() << "Unpacking catalog copy for volume=" << volumeUuid
+               << " from " << archiveFile;
+
+    if (!util::fileExists(archiveFile)) {
+        LOGERROR << logString() << "unable to locate catalog archive: " << archiveFile;
+        return ERR_NOT_FOUND;
+    }
+
+    Error err = unpackCatalog(archiveFile, stageDir);
+    if (!err.ok()) {
+        LOGERROR << logString() << "Failed to unpack catalog copy for volume=" << volumeUuid
+                 << " with error=" << err;
+    }
+    return err;
+}
+
+Error
+DmMigrationExecutor::processBulkCatalog(fpi::CtrlNotifyBulkCatalogMsgPtr& msg,
+                                        const std::string& stageDir)
+{
+    Error err(ERR_OK);
+    fds_verify(volumeUuid == fds_volid_t(msg->volume_id));
+    lastUpdateFromClientTsSec_ = util::getTimeStampSeconds();
+
+    LOGMIGRATE << logString() << "Loading catalog copy for volume=" << volumeUuid
+               << " from " << stageDir;
+
+    DmVolumeCatalog::ptr volCat = boost::dynamic_pointer_cast<DmVolumeCatalog>(
+        dataMgr.timeVolCat_->queryIface());
+    if (!volCat) {
+        LOGERROR << logString() << "unable to get the volume catalog";
+        return ERR_NOT_FOUND;
+    }
+
+    std::string dbDir = stageDir + util::strformat("/%ld_vcat.ldb", volumeUuid.get());
+    err = volCat->replaceCatalog(volDesc, dbDir);
+
+    if (err.ok()) {
+        auto volMeta = dataMgr.getVolumeMeta(volumeUuid);
+        if (volMeta != nullptr) {
+            err = volMeta->initState();
+        }
+    }
+
+    if (!err.ok()) {
+        LOGERROR << logString() << "Failed to load catalog copy for volume=" << volumeUuid
+                 << " with error=" << err;
+    }
+    return err;
+}
+
 Error
 DmMigrationExecutor::processDeltaBlobDescs(fpi::CtrlNotifyDeltaBlobDescMsgPtr& msg,
 										   migrationCb cb)
@@ -5,6 +5,7 @@
 #include <DataMgr.h>
 #include <DmIoReq.h>
 #include <DmMigrationMgr.h>
+#include <boost/filesystem.hpp>
 
 namespace fds {
 
@@ -749,6 +750,61 @@ DmMigrationMgr::applyTxState(DmIoMigrationTxState* txStateReq) {
     return (err);
 }
 
+Error
+DmMigrationMgr::unpackBulkCatalog(DmIoMigrationBulkCatalog* bulkCatalogReq) {
+    fpi::CtrlNotifyBulkCatalogMsgPtr bulkCatalogMsg = bulkCatalogReq->bulkCatalogMsg;
+    fds_volid_t volId(bulkCatalogMsg->volume_id);
+
+    auto uniqueId = std::make_pair(bulkCatalogReq->srcUuid, volId);
+    DmMigrationExecutor::shared_ptr executor;
+    {
+        SCOPEDREAD(migrExecutorLock);
+        executor = getMigrationExecutor(uniqueId);
+    }
+    if (executor == nullptr) {
+        LOGMIGRATE << "Unable to find executor for volume " << volId << " to unpack catalog";
+        return ERR_NOT_FOUND;
+    }
+
+    // Not under the executor lock: untarring a large catalog takes a while
+    return executor->unpackBulkCatalog(bulkCatalogMsg, bulkCatalogReq->stageDir);
+}
+
+Error
+DmMigrationMgr::applyBulkCatalog(DmIoMigrationBulkCatalog* bulkCatalogReq) {
+    fpi::CtrlNotifyBulkCatalogMsgPtr bulkCatalogMsg = bulkCatalogReq->bulkCatalogMsg;
+    fds_volid_t volId(bulkCatalogMsg->volume_id);
+    Error err = bulkCatalogReq->unpackErr;
+
+    if (err.ok()) {
+        auto uniqueId = std::make_pair(bulkCatalogReq->srcUuid, volId);
+        SCOPEDREAD(migrExecutorLock);
+        DmMigrationExecutor::shared_ptr executor = getMigrationExecutor(uniqueId);
+        if (executor == nullptr) {
+            if (isMigrationAborted()) {
+                LOGMIGRATE << "Unable to find executor for volume " << volId << " during migration abort";
+            } else {
+                LOGERROR << "Unable to find executor for volume " << volId;
+            }
+            err = ERR_NOT_FOUND;
+        } else {
+            err = executor->processBulkCatalog(bulkCatalogMsg, bulkCatalogReq->stageDir);
+        }
+    }
+
+    // Whatever was not moved into place
+    if (!bulkCatalogReq->stageDir.empty()) {
+        boost::filesystem::remove_all(bulkCatalogReq->stageDir);
+    }
+
+    if (!err.ok()) {
+        LOGERROR << "Error loading migrated catalog: " << err;
+        abortMigration();
+    }
+
+    return (err);
+}
+
 /**
  * This thread should always be safe to call while holding locks, so don't add any locking
  */
@@ -185,7 +185,7 @@ void VolumeMeta::setState(const fpi::ResourceState &state,
         setOpId(VolumeGroupConstants::OPSTARTID);
     } else if (state == fpi::ResourceState::Loading) {
         /* Every time volume goes into loading state version is incremented */
-        version = dataManager->getPersistDB(vol_desc->volUUID)->updateVersion();
+        version = dataManager->getPersistVolCat(vol_desc->volUUID)->updateVersion();
     } else if (state == fpi::ResourceState::Active) {
         initializerTriesCnt = 0;
     }
@@ -751,7 +751,14 @@ VolumeMeta::doHashTaskOnContext() {
         return;
     }
     // We first init the CatalogScanner
-    auto catalogPtr = dataManager->getPersistDB(vol_desc->volUUID)->getCatalog();
+    auto persistDB = dataManager->getPersistDB(vol_desc->volUUID);
+    if (!persistDB) {
+        // Flat catalogs have no leveldb to scan
+        LOGWARN << "Hash calculation not supported for vol:" << vol_desc->volUUID;
+        cleanupHashOnContext();
+        return;
+    }
+    auto catalogPtr = persistDB->getCatalog();
     auto threadPoolPtr = dataManager->qosCtrl->threadPool;
 
     // For each batch, what do we do?
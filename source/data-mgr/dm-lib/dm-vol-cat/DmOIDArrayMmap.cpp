@@ -13,19 +13,23 @@ const fds_uint32_t DmOIDArrayMmap::FRAGMENT_SIZE = 102400;
 const fds_uint32_t DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT =
         DmOIDArrayMmap::FRAGMENT_SIZE / OBJECTID_DIGESTLEN;
 
-DmOIDArrayMmap::DmOIDArrayMmap(fds_uint64_t id, int fd) : id_(id), fd_(fd) {
+DmOIDArrayMmap::DmOIDArrayMmap(fds_uint64_t id, int fd) : id_(id), fd_(fd),
+        seq_(new std::atomic<fds_uint32_t>[NUM_OBJS_PER_FRAGMENT]) {
     fds_verify(fd_ >= 0);
     base_ = 0;
 
     // XXX: Construction of an object is not thread-safe. Once the object
     // is created, all functions are thread-safe.
+    for (fds_uint32_t i = 0; i < NUM_OBJS_PER_FRAGMENT; ++i) {
+        seq_[i].store(0, std::memory_order_relaxed);
+    }
 
     struct stat64 st = {0};
     int rc = fstat64(fd_, &st);
     fds_verify(0 == rc);
 
     off64_t endOffset = (id_ + 1) * FRAGMENT_SIZE - 1;
-    if (st.st_size < endOffset) {
+    if (st.st_size <= endOffset) {
         char zero = 0;
         rc = pwrite64(fd_, reinterpret_cast<void *>(&zero), 1, endOffset);
         fds_verify(1 == rc);
@@ -42,4 +46,14 @@ DmOIDArrayMmap::~DmOIDArrayMmap() {
     }
 }
 
+Error DmOIDArrayMmap::sync() {
+    if (!valid()) {
+        return ERR_OK;
+    }
+    if (msync(base_, FRAGMENT_SIZE, MS_SYNC) < 0) {
+        return ERR_DISK_WRITE_FAILED;
+    }
+    return ERR_OK;
+}
+
 }  // namespace fds
@@ -148,7 +148,8 @@ Error DmPersistVolDB::copyVolDir(const std::string & destName) {
     return catalog_->DbSnap(destName);
 }
 
-Error DmPersistVolDB::archive(const std::string& destDir, const std::string& filename) {
+Error DmPersistVolDB::archive(const std::string& destDir, const std::string& filename,
+                              std::map<std::string, int64_t>* blobsSeqId) {
     Error err(ERR_OK);
     std::string archiveFile = destDir + std::string("/") + filename;
     std::string tempArchiveDir = archiveFile + std::string("-tmpXXXXXX");
@@ -165,6 +166,9 @@ Error DmPersistVolDB::archive(const std::string& destDir, const std::string& fil
         LOGCRITICAL << "unable to snapshot vol-db:" << volId_.get()
                     << " to:" << tempDBDir
                     << " error:" << err;
+    } else if (blobsSeqId && !(err = getAllBlobsWithSequenceId(tempDBDir, *blobsSeqId)).ok()) {
+        LOGERROR << "unable to read blobs of vol-db copy:" << tempDBDir
+                 << " error:" << err;
     } else {
         // now tar the dir
         std::ostringstream oss;
@@ -331,6 +335,31 @@ Error DmPersistVolDB::getAllBlobsWithSequenceId(std::map<std::string, int64_t>&
     return (ERR_OK);
 }
 
+Error DmPersistVolDB::getAllBlobsWithSequenceId(const std::string& catDir,
+                                                std::map<std::string, int64_t>& blobsSeqId) {
+    std::unique_ptr<Catalog> copy;
+    try {
+        copy.reset(new Catalog(catDir));
+    } catch(const CatalogException& e) {
+        LOGERROR << "Failed to open catalog copy " << catDir << " : " << e.what();
+        return ERR_NOT_READY;
+    }
+
+    auto dbIt = copy->NewIterator();
+    for (dbIt->SeekToFirst(); dbIt->Valid(); dbIt->Next()) {
+        leveldb::Slice dbKey = dbIt->key();
+        if (*reinterpret_cast<CatalogKeyType const*>(dbKey.data()) == CatalogKeyType::BLOB_METADATA) {
+            BlobMetaDesc blobMeta;
+            if (blobMeta.loadSerialized(dbIt->value().ToString()) != ERR_OK) {
+                LOGERROR << "Error deserializing blob metadata in catalog copy " << catDir;
+                return ERR_SERIALIZE_FAILED;
+            }
+            blobsSeqId.emplace(blobMeta.desc.blob_name, blobMeta.desc.sequence_id);
+        }
+    }
+    return status2error(dbIt->status());
+}
+
 Error DmPersistVolDB::getLatestSequenceId(sequence_id_t & max) {
     auto dbIt = catalog_->NewIterator();
     if (!dbIt) {
@@ -1,74 +1,416 @@
 /*
- * Copyright 2014 Formation Data Systems, Inc.
+ * Copyright 2014-2016 Formation Data Systems, Inc.
  */
 #define _LARGEFILE64_SOURCE  // should be before all includes
 
 #include <errno.h>
-
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <boost/filesystem.hpp>
+
+#include <catalogKeys/BlobObjectKey.h>
+#include <catalogKeys/CatalogKeyType.h>
 #include <dm-vol-cat/DmPersistVolFile.h>
+#include <leveldb/db.h>
+#include <leveldb/iterator.h>
+#include <leveldb/write_batch.h>
+#include <util/path.h>
+#include <util/stringutils.h>
+#include <dmutil.h>
+#include <net/volumegroup_extensions.h>
 
 namespace fds {
 
-const fds_uint32_t DmPersistVolFile::MMAP_CACHE_SIZE = 100;
+const std::string DmPersistVolFile::CATALOG_FLAT_CHECKPOINT_BYTES_STR(
+        "catalog_flat_checkpoint_bytes");
+const std::string DmPersistVolFile::OBJ_FILENAME("objects.oid");
+const std::string DmPersistVolFile::META_FILENAME("objects.meta");
+const std::string DmPersistVolFile::LOG_FILENAME("objects.log");
+const std::string DmPersistVolFile::OLD_LOG_FILENAME("objects.log.old");
+
+namespace {
+
+const fds_uint32_t LOG_RECORD_MAGIC = 0xf1a7ca7a;
+const fds_uint32_t LOG_RECORD_HDR_SIZE = 3 * sizeof(fds_uint32_t);
+const fds_uint32_t LOG_SLOT_SIZE = sizeof(fds_uint32_t) + OBJECTID_DIGESTLEN;
+
+const fds_uint32_t LOG_FLAG_BLOB_META = 0x1;
+const fds_uint32_t LOG_FLAG_BLOB_META_DELETED = 0x2;
+const fds_uint32_t LOG_FLAG_VOL_META = 0x4;
+
+const fds_uint64_t DEFAULT_CHECKPOINT_BYTES = 64 * 1024 * 1024;
+
+/// All-zero blocks of this size are left as holes when copying
+const size_t COPY_BLOCK_SIZE = 4096;
+const size_t COPY_BUFFER_SIZE = 256 * COPY_BLOCK_SIZE;
+
+fds_uint32_t fnv1a(const char * data, size_t len) {
+    fds_uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+inline void putU32(std::string & buf, fds_uint32_t val) {
+    buf.append(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+inline void putString(std::string & buf, const std::string & val) {
+    putU32(buf, val.size());
+    buf.append(val);
+}
+
+inline fds_bool_t getU32(const char * & p, const char * end, fds_uint32_t & val) {
+    if (static_cast<size_t>(end - p) < sizeof(val)) {
+        return false;
+    }
+    memcpy(&val, p, sizeof(val));
+    p += sizeof(val);
+    return true;
+}
+
+inline fds_bool_t getString(const char * & p, const char * end, std::string & val) {
+    fds_uint32_t len;
+    if (!getU32(p, end, len) || static_cast<size_t>(end - p) < len) {
+        return false;
+    }
+    val.assign(p, len);
+    p += len;
+    return true;
+}
+
+fds_bool_t writeAll(int fd, const std::string & buf) {
+    const char * p = buf.data();
+    size_t left = buf.size();
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+fds_bool_t pwriteAll(int fd, const char * p, size_t left, off64_t offset) {
+    while (left > 0) {
+        ssize_t n = pwrite64(fd, p, left, offset);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        left -= n;
+        offset += n;
+    }
+    return true;
+}
+
+inline fds_bool_t isZero(const char * p, size_t len) {
+    return 0 == len || (0 == p[0] && 0 == memcmp(p, p + 1, len - 1));
+}
+
+/**
+ * Copies src to dst, leaving holes for the all-zero blocks of src so that a
+ * sparse object file stays sparse.
+ */
+fds_bool_t copySparse(const std::string & src, const std::string & dst) {
+    int in = open(src.c_str(), O_RDONLY | O_LARGEFILE);
+    if (in < 0) {
+        return false;
+    }
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                   S_IRUSR | S_IWUSR | S_IRGRP);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    std::vector<char> buf(COPY_BUFFER_SIZE);
+    off64_t offset = 0;
+    fds_bool_t ok = true;
+    while (ok) {
+        ssize_t n = pread64(in, buf.data(), buf.size(), offset);
+        if (n < 0) {
+            ok = (EINTR == errno);
+            continue;
+        }
+        if (0 == n) {
+            break;
+        }
+        for (ssize_t blk = 0; ok && blk < n; blk += COPY_BLOCK_SIZE) {
+            size_t len = std::min(COPY_BLOCK_SIZE, static_cast<size_t>(n - blk));
+            if (!isZero(buf.data() + blk, len)) {
+                ok = pwriteAll(out, buf.data() + blk, len, offset + blk);
+            }
+        }
+        offset += n;
+    }
+    // Trailing holes are not written, the size has to be set
+    ok = ok && (0 == ftruncate64(out, offset)) && (0 == fsync(out));
+
+    close(in);
+    if (close(out) < 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+fds_bool_t readAll(const std::string & filename, std::string & buf) {
+    std::ifstream in(filename, std::ios::in | std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    buf.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+}  // namespace
+
+/**
+ * Point-in-time view of the map, handed out as a leveldb snapshot. Slots
+ * updated since it was taken have their old object ID saved here by the
+ * update, before it overwrites them.
+ */
+class DmPersistVolFile::Snapshot : public leveldb::Snapshot {
+  public:
+    Snapshot(fds_uint64_t slots, const std::string & name, const std::string & meta)
+            : numSlots(slots), blobName(name), blobMeta(meta) {}
+    ~Snapshot() override {}
+
+    /// Slots past the end of the file then were never written
+    const fds_uint64_t numSlots;
+    const std::string blobName;
+    const std::string blobMeta;
+
+    mutable fds_mutex lock;
+    mutable std::unordered_map<fds_uint32_t, ObjectID> saved;
+};
+
+/**
+ * Walks the non-null slots of the map in object index order, presenting
+ * each one as a BlobObjectKey -> object ID pair like the leveldb catalog.
+ */
+class DmPersistVolFile::ObjectIterator : public leveldb::Iterator {
+  public:
+    ObjectIterator(DmPersistVolFile * vol, const std::string & blobName,
+                   const Snapshot * snap = nullptr)
+            : vol_(vol), snap_(snap), key_(blobName), idx_(0) {
+        end_ = vol_->numSlots_(snap_);
+        idx_ = end_;
+    }
+
+    bool Valid() const override {
+        return idx_ < end_;
+    }
+
+    void SeekToFirst() override {
+        idx_ = 0;
+        skipForward_();
+    }
+
+    void SeekToLast() override {
+        idx_ = end_;
+        skipBackward_();
+    }
+
+    void Seek(const leveldb::Slice & target) override {
+        if (*reinterpret_cast<CatalogKeyType const*>(target.data()) !=
+            CatalogKeyType::BLOB_OBJECTS) {
+            SeekToFirst();
+            return;
+        }
+        idx_ = BlobObjectKey(target).getObjectIndex();
+        skipForward_();
+    }
+
+    void Next() override {
+        ++idx_;
+        skipForward_();
+    }
+
+    void Prev() override {
+        skipBackward_();
+    }
+
+    leveldb::Slice key() const override {
+        return static_cast<leveldb::Slice>(key_);
+    }
+
+    leveldb::Slice value() const override {
+        return leveldb::Slice(reinterpret_cast<const char *>(oid_.GetId()), oid_.GetLen());
+    }
+
+    leveldb::Status status() const override {
+        return leveldb::Status::OK();
+    }
+
+  private:
+    DmPersistVolFile * vol_;
+    const Snapshot * snap_;
+    BlobObjectKey key_;
+    ObjectID oid_;
+    fds_uint64_t idx_;
+    fds_uint64_t end_;
+
+    fds_bool_t load_() {
+        DmOIDArrayMmap * frag =
+                vol_->getFragment_(idx_ / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT, false);
+        if (!frag) {
+            return false;
+        }
+        frag->getObject(idx_, oid_);
+        fromSnapshot_(snap_, idx_, oid_);
+        if (NullObjectID == oid_) {
+            return false;
+        }
+        key_.setObjectIndex(static_cast<fds_uint32_t>(idx_));
+        return true;
+    }
+
+    void skipForward_() {
+        while (idx_ < end_ && !load_()) {
+            ++idx_;
+        }
+    }
+
+    void skipBackward_() {
+        while (idx_ > 0) {
+            --idx_;
+            if (load_()) {
+                return;
+            }
+        }
+        idx_ = end_;
+    }
+};
+
+DmPersistVolFile::FragmentPage::FragmentPage() {
+    for (auto & frag : frags) {
+        frag.store(nullptr, std::memory_order_relaxed);
+    }
+}
 
 DmPersistVolFile::DmPersistVolFile(CommonModuleProviderIf *modProvider,
                                    fds_volid_t volId,
                                    fds_uint32_t objSize,
-                   fds_bool_t snapshot, fds_bool_t readOnly,
-                   fds_volid_t srcVolId /* = invalid_vol_id */)
+                                   fds_bool_t snapshot,
+                                   fds_bool_t readOnly,
+                                   fds_bool_t clone,
+                                   fds_volid_t srcVolId /* = invalid_vol_id */)
         : DmPersistVolCat(modProvider,
                           volId,
                           objSize,
                           snapshot,
                           readOnly,
+                          clone,
                           fpi::FDSP_VOL_BLKDEV_TYPE,
                           srcVolId),
-        metaFd_(-1),
-        objFd_(-1)
-{ 
-    mmapCache_.reset(new SharedKvCache<fds_uint64_t, DmOIDArrayMmap>(
-            std::string("DmOIDArrayMmap") + std::to_string(volId), MMAP_CACHE_SIZE));
-
-    auto root = MODULEPROVIDER()->proc_fdsroot();
-    dirname_ = snapshot_ ? root->dir_user_repo_dm() : root->dir_sys_repo_dm();
-    if (!snapshot_ && srcVolId_ == invalid_vol_id) {
-        // volume
-        dirname_ += getVolIdStr();
-        dirname_ += "/" + getVolIdStr() + "_vcat.ldb";
-    } else if (srcVolId_ > invalid_vol_id && !snapshot_) {
-        // clone
-        dirname_ += getVolIdStr();
-        dirname_ += "/" + getVolIdStr() + "_vcat.ldb";
+        objFd_(-1),
+        logFd_(-1),
+        objFileSize_(0),
+        logSize_(0),
+        oldLogExists_(false),
+        snapshotCount_(0),
+        configHelper_(modProvider->get_conf_helper())
+{
+    for (auto & page : fragmentDir_) {
+        page.store(nullptr, std::memory_order_relaxed);
+    }
+
+    checkpointBytes_ = configHelper_.get<fds_uint64_t>(CATALOG_FLAT_CHECKPOINT_BYTES_STR,
+                                                       DEFAULT_CHECKPOINT_BYTES);
+
+    const FdsRootDir* root = modProvider->proc_fdsroot();
+    if (snapshot_) {
+        dirname_ = dmutil::getLevelDBFile(root, srcVolId_, volId_);
     } else {
-        // snapshot
-        dirname_ += std::to_string(srcVolId_) + "/snapshot";
-        dirname_ += "/" + getVolIdStr() + "_vcat.ldb";
+        dirname_ = dmutil::getLevelDBFile(root, volId_);
     }
 
-    objFilename_ = dirname_ + "/objects.oid";
-    metaFilename_ = dirname_ + "/objects.meta";
+    objFilename_ = dirname_ + "/" + OBJ_FILENAME;
+    metaFilename_ = dirname_ + "/" + META_FILENAME;
+    logFilename_ = dirname_ + "/" + LOG_FILENAME;
+    oldLogFilename_ = dirname_ + "/" + OLD_LOG_FILENAME;
 }
 
 DmPersistVolFile::~DmPersistVolFile() {
-    mmapCache_->clear();
-    close(metaFd_);
-    close(objFd_);
+    if (activated_ && !deleted_) {
+        fds_scoped_lock cl(checkpointLock_);
+        fds_scoped_lock sl(logLock_);
+        checkpointQuiesced_();
+    }
+
+    for (auto snap : snapshots_) {
+        LOGWARN << "Flat catalog for vol:" << volId_ << " destroyed with a live snapshot";
+        delete snap;
+    }
+
+    for (auto & pageSlot : fragmentDir_) {
+        FragmentPage * page = pageSlot.load(std::memory_order_relaxed);
+        if (!page) {
+            continue;
+        }
+        for (auto & frag : page->frags) {
+            delete frag.load(std::memory_order_relaxed);
+        }
+        delete page;
+    }
+
+    if (objFd_ >= 0) {
+        close(objFd_);
+    }
+    if (logFd_ >= 0) {
+        close(logFd_);
+    }
 
     if (deleted_) {
-        std::string rmCmd = "rm -rf " + dirname_;
-        int rc = system(rmCmd.c_str());
-        LOGNOTIFY << "Removed catalog directory, retcode = '" << rc << "'";
+        const FdsRootDir* root = MODULEPROVIDER()->proc_fdsroot();
+        std::string volDir = snapshot_ ? dmutil::getVolumeDir(root, srcVolId_, volId_) :
+                                         dmutil::getVolumeDir(root, volId_);
+        boost::filesystem::remove_all(volDir);
+        LOGNOTIFY << "path:voldelete " << (snapshot_? "snap:":"vol:") << volId_
+                  << " removed flat catalog:" << volDir;
     }
 }
 
+fds_bool_t DmPersistVolFile::exists(const std::string & catDir) {
+    struct stat64 st = {0};
+    return 0 == stat64((catDir + "/" + OBJ_FILENAME).c_str(), &st);
+}
+
 Error DmPersistVolFile::activate() {
-    LOGNOTIFY << "Activating '" << dirname_ << "'";
+    bool fAlreadyExists = util::dirExists(dirname_);
+    if (snapshot_ && !fAlreadyExists) {
+        LOGDEBUG << "Received activate on empty clone or snapshot! Directory " << dirname_;
+        return ERR_OK;
+    }
+
+    LOGNOTIFY << "Activating flat catalog '" << dirname_ << "'";
     FdsRootDir::fds_mkdir(dirname_.c_str());
 
-    objFd_ = open(objFilename_.c_str(), O_RDWR | O_ASYNC | O_CREAT | O_LARGEFILE,
+    objFd_ = open(objFilename_.c_str(), O_RDWR | O_CREAT | O_LARGEFILE,
             S_IRUSR | S_IWUSR | S_IRGRP);
     if (objFd_ < 0) {
         LOGERROR << "Failed to open/ create file: '" << objFilename_ << "' errno: '"
@@ -76,100 +418,167 @@ Error DmPersistVolFile::activate() {
         return ERR_DISK_WRITE_FAILED;
     }
 
-    metaFd_ = open(metaFilename_.c_str(), O_RDWR | O_ASYNC | O_CREAT | O_LARGEFILE,
+    struct stat64 st = {0};
+    if (fstat64(objFd_, &st) < 0) {
+        LOGERROR << "Failed to get stat details for file: '" << objFilename_ << "' errno: '"
+                 << errno << "'";
+        return ERR_DISK_READ_FAILED;
+    }
+    objFileSize_.store(st.st_size, std::memory_order_release);
+
+    logFd_ = open(logFilename_.c_str(), O_RDWR | O_APPEND | O_CREAT | O_LARGEFILE,
             S_IRUSR | S_IWUSR | S_IRGRP);
-    if (metaFd_ < 0) {
-        LOGERROR << "Failed to open/ create file: '" << metaFilename_ << "' errno: '"
+    if (logFd_ < 0) {
+        LOGERROR << "Failed to open/ create file: '" << logFilename_ << "' errno: '"
                 << errno << "'";
         return ERR_DISK_WRITE_FAILED;
     }
 
-    s_.reset(serialize::getFileSerializer(metaFd_));
-    fds_verify(s_);
+    Error err = loadMeta_();
+    if (err.ok()) {
+        err = replayLog_();
+    }
+    if (!err.ok()) {
+        LOGERROR << "Unable to load flat catalog for vol:" << volId_ << " ...not activating";
+        return ERR_DM_VOL_NOT_ACTIVATED;
+    }
 
-    d_.reset(serialize::getFileDeserializer(metaFd_));
-    fds_verify(d_);
+    fds_bool_t needVolMeta;
+    synchronized(metaLock_) {
+        needVolMeta = volMeta_.empty();
+    }
+    if (needVolMeta) {
+        // Write out the initial superblock descriptor into the volume
+        fpi::FDSP_MetaDataList emptyMetadataList;
+        VolumeMetaDesc volMetaDesc(emptyMetadataList, 0);
+        if (ERR_OK != putVolumeMetaDesc(volMetaDesc)) {
+            return ERR_DM_VOL_NOT_ACTIVATED;
+        }
+    }
 
+    activated_ = true;
     return ERR_OK;
 }
 
 Error DmPersistVolFile::copyVolDir(const std::string & destName) {
     fds_assert(!destName.empty());
-    FdsRootDir::fds_mkdir(destName.c_str());
 
-    std::ostringstream oss;
-    oss << "cp -rf " << dirname_ << "/* " << destName << "/";
+    // Hold off updates so the copy is a consistent point in time
+    fds_scoped_lock cl(checkpointLock_);
+    fds_scoped_lock sl(logLock_);
+    Error err = checkpointQuiesced_();
+    if (!err.ok()) {
+        return err;
+    }
 
-    // TODO(umesh): use staging are while copying
-    // XXX: this is not thread-safe
-    int rc = system(oss.str().c_str());
-    if (0 != rc) {
-        LOGERROR << "Failed to copy directory '" << dirname_ << "' to '" << destName << "'";
-        return ERR_DISK_WRITE_FAILED;
+    FdsRootDir::fds_mkdir(destName.c_str());
+
+    // A new volume has no meta file until its first checkpoint
+    for (auto & filename : {OBJ_FILENAME, META_FILENAME}) {
+        std::string src = dirname_ + "/" + filename;
+        struct stat64 st = {0};
+        if (filename == META_FILENAME && stat64(src.c_str(), &st) < 0 && ENOENT == errno) {
+            continue;
+        }
+        if (!copySparse(src, destName + "/" + filename)) {
+            LOGERROR << "Failed to copy '" << src << "' to '" << destName << "' errno: '"
+                     << errno << "'";
+            return ERR_DISK_WRITE_FAILED;
+        }
     }
 
     return ERR_OK;
 }
 
 Error DmPersistVolFile::getVolumeMetaDesc(VolumeMetaDesc & volDesc) {
-    return ERR_OK;
+    std::string value;
+    synchronized(metaLock_) {
+        value = volMeta_;
+    }
+    if (value.empty()) {
+        LOGERROR << "Failed to get metadata volume: " << std::hex << volId_ << std::dec;
+        return ERR_CAT_ENTRY_NOT_FOUND;
+    }
+    return volDesc.loadSerialized(value);
 }
 
-Error DmPersistVolFile::getBlobMetaDesc(const std::string & blobName, BlobMetaDesc & blobMeta) {
-    fds_scoped_lock sl(metaLock_);
-    if (!blobMeta_) {
-        blobMeta_.reset(new BlobMetaDesc());
-        if (lseek(metaFd_, 0, SEEK_SET) < 0) {
-            LOGERROR << "Failed to retrieve metadata for blob: '" << blobName << "' volume: '"
-                    << std::hex << volId_ << std::dec << "'";
-            return ERR_DISK_READ_FAILED;
+Error DmPersistVolFile::getBlobMetaDesc(const std::string & blobName,
+                                        BlobMetaDesc & blobMeta,
+                                        Catalog::MemSnap snap) {
+    std::string value;
+    if (snap) {
+        auto view = static_cast<const Snapshot *>(snap);
+        if (view->blobName == blobName) {
+            value = view->blobMeta;
         }
-
-        struct stat64 st = {0};
-        if (fstat64(metaFd_, &st) < 0 || 0 == st.st_size) {
-            return ERR_CAT_ENTRY_NOT_FOUND;
+    } else {
+        synchronized(metaLock_) {
+            if (blobName_ == blobName) {
+                value = blobMeta_;
+            }
         }
+    }
+    if (value.empty()) {
+        return ERR_CAT_ENTRY_NOT_FOUND;
+    }
+    return blobMeta.loadSerialized(value);
+}
 
-        if (!blobMeta_->read(d_.get())) {
-            LOGWARN << "Deserialization failed of metadata for blob: '" << blobName <<
-                    "' volume: '" << std::hex << volId_ << std::dec << "'";
-            return ERR_CAT_ENTRY_NOT_FOUND;
-        }
+Error DmPersistVolFile::getAllBlobMetaDesc(std::vector<BlobMetaDesc> & blobMetaList) {
+    std::string value;
+    synchronized(metaLock_) {
+        value = blobMeta_;
+    }
+    if (!value.empty()) {
+        BlobMetaDesc blobMeta;
+        fds_verify(blobMeta.loadSerialized(value) == ERR_OK);
+        blobMetaList.push_back(blobMeta);
     }
-    blobMeta = *(blobMeta_.get());
     return ERR_OK;
 }
 
-Error DmPersistVolFile::getAllBlobMetaDesc(std::vector<BlobMetaDesc> & blobMetaList) {
-    BlobMetaDesc blobMeta;
-    Error rc = getBlobMetaDesc("", blobMeta);
-    if (rc.ok()) {
+Error DmPersistVolFile::getBlobMetaDescForPrefix(std::string const& prefix,
+                                                 std::string const& delimiter,
+                                                 std::vector<BlobMetaDesc>& blobMetaList,
+                                                 std::vector<std::string>& skippedPrefixes) {
+    std::vector<BlobMetaDesc> all;
+    getAllBlobMetaDesc(all);
+    for (auto & blobMeta : all) {
+        auto & blobName = blobMeta.desc.blob_name;
+        if (0 != blobName.compare(0, prefix.size(), prefix)) {
+            continue;
+        }
+        if (!delimiter.empty()) {
+            auto delimiterPosition = blobName.find(delimiter, prefix.size());
+            if (delimiterPosition != std::string::npos) {
+                skippedPrefixes.push_back(blobName.substr(prefix.size(),
+                                                          delimiterPosition + 1 - prefix.size()));
+                continue;
+            }
+        }
         blobMetaList.push_back(blobMeta);
     }
-    return rc;
+    return ERR_OK;
 }
 
 Error DmPersistVolFile::getObject(const std::string & blobName, fds_uint64_t offset,
         ObjectID & obj) {
-    fds_verify(0 == offset % objSize_);
-
-    fds_uint64_t objIndex = offset / objSize_;
-    fds_uint64_t mmapId = objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT;
-
-    boost::shared_ptr<DmOIDArrayMmap> oidArrayMmap;
-    Error rc = getOIDArrayMmap(mmapId, oidArrayMmap);
-    if (rc.ok()) {
-        rc = oidArrayMmap->getObject(objIndex, obj);
+    fds_uint32_t objIndex;
+    Error rc = getObjIndex_(offset, objIndex);
+    if (!rc.ok()) {
+        return rc;
     }
 
-    if (!rc.ok()) {
-        LOGNOTIFY << "Failed to get oid for offset: '" << std::hex << offset << std::dec
-                << "' blob: '" << blobName << "' volume: '" << std::hex << volId_ <<
-                std::dec << "'";
-    } else if (NullObjectID == obj) {
+    DmOIDArrayMmap * frag = getFragment_(objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT,
+                                         false);
+    if (!frag) {
         return ERR_CAT_ENTRY_NOT_FOUND;
     }
-    return rc;
+    frag->getObject(objIndex, obj);
+    if (NullObjectID == obj) {
+        return ERR_CAT_ENTRY_NOT_FOUND;
+    }
+    return ERR_OK;
 }
 
 Error DmPersistVolFile::getObject(const std::string & blobName, fds_uint64_t startOffset,
@@ -178,30 +587,23 @@ Error DmPersistVolFile::getObject(const std::string & blobName, fds_uint64_t sta
     fds_verify(0 == startOffset % objSize_);
     fds_verify(0 == endOffset % objSize_);
 
-    Error rc = ERR_OK;
-    boost::shared_ptr<DmOIDArrayMmap> oidArrayMmap;
-    for (fds_uint64_t offset = startOffset; offset <= endOffset; offset += objSize_) {
-        fds_uint64_t objIndex = offset / objSize_;
-        fds_uint64_t mmapId = objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT;
+    // Slots past the end of the file were never written
+    fds_uint64_t numSlots = objFileSize_.load(std::memory_order_acquire) / OBJECTID_DIGESTLEN;
+    fds_uint64_t endIndex = std::min(endOffset / objSize_ + 1, numSlots);
 
-        if (!oidArrayMmap || oidArrayMmap->getID() != mmapId) {
-            rc = getOIDArrayMmap(mmapId, oidArrayMmap);
-            if (!rc.ok()) {
-                LOGNOTIFY << "Failed to get fragment for offset: '" << std::hex << offset <<
-                        std::dec << "' blob: '" << blobName << "' volume: '" << std::hex <<
-                        volId_ << std::dec << "'";
+    DmOIDArrayMmap * frag = nullptr;
+    for (fds_uint64_t objIndex = startOffset / objSize_; objIndex < endIndex; ++objIndex) {
+        fds_uint64_t mmapId = objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT;
+        if (!frag || frag->getID() != mmapId) {
+            frag = getFragment_(mmapId, false);
+            if (!frag) {
+                objIndex = (mmapId + 1) * DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT - 1;
                 continue;
             }
         }
 
         ObjectID obj;
-        rc = oidArrayMmap->getObject(objIndex, obj);
-        if (!rc.ok()) {
-            LOGNOTIFY << "Failed to get oid for offset: '" << std::hex << offset << std::dec
-                    << "' blob: '" << blobName << "' volume: '" << std::hex << volId_ <<
-                    std::dec << "'";
-            continue;
-        }
+        frag->getObject(objIndex, obj);
         if (NullObjectID == obj) {
             continue;
         }
@@ -216,35 +618,31 @@ Error DmPersistVolFile::getObject(const std::string & blobName, fds_uint64_t sta
 }
 
 Error DmPersistVolFile::getObject(const std::string & blobName, fds_uint64_t startOffset,
-        fds_uint64_t endOffset, fpi::FDSP_BlobObjectList& objList) {
+        fds_uint64_t endOffset, fpi::FDSP_BlobObjectList& objList,
+        const Catalog::MemSnap snap) {
     fds_assert(startOffset <= endOffset);
     fds_verify(0 == startOffset % objSize_);
     fds_verify(0 == endOffset % objSize_);
 
-    Error rc = ERR_OK;
-    boost::shared_ptr<DmOIDArrayMmap> oidArrayMmap;
-    for (fds_uint64_t offset = startOffset; offset <= endOffset; offset += objSize_) {
-        fds_uint64_t objIndex = offset / objSize_;
-        fds_uint64_t mmapId = objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT;
+    auto view = static_cast<const Snapshot *>(snap);
+    fds_uint64_t endIndex = std::min(endOffset / objSize_ + 1, numSlots_(view));
 
-        if (!oidArrayMmap || oidArrayMmap->getID() != mmapId) {
-            rc = getOIDArrayMmap(mmapId, oidArrayMmap);
-            if (!rc.ok()) {
-                LOGNOTIFY << "Failed to get fragment for offset: '" << std::hex << offset <<
-                        std::dec << "' blob: '" << blobName << "' volume: '" << std::hex <<
-                        volId_ << std::dec << "'";
+    // Fragments are never unmapped, so one missing now was missing for the
+    // snapshot too
+    DmOIDArrayMmap * frag = nullptr;
+    for (fds_uint64_t objIndex = startOffset / objSize_; objIndex < endIndex; ++objIndex) {
+        fds_uint64_t mmapId = objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT;
+        if (!frag || frag->getID() != mmapId) {
+            frag = getFragment_(mmapId, false);
+            if (!frag) {
+                objIndex = (mmapId + 1) * DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT - 1;
                 continue;
             }
         }
 
         ObjectID obj;
-        rc = oidArrayMmap->getObject(objIndex, obj);
-        if (!rc.ok()) {
-            LOGNOTIFY << "Failed to get oid for offset: '" << std::hex << offset << std::dec
-                    << "' blob: '" << blobName << "' volume: '" << std::hex << volId_ <<
-                    std::dec << "'";
-            continue;
-        }
+        frag->getObject(objIndex, obj);
+        fromSnapshot_(view, objIndex, obj);
         if (NullObjectID == obj) {
             continue;
         }
@@ -252,179 +650,915 @@ Error DmPersistVolFile::getObject(const std::string & blobName, fds_uint64_t sta
         fpi::FDSP_BlobObjectInfo blobInfo;
         blobInfo.offset = objIndex * objSize_;
         blobInfo.size = objSize_;
-        std::string objStr(reinterpret_cast<const char *>(obj.GetId()), obj.GetLen());
-        blobInfo.data_obj_id.digest = objStr;
-
+        blobInfo.data_obj_id.digest = std::string(reinterpret_cast<const char *>(obj.GetId()),
+                                                  obj.GetLen());
         objList.push_back(blobInfo);
     }
 
     return ERR_OK;
 }
 
-Error DmPersistVolFile::putVolumeMetaDesc(const VolumeMetaDesc & volDesc) {
-    return ERR_OK;
+Error DmPersistVolFile::getLatestSequenceId(sequence_id_t & max) {
+    max = 0;
+
+    std::vector<BlobMetaDesc> all;
+    getAllBlobMetaDesc(all);
+    for (auto & it : all) {
+        if (max < it.desc.sequence_id) {
+            max = it.desc.sequence_id;
+        }
+    }
+
+    fpi::FDSP_MetaDataList emptyMetadataList;
+    VolumeMetaDesc volMetaDesc(emptyMetadataList, 0);
+    Error err = getVolumeMetaDesc(volMetaDesc);
+    if (err.ok()) {
+        if (max < volMetaDesc.sequence_id) {
+            max = volMetaDesc.sequence_id;
+        }
+    } else {
+        LOGERROR << "Error searching volume descriptor for latest sequence id for volume "
+                 << volId_ << ": " << err;
+    }
+    return err;
 }
 
-Error DmPersistVolFile::putBlobMetaDesc(const std::string & blobName,
-        const BlobMetaDesc & blobMeta) {
-    IS_OP_ALLOWED();
+Error DmPersistVolFile::getAllBlobsWithSequenceId(std::map<std::string, int64_t>& blobsSeqId,
+                                                  Catalog::MemSnap snap) {
+    fds_bool_t dummyFlag = false;
+    return (getAllBlobsWithSequenceId(blobsSeqId, snap, dummyFlag));
+}
 
-    fds_scoped_lock sl(metaLock_);
-    *(blobMeta_.get()) = blobMeta;
-    if (lseek(metaFd_, 0, SEEK_SET) < 0) {
-        LOGERROR << "Failed to write metadata for blob: '" << blobName << "' volume: '"
-                << std::hex << volId_ << std::dec << "'";
-        return ERR_DISK_WRITE_FAILED;
+Error DmPersistVolFile::getAllBlobsWithSequenceId(std::map<std::string, int64_t>& blobsSeqId,
+                                                  Catalog::MemSnap snap,
+                                                  const fds_bool_t &abortFlag) {
+    if (abortFlag) {
+        LOGDEBUG << "Abort migration called. Exiting catalog operations.";
+        return (ERR_DM_MIGRATION_ABORTED);
     }
 
-    if (!blobMeta_->write(s_.get())) {
-        LOGERROR << "Serialization failed of metadata for blob: '" << blobName <<
-                "' volume: '" << std::hex << volId_ << std::dec << "'";
-        return ERR_DISK_WRITE_FAILED;
+    std::vector<BlobMetaDesc> all;
+    if (snap) {
+        auto view = static_cast<const Snapshot *>(snap);
+        if (!view->blobMeta.empty()) {
+            BlobMetaDesc blobMeta;
+            fds_verify(blobMeta.loadSerialized(view->blobMeta) == ERR_OK);
+            all.push_back(blobMeta);
+        }
+    } else {
+        getAllBlobMetaDesc(all);
     }
+    for (auto & blobMeta : all) {
+        blobsSeqId.emplace(blobMeta.desc.blob_name, blobMeta.desc.sequence_id);
+    }
+    return (ERR_OK);
+}
 
+Error DmPersistVolFile::getInMemorySnapshot(Catalog::MemSnap& snap) {
+    // Taken between updates, so it sees each of them entirely or not at all
+    fds_scoped_lock sl(logLock_);
+    Snapshot * view = nullptr;
+    synchronized(metaLock_) {
+        view = new Snapshot(numSlots_(nullptr), blobName_, blobMeta_);
+    }
+    snapshots_.push_back(view);
+    snapshotCount_.fetch_add(1, std::memory_order_relaxed);
+    snap = view;
     return ERR_OK;
 }
 
-Error DmPersistVolFile::putObject(const std::string & blobName, fds_uint64_t offset,
-        const ObjectID & obj) {
-    IS_OP_ALLOWED();
+Error DmPersistVolFile::freeInMemorySnapshot(Catalog::MemSnap& snap) {
+    if (!snap) {
+        return ERR_OK;
+    }
+    auto view = static_cast<const Snapshot *>(snap);
 
-    fds_verify(0 == offset % objSize_);
+    fds_scoped_lock sl(logLock_);
+    auto it = std::find(snapshots_.begin(), snapshots_.end(), view);
+    if (it == snapshots_.end()) {
+        LOGWARN << "Freeing unknown snapshot of flat catalog for vol:" << volId_;
+        return ERR_INVALID_ARG;
+    }
+    snapshots_.erase(it);
+    snapshotCount_.fetch_sub(1, std::memory_order_relaxed);
+    delete view;
+    snap = NULL;
+    return ERR_OK;
+}
+
+uint64_t DmPersistVolFile::getNumInMemorySnapshots() {
+    return snapshotCount_.load(std::memory_order_relaxed);
+}
 
-    fds_uint64_t objIndex = offset / objSize_;
-    fds_uint64_t mmapId = objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT;
+void DmPersistVolFile::getObjectIds(const uint32_t &maxObjs,
+                                    const Catalog::MemSnap &snap,
+                                    std::unique_ptr<Catalog::catalog_iterator_t>& dbItr,
+                                    std::list<ObjectID> &objects) {
+    objects.clear();
 
-    boost::shared_ptr<DmOIDArrayMmap> oidArrayMmap;
-    Error rc = getOIDArrayMmap(mmapId, oidArrayMmap, false);
-    if (rc.ok()) {
-        rc = oidArrayMmap->putObject(objIndex, obj);
+    if (dbItr == nullptr) {
+        std::string blobName;
+        synchronized(metaLock_) {
+            blobName = blobName_;
+        }
+        auto view = static_cast<const Snapshot *>(snap);
+        if (view) {
+            blobName = view->blobName;
+        }
+        dbItr.reset(new ObjectIterator(this, blobName, view));
+        dbItr->SeekToFirst();
     }
 
+    for (; dbItr->Valid() && objects.size() < maxObjs; dbItr->Next()) {
+        objects.push_back(ObjectID(dbItr->value().ToString()));
+    }
+}
+
+void DmPersistVolFile::forEachObject(std::function<void(const ObjectID&)> func) {
+    ObjectIterator it(this, std::string());
+    for (it.SeekToFirst(); it.Valid(); it.Next()) {
+        func(ObjectID(it.value().ToString()));
+    }
+}
+
+Error DmPersistVolFile::putVolumeMetaDesc(const VolumeMetaDesc & volDesc) {
+    LogRecord rec;
+    Error rc = volDesc.getSerialized(rec.volMeta);
     if (!rc.ok()) {
-        LOGNOTIFY << "Failed to write oid for offset: '" << std::hex << offset << std::dec
-                << "' blob: '" << blobName << "' volume: '" << std::hex << volId_ <<
-                std::dec << "'";
+        return rc;
+    }
+    rec.hasVolMeta = true;
+
+    rc = commit_(rec);
+    if (!rc.ok()) {
+        LOGERROR << "Failed to update metadata descriptor for vol:" << volId_;
+    } else {
+        LOGDEBUG << "Successfully updated metadata descriptor for vol:" << volId_;
     }
     return rc;
 }
 
-Error DmPersistVolFile::putObject(const std::string & blobName, const BlobObjList & objs) {
+Error DmPersistVolFile::putBlobMetaDesc(const std::string & blobName,
+                                        const BlobMetaDesc & blobMeta) {
     IS_OP_ALLOWED();
 
-    Error rc = ERR_OK;
-    if (objs.empty()) {
+    Error rc = checkBlobName_(blobName);
+    if (!rc.ok()) {
+        return rc;
+    }
+
+    LogRecord rec;
+    rc = blobMeta.getSerialized(rec.blobMeta);
+    if (!rc.ok()) {
         return rc;
     }
+    rec.hasBlobMeta = true;
+    rec.blobName = blobName;
 
-    boost::shared_ptr<DmOIDArrayMmap> oidArrayMmap;
+    rc = commit_(rec);
+    if (!rc.ok()) {
+        LOGERROR << "Failed to update metadata for blob: '" << blobName << "' volume: '"
+                 << std::hex << volId_ << std::dec << "'";
+    }
+    return rc;
+}
+
+Error DmPersistVolFile::putObject(const std::string & blobName, fds_uint64_t offset,
+                                  const ObjectID & obj) {
+    IS_OP_ALLOWED();
 
-    for (auto & it : objs) {
-        fds_verify(0 == it.first % objSize_);
+    BlobObjList objs;
+    objs[offset].oid = obj;
+    return putObject(blobName, objs);
+}
 
-        fds_uint64_t objIndex = it.first / objSize_;
-        fds_uint64_t mmapId = objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT;
+Error DmPersistVolFile::putObject(const std::string & blobName, const BlobObjList & objs) {
+    IS_OP_ALLOWED();
 
-        if (!oidArrayMmap || oidArrayMmap->getID() != mmapId) {
-            rc = getOIDArrayMmap(mmapId, oidArrayMmap, false);
-            if (!rc.ok()) {
-                LOGNOTIFY << "Failed to get fragment for offset: '" << std::hex << it.first <<
-                        std::dec << "' blob: '" << blobName << "' volume: '" << std::hex <<
-                        volId_ << std::dec << "'";
-                break;
-            }
+    return putBatch(blobName, BlobMetaDesc(), objs, std::vector<fds_uint64_t>());
+}
+
+Error DmPersistVolFile::putBatch(const std::string & blobName, const BlobMetaDesc & blobMeta,
+                                 const BlobObjList & puts,
+                                 const std::vector<fds_uint64_t> & deletes) {
+    IS_OP_ALLOWED();
+
+    Error rc = checkBlobName_(blobName);
+    if (!rc.ok()) {
+        return rc;
+    }
+
+    LogRecord rec;
+    rec.slots.reserve(puts.size() + deletes.size());
+    fds_uint32_t objIndex;
+    for (auto & it : puts) {
+        rc = getObjIndex_(it.first, objIndex);
+        if (!rc.ok()) {
+            return rc;
         }
+        rec.slots.emplace_back(objIndex, it.second.oid);
+    }
+    for (auto & it : deletes) {
+        rc = getObjIndex_(it, objIndex);
+        if (!rc.ok()) {
+            return rc;
+        }
+        rec.slots.emplace_back(objIndex, NullObjectID);
+    }
 
-        rc = oidArrayMmap->putObject(objIndex, it.second.oid);
+    // putObject() passes an empty descriptor, there is no blob meta to write
+    if (!blobMeta.desc.blob_name.empty()) {
+        rc = blobMeta.getSerialized(rec.blobMeta);
         if (!rc.ok()) {
-            LOGERROR << "Failed to write oid for offset: '" << std::hex << it.first << std::dec
-                    << "' blob: '" << blobName << "' volume: '" << std::hex << volId_ <<
-                    std::dec << "'";
-            break;
+            LOGERROR << "Failed to update metadata for blob: '" << blobName << "' volume: '"
+                     << std::hex << volId_ << std::dec << "'";
+            return rc;
         }
+        rec.hasBlobMeta = true;
+        rec.blobName = blobName;
     }
 
+    rc = commit_(rec);
+    if (!rc.ok()) {
+        LOGERROR << "Failed to put blob: '" << blobName << "' volume: '" << std::hex
+                 << volId_ << std::dec << "'";
+    }
     return rc;
 }
 
 Error DmPersistVolFile::putBatch(const std::string & blobName, const BlobMetaDesc & blobMeta,
-            const BlobObjList & puts, const std::vector<fds_uint64_t> & deletes) {
+                                 CatWriteBatch & wb) {
     IS_OP_ALLOWED();
 
-    Error rc = putBlobMetaDesc(blobName, blobMeta);
-    if (rc.ok()) {
-        rc = putObject(blobName, puts);
-        if (rc.ok()) {
-            for (auto & it : deletes) {
-                rc = deleteObject(blobName, it);
-                if (!rc.ok()) {
-                    break;
-                }
+    /**
+     * The commit log builds leveldb batches; pull the object updates back out
+     * of it. Anything that isn't an object key (op timestamps) has no place
+     * in the flat map.
+     */
+    struct BatchHandler : leveldb::WriteBatch::Handler {
+        BlobObjList puts;
+        std::vector<fds_uint64_t> deletes;
+        fds_uint32_t objSize;
+
+        void Put(const leveldb::Slice& key, const leveldb::Slice& value) override {
+            if (*reinterpret_cast<CatalogKeyType const*>(key.data()) ==
+                CatalogKeyType::BLOB_OBJECTS) {
+                fds_uint64_t offset = static_cast<fds_uint64_t>(
+                    BlobObjectKey(key).getObjectIndex()) * objSize;
+                puts[offset].oid = ObjectID(value.ToString());
+                puts[offset].size = objSize;
+            }
+        }
+        void Delete(const leveldb::Slice& key) override {
+            if (*reinterpret_cast<CatalogKeyType const*>(key.data()) ==
+                CatalogKeyType::BLOB_OBJECTS) {
+                deletes.push_back(static_cast<fds_uint64_t>(
+                    BlobObjectKey(key).getObjectIndex()) * objSize);
             }
         }
+    } handler;
+    handler.objSize = objSize_;
+
+    leveldb::Status s = wb.Iterate(&handler);
+    if (!s.ok()) {
+        LOGERROR << "Failed to read write batch for blob: '" << blobName << "' volume: '"
+                 << std::hex << volId_ << std::dec << "' error: " << s.ToString();
+        return ERR_INVALID;
+    }
+
+    return putBatch(blobName, blobMeta, handler.puts, handler.deletes);
+}
+
+Error DmPersistVolFile::deleteObject(const std::string & blobName, fds_uint64_t offset) {
+    // IS_OP_ALLOWED();
+
+    return deleteObject(blobName, offset, offset);
+}
+
+Error DmPersistVolFile::deleteObject(const std::string & blobName, fds_uint64_t startOffset,
+                                     fds_uint64_t endOffset) {
+    // commenting this out to support snapshot delete
+    // IS_OP_ALLOWED();
+
+    fds_uint64_t numSlots = objFileSize_.load(std::memory_order_acquire) / OBJECTID_DIGESTLEN;
+    fds_uint64_t endIndex = std::min(endOffset / objSize_ + 1, numSlots);
+
+    LogRecord rec;
+    for (fds_uint64_t objIndex = startOffset / objSize_; objIndex < endIndex; ++objIndex) {
+        if (objIndex > std::numeric_limits<fds_uint32_t>::max()) {
+            return ERR_DM_OFFSET_OUT_RANGE;
+        }
+        fds_uint64_t mmapId = objIndex / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT;
+        if (!getFragment_(mmapId, false)) {
+            objIndex = (mmapId + 1) * DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT - 1;
+            continue;
+        }
+        rec.slots.emplace_back(objIndex, NullObjectID);
+    }
+    if (rec.slots.empty()) {
+        return ERR_OK;
     }
 
+    Error rc = commit_(rec);
+    if (!rc.ok()) {
+        LOGERROR << "Failed to delete object for blob: '" << blobName << "' volume: '"
+                 << std::hex << volId_ << std::dec << "'";
+    }
     return rc;
 }
 
-Error DmPersistVolFile::putBatch(const std::string & blobName, const BlobMetaDesc & blobMeta,
-            CatWriteBatch & wb) {
-    // TODO(umesh): implement this
+Error DmPersistVolFile::deleteBlobMetaDesc(const std::string & blobName) {
+    //IS_OP_ALLOWED();
+
+    LOGDEBUG << "Deleting metadata for blob: '" << blobName << "' volume: '" << std::hex
+             << volId_ << std::dec << "'";
+
+    synchronized(metaLock_) {
+        if (blobName_ != blobName) {
+            return ERR_OK;
+        }
+    }
+
+    LogRecord rec;
+    rec.blobMetaDeleted = true;
+    return commit_(rec);
+}
+
+bool DmPersistVolFile::volSummaryInitialized() {
+    return volSummary_.initialized;
+}
+
+Error DmPersistVolFile::initVolSummary(fds_uint64_t logicalSize,
+                                       fds_uint64_t blobCount,
+                                       fds_uint64_t logicalObjectCount) {
+    Error err{ERR_OK};
+
+    synchronized(lockVolSummary_) {
+        if (!volSummary_.initialized) {
+            volSummary_.size = logicalSize;
+            volSummary_.blobCount = blobCount;
+            volSummary_.objectCount = logicalObjectCount;
+            volSummary_.initialized = true;
+        } else {
+            err = ERR_DUPLICATE;
+        }
+    }
+
+    return err;
+}
+
+Error DmPersistVolFile::applyStatDeltas(const fds_uint64_t bytesAdded,
+                                        const fds_uint64_t bytesRemoved,
+                                        const fds_uint64_t blobsAdded,
+                                        const fds_uint64_t blobsRemoved,
+                                        const fds_uint64_t objectsAdded,
+                                        const fds_uint64_t objectsRemoved) {
+    Error err{ERR_OK};
+
+    synchronized(lockVolSummary_) {
+        if (!volSummary_.initialized) {
+            err = ERR_NOT_READY;
+        } else {
+            volSummary_.size += bytesAdded;
+            volSummary_.size -= bytesRemoved;
+            volSummary_.blobCount += blobsAdded;
+            volSummary_.blobCount -= blobsRemoved;
+            volSummary_.objectCount += objectsAdded;
+            volSummary_.objectCount -= objectsRemoved;
+        }
+    }
+
+    return err;
+}
+
+void DmPersistVolFile::resetVolSummary() {
+    synchronized(lockVolSummary_) {
+        volSummary_.size = 0;
+        volSummary_.blobCount = 0;
+        volSummary_.objectCount = 0;
+        volSummary_.initialized = false;
+    }
+}
+
+Error DmPersistVolFile::getVolSummary(fds_uint64_t* logicalSize,
+                                      fds_uint64_t* blobCount,
+                                      fds_uint64_t* logicalObjectCount) {
+    Error err{ERR_OK};
+
+    synchronized(lockVolSummary_) {
+        if (!volSummary_.initialized) {
+            err = ERR_NOT_READY;
+        } else {
+            *logicalSize = volSummary_.size;
+            *blobCount = volSummary_.blobCount;
+            *logicalObjectCount = volSummary_.objectCount;
+        }
+    }
+
+    return err;
+}
+
+int32_t DmPersistVolFile::updateVersion()
+{
+    fds_verify(!snapshot_);
+    /* Read, increment, and persist new version */
+    int32_t version = getVersion();
+    if (version == VolumeGroupConstants::VERSION_INVALID) {
+        version = VolumeGroupConstants::VERSION_START;
+    } else {
+        version++;
+        if (version < VolumeGroupConstants::VERSION_INVALID) {
+            version = VolumeGroupConstants::VERSION_START;
+        }
+    }
+    setVersion(version);
+
+    return version;
+}
+
+int32_t DmPersistVolFile::getVersion()
+{
+    int32_t version;
+    std::ifstream in(getVersionFile_());
+    if (!in.is_open()) {
+        return VolumeGroupConstants::VERSION_INVALID;
+    }
+    in >> version;
+    in.close();
+    return version;
+}
+
+void DmPersistVolFile::setVersion(int32_t version)
+{
+    std::ofstream out(getVersionFile_());
+    out << version;
+    out.close();
+}
+
+std::string DmPersistVolFile::getVersionFile_()
+{
+    const FdsRootDir* root = MODULEPROVIDER()->proc_fdsroot();
+    return util::strformat("%s/%ld/version",
+                           root->dir_sys_repo_dm().c_str(), srcVolId_.get());
+}
+
+Error DmPersistVolFile::checkpoint() {
+    fds_scoped_lock sl(checkpointLock_);
+    return checkpoint_();
+}
+
+fds_uint64_t DmPersistVolFile::numSlots_(const Snapshot * snap) const {
+    if (snap) {
+        return snap->numSlots;
+    }
+    return objFileSize_.load(std::memory_order_acquire) / OBJECTID_DIGESTLEN;
+}
+
+void DmPersistVolFile::fromSnapshot_(const Snapshot * snap, fds_uint64_t objIndex,
+                                     ObjectID & obj) {
+    if (!snap) {
+        return;
+    }
+    // The caller read the live slot first. An update saves the old value
+    // before it overwrites the slot, so if nothing is saved yet the live
+    // value read was still the snapshot's.
+    fds_scoped_lock sl(snap->lock);
+    auto it = snap->saved.find(objIndex);
+    if (it != snap->saved.end()) {
+        obj = it->second;
+    }
+}
+
+void DmPersistVolFile::saveForSnapshots_(fds_uint64_t objIndex, DmOIDArrayMmap * frag) {
+    ObjectID old;
+    frag->getObject(objIndex, old);
+    for (auto snap : snapshots_) {
+        if (objIndex >= snap->numSlots) {
+            continue;
+        }
+        fds_scoped_lock sl(snap->lock);
+        // Only the first update after the snapshot holds its value
+        snap->saved.emplace(objIndex, old);
+    }
+}
+
+DmOIDArrayMmap * DmPersistVolFile::getFragment_(fds_uint64_t id, fds_bool_t create) {
+    fds_uint64_t pageId = id >> FRAGMENT_PAGE_BITS;
+    fds_uint64_t slot = id & (FRAGMENT_PAGE_SLOTS - 1);
+    fds_verify(pageId < MAX_FRAGMENT_PAGES);
+
+    FragmentPage * page = fragmentDir_[pageId].load(std::memory_order_acquire);
+    if (page) {
+        DmOIDArrayMmap * frag = page->frags[slot].load(std::memory_order_acquire);
+        if (frag) {
+            return frag;
+        }
+    }
+
+    // Slow path: the fragment isn't mapped yet. Reads only map what the file
+    // already has; anything past its end is a hole.
+    fds_uint64_t fragEnd = (id + 1) * DmOIDArrayMmap::FRAGMENT_SIZE;
+    if (!create &&
+        id * DmOIDArrayMmap::FRAGMENT_SIZE >= objFileSize_.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+
+    fds_scoped_lock sl(fragmentLock_);
+    page = fragmentDir_[pageId].load(std::memory_order_relaxed);
+    if (!page) {
+        page = new FragmentPage();
+        fragmentDir_[pageId].store(page, std::memory_order_release);
+    }
+    DmOIDArrayMmap * frag = page->frags[slot].load(std::memory_order_relaxed);
+    if (!frag) {
+        frag = new DmOIDArrayMmap(id, objFd_);
+        page->frags[slot].store(frag, std::memory_order_release);
+        if (objFileSize_.load(std::memory_order_relaxed) < fragEnd) {
+            objFileSize_.store(fragEnd, std::memory_order_release);
+        }
+    }
+    return frag;
+}
+
+Error DmPersistVolFile::getObjIndex_(fds_uint64_t offset, fds_uint32_t & objIndex) const {
+    fds_verify(0 == offset % objSize_);
+
+    auto index = offset / objSize_;
+    if (index > std::numeric_limits<fds_uint32_t>::max()) {
+        return ERR_DM_OFFSET_OUT_RANGE;
+    }
+    objIndex = static_cast<fds_uint32_t>(index);
     return ERR_OK;
 }
 
-Error DmPersistVolFile::deleteObject(const std::string & blobName, fds_uint64_t offset) {
-    return putObject(blobName, offset, NullObjectID);
+Error DmPersistVolFile::checkBlobName_(const std::string & blobName) {
+    fds_scoped_lock sl(metaLock_);
+    if (!blobName_.empty() && blobName_ != blobName) {
+        LOGWARN << "Flat catalog for volume " << std::hex << volId_ << std::dec
+                << " holds blob '" << blobName_ << "', rejecting update to '"
+                << blobName << "'";
+        return ERR_DM_OP_NOT_ALLOWED;
+    }
+    return ERR_OK;
 }
 
-Error DmPersistVolFile::deleteObject(const std::string & blobName, fds_uint64_t startOffset,
-        fds_uint64_t endOffset) {
-    BlobObjList objList;
-    for (fds_uint64_t offset = startOffset; offset <= endOffset; offset += objSize_) {
-        BlobObjInfo blobInfo;
-        blobInfo.size = getObjSize();
-        blobInfo.oid = NullObjectID;
-        objList[offset] = blobInfo;
+Error DmPersistVolFile::commit_(LogRecord & rec) {
+    std::string buf;
+    encode_(rec, buf);
+
+    fds_bool_t needCheckpoint = false;
+    synchronized(logLock_) {
+        if (!writeAll(logFd_, buf)) {
+            LOGERROR << "Failed to append to '" << logFilename_ << "' errno: '" << errno << "'";
+            return ERR_DISK_WRITE_FAILED;
+        }
+        logSize_ += buf.size();
+
+        apply_(rec);
+        needCheckpoint = (logSize_ >= checkpointBytes_);
     }
 
-    return putObject(blobName, objList);
+    // The update is already safe in the log; a skipped or failed checkpoint
+    // only means the log keeps growing until the next one succeeds.
+    if (needCheckpoint && checkpointLock_.try_lock()) {
+        Error err = checkpoint_();
+        checkpointLock_.unlock();
+        if (!err.ok()) {
+            LOGWARN << "Checkpoint of flat catalog for vol:" << volId_ << " failed: " << err;
+        }
+    }
+    return ERR_OK;
 }
 
-Error DmPersistVolFile::deleteBlobMetaDesc(const std::string & blobName) {
-    blobMeta_.reset();
-    if (ftruncate64(metaFd_, 0) < 0) {
-        return ERR_DISK_WRITE_FAILED;
+void DmPersistVolFile::apply_(const LogRecord & rec) {
+    for (auto & it : rec.slots) {
+        fds_bool_t isDelete = (NullObjectID == it.second);
+        DmOIDArrayMmap * frag = getFragment_(it.first / DmOIDArrayMmap::NUM_OBJS_PER_FRAGMENT,
+                                             !isDelete);
+        if (frag) {
+            if (!snapshots_.empty()) {
+                saveForSnapshots_(it.first, frag);
+            }
+            frag->putObject(it.first, it.second);
+        }
+    }
+
+    if (rec.hasBlobMeta || rec.blobMetaDeleted || rec.hasVolMeta) {
+        fds_scoped_lock sl(metaLock_);
+        if (rec.blobMetaDeleted) {
+            blobName_.clear();
+            blobMeta_.clear();
+        }
+        if (rec.hasBlobMeta) {
+            blobName_ = rec.blobName;
+            blobMeta_ = rec.blobMeta;
+        }
+        if (rec.hasVolMeta) {
+            volMeta_ = rec.volMeta;
+        }
+    }
+}
+
+Error DmPersistVolFile::loadMeta_() {
+    std::string buf;
+    if (!readAll(metaFilename_, buf) || buf.empty()) {
+        return ERR_OK;  // new volume
+    }
+
+    LogRecord rec;
+    size_t used;
+    if (!decode_(buf.data(), buf.size(), rec, used)) {
+        LOGERROR << "Corrupt flat catalog meta file '" << metaFilename_ << "'";
+        return ERR_ONDISK_DATA_CORRUPT;
     }
+    apply_(rec);
     return ERR_OK;
 }
 
-Error DmPersistVolFile::getOIDArrayMmap(fds_uint64_t id,
-        boost::shared_ptr<DmOIDArrayMmap> & oidArrayMmap, fds_bool_t read /* = true */) {
-    fds_scoped_lock sl(cacheLock_);
-    Error rc = mmapCache_->get(id, oidArrayMmap);
-    if (rc.ok()) {
-        return rc;  // we found mmap in cache
+Error DmPersistVolFile::replayLogFile_(const std::string & filename, fds_bool_t & replayed) {
+    struct stat64 st = {0};
+    if (stat64(filename.c_str(), &st) < 0 && ENOENT == errno) {
+        return ERR_OK;
+    }
+
+    std::string buf;
+    if (!readAll(filename, buf)) {
+        LOGERROR << "Failed to read '" << filename << "'";
+        return ERR_DISK_READ_FAILED;
+    }
+
+    size_t pos = 0;
+    fds_uint32_t count = 0;
+    while (pos < buf.size()) {
+        LogRecord rec;
+        size_t used;
+        if (!decode_(buf.data() + pos, buf.size() - pos, rec, used)) {
+            // A torn tail from a crash mid-append; drop it.
+            LOGWARN << "Discarding " << buf.size() - pos << " trailing bytes of '"
+                    << filename << "'";
+            replayed = true;
+            break;
+        }
+        apply_(rec);
+        pos += used;
+        ++count;
+    }
+
+    if (count) {
+        LOGNOTIFY << "Replayed " << count << " records of '" << filename
+                  << "' for flat catalog vol:" << volId_;
+        replayed = true;
     }
+    return ERR_OK;
+}
+
+Error DmPersistVolFile::replayLog_() {
+    fds_scoped_lock cl(checkpointLock_);
+    fds_scoped_lock sl(logLock_);
 
-    // check if requested fragment is already in file
+    // A checkpoint that did not finish leaves the older log behind; its
+    // records come before the current log's.
     struct stat64 st = {0};
-    if (fstat64(objFd_, &st) < 0) {
-        LOGNOTIFY << "Failed to get stat details for file: '" << objFilename_ << "'";
+    oldLogExists_ = (0 == stat64(oldLogFilename_.c_str(), &st));
+
+    fds_bool_t replayed = false;
+    for (auto & filename : {oldLogFilename_, logFilename_}) {
+        Error err = replayLogFile_(filename, replayed);
+        if (!err.ok()) {
+            return err;
+        }
+    }
+    if (fstat64(logFd_, &st) < 0) {
+        LOGERROR << "Failed to stat '" << logFilename_ << "' errno: '" << errno << "'";
         return ERR_DISK_READ_FAILED;
     }
+    logSize_ = st.st_size;
 
-    off64_t idOffset= id * DmOIDArrayMmap::FRAGMENT_SIZE;
-    if (idOffset >= st.st_size && read) {
-        return ERR_CAT_ENTRY_NOT_FOUND;
+    if (replayed || oldLogExists_) {
+        return checkpointQuiesced_();
     }
+    return ERR_OK;
+}
 
-    oidArrayMmap.reset(new DmOIDArrayMmap(id, objFd_));
-    mmapCache_->add(id, oidArrayMmap);
+Error DmPersistVolFile::flush_() {
+    fds_uint64_t numFrags = (objFileSize_.load(std::memory_order_acquire) +
+                             DmOIDArrayMmap::FRAGMENT_SIZE - 1) / DmOIDArrayMmap::FRAGMENT_SIZE;
+    for (fds_uint64_t id = 0; id < numFrags; ++id) {
+        FragmentPage * page = fragmentDir_[id >> FRAGMENT_PAGE_BITS].load(
+            std::memory_order_acquire);
+        if (!page) {
+            id |= (FRAGMENT_PAGE_SLOTS - 1);
+            continue;
+        }
+        DmOIDArrayMmap * frag = page->frags[id & (FRAGMENT_PAGE_SLOTS - 1)].load(
+            std::memory_order_acquire);
+        if (frag) {
+            Error err = frag->sync();
+            if (!err.ok()) {
+                LOGERROR << "Failed to sync fragment " << id << " of '" << objFilename_
+                         << "' errno: '" << errno << "'";
+                return err;
+            }
+        }
+    }
+    if (fdatasync(objFd_) < 0) {
+        LOGERROR << "Failed to sync '" << objFilename_ << "' errno: '" << errno << "'";
+        return ERR_DISK_WRITE_FAILED;
+    }
 
+    LogRecord meta;
+    synchronized(metaLock_) {
+        meta.hasBlobMeta = !blobMeta_.empty();
+        meta.blobName = blobName_;
+        meta.blobMeta = blobMeta_;
+        meta.hasVolMeta = !volMeta_.empty();
+        meta.volMeta = volMeta_;
+    }
+    std::string buf;
+    encode_(meta, buf);
+
+    std::string tmpFilename = metaFilename_ + ".tmp";
+    int fd = open(tmpFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd < 0) {
+        LOGERROR << "Failed to open/ create file: '" << tmpFilename << "' errno: '"
+                 << errno << "'";
+        return ERR_DISK_WRITE_FAILED;
+    }
+    fds_bool_t written = writeAll(fd, buf) && (0 == fsync(fd));
+    close(fd);
+    if (!written || rename(tmpFilename.c_str(), metaFilename_.c_str()) < 0) {
+        LOGERROR << "Failed to write '" << metaFilename_ << "' errno: '" << errno << "'";
+        return ERR_DISK_WRITE_FAILED;
+    }
     return ERR_OK;
 }
 
-void DmPersistVolFile::forEachObject(std::function<void(const ObjectID&)>) {
-    throw fds::Exception(ERR_NOT_IMPLEMENTED);
+/**
+ * Moves the log aside and starts a fresh one, then flushes with logLock_
+ * released so updates go on into the fresh log meanwhile. The flush covers
+ * every record of the old log, which is then dropped. Caller holds
+ * checkpointLock_.
+ */
+Error DmPersistVolFile::checkpoint_() {
+    synchronized(logLock_) {
+        if (0 == logSize_ && !oldLogExists_) {
+            return ERR_OK;
+        }
+
+        // An old log left by a failed checkpoint is still needed; the
+        // current one then keeps growing until that flush succeeds.
+        if (!oldLogExists_) {
+            // Link the log to the old name before the fresh log replaces it,
+            // so a crash at any point leaves every record under one of the
+            // names. Both names for one log only means a harmless re-replay.
+            std::string newFilename = logFilename_ + ".new";
+            unlink(newFilename.c_str());
+            int fd = open(newFilename.c_str(),
+                          O_RDWR | O_APPEND | O_CREAT | O_EXCL | O_LARGEFILE,
+                          S_IRUSR | S_IWUSR | S_IRGRP);
+            if (fd < 0) {
+                LOGERROR << "Failed to open/ create file: '" << newFilename << "' errno: '"
+                         << errno << "'";
+                return ERR_DISK_WRITE_FAILED;
+            }
+            if (link(logFilename_.c_str(), oldLogFilename_.c_str()) < 0) {
+                LOGERROR << "Failed to link '" << logFilename_ << "' errno: '" << errno << "'";
+                close(fd);
+                unlink(newFilename.c_str());
+                return ERR_DISK_WRITE_FAILED;
+            }
+            if (rename(newFilename.c_str(), logFilename_.c_str()) < 0) {
+                LOGERROR << "Failed to rename '" << newFilename << "' errno: '" << errno << "'";
+                close(fd);
+                unlink(newFilename.c_str());
+                unlink(oldLogFilename_.c_str());
+                return ERR_DISK_WRITE_FAILED;
+            }
+            close(logFd_);
+            logFd_ = fd;
+            logSize_ = 0;
+            oldLogExists_ = true;
+        }
+    }
+
+    Error err = flush_();
+    if (!err.ok()) {
+        return err;
+    }
+
+    if (unlink(oldLogFilename_.c_str()) < 0 && ENOENT != errno) {
+        LOGERROR << "Failed to remove '" << oldLogFilename_ << "' errno: '" << errno << "'";
+        return ERR_DISK_WRITE_FAILED;
+    }
+    oldLogExists_ = false;
+    return ERR_OK;
 }
+
+/**
+ * Flushes everything and empties the log in place. Caller holds both
+ * checkpointLock_ and logLock_, so no update is in flight.
+ */
+Error DmPersistVolFile::checkpointQuiesced_() {
+    if (0 == logSize_ && !oldLogExists_) {
+        return ERR_OK;
+    }
+
+    Error err = flush_();
+    if (!err.ok()) {
+        return err;
+    }
+
+    if (oldLogExists_) {
+        if (unlink(oldLogFilename_.c_str()) < 0 && ENOENT != errno) {
+            LOGERROR << "Failed to remove '" << oldLogFilename_ << "' errno: '" << errno << "'";
+            return ERR_DISK_WRITE_FAILED;
+        }
+        oldLogExists_ = false;
+    }
+    if (ftruncate64(logFd_, 0) < 0) {
+        LOGERROR << "Failed to truncate '" << logFilename_ << "' errno: '" << errno << "'";
+        return ERR_DISK_WRITE_FAILED;
+    }
+    logSize_ = 0;
+    return ERR_OK;
+}
+
+/**
+ * Record layout: magic, checksum and length of the body, then the body:
+ * flags, [blob name, blob meta], [volume meta], slot count and the slots
+ * as (object index, object id) pairs.
+ */
+void DmPersistVolFile::encode_(const LogRecord & rec, std::string & buf) {
+    std::string body;
+    body.reserve(sizeof(fds_uint32_t) * 2 + rec.slots.size() * LOG_SLOT_SIZE +
+                 rec.blobName.size() + rec.blobMeta.size() + rec.volMeta.size() + 16);
+
+    fds_uint32_t flags = (rec.hasBlobMeta ? LOG_FLAG_BLOB_META : 0) |
+            (rec.blobMetaDeleted ? LOG_FLAG_BLOB_META_DELETED : 0) |
+            (rec.hasVolMeta ? LOG_FLAG_VOL_META : 0);
+    putU32(body, flags);
+    if (rec.hasBlobMeta) {
+        putString(body, rec.blobName);
+        putString(body, rec.blobMeta);
+    }
+    if (rec.hasVolMeta) {
+        putString(body, rec.volMeta);
+    }
+    putU32(body, rec.slots.size());
+    for (auto & it : rec.slots) {
+        putU32(body, it.first);
+        body.append(reinterpret_cast<const char *>(it.second.GetId()), OBJECTID_DIGESTLEN);
+    }
+
+    buf.clear();
+    buf.reserve(LOG_RECORD_HDR_SIZE + body.size());
+    putU32(buf, LOG_RECORD_MAGIC);
+    putU32(buf, fnv1a(body.data(), body.size()));
+    putU32(buf, body.size());
+    buf.append(body);
+}
+
+fds_bool_t DmPersistVolFile::decode_(const char * data, size_t len, LogRecord & rec,
+                                     size_t & used) {
+    const char * p = data;
+    const char * end = data + len;
+    fds_uint32_t magic, checksum, bodyLen;
+    if (!getU32(p, end, magic) || !getU32(p, end, checksum) || !getU32(p, end, bodyLen) ||
+        LOG_RECORD_MAGIC != magic || static_cast<size_t>(end - p) < bodyLen ||
+        fnv1a(p, bodyLen) != checksum) {
+        return false;
+    }
+    end = p + bodyLen;
+
+    fds_uint32_t flags, numSlots;
+    if (!getU32(p, end, flags)) {
+        return false;
+    }
+    rec.hasBlobMeta = (flags & LOG_FLAG_BLOB_META) != 0;
+    rec.blobMetaDeleted = (flags & LOG_FLAG_BLOB_META_DELETED) != 0;
+    rec.hasVolMeta = (flags & LOG_FLAG_VOL_META) != 0;
+    if (rec.hasBlobMeta &&
+        (!getString(p, end, rec.blobName) || !getString(p, end, rec.blobMeta))) {
+        return false;
+    }
+    if (rec.hasVolMeta && !getString(p, end, rec.volMeta)) {
+        return false;
+    }
+    if (!getU32(p, end, numSlots) ||
+        static_cast<size_t>(end - p) != static_cast<size_t>(numSlots) * LOG_SLOT_SIZE) {
+        return false;
+    }
+    rec.slots.reserve(numSlots);
+    for (fds_uint32_t i = 0; i < numSlots; ++i) {
+        fds_uint32_t objIndex;
+        getU32(p, end, objIndex);
+        rec.slots.emplace_back(objIndex, ObjectID(reinterpret_cast<const uint8_t *>(p),
+                                                  OBJECTID_DIGESTLEN));
+        p += OBJECTID_DIGESTLEN;
+    }
+
+    used = LOG_RECORD_HDR_SIZE + bodyLen;
+    return true;
+}
+
 }  // namespace fds
@@ -18,6 +18,9 @@
 
 #include <VolumeMeta.h>
 #include <StatTypes.h>  // For StatConstants::singleton().
+#include <dmutil.h>
+#include <util/path.h>
+#include <boost/filesystem.hpp>
 
 #define ENSURE_SEQUENCE_ADV(seq_a, seq_b, volId, blobName) \
         auto const seq_ev_a = (seq_a); auto const seq_ev_b = (seq_b); \
@@ -58,9 +61,11 @@ DmVolumeCatalog::DmVolumeCatalog(CommonModuleProviderIf* modProvider,
     : HasModuleProvider(modProvider),
       Module(name),
       expungeCb_(0),
-      _ft_newStats { false }
+      _ft_newStats { false },
+      flatBlockCatalog_(false)
 {
     _ft_newStats = CONFIG_BOOL("fds.feature_toggle.common.send_to_new_stats_service", true);
+    flatBlockCatalog_ = CONFIG_BOOL("fds.dm.catalog_flat_block_volumes", false);
 }
 
 DmVolumeCatalog::~DmVolumeCatalog() {}
@@ -85,10 +90,13 @@ Error DmVolumeCatalog::addCatalog(const VolumeDesc & voldesc) {
             std::hex << voldesc.volUUID << std::dec << "'";
 
     DmPersistVolCat::ptr vol;
-    /*
-     * TODO(umesh): commented out for beta for commit log and consistent hot snapshot features
-    if (fpi::FDSP_VOL_S3_TYPE == voldesc.volType) {
-    */
+    if (useFlatCatalog_(voldesc)) {
+        vol.reset(new DmPersistVolFile(MODULEPROVIDER(),
+                                       voldesc.volUUID, voldesc.maxObjSizeInBytes,
+                                       voldesc.isSnapshot(), voldesc.isSnapshot(),
+                                       voldesc.isClone(),
+                                       voldesc.isSnapshot() ? voldesc.srcVolumeId : invalid_vol_id));
+    } else {
     fds_bool_t fArchiveLogs = CONFIG_BOOL("fds.feature_toggle.common.enable_timeline", true) &&
             !voldesc.isSnapshot() && voldesc.contCommitlogRetention > 0;
         vol.reset(new DmPersistVolDB(MODULEPROVIDER(),
@@ -96,13 +104,7 @@ Error DmVolumeCatalog::addCatalog(const VolumeDesc & voldesc) {
                                      voldesc.isSnapshot(), voldesc.isSnapshot(), voldesc.isClone(),
                                      fArchiveLogs,
                                      voldesc.isSnapshot() ? voldesc.srcVolumeId : invalid_vol_id));
-    /*
-    } else {
-        vol.reset(new DmPersistVolFile(voldesc.volUUID, voldesc.maxObjSizeInBytes,
-                    voldesc.isSnapshot(), voldesc.isSnapshot(),
-                    voldesc.isSnapshot() ? voldesc.srcVolumeId : invalid_vol_id));
     }
-    */
 
     FDSGUARD(volMapLock_);
 
@@ -152,22 +154,20 @@ Error DmVolumeCatalog::copyVolume(const VolumeDesc & voldesc) {
 
     if (rc.ok()) {
         DmPersistVolCat::ptr vol;
-        /*
-         * TODO(umesh): commented out for beta for commit log and consistent hot snapshot features
-        if (fpi::FDSP_VOL_S3_TYPE == volType) {
-        */
+        // A copy keeps the engine of its source
+        if (boost::dynamic_pointer_cast<DmPersistVolFile>(voldir)) {
+            vol.reset(new DmPersistVolFile(MODULEPROVIDER(),
+                                           voldesc.volUUID, objSize, voldesc.isSnapshot(),
+                                           voldesc.isSnapshot(), voldesc.isClone(),
+                                           voldesc.srcVolumeId));
+        } else {
         fds_bool_t fArchiveLogs = CONFIG_BOOL("fds.feature_toggle.common.enable_timeline", true) &&
                 !voldesc.isSnapshot() && voldesc.contCommitlogRetention > 0;
 
             vol.reset(new DmPersistVolDB(MODULEPROVIDER(),
                                          voldesc.volUUID, objSize, voldesc.isSnapshot(),
                                          voldesc.isSnapshot(), voldesc.isClone(), fArchiveLogs, voldesc.srcVolumeId));
-        /*
-        } else {
-            vol.reset(new DmPersistVolFile(voldesc.volUUID, objSize, voldesc.isSnapshot(),
-                    voldesc.isSnapshot(), voldesc.srcVolumeId));
         }
-        */
 
         FDSGUARD(volMapLock_);
         volMap_[voldesc.volUUID] = vol;
@@ -176,6 +176,24 @@ Error DmVolumeCatalog::copyVolume(const VolumeDesc & voldesc) {
     return rc;
 }
 
+bool DmVolumeCatalog::useFlatCatalog_(const VolumeDesc & voldesc) {
+    if (fpi::FDSP_VOL_BLKDEV_TYPE != voldesc.volType) {
+        return false;
+    }
+
+    // An existing catalog keeps whichever engine created it
+    const FdsRootDir* root = MODULEPROVIDER()->proc_fdsroot();
+    std::string catDir = voldesc.isSnapshot() ?
+            dmutil::getLevelDBFile(root, voldesc.srcVolumeId, voldesc.volUUID) :
+            dmutil::getLevelDBFile(root, voldesc.volUUID);
+    if (DmPersistVolFile::exists(catDir)) {
+        return true;
+    } else if (util::dirExists(catDir)) {
+        return false;
+    }
+    return flatBlockCatalog_;
+}
+
 Error DmVolumeCatalog::activateCatalog(fds_volid_t volId) {
     LOGDEBUG << "Will activate catalog for volume " << std::hex << volId << std::dec;
 
@@ -218,6 +236,32 @@ Error DmVolumeCatalog::reloadCatalog(const VolumeDesc & voldesc) {
     return rc;
 }
 
+Error DmVolumeCatalog::replaceCatalog(const VolumeDesc & voldesc, const std::string & srcDir) {
+    LOGNORMAL << "Will replace catalog for volume " << voldesc.volUUID << " with " << srcDir;
+    std::string catDir = dmutil::getLevelDBFile(MODULEPROVIDER()->proc_fdsroot(), voldesc.volUUID);
+
+    deleteCatalog(voldesc.volUUID, false);
+    try {
+        boost::filesystem::remove_all(catDir);
+        boost::filesystem::rename(srcDir, catDir);
+    } catch (const boost::filesystem::filesystem_error & e) {
+        LOGERROR << "unable to move " << srcDir << " to " << catDir << " : " << e.what();
+        return ERR_DISK_WRITE_FAILED;
+    }
+
+    Error rc = addCatalog(voldesc);
+    if (!rc.ok()) {
+        LOGWARN << "Failed to re-instantiate the volume '" << voldesc.volUUID;
+        return rc;
+    }
+    rc = activateCatalog(voldesc.volUUID);
+    if (!rc.ok()) {
+        LOGWARN << "unable to activate vol:" << voldesc.volUUID
+                << "error:" << rc;
+    }
+    return rc;
+}
+
 void DmVolumeCatalog::registerExpungeObjectsCb(expunge_objs_cb_t cb) {
     expungeCb_ = cb;
 }
@@ -331,6 +331,53 @@ void DmMigrationTxStateHandler::handleResponse(boost::shared_ptr<fpi::AsyncHdr>&
 	delete dmRequest;
 }
 
+DmMigrationBulkCatalogHandler::DmMigrationBulkCatalogHandler(DataMgr& dataManager)
+    : Handler(dataManager)
+{
+    if (!dataManager.features.isTestModeEnabled()) {
+        REGISTER_DM_MSG_HANDLER(fpi::CtrlNotifyBulkCatalogMsg, handleRequest);
+    }
+}
+
+void DmMigrationBulkCatalogHandler::handleRequest(fpi::AsyncHdrPtr& asyncHdr,
+                                                  fpi::CtrlNotifyBulkCatalogMsgPtr& message) {
+    NodeUuid srcUuid;
+    srcUuid.uuid_set_val(asyncHdr->msg_src_uuid.svc_uuid);
+    auto dmReq = new DmIoMigrationBulkCatalog(srcUuid, message);
+    dmReq->version = message->version;
+
+    dmReq->cb = BIND_MSG_CALLBACK(DmMigrationBulkCatalogHandler::handleResponse, asyncHdr, message);
+
+    fds_verify(dmReq->io_type == FDS_DM_MIG_BULK_CATALOG);
+
+    LOGMIGRATE << "Unpacking bulk catalog migration request " << logString(*asyncHdr)
+               << " " << *dmReq;
+
+    // Untarring a large catalog takes a while, so only queue the swap once it is done
+    dataManager.getModuleProvider()->proc_thrpool()->schedule([this, dmReq]() {
+        dmReq->unpackErr = dataManager.dmMigrationMgr->unpackBulkCatalog(dmReq);
+        addToQueue(dmReq);
+    });
+}
+
+void DmMigrationBulkCatalogHandler::handleQueueItem(DmRequest* dmRequest) {
+    QueueHelper helper(dataManager, dmRequest);
+    DmIoMigrationBulkCatalog* typedRequest = static_cast<DmIoMigrationBulkCatalog*>(dmRequest);
+    helper.err = dataManager.dmMigrationMgr->applyBulkCatalog(typedRequest);
+}
+
+void DmMigrationBulkCatalogHandler::handleResponse(boost::shared_ptr<fpi::AsyncHdr>& asyncHdr,
+                        boost::shared_ptr<fpi::CtrlNotifyBulkCatalogMsg>& message,
+                        Error const& e, DmRequest* dmRequest) {
+    asyncHdr->msg_code = e.GetErrno();
+
+    LOGMIGRATE << logString(*asyncHdr) << " sending bulk catalog resp with err: " << e;
+    DM_SEND_ASYNC_RESP(*asyncHdr, FDSP_MSG_TYPEID(fpi::CtrlNotifyBulkCatalogRspMsg),
+                       fpi::CtrlNotifyBulkCatalogRspMsg());
+
+    delete dmRequest;
+}
+
 DmMigrationRequestTxStateHandler::DmMigrationRequestTxStateHandler(DataMgr& dataManager)
     : Handler(dataManager)
 {
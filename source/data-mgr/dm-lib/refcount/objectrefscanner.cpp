@@ -1,6 +1,7 @@
 /*
  * Copyright 2015 Formation Data Systems, Inc.
  */
+#include <algorithm>
 #include <sstream>
 #include <lib/Catalog.h>
 #include <DataMgr.h>
@@ -12,10 +13,12 @@
 namespace fds { namespace refcount {
 namespace bfs = boost::filesystem;
 
-BloomFilterStore::BloomFilterStore(const std::string &path, uint32_t cacheSize, uint32_t bloomfilterBits)
+BloomFilterStore::BloomFilterStore(const std::string &path, uint32_t cacheSize,
+                                   uint32_t bloomfilterBits, uint8_t bitsPerKey)
         : basePath(path),
           maxCacheSize(cacheSize),
           bloomfilterBits(bloomfilterBits),
+          bitsPerKey(bitsPerKey),
           accessCnt(1)
 {
     if (basePath[basePath.size()-1] != '/') {
@@ -34,9 +37,11 @@ BloomFilterStore::~BloomFilterStore() {
 
 util::BloomFilterPtr BloomFilterStore::load(const std::string &key) {
     auto deserializer = serialize::getFileDeserializer(getFilePath(key));
-    auto bloomfilter = util::BloomFilterPtr(new util::BloomFilter(bloomfilterBits));
+    auto bloomfilter = util::BloomFilterPtr(new util::BloomFilter(64, bitsPerKey));
     auto readSize = bloomfilter->read(deserializer);
     delete deserializer;
+    // The store is wiped on startup, so every file was written by this process
+    fds_verify(!bloomfilter->formatMismatch());
     return bloomfilter;
 }
 
@@ -92,7 +97,7 @@ util::BloomFilterPtr BloomFilterStore::get(const std::string &key, bool create)
             return bloomfilter;
         }
         /* Create empty bloomfilter and add to index and cache */
-        bloomfilter.reset(new util::BloomFilter(bloomfilterBits));
+        bloomfilter.reset(new util::BloomFilter(bloomfilterBits, bitsPerKey));
         addToCache(key, bloomfilter);
         index.insert(key);
         GLOGDEBUG << "created bloomfilter: " << key;
@@ -277,11 +282,11 @@ void ObjectRefScanMgr::prescanInit()
 
     /* Init bloomfilter store */
     auto dmUserRepo = MODULEPROVIDER()->proc_fdsroot()->dir_user_repo_dm();
-    auto config = MODULEPROVIDER()->get_conf_helper();
-    auto bfSize = util::getBytesFromHumanSize(
-        config.get<std::string>("objectrefscan.bf_size", "1M"));
+    uint8_t bitsPerKey = 8;
+    auto bfSize = getBloomFilterBits(bitsPerKey);
 
-    bfStore.reset(new BloomFilterStore(util::strformat("%s/bloomfilters/", dmUserRepo.c_str()), 5, bfSize));
+    bfStore.reset(new BloomFilterStore(util::strformat("%s/bloomfilters/", dmUserRepo.c_str()),
+                                       5, bfSize, bitsPerKey));
 
     /* Scan cycle counters */
     scanCntr++;
@@ -290,6 +295,52 @@ void ObjectRefScanMgr::prescanInit()
     state = RUNNING;
 }
 
+uint32_t ObjectRefScanMgr::getBloomFilterBits(uint8_t &bitsPerKey)
+{
+    auto config = MODULEPROVIDER()->get_conf_helper();
+    auto fpRate = config.get<double>("objectrefscan.bf_fp_rate", 0.01);
+    if (fpRate <= 0.0) {
+        /* Sizing disabled; use the fixed size */
+        bitsPerKey = 8;
+        return util::getBytesFromHumanSize(config.get<std::string>("objectrefscan.bf_size", "1M"));
+    }
+    auto minBits = util::getBytesFromHumanSize(
+        config.get<std::string>("objectrefscan.bf_min_size", "64K"));
+    auto maxBits = util::getBytesFromHumanSize(
+        config.get<std::string>("objectrefscan.bf_max_size", "256M"));
+    auto headroom = config.get<double>("objectrefscan.bf_headroom", 1.5);
+
+    /* Volume token filters are merged into the token filter, so every filter has
+     * to be able to hold all objects of a token.  Estimate that from the logical
+     * object counts of the volumes being scanned.  Snapshots mostly share their
+     * source volume's objects and are not counted.
+     */
+    uint64_t totalObjects = 0;
+    auto volcatIf = dataMgr->timeVolCat_->queryIface();
+    for (const auto &ctx : scanList) {
+        fds_uint64_t size = 0, blobCount = 0, objCount = 0;
+        if (volcatIf->statVolumeLogical(ctx.volId, &size, &blobCount, &objCount, nullptr) == ERR_OK) {
+            totalObjects += objCount;
+        }
+    }
+    uint32_t tokenCnt = std::max(currentDlt ? currentDlt->getNumTokens() : 1U, 1U);
+    uint64_t expected = static_cast<uint64_t>(totalObjects * headroom / tokenCnt) + 1;
+
+    uint64_t bits = util::BloomFilter::optimalTotalBits(expected, fpRate);
+    bits = std::max<uint64_t>(bits, minBits);
+    bits = std::min<uint64_t>(bits, maxBits);
+    bits = std::max<uint64_t>(bits & ~63ULL, 64);
+    bitsPerKey = util::BloomFilter::optimalBitsPerKey(bits, expected);
+
+    LOGNORMAL << "bloomfilter sizing objects:" << totalObjects
+              << " tokens:" << tokenCnt
+              << " expected.per.token:" << expected
+              << " bits:" << bits
+              << " hashes:" << static_cast<uint32_t>(bitsPerKey)
+              << " fp.rate:" << fpRate;
+    return static_cast<uint32_t>(bits);
+}
+
 VolumeRefScannerContext::VolumeRefScannerContext(ObjectRefScanMgr* m, fds_volid_t vId)
         : ObjectRefScannerIf(m)
 {
@@ -7,6 +7,11 @@ extern "C" {
 #include <sys/inotify.h>
 #include <dirent.h>
 }
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <DataMgr.h>
 #include <leveldb/cat_journal.h>
 #include <util/path.h>
@@ -17,8 +22,101 @@ static const fds_uint32_t POLL_WAIT_TIME_MS = 120000;
 static const fds_uint32_t MAX_POLL_EVENTS = 1024;
 static const fds_uint32_t BUF_LEN = MAX_POLL_EVENTS * (sizeof(struct inotify_event) + NAME_MAX);
 
+/**
+ * The in-window records of one journal file, in file order. Each record is
+ * the write batch of one catalog update.
+ */
+struct ReplayRecords {
+    std::vector<leveldb::WriteBatch> batches;
+};
+
+/**
+ * Gathers the writes of whole records for one catalog update, so a record is
+ * never split across updates. A key written again before the update only
+ * keeps its last put or delete; the update applies writes in the order their
+ * keys were last written.
+ */
+struct BatchAppender : leveldb::WriteBatch::Handler {
+    struct Write {
+        std::string key;
+        std::string value;
+        bool isDelete;
+        bool superseded;
+    };
+
+    void Put(const leveldb::Slice& key, const leveldb::Slice& value) override {
+        append(key, value, false);
+    }
+
+    void Delete(const leveldb::Slice& key) override {
+        append(key, leveldb::Slice(), true);
+    }
+
+    /// Moves the gathered writes that were not superseded into batch
+    void fill(CatWriteBatch & batch) {
+        for (auto &w : pending) {
+            if (w.superseded) {
+                continue;
+            }
+            if (w.isDelete) {
+                batch.Delete(w.key);
+            } else {
+                batch.Put(w.key, w.value);
+            }
+        }
+        pending.clear();
+        latest.clear();
+        writes = 0;
+    }
+
+    /// Writes gathered since the last fill(), superseded ones included
+    fds_uint32_t writes = 0;
+    /// Writes dropped because a later one in the same update wrote their key
+    fds_uint64_t collapsed = 0;
+
+  private:
+    void append(const leveldb::Slice& key, const leveldb::Slice& value, bool isDelete) {
+        auto ins = latest.emplace(key.ToString(), pending.size());
+        if (!ins.second) {
+            pending[ins.first->second].superseded = true;
+            ins.first->second = pending.size();
+            ++collapsed;
+        }
+        pending.push_back({ins.first->first, value.ToString(), isDelete, false});
+        ++writes;
+    }
+
+    std::vector<Write> pending;
+    std::unordered_map<std::string, size_t> latest;
+};
+
+static void decodeJournal(const std::string &file,
+                          util::TimeStamp fromTime,
+                          util::TimeStamp toTime,
+                          ReplayRecords &records) {
+    for (leveldb::CatJournalIterator iter(file); iter.isValid(); iter.Next()) {
+        leveldb::WriteBatch & wb = iter.GetBatch();
+        fds_uint64_t ts = getWriteBatchTimestamp(wb);
+        if (!ts) {
+            LOGDEBUG << "Error getting the write batch time stamp";
+            break;
+        }
+        if (ts > toTime) {
+            // we don't care about further records in this file.
+            break;
+        }
+        if (ts >= fromTime) {
+            records.batches.push_back(wb);
+        }
+    }
+}
+
 JournalManager::JournalManager(fds::DataMgr* dm) : dm(dm),fStopLogMonitoring(false) {
     inotifyFd = -1;
+    auto config = dm->getModuleProvider()->get_fds_config();
+    replayThreads = std::max(1u, config->get<fds_uint32_t>("fds.dm.journal_replay_threads", 4));
+    replayBatchSize = std::max(1u, config->get<fds_uint32_t>("fds.dm.journal_replay_batch_size",
+                                                             4096));
     if (dm->features.isTimelineEnabled()) {
         logMonitor.reset(new std::thread(
             std::bind(&JournalManager::monitorLogs, this)));
@@ -43,26 +141,78 @@ Error JournalManager::replayTransactions(Catalog& destCat,
                                          const std::vector<std::string> &files,
                                          util::TimeStamp fromTime,
                                          util::TimeStamp toTime) {
+    return replayJournals(destCat, files, fromTime, toTime, replayThreads, replayBatchSize);
+}
+
+Error JournalManager::replayJournals(Catalog& destCat,
+                                     const std::vector<std::string> &files,
+                                     util::TimeStamp fromTime,
+                                     util::TimeStamp toTime,
+                                     fds_uint32_t replayThreads,
+                                     fds_uint32_t replayBatchSize) {
     Error err(ERR_DM_REPLAY_JOURNAL);
+    util::TimeStamp startTime = util::getTimeStampMicros();
+
+    fds_uint64_t records = 0, writes = 0, batches = 0;
+    BatchAppender appender;
+    auto applyBatch = [&]() {
+        CatWriteBatch batch;
+        writes += appender.writes;
+        appender.fill(batch);
+        err = destCat.Update(&batch);
+        if (!err.ok()) {
+            LOGERROR << "failed to apply replayed journal batch " << batches
+                     << " err:" << err;
+        }
+        ++batches;
+    };
+
+    // Decode a window of files at a time, then apply their records in file
+    // order before decoding the next window.
+    size_t filesDone = 0;
+    while (filesDone < files.size()) {
+        size_t count = std::min<size_t>(replayThreads, files.size() - filesDone);
+        std::vector<ReplayRecords> decoded(count);
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < count; ++i) {
+            workers.emplace_back(decodeJournal, std::cref(files[filesDone + i]),
+                                 fromTime, toTime, std::ref(decoded[i]));
+        }
+        decodeJournal(files[filesDone], fromTime, toTime, decoded[0]);
+        for (auto &worker : workers) {
+            worker.join();
+        }
 
-    fds_uint64_t ts = 0;
-    for (const auto &f : files) {
-        for (leveldb::CatJournalIterator iter(f); iter.isValid(); iter.Next()) {
-            leveldb::WriteBatch & wb = iter.GetBatch();
-            ts = getWriteBatchTimestamp(wb);
-            if (!ts) {
-                LOGDEBUG << "Error getting the write batch time stamp";
-                break;
-            }
-            if (ts > toTime) {
-                // we don't care about further records.
-                break;
-            }
-            if (ts >= fromTime && ts <= toTime) {
-                err = destCat.Update(&wb);
+        for (auto &file : decoded) {
+            for (auto &wb : file.batches) {
+                wb.Iterate(&appender);
+                ++records;
+                if (appender.writes >= replayBatchSize) {
+                    applyBatch();
+                    if (!err.ok()) {
+                        return err;
+                    }
+                }
             }
+            ++filesDone;
         }
+        LOGNORMAL << "replayed [" << filesDone << "/" << files.size() << "] journal files"
+                  << " records:" << records << " collapsed:" << appender.collapsed;
     }
+    if (appender.writes) {
+        applyBatch();
+        if (!err.ok()) {
+            return err;
+        }
+    }
+
+    util::TimeStamp elapsed = std::max<util::TimeStamp>(1, util::getTimeStampMicros() - startTime);
+    LOGNORMAL << "replayed [" << filesDone << "] journal files"
+              << " records:" << records << " writes:" << writes
+              << " collapsed:" << appender.collapsed
+              << " in batches:" << batches
+              << " time:" << elapsed / 1000 << "ms"
+              << " rate:" << (records * 1000 * 1000 / elapsed) << " records/s";
     return err;
 }
 
@@ -106,6 +256,11 @@ Error JournalManager::replayTransactions(fds_volid_t srcVolId,
 
     DmPersistVolDB::ptr voldDBPtr = boost::dynamic_pointer_cast
             <DmPersistVolDB>(persistVolDirPtr);
+    if (voldDBPtr.get() == NULL) {
+        // flat block catalogs keep no leveldb journals
+        LOGERROR << "no leveldb catalog to replay into for vol:" << destVolId;
+        return ERR_NOT_FOUND;
+    }
     Catalog* catalog = voldDBPtr->getCatalog();
 
     if (NULL == catalog) {
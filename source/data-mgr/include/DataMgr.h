@@ -52,6 +52,7 @@
 
 namespace fds {
 // forward declarations
+class DmPersistVolCat;
 class DmPersistVolDB;
 namespace dm {
 
@@ -263,6 +264,7 @@ public:
     void getActiveVolumes(std::vector<fds_volid_t>& vecVolIds) const;
     void getAllVolumes(std::vector<fds_volid_t>& vecVolIds) const;
 
+    SHPTR<DmPersistVolCat> getPersistVolCat(fds_volid_t volId);
     SHPTR<DmPersistVolDB> getPersistDB(fds_volid_t volId);
 
     ///
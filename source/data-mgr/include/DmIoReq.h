@@ -895,6 +895,26 @@ struct DmIoMigrationTxState : DmRequest {
     fpi::CtrlNotifyTxStateMsgPtr txStateMsg;
 };
 
+struct DmIoMigrationBulkCatalog : DmRequest {
+    NodeUuid srcUuid;
+    explicit DmIoMigrationBulkCatalog(NodeUuid _src, const fpi::CtrlNotifyBulkCatalogMsgPtr &msg)
+            : DmRequest(FdsDmSysTaskId, "", "", 0, FDS_DM_MIG_BULK_CATALOG),
+              srcUuid(_src),
+              bulkCatalogMsg(msg)
+    {
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const DmIoMigrationBulkCatalog& io) {
+        return out << "DmIoMigrationBulkCatalog vol:"
+                   << std::hex << io.bulkCatalogMsg->volume_id << std::dec;
+    }
+
+    fpi::CtrlNotifyBulkCatalogMsgPtr bulkCatalogMsg;
+    /* Where the catalog copy was unpacked, and how that went */
+    std::string stageDir;
+    Error unpackErr;
+};
+
 struct DmIoMigrationRequestTxState : DmRequest {
     explicit DmIoMigrationRequestTxState(fds_volid_t volId, const fpi::CtrlNotifyRequestTxStateMsgPtr &msg)
             : DmRequest(volId, "", "", 0, FDS_DM_MIG_REQ_TX_STATE),
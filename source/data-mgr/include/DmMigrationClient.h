@@ -140,6 +140,13 @@ class DmMigrationClient : public DmMigrationBase {
      */
     uint64_t maxNumBlobs;
 
+    /**
+     * Full resyncs of volumes with at least bulkCatalogMinBlobs blobs
+     * ship the catalog files when bulkCatalog is set.
+     */
+    fds_bool_t bulkCatalog;
+    uint64_t bulkCatalogMinBlobs;
+
     /**
      * Local copy of the dmtVersion undergoing migration
      */
@@ -185,6 +192,26 @@ class DmMigrationClient : public DmMigrationBase {
      */
     Error processBlobDiff();
 
+    /**
+     * Full resync fast path: whether to ship a copy of the catalog files
+     * instead of sending every blob as delta sets.
+     */
+    fds_bool_t shouldSendBulkCatalog(size_t numBlobs);
+
+    /**
+     * Archive a copy of the volume catalog and send it to the destination
+     * with the file transfer service. The <blob, sequence id> set of the
+     * copy is returned so that only the catch-up delta is sent afterwards.
+     */
+    Error transferCatalogCopy(std::string& archiveFileName,
+                              std::map<std::string, int64_t>& copyBlobMap);
+
+    /**
+     * Ask the destination to load the transferred catalog copy.
+     * Blocks until the destination has replied.
+     */
+    Error sendBulkCatalog(const std::string& archiveFileName);
+
     /**
      * Generate delta set based on update blob ids and delete ids.
      */
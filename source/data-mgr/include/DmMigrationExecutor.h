@@ -49,6 +49,27 @@ class DmMigrationExecutor : public DmMigrationBase {
      */
     Error processInitialBlobFilterSet();
 
+    /**
+     * Step 2.0 (full resync only), before queueing the swap:
+     * Unpack the catalog copy shipped by the source DM into stageDir.
+     * Takes a while for a large volume, so not run on a DM queue.
+     */
+    Error unpackBulkCatalog(fpi::CtrlNotifyBulkCatalogMsgPtr &msg, std::string &stageDir);
+
+    /**
+     * Step 2.0 (full resync only):
+     * Replace the volume catalog with the copy unpacked in stageDir.
+     * Runs before any delta set is sent, so the delta sets only carry what
+     * changed between the copy and the source's migration snapshot.
+     */
+    Error processBulkCatalog(fpi::CtrlNotifyBulkCatalogMsgPtr &msg, const std::string &stageDir);
+
+    /**
+     * Untar the catalog archive into a new dir next to it, returned in stageDir,
+     * and remove the archive.  stageDir is left empty on failure.
+     */
+    static Error unpackCatalog(const std::string &archiveFile, std::string &stageDir);
+
     /**
      * Step 2.1:
      * Process the incoming delta blobs set coming from the source DM.
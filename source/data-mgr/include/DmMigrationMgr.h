@@ -150,6 +150,19 @@ class DmMigrationMgr {
      */
     Error applyTxState(DmIoMigrationTxState* txStateReq);
 
+    /**
+     * Destination DM:
+     * Unpack the catalog copy shipped by the source DM on a full resync.
+     * Run before the request is queued, keeps the unpacked dir in the request.
+     */
+    Error unpackBulkCatalog(DmIoMigrationBulkCatalog* bulkCatalogReq);
+
+    /**
+     * Destination DM:
+     * Swap in the catalog copy unpacked by unpackBulkCatalog().
+     */
+    Error applyBulkCatalog(DmIoMigrationBulkCatalog* bulkCatalogReq);
+
     /**
      * Public interface to check whether or not a I/O should be forwarded as part ofstion.
      * Params:
@@ -6,17 +6,27 @@
 
 #include <sys/mman.h>
 
+#include <atomic>
+#include <cstring>
+#include <memory>
+
 #include <boost/shared_ptr.hpp>
 
 #include <fds_types.h>
-#include <concurrency/Mutex.h>
+#include <fds_error.h>
+#include <fds_assert.h>
 
 namespace fds {
 
 /**
  * This class mmaps into flat file which stores object ID array.
  * Object IDs belonging to a blob or a volume are stored in long,
- * flat, sparse file.
+ * flat, sparse file. Slot i of the file holds the object ID at object
+ * index i; an all-zero slot is NullObjectID.
+ *
+ * Readers never take a lock. Every slot has an in-memory sequence number
+ * which a writer makes odd while it copies the ID in. A reader copies the
+ * ID out and retries if the sequence was odd or moved underneath it.
  */
 class DmOIDArrayMmap {
   public:
@@ -49,9 +59,21 @@ class DmOIDArrayMmap {
         fds_assert((objIndex / NUM_OBJS_PER_FRAGMENT) == id_);
         fds_assert(valid());
 
-        fds_scoped_lock sl(lock_);
-        objId.SetId(reinterpret_cast<const char *>(getOID(objIndex % NUM_OBJS_PER_FRAGMENT)),
-                OBJECTID_DIGESTLEN);
+        fds_uint64_t arrIndex = objIndex % NUM_OBJS_PER_FRAGMENT;
+        std::atomic<fds_uint32_t> & seq = seq_[arrIndex];
+        uint8_t oid[OBJECTID_DIGESTLEN];
+        for (;;) {
+            fds_uint32_t before = seq.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;  // writer in progress
+            }
+            memcpy(oid, getOID(arrIndex), OBJECTID_DIGESTLEN);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == before) {
+                break;
+            }
+        }
+        objId.SetId(reinterpret_cast<const char *>(oid), OBJECTID_DIGESTLEN);
         return ERR_OK;
     }
 
@@ -59,17 +81,31 @@ class DmOIDArrayMmap {
         fds_assert((objIndex / NUM_OBJS_PER_FRAGMENT) == id_);
         fds_assert(valid());
 
-        fds_scoped_lock sl(lock_);
-        memcpy(reinterpret_cast<void *>(getOID(objIndex % NUM_OBJS_PER_FRAGMENT)),
-                objId.GetId(), OBJECTID_DIGESTLEN);
+        fds_uint64_t arrIndex = objIndex % NUM_OBJS_PER_FRAGMENT;
+        std::atomic<fds_uint32_t> & seq = seq_[arrIndex];
+        fds_uint32_t cur = seq.load(std::memory_order_relaxed);
+        do {
+            while (cur & 1) {
+                cur = seq.load(std::memory_order_relaxed);
+            }
+        } while (!seq.compare_exchange_weak(cur, cur + 1, std::memory_order_acquire,
+                                            std::memory_order_relaxed));
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(reinterpret_cast<void *>(getOID(arrIndex)), objId.GetId(), OBJECTID_DIGESTLEN);
+        seq.store(cur + 2, std::memory_order_release);
         return ERR_OK;
     }
 
+    /**
+     * Flushes dirty pages of this fragment to the backing file.
+     */
+    Error sync();
+
   protected:
     fds_uint64_t id_;
     int fd_;
     void * base_;
-    mutable fds_mutex lock_;
+    std::unique_ptr<std::atomic<fds_uint32_t>[]> seq_;
 
     // methods
     inline const uint8_t * getBaseOffset() const {
@@ -238,6 +238,7 @@ class DmPersistVolCat : public HasModuleProvider {
 
     virtual int32_t getVersion() = 0;
     virtual void setVersion(int32_t version) = 0;
+    virtual int32_t updateVersion() = 0;
 
   protected:
     // vars
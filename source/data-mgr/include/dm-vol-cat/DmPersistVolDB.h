@@ -59,7 +59,13 @@ class DmPersistVolDB : public HasLogger, public DmPersistVolCat {
 
     virtual Error copyVolDir(const std::string & destName) override;
     
-    Error archive(const std::string& destDir, const std::string& filename);
+    /**
+     * Tars a point-in-time copy of the catalog into destDir/filename. If
+     * blobsSeqId is given it is filled with the <blob, sequence id> set of
+     * that copy.
+     */
+    Error archive(const std::string& destDir, const std::string& filename,
+                  std::map<std::string, int64_t>* blobsSeqId = NULL);
     // gets
     virtual Error getVolumeMetaDesc(VolumeMetaDesc & volDesc) override;
 
@@ -171,11 +177,13 @@ class DmPersistVolDB : public HasLogger, public DmPersistVolCat {
     */
     int32_t getVersion() override;
     void setVersion(int32_t version) override;
-    int32_t updateVersion();
+    int32_t updateVersion() override;
 
   private:
     std::string getVersionFile_();
     // methods
+    static Error getAllBlobsWithSequenceId(const std::string& catDir,
+                                           std::map<std::string, int64_t>& blobsSeqId);
 
     // vars
     std::atomic<uint64_t> snapshotCount;
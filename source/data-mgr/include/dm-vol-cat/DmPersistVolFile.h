@@ -4,57 +4,110 @@
 #ifndef SOURCE_DATA_MGR_INCLUDE_DM_VOL_CAT_DMPERSISTVOLFILE_H_
 #define SOURCE_DATA_MGR_INCLUDE_DM_VOL_CAT_DMPERSISTVOLFILE_H_
 
+#include <atomic>
+#include <list>
+#include <map>
 #include <string>
 #include <vector>
 
 #include <fds_process.h>
 #include <fds_module.h>
-#include <serialize.h>
-
-#include <cache/SharedKvCache.h>
+#include <fds_config.hpp>
 
 #include <dm-vol-cat/DmPersistVolCat.h>
 #include <dm-vol-cat/DmOIDArrayMmap.h>
 
 namespace fds {
 
+/**
+ * Volume catalog for block volumes that keeps the offset -> object ID map
+ * in a flat, sparse, mmapped file instead of leveldb. A block volume has a
+ * single blob, so the object index is the position in the file and a lookup
+ * is two pointer loads plus a 20 byte copy, with no lock on the read path.
+ *
+ * Updates are serialized per volume. Each update is appended to a redo log
+ * before it is applied to the mapped file; the log is replayed on activate.
+ * A checkpoint switches updates over to a fresh log, flushes the mapped
+ * fragments and then drops the old log, without holding up updates.
+ *
+ * In-memory snapshots are copy on write: an update saves the old object ID
+ * of a slot into every live snapshot that has not saved that slot yet.
+ */
 class DmPersistVolFile : public HasLogger, public DmPersistVolCat {
   public:
     // types
     typedef boost::shared_ptr<DmPersistVolFile> ptr;
     typedef boost::shared_ptr<const DmPersistVolFile> const_ptr;
 
-    static const fds_uint32_t MMAP_CACHE_SIZE;
+    static const std::string CATALOG_FLAT_CHECKPOINT_BYTES_STR;
+    static const std::string OBJ_FILENAME;
+    static const std::string META_FILENAME;
+    static const std::string LOG_FILENAME;
+    static const std::string OLD_LOG_FILENAME;
 
     // ctor & dtor
     DmPersistVolFile(CommonModuleProviderIf *modProvider,
                      fds_volid_t volId, fds_uint32_t objSize,
                      fds_bool_t snapshot, fds_bool_t readOnly,
+                     fds_bool_t clone,
                      fds_volid_t srcVolId = invalid_vol_id);
     virtual ~DmPersistVolFile();
 
+    /**
+     * Returns true if the catalog directory holds a flat offset map.
+     */
+    static fds_bool_t exists(const std::string & catDir);
+
     // methods
     virtual Error activate() override;
 
     virtual Error copyVolDir(const std::string & destName) override;
 
     // gets
+    virtual Error getVolumeMetaDesc(VolumeMetaDesc & volDesc) override;
+
     virtual Error getBlobMetaDesc(const std::string & blobName,
-                                  BlobMetaDesc & blobMeta, Catalog::MemSnap snap) override;
+                                  BlobMetaDesc & blobMeta,
+                                  Catalog::MemSnap snap = NULL) override;
 
     virtual Error getAllBlobMetaDesc(std::vector<BlobMetaDesc> & blobMetaList) override;
 
+    virtual Error getBlobMetaDescForPrefix(std::string const& prefix,
+                                           std::string const& delimiter,
+                                           std::vector<BlobMetaDesc>& blobMetaList,
+                                           std::vector<std::string>& skippedPrefixes) override;
+
     virtual Error getObject(const std::string & blobName, fds_uint64_t offset,
             ObjectID & obj) override;
 
     virtual Error getObject(const std::string & blobName, fds_uint64_t startOffset,
                             fds_uint64_t endOffset,
                             fpi::FDSP_BlobObjectList& objList,
-                            Catalog::MemSnap snap) override;
+                            const Catalog::MemSnap snap = NULL) override;
 
     virtual Error getObject(const std::string & blobName, fds_uint64_t startOffset,
             fds_uint64_t endOffset, BlobObjList & objList) override;
 
+    virtual Error getLatestSequenceId(blob_version_t & max) override;
+
+    virtual Error getAllBlobsWithSequenceId(std::map<std::string, int64_t>& blobsSeqId,
+                                            Catalog::MemSnap snap) override;
+
+    virtual Error getAllBlobsWithSequenceId(std::map<std::string, int64_t>& blobsSeqId,
+                                            Catalog::MemSnap snap,
+                                            const fds_bool_t &abortFlag) override;
+
+    /**
+     * Returns a point-in-time view of the map and blob descriptor, valid
+     * until it is freed with freeInMemorySnapshot().
+     */
+    virtual Error getInMemorySnapshot(Catalog::MemSnap &snap) override;
+
+    virtual void getObjectIds(const uint32_t &maxObjs,
+                              const Catalog::MemSnap &snap,
+                              std::unique_ptr<Catalog::catalog_iterator_t>& dbItr,
+                              std::list<ObjectID> &objects) override;
+
     // puts
     virtual Error putVolumeMetaDesc(const VolumeMetaDesc & volDesc) override;
 
@@ -99,26 +152,103 @@ class DmPersistVolFile : public HasLogger, public DmPersistVolCat {
                                 fds_uint64_t* blobCount,
                                 fds_uint64_t* logicalObjectCount) override;
 
+    virtual void forEachObject(std::function<void(const ObjectID&)>) override;
+
+    virtual Error freeInMemorySnapshot(Catalog::MemSnap& snap) override;
+    virtual uint64_t getNumInMemorySnapshots() override;
+
+    int32_t getVersion() override;
+    void setVersion(int32_t version) override;
+    int32_t updateVersion() override;
+
+    /**
+     * Flushes mapped fragments and metadata and drops the redo log they cover.
+     * Updates go on meanwhile, into a fresh log.
+     */
+    Error checkpoint();
+
   private:
+    /// Fragments are found through a two level directory of pages, each
+    /// page holding FRAGMENT_PAGE_SLOTS fragment pointers
+    static const fds_uint32_t FRAGMENT_PAGE_BITS = 12;
+    static const fds_uint32_t FRAGMENT_PAGE_SLOTS = 1 << FRAGMENT_PAGE_BITS;
+    /// Enough pages to cover every 32-bit object index
+    static const fds_uint32_t MAX_FRAGMENT_PAGES = 256;
+
+    class ObjectIterator;
+    class Snapshot;
+
+    struct FragmentPage {
+        FragmentPage();
+        std::atomic<DmOIDArrayMmap *> frags[FRAGMENT_PAGE_SLOTS];
+    };
+
+    /// One redo log record; also the format of the meta file
+    struct LogRecord {
+        fds_bool_t hasBlobMeta {false};
+        fds_bool_t blobMetaDeleted {false};
+        fds_bool_t hasVolMeta {false};
+        std::string blobName;
+        std::string blobMeta;
+        std::string volMeta;
+        std::vector<std::pair<fds_uint32_t, ObjectID>> slots;
+    };
+
     // vars
-    int metaFd_;
     int objFd_;
+    int logFd_;
     std::string dirname_;
     std::string objFilename_;
     std::string metaFilename_;
+    std::string logFilename_;
+    /// Log being checkpointed, or left over by a checkpoint that failed
+    std::string oldLogFilename_;
+
+    std::atomic<FragmentPage *> fragmentDir_[MAX_FRAGMENT_PAGES];
+    /// Size of the object file; fragments below it may be mapped on read
+    std::atomic<fds_uint64_t> objFileSize_;
+    fds_mutex fragmentLock_;
+
+    /// Serializes updates: log append and apply. Taken after checkpointLock_.
+    fds_mutex logLock_;
+    fds_uint64_t logSize_;
+    fds_uint64_t checkpointBytes_;
+    /// Serializes checkpoints, and guards oldLogExists_
+    fds_mutex checkpointLock_;
+    fds_bool_t oldLogExists_;
+
+    /// Live snapshots, guarded by logLock_
+    std::list<Snapshot *> snapshots_;
+
+    /// Serialized blob and volume descriptors, guarded by metaLock_
+    fds_mutex metaLock_;
+    std::string blobName_;
+    std::string blobMeta_;
+    std::string volMeta_;
 
-    boost::shared_ptr<SharedKvCache<fds_uint64_t, DmOIDArrayMmap> > mmapCache_;
-
-    boost::shared_ptr<BlobMetaDesc> blobMeta_;  // cached copy
-    boost::shared_ptr<serialize::Serializer> s_;
-    boost::shared_ptr<serialize::Deserializer> d_;
+    std::atomic<uint64_t> snapshotCount_;
 
-    fds_mutex cacheLock_;
-    fds_mutex metaLock_;
+    FdsConfigAccessor configHelper_;
 
     // methods
-    Error getOIDArrayMmap(fds_uint64_t id, boost::shared_ptr<DmOIDArrayMmap> & oidArrayMap,
-            fds_bool_t read = true);
+    DmOIDArrayMmap * getFragment_(fds_uint64_t id, fds_bool_t create);
+    Error getObjIndex_(fds_uint64_t offset, fds_uint32_t & objIndex) const;
+    fds_uint64_t numSlots_(const Snapshot * snap) const;
+    static void fromSnapshot_(const Snapshot * snap, fds_uint64_t objIndex, ObjectID & obj);
+    void saveForSnapshots_(fds_uint64_t objIndex, DmOIDArrayMmap * frag);
+    Error checkBlobName_(const std::string & blobName);
+    Error commit_(LogRecord & rec);
+    void apply_(const LogRecord & rec);
+    Error replayLog_();
+    Error replayLogFile_(const std::string & filename, fds_bool_t & replayed);
+    Error loadMeta_();
+    Error flush_();
+    Error checkpoint_();
+    Error checkpointQuiesced_();
+    std::string getVersionFile_();
+
+    static void encode_(const LogRecord & rec, std::string & buf);
+    static fds_bool_t decode_(const char * data, size_t len, LogRecord & rec, size_t & used);
 };
 }  // namespace fds
 #endif  // SOURCE_DATA_MGR_INCLUDE_DM_VOL_CAT_DMPERSISTVOLFILE_H_
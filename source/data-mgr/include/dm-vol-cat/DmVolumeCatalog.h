@@ -89,6 +89,12 @@ class DmVolumeCatalog : public HasModuleProvider,
      */
     Error reloadCatalog(const VolumeDesc & voldesc) override;
 
+    /**
+     * Replace the catalog of the given volume with the leveldb directory
+     * 'srcDir' (moved into place) and reopen it
+     */
+    Error replaceCatalog(const VolumeDesc & voldesc, const std::string & srcDir);
+
     /**
      * VolumeCatalogQueryIface methods. This interface is used by DM
      * processing layer to query for committed blob metadata.
@@ -347,8 +353,12 @@ class DmVolumeCatalog : public HasModuleProvider,
     expunge_objs_cb_t expungeCb_;
 
     bool _ft_newStats;
+    /// Back new block volumes with the flat offset map instead of leveldb
+    bool flatBlockCatalog_;
 
     // methods
+    bool useFlatCatalog_(const VolumeDesc & voldesc);
+
     Error statVolumeInternal(fds_volid_t volId, fds_uint64_t * volSize,
                              fds_uint64_t * blobCount, fds_uint64_t * objCount,
                              sequence_id_t * maxSeqId);
@@ -450,6 +450,16 @@ struct DmMigrationTxStateHandler : Handler {
                         Error const& e, DmRequest* dmRequest);
 };
 
+struct DmMigrationBulkCatalogHandler : Handler {
+    explicit DmMigrationBulkCatalogHandler(DataMgr& dataManager);
+    void handleRequest(boost::shared_ptr<fpi::AsyncHdr>& asyncHdr,
+                       boost::shared_ptr<fpi::CtrlNotifyBulkCatalogMsg>& message);
+    void handleQueueItem(DmRequest* dmRequest);
+    void handleResponse(boost::shared_ptr<fpi::AsyncHdr>& asyncHdr,
+                        boost::shared_ptr<fpi::CtrlNotifyBulkCatalogMsg>& message,
+                        Error const& e, DmRequest* dmRequest);
+};
+
 struct DmMigrationRequestTxStateHandler : Handler {
     explicit DmMigrationRequestTxStateHandler(DataMgr& dataManager);
     void handleRequest(boost::shared_ptr<fpi::AsyncHdr>& asyncHdr,
@@ -26,7 +26,8 @@ struct ObjectRefScanMgr;
 * -Based on cache size, recently used bloomfilters are kept in memory
 */
 struct BloomFilterStore {
-    BloomFilterStore(const std::string &path, uint32_t cacheSize, uint32_t bloomfilterBits = 1*MB);
+    BloomFilterStore(const std::string &path, uint32_t cacheSize,
+                     uint32_t bloomfilterBits = 1*MB, uint8_t bitsPerKey = 8);
     virtual ~BloomFilterStore();
     /**
     * @brief returns a refernce to stored bloomfilter.  When create is set to true
@@ -83,6 +84,8 @@ struct BloomFilterStore {
     uint32_t                                maxCacheSize;
     /* Size of each bloomfilter in bits */
     uint32_t                                bloomfilterBits;
+    /* Number of hashes per key for each bloomfilter */
+    uint8_t                                 bitsPerKey;
     /* set of bloomfilter names/keys being managed */
     std::set<std::string>                   index;
     /* bloomfilter cache */
@@ -221,6 +224,12 @@ struct ObjectRefScanMgr : HasModuleProvider, Module {
     * snapshots to scan
     */
     void prescanInit();
+    /**
+    * @brief Returns the bloomfilter size in bits for this scan cycle.  Sized from
+    * the expected number of objects per token to hit the configured false positive
+    * rate.  All filters in a cycle share the size so they can be merged.
+    */
+    uint32_t getBloomFilterBits(uint8_t &bitsPerKey);
 
     enum State {
         STOPPED,
@@ -13,11 +13,27 @@ struct JournalManager {
     JournalManager(fds::DataMgr* dm);
     virtual ~JournalManager();
     void stopMonitoring();
+    /**
+     * Replays the journal records within [fromTime, toTime] onto destCat,
+     * in file and record order. Files are decoded in parallel, a window at
+     * a time, and whole records are grouped into larger catalog updates.
+     */
     Error replayTransactions(Catalog& destCat,
                              const std::vector<std::string> &files,
                              util::TimeStamp fromTime,
                              util::TimeStamp toTime);
 
+    /**
+     * replayTransactions() with the decode window and batch size given.
+     * Records past toTime end their file only; later files are still read.
+     */
+    static Error replayJournals(Catalog& destCat,
+                                const std::vector<std::string> &files,
+                                util::TimeStamp fromTime,
+                                util::TimeStamp toTime,
+                                fds_uint32_t replayThreads,
+                                fds_uint32_t replayBatchSize);
+
     Error replayTransactions(fds_volid_t srcVolId,
                              fds_volid_t destVolId,
                              util::TimeStamp fromTime,
@@ -34,6 +50,10 @@ struct JournalManager {
     fds::DataMgr* dm;
     int inotifyFd;
     bool fStopLogMonitoring;
+    /// Journal files decoded concurrently during replay
+    fds_uint32_t replayThreads;
+    /// Writes per batch applied to the destination catalog
+    fds_uint32_t replayBatchSize;
 };
 }  // namespace timeline
 }  // namespace fds
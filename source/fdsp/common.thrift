@@ -31,6 +31,12 @@ const string PLATNET_SERVICE_NAME       = "PlatNetSvc"
 const string SM_SERVICE_NAME            = "SMSvc"
 const string STREAMING_SERVICE_NAME     = "Streaming"
 
+/**
+ * Service properties (SvcInfo.props) advertising optional protocol support.
+ * SM_PROP_PUT_BY_REF is "true" when SM honors PutObjectMsg.data_by_ref.
+ */
+const string SM_PROP_PUT_BY_REF         = "put_by_ref"
+
 enum BlobListOrder {
     UNSPECIFIED = 0,
     LEXICOGRAPHIC,
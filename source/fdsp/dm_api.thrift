@@ -607,6 +607,24 @@ struct CtrlNotifyFinishMigrationMsg {
   4: svc_types.SvcUuid       srcUuid;
 }
 
+/**
+ * Sent by the source DM on a full resync once a copy of its volume catalog
+ * has been shipped with the file transfer service. The destination DM swaps
+ * the copy in as its catalog before the catch-up delta sets arrive.
+ */
+struct CtrlNotifyBulkCatalogMsg {
+  1: i64                     volume_id;
+  2: i64                     DMT_version;
+  /* Version of the volume stored in volumeMeta */
+  3: i64                     version;
+  /* Archive name, relative to the file transfer dir */
+  4: string                  filename;
+}
+
+struct CtrlNotifyBulkCatalogRspMsg {
+  /* empty message to acknowledge the catalog was loaded */
+}
+
 /**
  *  send the snapshot of in-progress transactions (contents of the commit log)
  */
@@ -116,6 +116,10 @@ struct PutObjectMsg {
   4: i32                      	data_obj_len;
   /** Object data. */
   5: binary                   	data_obj;
+  /** Data is not sent, only add a reference to the stored object.
+   *  Fails with ERR_NOT_FOUND if the object isn't stored.
+   */
+  6: bool                       data_by_ref = false;
 }
 
 /**
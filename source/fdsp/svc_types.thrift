@@ -420,6 +420,8 @@ enum  FDSPMsgTypeId {
   CopyVolumeMsgTypeId                   = 20067;
   ArchiveMsgTypeId                      = 20068;
   ArchiveRespMsgTypeId                  = 20069;
+  CtrlNotifyBulkCatalogMsgTypeId        = 20070;
+  CtrlNotifyBulkCatalogRspMsgTypeId     = 20071;
 
 
   /* DM Debug Messages */
@@ -511,6 +513,8 @@ struct AsyncHdr {
   9: optional i32               replicaVersion = 0;
   /* Header specific for payload */
   10: optional binary           payloadHdr;
+  /* Id of the sampled request trace this message is part of.  Only set when traced */
+  11: optional i64              traceId = 0;
 }
 
 
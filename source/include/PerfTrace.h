@@ -7,6 +7,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <memory>
 #include <utility>
 #include <vector>
 #include <unordered_map>
@@ -54,6 +56,27 @@ namespace fds {
 
 extern const std::string PERF_COUNTERS_NAME;
 
+/**
+ * Counter of one event type, volume and name, see PerfTracer::counterHandle().
+ * Updates through a handle go to per cpu cells of the counter slots it points
+ * to, which are summed up when the counters are exported.
+ */
+struct PerfCounterHandle {
+    PerfCounterHandle(const PerfEventType & type_, fds_volid_t volid_,
+                      std::string const& name_, int32_t aggregateSlot_)
+            : type(type_), volid(volid_), name(name_),
+              aggregateSlot(aggregateSlot_), namedSlot(-1) {}
+
+    PerfEventType type;
+    fds_volid_t volid;
+    std::string name;
+    /* Slot of the counter per type and volume */
+    int32_t aggregateSlot;
+    /* Slot of the counter per type, volume and name, -1 unless the name
+     * filter matched name */
+    std::atomic<int32_t> namedSlot;
+};
+
 /**
  * Per module (SM/DM/SH) performance tracer
  *
@@ -77,6 +100,18 @@ public:
     static void decr(const PerfEventType & type, fds_volid_t volid, uint64_t val,
             std::string name = "");
 
+    /**
+     * Returns the handle of the counter for type, volid and name.  Handles live
+     * as long as the tracer does.  Updating through a handle skips the handle
+     * lookup the calls above do, so hot paths can register theirs upfront.
+     */
+    static PerfCounterHandle * counterHandle(const PerfEventType & type,
+            fds_volid_t volid, std::string const& name = "");
+
+    // Same as the calls above, for a registered counter
+    static void incr(PerfCounterHandle * handle, uint64_t val = 1, uint64_t cnt = 0);
+    static void decr(PerfCounterHandle * handle, uint64_t val = 1);
+
 
     // For LatencyCounters
     /**
@@ -114,6 +149,44 @@ public:
     static void refresh();
 
 private:
+    class ExportedCounters;
+
+    struct CounterKey {
+        PerfEventType type;
+        fds_volid_t volid;
+        std::string name;
+
+        bool operator==(const CounterKey & rhs) const {
+            return type == rhs.type && volid == rhs.volid && name == rhs.name;
+        }
+    };
+
+    struct CounterKeyHash {
+        size_t operator()(const CounterKey & key) const {
+            return std::hash<uint64_t>()(key.volid.get()) * 31 +
+                    fds_enum::get_index<PerfEventType>(key.type) * 7 +
+                    std::hash<std::string>()(key.name);
+        }
+    };
+
+    // Per cpu values of a counter slot, folded into its exported counter
+    struct CounterCell {
+        std::atomic<uint64_t> val;
+        std::atomic<uint64_t> cnt;
+        std::atomic<uint64_t> min;
+        std::atomic<uint64_t> max;
+    };
+
+    struct CounterSlot {
+        CounterKey key;
+        // Created on the first export that finds the slot updated
+        std::unique_ptr<FdsBaseCounter> exported;
+    };
+
+    /* Cells are allocated CHUNK_SLOTS slots at a time, in a chunk holding
+     * those slots' cells of cpu 0, then of cpu 1 and so on */
+    static const uint32_t CHUNK_SLOTS = 256;
+    static const uint32_t MAX_CHUNKS = 4096;
 
     typedef std::unordered_map<std::string, PerfContext *> PerfContextMap;
     PerfContextMap latencyMap_;
@@ -122,13 +195,14 @@ private:
     // all the counters
     boost::shared_ptr<FdsCounters> exportedCounters;
 
-    std::vector<std::unordered_map<fds_volid_t, PerfContext>> aggregateCounters_;
-    fds_mutex ptrace_mutex_aggregate_;   // only for aggregate
-
-    std::vector<std::unordered_map<fds_volid_t, PerfContextMap>> namedCounters_;
-    fds_mutex ptrace_mutex_named_; // only for namedCounters_
+    uint32_t numCpus_;
+    std::atomic<CounterCell *> cellChunks_[MAX_CHUNKS];
 
-    fds_mutex ptrace_mutex_; 
+    // Registered handles and slots, only for registry_mutex_ holders
+    std::unordered_map<CounterKey, PerfCounterHandle *, CounterKeyHash> handles_;
+    std::unordered_map<CounterKey, int32_t, CounterKeyHash> slotIds_;
+    std::vector<CounterSlot> slots_;
+    fds_mutex registry_mutex_;
 
     /*
      * configuration
@@ -140,7 +214,8 @@ private:
     std::bitset<fds_enum::get_size<PerfEventType>()> eventsFilter_;
     bool useEventsFilter_;
 
-    // events filter for event name
+    // events filter for event name, written holding registry_mutex_ and
+    // applied when handles are registered
     boost::regex nameFilter_;
     bool useNameFilter_;
 
@@ -157,16 +232,28 @@ private:
 
     void reconfig();
 
-    void updateCounter(PerfContext & ctx, const PerfEventType & type, 
-                const uint64_t & val, const uint64_t cnt,  const fds_volid_t volid, 
-                const std::string& name);
+    // handle for type, volid and name, cached per thread
+    PerfCounterHandle * lookup(const PerfEventType & type, fds_volid_t volid,
+            const std::string & name);
+    PerfCounterHandle * registerHandle(const PerfEventType & type, fds_volid_t volid,
+            const std::string & name);
+    // slot of the counter for key, registry_mutex_ held
+    int32_t slot(const CounterKey & key);
+    int32_t namedSlot(const PerfCounterHandle & handle);
+
+    inline CounterCell & cell(int32_t slot, uint32_t cpu) {
+        CounterCell * chunk = cellChunks_[slot / CHUNK_SLOTS].load(std::memory_order_acquire);
+        return chunk[cpu * CHUNK_SLOTS + slot % CHUNK_SLOTS];
+    }
+
+    void update(const PerfCounterHandle & handle, uint64_t val, uint64_t cnt);
+    void updateSlot(int32_t slot, uint32_t cpu, uint64_t val, uint64_t cnt);
+    void decrement(const PerfCounterHandle & handle, uint64_t val);
 
-    // update & insert (if counter is not present)
-    void upsert(const PerfEventType & type, fds_volid_t volid, uint64_t val, 
-            uint64_t cnt, const std::string & name);
+    // folds the per cpu cells into the exported counters, children of counterParent
+    void aggregate(FdsCounters * counterParent);
 
-    void decrement(const PerfEventType & type, fds_volid_t volid, 
-            uint64_t val, const std::string & name);
+    static inline bool isFiltered(const PerfEventType & type);
     static inline PerfTracer & instance();
 };
 
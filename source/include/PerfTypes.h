@@ -101,6 +101,18 @@ DEFINE_ENUM_WITH_STRING_CONVERSIONS(PerfEventType,
     (AM_DESC_CACHE_HIT)         /* AM descriptor cache hits */
     (AM_OFFSET_CACHE_HIT)       /* AM offset cache hits */
     (AM_OBJECT_CACHE_HIT)       /* AM object cache hits */
+    (AM_ZERO_ELIDED_BYTES)      /* Bytes of all-zero block writes not sent to SM */
+    (AM_READAHEAD_OBJS)         /* AM objects read ahead of sequential streams */
+    (AM_READAHEAD_HIT)          /* AM read ahead objects that were then read */
+    (AM_READAHEAD_WASTE)        /* AM read ahead objects that never were */
+    (AM_PUT_BY_REF)             /* AM object puts sent as a reference */
+    (AM_PUT_BY_REF_MISS)        /* AM reference puts that had to send data */
+    (AM_NBD_TASK_REUSED)        /* NBD requests served by a task off the ring */
+    (AM_NBD_TASK_ALLOC)         /* NBD requests that had to allocate a task */
+    (AM_ADMISSION_QUEUE_DELAY)  /* Time AM requests waited for admission and QoS */
+    (AM_ADMISSION_SERVICE_TIME) /* Time AM requests took once dispatched by QoS */
+    (AM_ADMISSION_LIMIT)        /* AM requests a volume may have in QoS at once */
+    (AM_ADMISSION_REJECTED)     /* AM requests rejected with the admission queue full */
 
     // Data Manager
     (DM_TX_OP_ERR)              /* DM IO number of errors */
@@ -7,6 +7,10 @@
 #include <vector>
 #include <queue>
 #include <memory>
+#include <string>
+#include <typeinfo>
+#include <type_traits>
+#include <utility>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -29,6 +33,76 @@
 namespace fds {
 typedef std::function<void()> LockFreeTask;
 struct LFMQThreadpool;
+struct LFTaskCache;
+
+/**
+* @brief Task scheduled on LFMQThreadpool.  The callable is kept inline when it fits
+* in INLINE_BYTES, and tasks come from and go back to per-thread caches (LFTaskCache),
+* so scheduling doesn't allocate once the caches are warm.
+*/
+struct LFTask {
+    static const size_t INLINE_BYTES = 64;
+
+    /* Takes a task from the calling thread's cache */
+    static LFTask* alloc();
+    /* Destroys the callable and returns the task to the cache it came from */
+    static void free(LFTask *task);
+
+    template <class F>
+    void set(F &&f)
+    {
+        typedef typename std::decay<F>::type Fn;
+        if (sizeof(Fn) <= INLINE_BYTES && alignof(Fn) <= alignof(Storage)) {
+            fn_ = new (&storage_) Fn(std::forward<F>(f));
+            destroy_ = &destroyInlineFn_<Fn>;
+        } else {
+            fn_ = new Fn(std::forward<F>(f));
+            destroy_ = &destroyHeapFn_<Fn>;
+        }
+        invoke_ = &invokeFn_<Fn>;
+        type_ = &typeid(Fn);
+    }
+
+    inline void operator()() { invoke_(fn_); }
+    inline const char* name() const { return type_->name(); }
+
+ protected:
+    typedef std::aligned_storage<INLINE_BYTES>::type Storage;
+
+    template <class Fn> static void invokeFn_(void *fn) { (*static_cast<Fn*>(fn))(); }
+    template <class Fn> static void destroyInlineFn_(void *fn) { static_cast<Fn*>(fn)->~Fn(); }
+    template <class Fn> static void destroyHeapFn_(void *fn) { delete static_cast<Fn*>(fn); }
+
+    Storage                                 storage_;
+    void                                    *fn_ {nullptr};
+    void                                    (*invoke_)(void*) {nullptr};
+    void                                    (*destroy_)(void*) {nullptr};
+    const std::type_info                    *type_ {nullptr};
+    /* Cache the task goes back to, and link while in it */
+    LFTaskCache                             *owner_ {nullptr};
+    LFTask                                  *next_ {nullptr};
+    friend struct LFTaskCache;
+};
+
+/**
+* @brief Free LFTasks of a thread.  The thread takes and returns tasks on its own
+* list without synchronization; tasks freed by other threads, typically the workers
+* that ran them, are pushed on a lock free list the owner takes over when its own
+* runs out.  Caches outlive their threads and are handed to the next thread started.
+*/
+struct LFTaskCache {
+    LFTask* alloc();
+    void free(LFTask *task);
+
+    /* The calling thread's cache */
+    static LFTaskCache* local();
+
+ protected:
+    LFTask                                  *free_ {nullptr};
+    std::atomic<LFTask*>                    remoteFree_ {nullptr};
+    LFTaskCache                             *nextUnowned_ {nullptr};
+    friend struct LFTaskCacheOwner;
+};
 
 
 // futex provides a kernel facitility to wait for a value at a given address to
@@ -57,56 +131,100 @@ struct LockfreeWorker {
     };
     LockfreeWorker(LFMQThreadpool *parent,
                    const std::string &threadpoolId,
-                   bool steal, std::vector<LockfreeWorker*> &peers);
+                   bool steal, std::vector<LockfreeWorker*> &peers,
+                   int cpu = -1);
     void start();
     void finish();
-    void enqueue(LockFreeTask *t);
+    /* Pinned tasks run on this worker, others may be stolen by idle peers */
+    void enqueue(LFTask *t, bool pinned = false);
     void workLoop();
     std::string logString() const;
 
     // This should be cache line size aligned to avoid false sharing.
-    alignas(64) int                         queueCnt = 0;
+    /* Tasks queued, in both queues */
+    alignas(64) std::atomic<int>            queueCnt;
+    /* Roughly the tasks in tasks, those peers could steal */
+    std::atomic<int>                        stealableCnt;
+    /* Set while the worker has nothing to run, and may be sleeping on wakeWord */
+    std::atomic<bool>                       idle;
+    /* Futex the worker sleeps on, bumped to wake it */
+    int                                     wakeWord;
 
     /* Combination of threadpool id and thread id */
     LFMQThreadpool                          *parent_; 
     std::string                             id_;
     bool                                    steal_;
     std::vector<LockfreeWorker*>            &peers_;
-    State                                   state_;
-    // the task queue
-    boost::lockfree::queue<LockFreeTask*>   tasks;
+    std::atomic<State>                      state_;
+    /* Cpu the thread is pinned to, -1 if not */
+    int                                     cpu_;
+    /* Our index in peers_, where we start looking for tasks to steal */
+    uint32_t                                index_;
+    // the task queues
+    boost::lockfree::queue<LFTask*>         tasks;
+    boost::lockfree::queue<LFTask*>         pinnedTasks;
 
     std::thread*                            worker;
     /* Counters */
     uint64_t                                completedCntr;
+    uint64_t                                stolenCntr;
     /* = -1 means thread is idle; >= 0 indicates thread is busy and the value
      * held is couner value when last thread check was run
      */
     int64_t                                 threadCheckCntr;
+
+    /* Wakes the worker if it's sleeping */
+    void wake();
+
+ protected:
+    /* Claims one of the queued tasks, so the pop that follows can't come up empty */
+    bool reserve_();
+    LFTask* popReserved_();
+    bool canSteal_() const;
+    LFTask* stealFromPeers_();
+    void runTask_(LFTask *task);
 };
 
 /**
 * @brief Lockfree threadpool implementation that uses multiple queues, single queue
 * per thread.
+*
+* Tasks are placed on the less loaded of two workers picked round robin.  With
+* steal set, workers that run out of tasks take unpinned ones off busy peers, and
+* are woken to do so when tasks queue up behind a busy worker.  Tasks scheduled
+* with affinity always run on the worker the affinity maps to.
+*
+* Worker threads can be pinned to cpus, e.g. those of a numa node (see
+* numaNodeCpus()), worker i to cpus[i % cpus.size()].
 */
 struct LFMQThreadpool {
-    LFMQThreadpool(const std::string &id, uint32_t sz, bool steal = false);
-    LFMQThreadpool(uint32_t sz, bool steal = false);
+    LFMQThreadpool(const std::string &id, uint32_t sz, bool steal = true,
+                   const std::vector<int> &cpus = std::vector<int>());
+    LFMQThreadpool(uint32_t sz, bool steal = true);
     ~LFMQThreadpool();
     void stop();
     template <class F, class... Args>
     void schedule(F&& f, Args&&... args)
     {
-        int i = idx++ % workers.size();
-        auto b = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-        workers[i]->enqueue(new LockFreeTask(b));
+        uint32_t n = workers.size();
+        uint32_t i = idx.fetch_add(1, std::memory_order_relaxed) % n;
+        /* Of this worker and the one half way round, take the less loaded */
+        uint32_t j = (i + n / 2) % n;
+        if (workers[j]->queueCnt.load(std::memory_order_relaxed) <
+            workers[i]->queueCnt.load(std::memory_order_relaxed)) {
+            i = j;
+        }
+        auto t = LFTask::alloc();
+        t->set(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        workers[i]->enqueue(t);
     }
     template <class F, class... Args>
     void scheduleWithAffinity(uint64_t affin, F&& f, Args&&... args)
     {
         uint32_t idx = affin % workers.size();
-        workers[idx]->enqueue(
-                new LockFreeTask(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+        auto t = LFTask::alloc();
+        t->set(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        workers[idx]->enqueue(t, true);
     }
     /* Use this function to catch cases where long running/blocking
      * task is blocking thread in the threadpool
@@ -124,10 +242,21 @@ struct LFMQThreadpool {
         return workers[affinity % workers.size()]->worker->get_id();
     }
 
+    /**
+    * @brief Parses a cpu list such as "0-3,8,10-11".  Returns no cpus when malformed
+    */
+    static std::vector<int> parseCpuList(const std::string &cpuList);
+
+    /**
+    * @brief Returns the cpus of a numa node, none when there is no such node
+    */
+    static std::vector<int> numaNodeCpus(int node);
 
     std::vector<LockfreeWorker*>            workers;
-    int                                     idx;
+    std::atomic<uint32_t>                   idx;
     int64_t                                 threadCheckCntr;
+    /* Workers idle, to skip looking for one to steal when there are none */
+    std::atomic<int>                        idleCnt;
 };
 
 typedef std::thread LFSQWorker;
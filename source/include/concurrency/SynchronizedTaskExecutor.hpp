@@ -5,21 +5,49 @@
 #define SOURCE_INCLUDE_SYNCHRONIZED_TASK_EXECUTOR_H_
 
 #include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <unordered_map>
-#include <deque>
 #include <mutex>
 #include <utility>
+#include <vector>
 #include <concurrency/ThreadPool.h>
 
 namespace fds {
 
+/**
+ * Runs tasks scheduled on the same key one at a time, in the order they reach
+ * the executor, while tasks on different keys run in parallel.
+ *
+ * Keys are spread over shards, each with its own lock and queue maps, so
+ * scheduling and completing tasks on unrelated keys doesn't contend on one
+ * lock.  A key's queue is an intrusive list of task nodes; the first task on
+ * an idle key runs without being queued at all.
+ */
 template <class KeyT>
 class SynchronizedTaskExecutor
 {
  public:
     typedef std::function<void ()>TaskT;
+
+    static const uint32_t DEFAULT_SHARDS = 64;
+
+    /* Counters summed over all shards */
+    struct ContentionStats {
+        /* Times a shard lock was taken */
+        uint64_t acquisitions;
+        /* Times a shard lock was already held by someone else */
+        uint64_t contended;
+        /* Tasks queued behind a running task with the same key */
+        uint64_t queued;
+        /* Two key tasks that had to wait for the second key's queue */
+        uint64_t waits;
+    };
+
     SynchronizedTaskExecutor(fds_threadpool &tp);
-    SynchronizedTaskExecutor(fds_threadpool &tp, bool useAffinity);
+    SynchronizedTaskExecutor(fds_threadpool &tp, bool useAffinity,
+                             uint32_t shards = DEFAULT_SHARDS);
     ~SynchronizedTaskExecutor();
 
     void scheduleOnTemplateKey(const KeyT &k, const TaskT &task);
@@ -30,39 +58,107 @@ class SynchronizedTaskExecutor
     void runHashKey_(const size_t &k, const TaskT &task);
     void runHashKeys_(const size_t &k1, const size_t &k2, const TaskT &task);
 
+    ContentionStats getContentionStats();
+
  protected:
+    /* Free nodes kept around by each shard */
+    static const uint32_t FREE_NODES_MAX = 64;
+
+    struct TaskNode {
+        TaskT task;
+        TaskNode *next;
+    };
+
+    /**
+     * Tasks waiting behind the running task of a key.  The key being in its
+     * shard's map means a task with that key is running.
+     */
+    struct TaskQueue {
+        TaskNode *head {nullptr};
+        TaskNode *tail {nullptr};
+
+        void push(TaskNode *node) {
+            node->next = nullptr;
+            if (tail) {
+                tail->next = node;
+            } else {
+                head = node;
+            }
+            tail = node;
+        }
+        TaskNode *pop() {
+            auto node = head;
+            if (node) {
+                head = node->next;
+                if (!head) {
+                    tail = nullptr;
+                }
+            }
+            return node;
+        }
+    };
+
+    struct Shard {
+        /* Lock around everything below */
+        std::mutex lock;
+        /* Notification around finishing a queue, for two key tasks */
+        std::condition_variable queueFinished;
+        uint32_t waiters {0};
+
+        /**
+         * Depending upon the requirements of the task as determined by
+         * the task builder, either the templateKeyQueues will be used
+         * to serialize tasks or the hashKeyQueues will be used.
+         */
+        std::unordered_map<KeyT, TaskQueue> templateKeyQueues;
+        std::unordered_map<size_t, TaskQueue> hashKeyQueues;
+
+        TaskNode *freeNodes {nullptr};
+        uint32_t freeCnt {0};
+
+        uint64_t acquisitions {0};
+        uint64_t contended {0};
+        uint64_t queued {0};
+        uint64_t waits {0};
+
+        /* Keep neighbouring shards off each other's cache lines */
+        char pad[64];
+    };
+
+    Shard &shard_(size_t hash) {
+        /* Hash keys may well be small integers, spread them before masking */
+        return *shards_[((hash * 0x9E3779B97F4A7C15ULL) >> 32) & shardMask_];
+    }
+    void lockShard_(Shard &shard);
+    TaskNode *allocNode_(Shard &shard, const TaskT &task);
+    void freeNode_(Shard &shard, TaskNode *node);
+
+    template <class MapT>
+    void run_(Shard &shard, MapT &queues, const typename MapT::key_type &k, const TaskT &task);
+
     /* Threadpool to execute task functions */
     fds_threadpool &threadpool_;
 
-    /* When set, each task is given a thread affinity.  The task is only run by 
+    /* When set, each task is given a thread affinity.  The task is only run by
      * a thread with particular id
      */
     bool useAffinity_;
 
-    /* Lock around task maps */
-    std::mutex lock_;
-
-    /* Notification around finishing a queue */
-    std::condition_variable queue_finished_;
-
-    /**
-     * Depending upon the requirements of the task as determined by
-     * the task builder, either the templateKeyTaskMap_ will be used
-     * to serialize tasks or the hashKeyTaskMap_ will be used. The
-     * default is the templateKeyTaskMap_.
-     *
-     * If you would rather not serialize your tasks or incur the hit
-     * for task serialization infrustructure, your SOL for now.
-     */
-    /* Map of task qs based on KeyT values. */
-    std::unordered_map<KeyT, std::deque<TaskT>> templateKeyTaskMap_;
-    /* Map of task qs based on hash values. */
-    std::unordered_map<size_t, std::deque<TaskT>> hashKeyTaskMap_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    size_t shardMask_;
 
  private:
-    void runLoop_(const size_t &k, const SynchronizedTaskExecutor::TaskT &task);
+    template <class MapT>
+    void runLoop_(Shard &shard, MapT &queues, const typename MapT::key_type &k,
+                  TaskQueue &sameKeyTasks, const TaskT &task);
 };
 
+template <class KeyT>
+const uint32_t SynchronizedTaskExecutor<KeyT>::DEFAULT_SHARDS;
+
+template <class KeyT>
+const uint32_t SynchronizedTaskExecutor<KeyT>::FREE_NODES_MAX;
+
 template <class KeyT>
 SynchronizedTaskExecutor<KeyT>::SynchronizedTaskExecutor(fds_threadpool &tp)
 : SynchronizedTaskExecutor<KeyT>(tp, true)
@@ -71,15 +167,83 @@ SynchronizedTaskExecutor<KeyT>::SynchronizedTaskExecutor(fds_threadpool &tp)
 
 template <class KeyT>
 SynchronizedTaskExecutor<KeyT>::SynchronizedTaskExecutor(
-    fds_threadpool &tp, bool useAffinity)
+    fds_threadpool &tp, bool useAffinity, uint32_t shards)
 : threadpool_(tp),
     useAffinity_(useAffinity)
 {
+    /* Round up to a power of 2 so a shard is picked with a mask */
+    size_t cnt = 1;
+    while (cnt < shards) {
+        cnt <<= 1;
+    }
+    shardMask_ = cnt - 1;
+    for (size_t i = 0; i < cnt; i++) {
+        shards_.emplace_back(new Shard());
+    }
 }
 
 template <class KeyT>
 SynchronizedTaskExecutor<KeyT>::~SynchronizedTaskExecutor()
 {
+    for (auto &shard : shards_) {
+        while (shard->freeNodes) {
+            auto node = shard->freeNodes;
+            shard->freeNodes = node->next;
+            delete node;
+        }
+    }
+}
+
+template <class KeyT>
+void SynchronizedTaskExecutor<KeyT>::lockShard_(Shard &shard)
+{
+    if (!shard.lock.try_lock()) {
+        shard.lock.lock();
+        ++shard.contended;
+    }
+    ++shard.acquisitions;
+}
+
+template <class KeyT>
+typename SynchronizedTaskExecutor<KeyT>::TaskNode *
+SynchronizedTaskExecutor<KeyT>::allocNode_(Shard &shard, const TaskT &task)
+{
+    auto node = shard.freeNodes;
+    if (node) {
+        shard.freeNodes = node->next;
+        --shard.freeCnt;
+        node->task = task;
+    } else {
+        node = new TaskNode{task, nullptr};
+    }
+    return node;
+}
+
+template <class KeyT>
+void SynchronizedTaskExecutor<KeyT>::freeNode_(Shard &shard, TaskNode *node)
+{
+    if (shard.freeCnt < FREE_NODES_MAX) {
+        node->next = shard.freeNodes;
+        shard.freeNodes = node;
+        ++shard.freeCnt;
+    } else {
+        delete node;
+    }
+}
+
+template <class KeyT>
+typename SynchronizedTaskExecutor<KeyT>::ContentionStats
+SynchronizedTaskExecutor<KeyT>::getContentionStats()
+{
+    ContentionStats stats {0, 0, 0, 0};
+    for (auto &shard : shards_) {
+        std::lock_guard<std::mutex> g(shard->lock);
+        stats.acquisitions += shard->acquisitions;
+        stats.contended += shard->contended;
+        stats.queued += shard->queued;
+        stats.waits += shard->waits;
+    }
+    return stats;
 }
 
 template <class KeyT>
@@ -88,7 +252,7 @@ scheduleOnTemplateKey(const KeyT &k, const SynchronizedTaskExecutor::TaskT &task
 {
     if (useAffinity_) {
         std::hash<KeyT> kHash;
-        threadpool_.scheduleWithAffinity(kHash(), task);
+        threadpool_.scheduleWithAffinity(kHash(k), task);
     } else {
         threadpool_.schedule(&SynchronizedTaskExecutor<KeyT>::runTemplateKey_, this, k, task);
     }
@@ -98,39 +262,9 @@ template <class KeyT>
 void SynchronizedTaskExecutor<KeyT>::
 runTemplateKey_(const KeyT &k, const SynchronizedTaskExecutor::TaskT &task)
 {
-    lock_.lock();
-    auto itr = templateKeyTaskMap_.find(k);
-    if (itr == templateKeyTaskMap_.end()) {
-        /* No oustanding tasks with same id.  Start a new queue for incoming tasks with same id */
-        const SynchronizedTaskExecutor::TaskT *taskP = &task;
-        auto insRes = templateKeyTaskMap_.insert(std::make_pair(k, std::deque<SynchronizedTaskExecutor::TaskT>()));
-        auto &sameIdTasks = insRes.first->second;
-        sameIdTasks.push_back(task);
-        lock_.unlock();
-
-        /* Execute tasks with same id in this loop */
-        while (true) {
-
-            (*taskP)();
-
-            std::lock_guard<std::mutex> g(lock_);
-            sameIdTasks.pop_front();
-            if (sameIdTasks.size() == 0) {
-                /* No more tasks with same id left.  Exit */
-                templateKeyTaskMap_.erase(k);
-                break;
-            } else {
-                /* More tasks were added with same id while we were executing this task.
-                 * Move onto the next task
-                 */
-                taskP = &(sameIdTasks.front());
-            }
-        }
-    } else {
-        /* We have outstanding tasks with same id.  Add this task to that queue */
-        itr->second.push_back(task);
-        lock_.unlock();
-    }
+    std::hash<KeyT> kHash;
+    auto &shard = shard_(kHash(k));
+    run_(shard, shard.templateKeyQueues, k, task);
 }
 
 template <class KeyT>
@@ -148,15 +282,8 @@ template <class KeyT>
 void SynchronizedTaskExecutor<KeyT>::
 runHashKey_(const size_t &k, const SynchronizedTaskExecutor::TaskT &task)
 {
-    lock_.lock();
-    auto itr = hashKeyTaskMap_.find(k);
-    if (itr == hashKeyTaskMap_.end()) {
-        runLoop_(k, task);
-    } else {
-        /* We have outstanding tasks with same id.  Add this task to that queue */
-        itr->second.push_back(task);
-        lock_.unlock();
-    }
+    auto &shard = shard_(k);
+    run_(shard, shard.hashKeyQueues, k, task);
 }
 
 template <class KeyT>
@@ -170,48 +297,92 @@ template <class KeyT>
 void SynchronizedTaskExecutor<KeyT>::
 runHashKeys_(const size_t &k1, const size_t &k2, const SynchronizedTaskExecutor::TaskT &task)
 {
+    if (k1 == k2) {
+        runHashKey_(k1, task);
+        return;
+    }
+    /* Run on k1's queue, and once there, also take over k2's queue.  The task
+     * may be queued and run after we return, so it captures by value.
+     */
     runHashKey_(k1,
-                [this, &k1, &k2, &task] () mutable -> void {
-                    auto lock = std::unique_lock<std::mutex>(lock_);
-                    queue_finished_.wait(lock,
-                                         [this, k2] () -> bool {
-                                            return hashKeyTaskMap_.end() == hashKeyTaskMap_.find(k2);
-                                         });
-                    runLoop_(k2, task);
+                [this, k2, task] () -> void {
+                    auto &shard = shard_(k2);
+                    lockShard_(shard);
+                    std::unique_lock<std::mutex> lock(shard.lock, std::adopt_lock);
+                    auto &queues = shard.hashKeyQueues;
+                    if (queues.end() != queues.find(k2)) {
+                        ++shard.waits;
+                        ++shard.waiters;
+                        shard.queueFinished.wait(lock,
+                                                 [&queues, k2] () -> bool {
+                                                    return queues.end() == queues.find(k2);
+                                                 });
+                        --shard.waiters;
+                    }
+                    auto &sameKeyTasks = queues[k2];
+                    lock.unlock();
+                    runLoop_(shard, queues, k2, sameKeyTasks, task);
                 });
 }
 
 template <class KeyT>
+template <class MapT>
 void SynchronizedTaskExecutor<KeyT>::
-runLoop_(const size_t &k, const SynchronizedTaskExecutor::TaskT &task) {
-    /* No oustanding tasks with same hash.  Start a new queue for incoming tasks with same hash. */
-    const SynchronizedTaskExecutor::TaskT *taskP = &task;
-    auto insRes = hashKeyTaskMap_.insert(std::make_pair(k, std::deque<SynchronizedTaskExecutor::TaskT>()));
-    auto &sameHashTasks = insRes.first->second;
-    sameHashTasks.push_back(task);
-    lock_.unlock();
-
-    /* Execute tasks with same id in this loop */
-    while (true) {
-
-        (*taskP)();
+run_(Shard &shard, MapT &queues, const typename MapT::key_type &k,
+     const SynchronizedTaskExecutor::TaskT &task)
+{
+    lockShard_(shard);
+    auto itr = queues.find(k);
+    if (itr != queues.end()) {
+        /* We have outstanding tasks with same key.  Add this task to that queue */
+        itr->second.push(allocNode_(shard, task));
+        ++shard.queued;
+        shard.lock.unlock();
+        return;
+    }
+    /* No oustanding tasks with same key.  Start a new queue for incoming tasks with same key */
+    auto &sameKeyTasks = queues[k];
+    shard.lock.unlock();
+    runLoop_(shard, queues, k, sameKeyTasks, task);
+}
 
-        std::lock_guard<std::mutex> g(lock_);
-        sameHashTasks.pop_front();
-        if (sameHashTasks.size() == 0) {
-            /* No more tasks with same id left.  Exit */
-            hashKeyTaskMap_.erase(k);
+template <class KeyT>
+template <class MapT>
+void SynchronizedTaskExecutor<KeyT>::
+runLoop_(Shard &shard, MapT &queues, const typename MapT::key_type &k,
+         TaskQueue &sameKeyTasks, const SynchronizedTaskExecutor::TaskT &task)
+{
+    /* Execute tasks with same key in this loop.  References to map elements
+     * stay valid across rehashing, and only this loop erases the key.
+     */
+    task();
+    TaskNode *done = nullptr;
+    while (true) {
+        lockShard_(shard);
+        if (done) {
+            freeNode_(shard, done);
+        }
+        auto node = sameKeyTasks.pop();
+        if (!node) {
+            /* No more tasks with same key left.  Exit */
+            queues.erase(k);
+            bool notify = shard.waiters > 0;
+            shard.lock.unlock();
+            if (notify) {
+                shard.queueFinished.notify_all();
+            }
             break;
-        } else {
-            /* More tasks were added with same id while we were executing this task.
-             * Move onto the next task
-             */
-            taskP = &(sameHashTasks.front());
         }
+        /* More tasks were added with same key while we were executing this task.
+         * Move onto the next task
+         */
+        shard.lock.unlock();
+        node->task();
+        /* Drop whatever the task captured outside of the lock */
+        node->task = nullptr;
+        done = node;
     }
-    queue_finished_.notify_all();
 }
 
 }  // namespace fds
 #endif  // SOURCE_INCLUDE_SYNCHRONIZED_TASK_EXECUTOR_H_
-
@@ -5,6 +5,7 @@
 #ifndef INCLUDE_CONCURRENCY_THREADPOOL_H_
 #define INCLUDE_CONCURRENCY_THREADPOOL_H_
 
+#include <vector>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
@@ -118,9 +119,11 @@ class fds_threadpool : boost::noncopyable
     void stop();
 
     /*
-     * Create the threadpool with specified id, number of thread.
+     * Create the threadpool with specified id, number of thread.  With lftp, the
+     * threads may be pinned to cpus, see LFMQThreadpool.
      */
-    fds_threadpool(const std::string &id, int num_thr = 10, bool use_lftp = true);
+    fds_threadpool(const std::string &id, int num_thr = 10, bool use_lftp = true,
+                   const std::vector<int> &cpus = std::vector<int>());
 
     /*
      * Create the threadpool with specified number of thread.
@@ -66,6 +66,7 @@ public:
     std::string export_as_graphite();
     void export_to_ostream(std::ostream &stream);
     void toMap(std::map<std::string, int64_t>& m);
+    bool toMap(const std::string &id, std::map<std::string, int64_t>& m);
     void reset();
 
     /* Status provider methods */
@@ -113,6 +114,13 @@ public:
 
     void reset();
 
+    /**
+     * Brings the exported counters up to date.  Invoked by the counter manager
+     * before exporting, for counters that are updated somewhere else and only
+     * summed up on export.  Counters may be added for export meanwhile.
+     */
+    virtual void aggregate() {}
+
 protected:
     void add_for_export(FdsBaseCounter* cp);
 
@@ -234,6 +242,10 @@ public:
 
     virtual LatencyCounter & operator +=(const LatencyCounter & rhs);
 
+    /* Adds cnt updates of total_latency, min and max of which were given */
+    void merge(const uint64_t &total_latency, uint64_t cnt,
+               uint64_t min_latency, uint64_t max_latency);
+
     inline double latency() const {
         uint64_t cnt = count();
         if (!cnt) {
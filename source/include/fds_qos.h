@@ -17,6 +17,7 @@
 #include <util/timeutils.h>
 #include "qos_ctrl.h"
 #include "PerfTrace.h"
+#include "fds_trace.h"
 
 #include "EclipseWorkarounds.h"
 
@@ -244,6 +245,11 @@ namespace fds {
             fds_uint32_t n_pios = 0;
 
             io->enqueue_ts = util::getTimeStampNanos();
+            if (!io->trace_id) {
+                io->trace_id = RequestTracer::current();
+            }
+            RequestTracer::record(io->trace_id, TraceStage::QOS_ENQUEUE,
+                                  io->io_type, io->enqueue_ts);
 
             qda_lock.read_lock();
             if (queue_map.count(queue_id) == 0) {
@@ -272,6 +278,7 @@ namespace fds {
             qda_lock.read_unlock();
 
             if (bypass_dispatcher == true) {
+                RequestTracer::record(io->trace_id, TraceStage::QOS_DISPATCH, io->io_type);
                 try {
                     parent_ctrlr->processIO(io);
                 } catch (const std::exception &e) {
@@ -417,34 +424,12 @@ namespace fds {
 
                 qda_lock.read_unlock();
 
-                io->dispatch_ts = util::getTimeStampNanos();
-
                 n_pios = 0;
                 n_pios = atomic_fetch_sub(&(num_pending_ios), (unsigned int)1);
                 // assert(n_pios >= 1);
+                LOGTRACE << "Dispatcher: # of pending ios = " << n_pios-1;
 
-                n_oios = 0;
-                n_oios = atomic_fetch_add(&(num_outstanding_ios), (unsigned int)1);
-
-                LOGTRACE << "Dispatcher: dispatchIO from queue 0x"
-                         << std::hex << queue_id << std::dec
-                         << " : # of outstanding ios = " << n_oios+1
-                         << " : # of pending ios = " << n_pios-1;
-                // assert(n_oios >= 0);
-
-                try {
-                    parent_ctrlr->processIO(io);
-                } catch (const std::exception &e) {
-                    LOGWARN << "exception:" << e.what()
-                        << " queue_id:" << queue_id
-                        << " type:" << io->io_type
-                        << " on processio.  ignoring...";
-                } catch (...) {
-                    LOGWARN << "exception:unknown"
-                        << " queue_id:" << queue_id
-                        << " type:" << io->io_type
-                        << " on processio.  ignoring...";
-                }
+                dispatchIO(queue_id, io);
             }
 
             LOGNOTIFY << "Exiting qos dispatcher thread.  " << err;
@@ -452,6 +437,35 @@ namespace fds {
             return err;
         }
 
+        // Hand an IO taken off its queue to the control for processing
+        void dispatchIO(fds_qid_t queue_id, FDS_IOType *io)
+        {
+            io->dispatch_ts = util::getTimeStampNanos();
+            RequestTracer::record(io->trace_id, TraceStage::QOS_DISPATCH,
+                                  io->io_type, io->dispatch_ts);
+
+            fds_uint32_t n_oios = atomic_fetch_add(&(num_outstanding_ios), (unsigned int)1);
+
+            LOGTRACE << "Dispatcher: dispatchIO from queue 0x"
+                     << std::hex << queue_id << std::dec
+                     << " : # of outstanding ios = " << n_oios+1;
+            // assert(n_oios >= 0);
+
+            try {
+                parent_ctrlr->processIO(io);
+            } catch (const std::exception &e) {
+                LOGWARN << "exception:" << e.what()
+                    << " queue_id:" << queue_id
+                    << " type:" << io->io_type
+                    << " on processio.  ignoring...";
+            } catch (...) {
+                LOGWARN << "exception:unknown"
+                    << " queue_id:" << queue_id
+                    << " type:" << io->io_type
+                    << " on processio.  ignoring...";
+            }
+        }
+
         virtual size_t markIODone(FDS_IOType *io)
         {
             size_t n_oios = 1;
@@ -470,6 +484,8 @@ namespace fds {
             --n_oios;
 
             io->io_done_ts = util::getTimeStampNanos();
+            RequestTracer::record(io->trace_id, TraceStage::IO_DONE,
+                                  io->io_type, io->io_done_ts);
             fds_uint64_t wait_nano = io->dispatch_ts - io->enqueue_ts;
             fds_uint64_t service_nano = io->io_done_ts - io->dispatch_ts;
             fds_uint64_t total_nano = io->io_done_ts - io->enqueue_ts;
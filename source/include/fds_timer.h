@@ -4,10 +4,14 @@
 #ifndef SOURCE_INCLUDE_FDS_TIMER_H_
 #define SOURCE_INCLUDE_FDS_TIMER_H_
 
+#include <array>
 #include <atomic>
 #include <chrono>
-#include <set>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include <thread>
 #include <fds_defines.h>
@@ -49,21 +53,23 @@ protected:
     std::chrono::system_clock::time_point expTime_;
     std::chrono::milliseconds durationMs_;
     /* Task state */
-    TimerTaskState state_;
+    std::atomic<TimerTaskState> state_;
+    /* Bumped on every schedule and cancel, so stale wheel entries are skipped */
+    std::atomic<uint64_t> gen_;
+
+    /* Wheel linkage, only touched by the timer thread */
+    boost::shared_ptr<FdsTimerTask> wheelRef_;
+    /* Points at whatever points at us: the slot's head or the previous task */
+    FdsTimerTask **wheelPprev_;
+    FdsTimerTask *wheelNext_;
+    uint64_t wheelGen_;
+    uint64_t wheelTick_;
+    std::chrono::milliseconds wheelPeriod_;
     friend class FdsTimer;
 };
 
 typedef boost::shared_ptr<FdsTimerTask> FdsTimerTaskPtr;
 
-struct LessFdsTimerTaskPtr {
-    bool operator()(const FdsTimerTaskPtr& lhs, const FdsTimerTaskPtr& rhs) {
-        if (lhs->getExpiryTime() == rhs->getExpiryTime()) {
-            return lhs.get() < rhs.get();
-        }
-        return lhs->getExpiryTime() < rhs->getExpiryTime();
-    }
-};
-
 /**
 * @brief Timer task to wrap std::function
 */
@@ -79,8 +85,17 @@ struct FdsTimerFunctionTask : FdsTimerTask {
  * The timer class is used to schedule tasks for one-time execution or
  * repeated execution. Tasks are executed by the dedicated timer thread
  * sequentially.
- * IMPORTANT: Firing of the timer tasks isn't very accurate.  It's better to schedule
- * timer tasks in the granularity of seconds.
+ *
+ * Pending tasks are kept in a hierarchical timing wheel with millisecond ticks:
+ * WHEEL_LEVELS levels of WHEEL_SLOTS slots each, a level's slot spanning a
+ * whole turn of the level below it.  Tasks are moved down a level as their
+ * slot comes up, and run once they reach the first level's current slot, so
+ * both scheduling and cancelling are O(1).
+ *
+ * schedule() and cancel() don't touch the wheel.  They queue their change in
+ * one of WHEEL_STRIPES buffers, picked per calling thread, which the timer
+ * thread applies before every tick it processes.  A cancelled task doesn't run
+ * once cancel() returns, unless it is already running.
  */
 class FdsTimer
 {
@@ -96,6 +111,14 @@ public:
      */
     explicit FdsTimer(const std::string &id);
 
+    /**
+     * Constructor taking the time, in milliseconds from 0, from tickSource
+     * rather than the clock.  Meant for tests: the timer thread only looks at
+     * tickSource again when woken, by wake() or by a task scheduled sooner
+     * than any it has.
+     */
+    FdsTimer(const std::string &id, const std::function<uint64_t ()> &tickSource);
+
     /**
      * Destructor
      */
@@ -142,7 +165,7 @@ public:
     * @param time
     * @param f
     */
-    SHPTR<FdsTimerTask> scheduleFunction(const std::chrono::seconds &time,
+    SHPTR<FdsTimerTask> scheduleFunction(const std::chrono::milliseconds &time,
                                          const std::function<void()> &f);
     /**
     * @brief 
@@ -150,7 +173,7 @@ public:
     * @param time
     * @param f
     */
-    SHPTR<FdsTimerTask> scheduledFunctionRepeated(const std::chrono::seconds &time,
+    SHPTR<FdsTimerTask> scheduledFunctionRepeated(const std::chrono::milliseconds &time,
                                                  const std::function<void()> &f);
 
     /**
@@ -160,45 +183,98 @@ public:
      */
     bool cancel(const FdsTimerTaskPtr& task);
 
+    /**
+     * Wakes the timer thread to run what is due by now, e.g. after moving
+     * the tick source on
+     */
+    void wake();
+
     virtual std::string log_string();
 
 private:
+    static const uint32_t WHEEL_SLOT_BITS = 8;
+    static const uint32_t WHEEL_SLOTS = 1 << WHEEL_SLOT_BITS;
+    static const uint32_t WHEEL_LEVELS = 4;
+    static const uint32_t WHEEL_STRIPES = 16;
+
+    /* A schedule or cancel waiting for the timer thread */
+    struct TimerOp {
+        FdsTimerTaskPtr task;
+        uint64_t gen;
+        uint64_t tick;
+        std::chrono::milliseconds period;
+    };
+
+    /* Doubly linked list of the tasks expiring in a slot */
+    struct WheelSlot {
+        FdsTimerTask *head {nullptr};
+    };
+
+    /* Buffered ops from the threads mapped to it */
+    struct OpStripe {
+        std::mutex lock;
+        std::vector<TimerOp> ops;
+        /* Keeps neighbouring stripes' locks off this one's cacheline */
+        char pad[64];
+    };
+
     template<typename Rep, typename Period>
     bool scheduleInternal_(FdsTimerTaskPtr& task,
             const std::chrono::duration<Rep, Period>& time,
             const bool &repeated)
     {
-        fds_assert(time >= std::chrono::seconds(1));
-
-        lock_.lock();
-        task->durationMs_ = std::chrono::duration_cast<std::chrono::milliseconds>(time);
-        task->expTime_ = std::chrono::system_clock::now() + task->durationMs_;
-        pendingTasks_.insert(task);
-        if (repeated) {
-            task->state_ = TASK_STATE_SCHEDULED_REPEAT;
-        } else {
-            task->state_ = TASK_STATE_SCHEDULED_ONCE;
+        auto durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(time);
+        /* Round up, so a task never runs before it's due */
+        if (durationMs < time || durationMs.count() <= 0) {
+            durationMs += std::chrono::milliseconds(1);
         }
-        lock_.unlock();
+        task->durationMs_ = durationMs;
+        task->expTime_ = std::chrono::system_clock::now() + durationMs;
+        task->state_ = repeated ? TASK_STATE_SCHEDULED_REPEAT : TASK_STATE_SCHEDULED_ONCE;
+        auto gen = ++task->gen_;
+        /* Plus one as we're already into the current tick */
+        pushOp_(TimerOp{task, gen, nowTick_() + durationMs.count() + 1,
+                        repeated ? durationMs : std::chrono::milliseconds(0)});
         return true;
     }
 
+    /* Milliseconds since the timer was created, or from the tick source */
+    uint64_t nowTick_() const;
+
+    void pushOp_(TimerOp &&op);
+    bool applyOps_();
+    void link_(FdsTimerTask *task);
+    void unlink_(FdsTimerTask *task);
+    void cascade_(uint32_t level, uint32_t slot);
+    void expire_(std::vector<std::pair<FdsTimerTaskPtr, uint64_t>> &due);
+    uint64_t nextDueTick_() const;
+
     void runTimerThread_();
 
-    /* Lock for protecting scheduled variable */
-    fds_mutex lock_;
     /* Id of the timer */
     std::string id_;
-    /* Pending timer objects */
-    std::set<FdsTimerTaskPtr, LessFdsTimerTaskPtr> pendingTasks_;
+    std::chrono::steady_clock::time_point startTime_;
+    std::function<uint64_t ()> tickSource_;
+
+    std::array<OpStripe, WHEEL_STRIPES> stripes_;
+
+    /* Owned by the timer thread */
+    std::array<std::array<WheelSlot, WHEEL_SLOTS>, WHEEL_LEVELS> wheel_;
+    uint64_t curTick_;
+    size_t wheelTaskCnt_;
+
+    /* Tick the timer thread sleeps until, woken early for sooner tasks */
+    std::atomic<uint64_t> wakeTick_;
+    std::mutex wakeLock_;
+    std::condition_variable wakeCond_;
+    bool wakeRequested_;
+
     /*
      * Whether timer thread should abort or not. Zero means not aborted.
      * value held indicates the # of times destroy() is called
      * We only destroy, i.e join on timer thread once
      */
     std::atomic<int> abortCntr_;
-    /* Timer thread sleep time */
-    int timerThreadSleepMs_;
     /* Timer thread */
     std::thread timerThread_;
 };
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#ifndef SOURCE_INCLUDE_FDS_TRACE_H_
+#define SOURCE_INCLUDE_FDS_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fds_counters.h>
+
+namespace fds {
+
+/**
+ * Points a traced request passes through, roughly in the order it does.
+ * Stages of one trace are recorded by every service the request touches,
+ * the trace id travels between them in fpi::AsyncHdr::traceId.
+ */
+enum class TraceStage : uint16_t {
+    AM_START,           /* AM request created */
+    AM_DONE,            /* AM request freed after it was responded to */
+    QOS_ENQUEUE,        /* Queued on a QoS volume queue */
+    QOS_DISPATCH,       /* Taken off the QoS queue for processing */
+    IO_DONE,            /* Processing done, as marked with the QoS dispatcher */
+    VG_SEND,            /* Sent to a volume group */
+    VG_DONE,            /* Volume group request completed */
+    SVC_SEND,           /* Request message sent */
+    SVC_RECV,           /* Request message received */
+    SVC_RESP_SEND,      /* Response message sent */
+    SVC_RESP_RECV,      /* Response message received */
+    MAX
+};
+
+const char* traceStageName(const TraceStage &stage);
+
+/**
+ * Process wide request tracing.
+ *
+ * Every sample_every'th request an AM gets is given a trace id, 0 meaning
+ * not traced.  Services record the stages a traced request goes through into
+ * a ring buffer of the recording thread, so recording takes no locks, and the
+ * rings are dumped as per trace timelines through the "requesttrace" state
+ * provider.  Timestamps are wall clock nanoseconds so timelines of different
+ * services can be lined up.
+ *
+ * The trace of the request being worked on is kept per thread, see
+ * RequestTraceScope, and picked up by the service requests and QoS requests
+ * made on its behalf.  When tracing is disabled all this costs is checking
+ * for a zero trace id.
+ */
+class RequestTracer {
+ public:
+    static const uint32_t DEFAULT_RING_ENTRIES = 4096;
+
+    /* Sample every sampleEvery'th request, 0 disables sampling */
+    static void configure(uint32_t sampleEvery, uint32_t ringEntries);
+
+    /* Trace id for a new request, 0 unless sampled */
+    static inline uint64_t sample() {
+        auto every = sampleEvery_.load(std::memory_order_acquire);
+        return every ? sample_(every) : 0;
+    }
+
+    /* Trace of the request being worked on by this thread */
+    static inline uint64_t current() { return current_; }
+    static inline void setCurrent(const uint64_t &traceId) { current_ = traceId; }
+
+    static inline void record(const uint64_t &traceId, const TraceStage &stage,
+                              int32_t detail = 0) {
+        if (traceId) {
+            record_(traceId, stage, detail, 0);
+        }
+    }
+    /* Record with a timestamp the caller already took */
+    static inline void record(const uint64_t &traceId, const TraceStage &stage,
+                              int32_t detail, uint64_t ts) {
+        if (traceId) {
+            record_(traceId, stage, detail, ts);
+        }
+    }
+
+    /* Json of recorded traces, each a timeline of stages ordered by time */
+    static std::string dump();
+
+    /* Exports dump() as "requesttrace" */
+    static StateProvider* stateProvider();
+
+ protected:
+    struct Entry {
+        /* Index + 1 of the record held, 0 while one is being written */
+        std::atomic<uint64_t> seq;
+        std::atomic<uint64_t> traceId;
+        std::atomic<uint64_t> ts;
+        /* Stage in the upper, detail in the lower 32 bits */
+        std::atomic<uint64_t> stageDetail;
+    };
+
+    /* Written by its thread only, read by dump() */
+    struct Ring {
+        explicit Ring(uint32_t entries);
+
+        std::unique_ptr<Entry[]> entries;
+        uint64_t mask;
+        /* Entries written so far.  Entry i is at entries[i & mask] */
+        std::atomic<uint64_t> head;
+        int32_t tid;
+    };
+
+    static uint64_t sample_(uint32_t every);
+    static void record_(uint64_t traceId, TraceStage stage, int32_t detail, uint64_t ts);
+    static Ring* ring_();
+
+    static std::atomic<uint32_t> sampleEvery_;
+    static std::atomic<uint32_t> ringEntries_;
+    /* Requests sample() was asked about while sampling was on */
+    static std::atomic<uint64_t> requestCnt_;
+    static std::atomic<uint64_t> nextTraceId_;
+    static std::atomic<uint64_t> traceIdBase_;
+
+    static thread_local uint64_t current_;
+    static thread_local Ring *threadRing_;
+
+    /* Rings of all threads that recorded, kept after their threads exit */
+    static std::mutex ringsLock_;
+    static std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+/**
+ * Makes traceId the current trace of this thread while in scope
+ */
+struct RequestTraceScope {
+    explicit RequestTraceScope(const uint64_t &traceId)
+        : prev_(RequestTracer::current()) {
+        RequestTracer::setCurrent(traceId);
+    }
+    ~RequestTraceScope() {
+        RequestTracer::setCurrent(prev_);
+    }
+    RequestTraceScope(const RequestTraceScope&) = delete;
+    RequestTraceScope& operator=(const RequestTraceScope&) = delete;
+
+ protected:
+    uint64_t prev_;
+};
+
+}  // namespace fds
+
+#endif  // SOURCE_INCLUDE_FDS_TRACE_H_
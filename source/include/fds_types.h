@@ -279,6 +279,7 @@ typedef enum {
     FDS_DM_VOLUME_IO,
     FDS_DM_MIG_REQ_TX_STATE,
     FDS_DM_VOLUME_CHK_MSG,
+    FDS_DM_MIG_BULK_CATALOG,
     FDS_GENERIC_REQUEST,
     FDS_OP_INVALID
 } fds_io_op_t;
@@ -311,6 +312,8 @@ class FDS_IOType {
     fds_uint64_t enqueue_ts {0};
     fds_uint64_t dispatch_ts {0};
     fds_uint64_t io_done_ts;
+    // Sampled request trace the IO is part of, 0 when not traced
+    fds_uint64_t trace_id {0};
 
     // performance data collection related structures
     PerfEventType opReqFailedPerfEventType;
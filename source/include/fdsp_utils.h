@@ -12,6 +12,7 @@
 #include <arpa/inet.h>
 #include <thrift/transport/TSocket.h>
 #include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TVirtualTransport.h>
 #include <thrift/protocol/TBinaryProtocol.h>
 #include <fds_types.h>
 #include <fdsp/svc_types_types.h>
@@ -68,7 +69,32 @@ std::string quoteString(std::string const& text,
                         std::string const& escape = "\\");
 
 /**
-* @brief For serializing FDSP messages
+* @brief Transport that only counts the bytes written to it
+*/
+class FdspSizingTransport : public tt::TVirtualTransport<FdspSizingTransport> {
+ public:
+    void write(const uint8_t *buf, uint32_t len) { size_ += len; }
+    size_t size() const { return size_; }
+ private:
+    size_t size_ {0};
+};
+
+/**
+* @brief Transport that appends what is written to it to a string
+*/
+class FdspStringTransport : public tt::TVirtualTransport<FdspStringTransport> {
+ public:
+    explicit FdspStringTransport(std::string &str) : str_(str) {}
+    void write(const uint8_t *buf, uint32_t len) {
+        str_.append(reinterpret_cast<const char*>(buf), len);
+    }
+ private:
+    std::string &str_;
+};
+
+/**
+* @brief For serializing FDSP messages.  The message is sized first, so the
+* payload is written once straight into a buffer of the right size
 *
 * @tparam PayloadT
 * @param payload
@@ -77,11 +103,16 @@ std::string quoteString(std::string const& text,
 template<class PayloadT>
 void serializeFdspMsg(const PayloadT &payload, bo::shared_ptr<std::string> &payloadBuf)
 {
-    uint32_t bufSz = 512;
-    bo::shared_ptr<tt::TMemoryBuffer> buffer(new tt::TMemoryBuffer(bufSz));
-    bo::shared_ptr<tp::TProtocol> binary_buf(new tp::TBinaryProtocol(buffer));
+    auto buf = bo::make_shared<std::string>();
     try {
-        auto written = payload.write(binary_buf.get());
+        bo::shared_ptr<FdspSizingTransport> sizing(new FdspSizingTransport());
+        tp::TBinaryProtocolT<FdspSizingTransport> sizing_proto(sizing);
+        payload.write(&sizing_proto);
+        buf->reserve(sizing->size());
+
+        bo::shared_ptr<FdspStringTransport> str(new FdspStringTransport(*buf));
+        tp::TBinaryProtocolT<FdspStringTransport> binary_buf(str);
+        auto written = payload.write(&binary_buf);
         fds_verify(written > 0);
     } catch(std::exception &e) {
         /* This is to ensure we assert on any serialization exceptions in debug
@@ -104,8 +135,7 @@ void serializeFdspMsg(const PayloadT &payload, bo::shared_ptr<std::string> &payl
  */
         throw;
     }
-    payloadBuf = bo::make_shared<std::string>();
-    *payloadBuf = buffer->getBufferAsString();
+    payloadBuf = buf;
 }
 
 template<class PayloadT>
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016 by Formation Data Systems, Inc.
+ */
+#ifndef SOURCE_INCLUDE_NET_COALESCINGTRANSPORT_H_
+#define SOURCE_INCLUDE_NET_COALESCINGTRANSPORT_H_
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TSocket.h>
+#include <thrift/transport/TVirtualTransport.h>
+
+namespace fds {
+namespace net {
+
+/**
+ * Framed transport that writes its frames with vectored IO.  Frames are wire
+ * compatible with TFramedTransport, so the other end reads them as usual.
+ *
+ * Small writes (thrift headers, field metadata) are copied into a scratch
+ * buffer, but writes of at least SEGMENT_BYTES, typically the serialized
+ * message payload, are only referenced and go out as their own segment.  So
+ * what is written must stay valid until the frame is flushed, or, while the
+ * transport is held, until release().
+ *
+ * Holding the transport while writing a batch of messages makes their frames
+ * go out together, in as few writes as coalesceBytes allows.
+ */
+class CoalescingTransport
+    : public apache::thrift::transport::TVirtualTransport<CoalescingTransport> {
+ public:
+    static const uint32_t SEGMENT_BYTES = 4096;
+
+    CoalescingTransport(boost::shared_ptr<apache::thrift::transport::TSocket> socket,
+                        uint32_t coalesceBytes);
+
+    bool isOpen() { return socket_->isOpen(); }
+    bool peek() { return reader_->peek(); }
+    void open() { socket_->open(); }
+    void close() { socket_->close(); }
+
+    /* Replies, if any, are read as regular frames */
+    uint32_t read(uint8_t *buf, uint32_t len) { return reader_->read(buf, len); }
+    uint32_t readEnd() { return reader_->readEnd(); }
+
+    void write(const uint8_t *buf, uint32_t len);
+
+    /* Ends the frame, writing it out unless held */
+    void flush();
+
+    /* Frames are only written once coalesceBytes are pending until release() */
+    void hold() { held_ = true; }
+
+    /* Write whatever was held back */
+    void release();
+
+    /* Frames written out in full, including those that went out before a
+     * write failed */
+    uint64_t framesWritten() const { return framesWritten_; }
+
+ protected:
+    /* A piece of a frame, either referenced or at offset in scratch_ */
+    struct Segment {
+        const uint8_t *ref;
+        size_t offset;
+        size_t len;
+    };
+
+    void writeFrames_();
+
+    boost::shared_ptr<apache::thrift::transport::TSocket> socket_;
+    boost::shared_ptr<apache::thrift::transport::TFramedTransport> reader_;
+    uint32_t const coalesceBytes_;
+    bool held_ {false};
+
+    std::string scratch_;
+    std::vector<Segment> segments_;
+    /* Offset in scratch_ of the current frame's length, if in a frame */
+    bool inFrame_ {false};
+    size_t frameHeader_ {0};
+    uint32_t frameSize_ {0};
+    /* Bytes of complete frames not yet written, and where each ends */
+    size_t pendingBytes_ {0};
+    std::vector<size_t> frameEnds_;
+    uint64_t framesWritten_ {0};
+};
+
+}  // namespace net
+}  // namespace fds
+
+#endif  // SOURCE_INCLUDE_NET_COALESCINGTRANSPORT_H_
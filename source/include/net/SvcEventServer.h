@@ -0,0 +1,76 @@
+/*
+ * Copyright 2016 by Formation Data Systems, Inc.
+ */
+#ifndef SOURCE_INCLUDE_NET_SVCEVENTSERVER_H_
+#define SOURCE_INCLUDE_NET_SVCEVENTSERVER_H_
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <ev++.h>
+#include <boost/shared_ptr.hpp>
+#include <thrift/server/TServer.h>
+
+namespace fds {
+
+class fds_threadpool;
+
+/**
+* @brief Thrift server for framed transports that serves its connections on a
+* fixed number of event loops instead of a thread per connection.
+*
+* Connections are accepted on the thread calling serve() and assigned to the IO
+* loops round-robin.  The loops only read frames and write replies, without
+* blocking.  Calls are processed on the threadpool, as handlers may block; oneway
+* calls (the service layer's asyncReqt and asyncResp) of a connection one at a
+* time in the order received, calls with a reply as they come.  The reply is
+* written back by the connection's loop.  Without a threadpool calls are
+* processed on the loop.
+*/
+struct SvcEventServer : apache::thrift::server::TServer {
+    SvcEventServer(const boost::shared_ptr<apache::thrift::TProcessor> &processor,
+                   const boost::shared_ptr<apache::thrift::protocol::TProtocolFactory> &protocolFactory,
+                   int port,
+                   uint32_t ioThreads,
+                   fds_threadpool *threadpool);
+    virtual ~SvcEventServer();
+
+    /**
+    * @brief Listens and serves until stop().  Throws when unable to listen
+    */
+    void serve() override;
+
+    /**
+    * @brief Makes serve() close all the connections and return
+    */
+    void stop() override;
+
+ protected:
+    struct Connection;
+    struct IoLoop;
+    using ConnectionPtr = std::shared_ptr<Connection>;
+
+    int listen_();
+    void acceptCb_(ev::io &watcher, int revents);
+    void stopCb_(ev::async &watcher, int revents);
+    void wakeupCb_(IoLoop &ioLoop);
+    void ioCb_(ConnectionPtr conn, int revents);
+    void close_(IoLoop &ioLoop, ConnectionPtr conn);
+
+    int port_;
+    int listenFd_;
+    fds_threadpool *threadpool_;
+    std::atomic<bool> stopping_;
+
+    std::unique_ptr<ev::dynamic_loop> acceptLoop_;
+    std::unique_ptr<ev::io> acceptWatcher_;
+    std::unique_ptr<ev::async> stopWatcher_;
+
+    std::vector<std::unique_ptr<IoLoop>> ioLoops_;
+    size_t nextLoop_;
+};
+
+}  // namespace fds
+
+#endif  // SOURCE_INCLUDE_NET_SVCEVENTSERVER_H_
@@ -4,6 +4,8 @@
 #ifndef SOURCE_INCLUDE_NET_SVCMGR_H_
 #define SOURCE_INCLUDE_NET_SVCMGR_H_
 
+#include <deque>
+#include <memory>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -13,6 +15,7 @@
 #include <concurrency/SynchronizedTaskExecutor.hpp>
 #include <net/PlatNetSvcHandler.h>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <fdsp/OMSvc.h>
 
 #define NET_SVC_RPC_CALL(eph, rpc, rpc_fn, ...)                                         \
@@ -67,6 +70,9 @@ namespace fpi = FDS_ProtocolInterface;
 DECL_EXTERN_OUTPUT_FUNCS(SvcUuid);
 
 namespace fds {
+namespace net {
+    class CoalescingTransport;
+}  // namespace net
 
 namespace bo  = boost;
 namespace tt  = apache::thrift::transport;
@@ -104,14 +110,17 @@ std::string logString(const FDS_ProtocolInterface::SvcInfo &info);
 std::string logDetailedString(const FDS_ProtocolInterface::SvcInfo &info);
 
 /**
- * @brief Factory method for Thrift client
+ * @brief Factory method for Thrift client.  When coalesceBytes is non zero the
+ * client frames its messages with a net::CoalescingTransport instead of a
+ * TFramedTransport, coalescing up to that many bytes into one write
  */
 template<class T>
 extern boost::shared_ptr<T> allocRpcClient(const std::string &ip,
     const int &port,
     const int &retryCnt,
     const std::string &strServiceName,
-    const boost::shared_ptr<FdsConfig> pLibConfig);
+    const boost::shared_ptr<FdsConfig> pLibConfig,
+    const uint32_t &coalesceBytes = 0);
 
 /*--------------- Utility classes --------------*/
 struct SvcUuidHash {
@@ -350,6 +359,12 @@ struct SvcMgr : HasModuleProvider, Module, StateProvider {
     * @return 
     */
     SynchronizedTaskExecutor<uint64_t>* getTaskExecutor();
+
+    /**
+    * @brief Returns the threadpool service handles drain their send queues on.
+    * nullptr when sends are to be done on the sender's thread
+    */
+    fds_threadpool* getSendThreadpool();
     
     /**
     * @brief Return current dlt
@@ -607,6 +622,12 @@ struct SvcMgr : HasModuleProvider, Module, StateProvider {
     /* For executing task in a threadpool in a synchronized manner */
     SynchronizedTaskExecutor<uint64_t> *taskExecutor_;
 
+    /* Threadpool service handle send queues are drained on */
+    fds_threadpool *sendThreadpool_;
+    /* Connections per peer and how many bytes to coalesce into one write */
+    uint32_t sendConnections_;
+    uint32_t sendCoalesceBytes_;
+
     /* Dlt manager */
     DLTManagerPtr dltMgr_;
     /* Dmt manager */
@@ -618,11 +639,32 @@ struct SvcMgr : HasModuleProvider, Module, StateProvider {
 
 
 /**
-* @brief Wrapper around service information and service rpc client.
+* @brief Send queue statistics of a service handle, summed over its connections
+*/
+struct SvcSendStats {
+    /* Messages waiting to be sent */
+    uint64_t queued {0};
+    /* Messages sent and the total and worst time they took from being queued */
+    uint64_t sent {0};
+    uint64_t latencyUsec {0};
+    uint64_t maxLatencyUsec {0};
+    /* Socket writes the messages were coalesced into */
+    uint64_t batches {0};
+};
+
+/**
+* @brief Wrapper around service information and service rpc clients.
+* Messages to the service are queued on one of its connections and written out
+* by whoever drains that connection, normally a job on the svc mgr's send
+* threadpool, so senders never wait on the socket.  With more than one
+* connection messages are striped over them by request id, which means messages
+* of different requests may arrive out of order.
 */
-struct SvcHandle : HasModuleProvider {
+struct SvcHandle : HasModuleProvider, boost::enable_shared_from_this<SvcHandle> {
     SvcHandle(CommonModuleProviderIf *moduleProvider,
-              const fpi::SvcInfo &info);
+              const fpi::SvcInfo &info,
+              uint32_t connections = 1,
+              uint32_t coalesceBytes = 0);
     virtual ~SvcHandle();
 
     // Making this a static so that configDB can use this intelligence too
@@ -675,38 +717,106 @@ struct SvcHandle : HasModuleProvider {
     */
     void getSvcInfo(fpi::SvcInfo &info) const;
 
+    /**
+    * @brief Returns the send queue statistics
+    */
+    SvcSendStats getSendStats() const;
+
     std::string logString() const;
 
  protected:
+    /* A message waiting on a connection's send queue */
+    struct SvcMessage {
+        bool isAsyncReqt;
+        fpi::AsyncHdrPtr header;
+        StringPtr payload;
+        uint64_t queuedTs;
+    };
+
+    /* One of the connections to the service and its send queue */
+    struct SvcConnection {
+        /* Protects queue, draining and stats */
+        mutable fds_mutex lock;
+        std::deque<SvcMessage> queue;
+        /* Whether someone is draining the queue */
+        bool draining {false};
+        SvcSendStats stats;
+
+        /* Only used by whoever is draining */
+        fpi::PlatNetSvcClientPtr client;
+        boost::shared_ptr<net::CoalescingTransport> transport;
+        /* clientGen_ the client was made for */
+        uint64_t clientGen {0};
+    };
+
     /**
     * @brief Common interface for sending asyn service messages.  isAsyncReqt determines
-    * whether it's a request or response
+    * whether it's a request or response.  Queues the message and makes sure the
+    * connection it was queued on is being drained.
     *
     * @param isAsyncReqt
     * @param header
     * @param payload
     *
-    * @return 
+    * @return false when the service is down
     */
     bool sendAsyncSvcMessageCommon_(bool isAsyncReqt,
                                     fpi::AsyncHdrPtr &header,
                                     StringPtr &payload);
+
+    /**
+    * @brief Sends what is queued on the connection.  Only one drain per connection
+    * runs at a time
+    */
+    void drainConnection_(SvcConnection *conn);
+
+    /**
+    * @brief Writes the messages out on the connection, returning the ones that
+    * could not be sent in failed
+    */
+    void sendBatch_(SvcConnection &conn,
+                    std::deque<SvcMessage> &batch,
+                    std::vector<fpi::AsyncHdrPtr> &failed);
+
+    /**
+    * @brief Threadpool the send queues are drained on, the svc mgr's send
+    * threadpool.  nullptr drains them on the sender's thread
+    */
+    virtual fds_threadpool* getSendThreadpool_();
+
+    /**
+    * @brief Fails the request of a message that could not be sent
+    */
+    virtual void postSendError_(fpi::AsyncHdrPtr &header);
+
+    /**
+    * @brief Sets the client connection 0 uses.  Clients of the other connections
+    * are dropped and recreated on their next send.
+    * NOTE: Assumes lock_ is held
+    */
+    void resetClients_(const fpi::PlatNetSvcClientPtr &client);
     /**
     * @brief Checks if service is down or not
     */
     bool isSvcDown_() const;
 
     /**
-    * @brief Marks the service down.  Set rpcClient_ to null
+    * @brief Marks the service down and drops the connections' clients
     */
-    void markSvcDown_();
+    virtual void markSvcDown_();
 
-    /* Lock for protecting svcInfo_ and rpcClient_ */
+    /* Lock for protecting svcInfo_, svcClient_ and clientGen_ */
     mutable fds_mutex lock_;
     /* Service information */
     fpi::SvcInfo svcInfo_;
-    /* Rpc client.  Typcially this is PlatNetSvcClient */
+    /* Rpc client given to us for connection 0, if any.  Typcially this is PlatNetSvcClient */
     fpi::PlatNetSvcClientPtr svcClient_;
+    /* Bumped whenever the connections' clients are to be recreated */
+    uint64_t clientGen_;
+
+    /* Bytes of messages coalesced into one write, 0 to write each one on its own */
+    uint32_t const coalesceBytes_;
+    std::vector<std::unique_ptr<SvcConnection>> connections_;
 };
 
 }  // namespace fds
@@ -6,6 +6,8 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <unordered_map>
 #include <boost/shared_ptr.hpp>
 
 #include <fds_timer.h>
@@ -17,6 +19,7 @@
 #include <fdsp_utils.h>
 #include <concurrency/taskstatus.h>
 #include <fds_counters.h>
+#include <fds_trace.h>
 #include <fds_module_provider.h>
 
 namespace fds {
@@ -62,6 +65,19 @@ enum SvcRequestState {
     SVC_REQUEST_COMPLETE
 };
 
+/**
+ * @brief Counters for reads served by a single volume replica (DM).  Used to
+ * expose how reads are distributed across the replicas of volume groups.
+ */
+struct ReplicaReadCounters : FdsCounters {
+    explicit ReplicaReadCounters(const fpi::SvcUuid &svcUuid);
+
+    /* Reads served by the replica along with their latency in ns */
+    LatencyCounter      reads;
+    /* Reads that returned an error (including timeouts) */
+    NumericCounter      readerrors;
+};
+
 /**
  * @brief Svc request counters
  */
@@ -71,6 +87,12 @@ class SvcRequestCounters : public FdsCounters
     SvcRequestCounters(const std::string &id, FdsCountersMgr *mgr);
     ~SvcRequestCounters();
 
+    /**
+    * @brief Returns read counters for replica hosted on svcUuid.  Counters are
+    * created and registered for export on first use.
+    */
+    ReplicaReadCounters* getReplicaReadCntrs(const fpi::SvcUuid &svcUuid);
+
     /* Number of requests that have timedout */
     NumericCounter      timedout;
     /* Number of requests that experienced transport error */
@@ -79,6 +101,11 @@ class SvcRequestCounters : public FdsCounters
     NumericCounter      appsuccess;
     /* Number of responses that resulted in app rejections */
     NumericCounter      apperrors;
+
+ protected:
+    FdsCountersMgr      *mgr_;
+    fds_mutex           replicaReadCntrsLock_;
+    std::unordered_map<int64_t, std::unique_ptr<ReplicaReadCounters>> replicaReadCntrs_;
 };
 
 template <class ReqT, class RespMsgT>
@@ -281,6 +308,10 @@ struct SvcRequestIf : TrackableRequest {
     bool taskExecutorIdIsSet();
     bool isSynchronized() const;
 
+    /* Requests start out in the trace current to the thread creating them */
+    inline void setTraceId(const uint64_t &traceId) { traceId_ = traceId; }
+    inline uint64_t getTraceId() const { return traceId_; }
+
     inline const fpi::AsyncHdrPtr& responseHeader() const { return respHeader_; }
     inline Error responseStatus() const { return respHeader_->msg_code; }
     inline const StringPtr& responsePayload() const { return respPayload_; }
@@ -312,6 +343,8 @@ struct SvcRequestIf : TrackableRequest {
     bool fireAndForget_;
     /* Minor version */
     int minor_version;
+    /* Request trace sent along in the header, 0 when not traced */
+    uint64_t traceId_;
 };
 
 /**
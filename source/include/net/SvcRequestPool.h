@@ -3,6 +3,7 @@
 #ifndef SOURCE_INCLUDE_NET_SVCREQUESTPOOL_H_
 #define SOURCE_INCLUDE_NET_SVCREQUESTPOOL_H_
 
+#include <atomic>
 #include <vector>
 #include <string>
 
@@ -95,11 +96,31 @@ class SvcRequestPool : HasModuleProvider {
     static SvcRequestId SVC_UNTRACKED_REQ_ID;
 
  protected:
+    /* Ids each thread reserves from nextAsyncReqId_ at a time */
+    static const SvcRequestId REQ_ID_BLOCK = 1024;
+
+    /**
+     * Hands out ids from a block reserved by the calling thread, so threads
+     * issuing requests only touch the shared nextAsyncReqId_ once per
+     * REQ_ID_BLOCK requests.  Ids are unique but not ordered across threads.
+     */
     inline SvcRequestId getNextAsyncReqId_() {
-        SvcRequestId id =  ++nextAsyncReqId_;
-        /* Ensure nextAsyncReqId_ isn't SVC_UNTRACKED_REQ_ID */
-        while (id == SVC_UNTRACKED_REQ_ID) {
-            id =  ++nextAsyncReqId_;
+        struct IdBlock {
+            uint64_t poolEpoch;
+            SvcRequestId next;
+            SvcRequestId end;
+        };
+        static thread_local IdBlock block {0, 0, 0};
+
+        if (block.poolEpoch != poolEpoch_ || block.next == block.end) {
+            block.poolEpoch = poolEpoch_;
+            block.next = nextAsyncReqId_.fetch_add(REQ_ID_BLOCK);
+            block.end = block.next + REQ_ID_BLOCK;
+        }
+        SvcRequestId id = block.next++;
+        /* Ensure id isn't SVC_UNTRACKED_REQ_ID */
+        if (id == SVC_UNTRACKED_REQ_ID) {
+            return getNextAsyncReqId_();
         }
         return id;
     }
@@ -112,6 +133,9 @@ class SvcRequestPool : HasModuleProvider {
     /* align it to 64, so atomic doesn't share with cacheline with other
      * vars.  This is to prevent false-sharing and cache ping-pong.
      */
+    /* Tells the threads' id blocks of this pool from those of earlier ones */
+    uint64_t poolEpoch_;
+    static std::atomic<uint64_t> poolEpochs_;
     alignas(64) std::atomic<SvcRequestId> nextAsyncReqId_;
     /* Common completion callback for svc requests */
     SvcRequestCompletionCb finishTrackingCb_;
@@ -3,8 +3,11 @@
 #ifndef SOURCE_INCLUDE_NET_SVCREQUESTTRACKER_H_
 #define SOURCE_INCLUDE_NET_SVCREQUESTTRACKER_H_
 
+#include <atomic>
+#include <memory>
 #include <unordered_map>
 #include <string>
+#include <vector>
 
 #include <concurrency/Mutex.h>
 #include <fds_counters.h>
@@ -17,18 +20,39 @@ struct CommonModuleProviderIf;
 
 /**
  * Tracker svc requests.  svc requests are tracked by their id
+ *
+ * Every request is added on send and popped on response or timeout, from
+ * whichever threads do those, so the map is split in shards, each with its own
+ * lock, by the low bits of the id.  Ids are handed out in sequence so
+ * consecutive requests land on different shards.
  */
 class SvcRequestTracker : HasModuleProvider {
  public:
-    explicit SvcRequestTracker(CommonModuleProviderIf *moduleProvider);
+    static const uint32_t DEFAULT_SHARDS = 64;
+
+    /* shards is rounded up to a power of two */
+    explicit SvcRequestTracker(CommonModuleProviderIf *moduleProvider,
+                               uint32_t shards = DEFAULT_SHARDS);
     bool addForTracking(const SvcRequestId& id, SvcRequestIfPtr req);
     SvcRequestIfPtr popFromTracking(const SvcRequestId& id);
     SvcRequestIfPtr getSvcRequest(const SvcRequestId &id);
     uint64_t getOutstandingSvcReqsCount();
 
  protected:
-    fds_mutex svcReqMaplock_;
-    std::unordered_map<SvcRequestId, SvcRequestIfPtr> svcReqMap_;
+    struct Shard {
+        fds_mutex svcReqMaplock;
+        std::unordered_map<SvcRequestId, SvcRequestIfPtr> svcReqMap;
+        /* Keeps the next shard's lock off this shard's cachelines */
+        char pad[64];
+    };
+
+    inline Shard& shard_(const SvcRequestId &id) {
+        return *shards_[id & shardMask_];
+    }
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    SvcRequestId shardMask_;
+    std::atomic<uint64_t> outstanding_;
 };
 
 }  // namespace fds
@@ -48,7 +48,9 @@ struct SvcServerListener {
 };
 
 /**
-* @brief Server for the service.  Every service will have an instance of this server
+* @brief Server for the service.  Every service will have an instance of this server.
+* Connections are served by a SvcEventServer on a few event loops, or, when
+* fds.common.svc_server.io_threads is 0, by a TThreadedServer with a thread each.
 */
 struct SvcServer : boost::enable_shared_from_this<SvcServer>,
     apache::thrift::server::TServerEventHandler,
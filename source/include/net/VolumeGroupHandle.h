@@ -10,6 +10,7 @@
 #include <fdsp/dm_api_types.h>
 #include <net/volumegroup_extensions.h>
 #include <boost/circular_buffer.hpp>
+#include <util/timeutils.h>
 
 #define GROUPHANDLE_ACCESS_CHECK_CB(isWrite, cb, msg) \
     if (state_ != fpi::ResourceState::Active) { \
@@ -72,7 +73,10 @@ struct VolumeReplicaHandle {
         state(fpi::ResourceState::Offline),
         lastError(ERR_OK),
         appliedOpId(VolumeGroupConstants::OPSTARTID),
-        appliedCommitId(VolumeGroupConstants::COMMITSTARTID)
+        appliedCommitId(VolumeGroupConstants::COMMITSTARTID),
+        outstandingReads(0),
+        readLatencyUs(0),
+        readsSent(0)
     {
     }
     inline static bool isFunctional(const fpi::ResourceState& s)
@@ -133,6 +137,14 @@ struct VolumeReplicaHandle {
     int64_t                 appliedOpId;
     /* Last succesfully applied commit id */
     int64_t                 appliedCommitId;
+    /* # of reads sent to this replica that haven't been responded to yet */
+    uint32_t                outstandingReads;
+    /* Moving average of read latency observed against this replica.  Zero until
+     * the first read response is seen
+     */
+    uint64_t                readLatencyUs;
+    /* Total # of reads sent to this replica */
+    uint64_t                readsSent;
 };
 std::ostream& operator << (std::ostream &out, const VolumeReplicaHandle &h);
 
@@ -197,6 +209,11 @@ struct VolumeGroupFailoverRequest : VolumeGroupRequest {
     virtual void invokeWork_() override;
 
     std::vector<VolumeReplicaHandle>   availableReplicas_;
+    /* Replicas this request has already been sent to.  Only one replica is tried at a
+     * time so the send timestamp applies to the last entry
+     */
+    std::vector<fpi::SvcUuid>          triedReplicas_;
+    util::TimeStamp                    sendTs_ {0};
 };
 
 /**
@@ -240,6 +257,10 @@ struct VolumeGroupHandle : HasModuleProvider, StateProvider {
     static uint32_t                     GROUPCHECK_INTERVAL_SEC;
     static uint32_t                     IO_TIMEOUT_MS;
     static uint32_t                     COORDINATOR_SWITCH_TIMEOUT_MS;
+    /* Every READ_PROBE_INTERVAL reads, the read replica is picked round robin instead of
+     * by load so that latency estimates of idle replicas don't go stale
+     */
+    static uint32_t                     READ_PROBE_INTERVAL;
 
     VolumeGroupHandle(CommonModuleProviderIf* provider,
                       const fds_volid_t& volId,
@@ -379,6 +400,12 @@ struct VolumeGroupHandle : HasModuleProvider, StateProvider {
     void scheduleCheckOnNonfunctionalReplicas_();
     void checkOnNonFunctaionalReplicas_();
     void closeHandle_();
+    int32_t pickReadReplica_(const VolumeReplicaHandleList &candidates,
+                             const std::vector<fpi::SvcUuid> &excluded);
+    void onReadSent_(const fpi::SvcUuid &svcUuid);
+    void onReadResponse_(const fpi::SvcUuid &svcUuid,
+                         const uint64_t &latencyNs,
+                         const Error &e);
 
     SynchronizedTaskExecutor<uint64_t>  *taskExecutor_;
     /* ID of the thread on which all work related to this handle is done on.
@@ -433,6 +460,8 @@ struct VolumeGroupHandle : HasModuleProvider, StateProvider {
      *    # of replicas return ERR_INVALID_COORDINATOR
      */
     std::unique_ptr<OpenRetryCtx>       openRetryCtx_;
+    /* # of read replica selections done.  Used for round robin probing and tie breaks */
+    uint64_t                            readSelectCnt_;
 
     static const uint32_t               WRITEOPS_BUFFER_SZ = 1024;
 
@@ -446,9 +475,13 @@ void VolumeGroupHandle::sendReadMsg(const fpi::FDSPMsgTypeId &msgTypeId,
 {
     fds_assert(!closeCb_);
 
-    runSynchronized([this, msgTypeId, msg, cb]() mutable {
+    /* Requests are made on the handle's thread, carry the caller's trace over */
+    auto traceId = RequestTracer::current();
+    runSynchronized([this, msgTypeId, msg, cb, traceId]() mutable {
         GROUPHANDLE_ACCESS_CHECK_CB(false, cb, msg);
 
+        RequestTraceScope traceScope(traceId);
+        RequestTracer::record(traceId, TraceStage::VG_SEND, msgTypeId);
         /* Create a request and send */
         auto req = requestMgr_->newSvcRequest<VolumeGroupFailoverRequest>(this);
         req->setPayload(msgTypeId, msg);
@@ -467,9 +500,12 @@ void VolumeGroupHandle::sendModifyMsg(const fpi::FDSPMsgTypeId &msgTypeId,
                                       SHPTR<MsgT> &msg, const VolumeResponseCb &cb) {
     fds_assert(!closeCb_);
 
-    runSynchronized([this, msgTypeId, msg, cb]() mutable {
+    auto traceId = RequestTracer::current();
+    runSynchronized([this, msgTypeId, msg, cb, traceId]() mutable {
         GROUPHANDLE_ACCESS_CHECK_CB(true, cb, msg);
 
+        RequestTraceScope traceScope(traceId);
+        RequestTracer::record(traceId, TraceStage::VG_SEND, msgTypeId);
         opSeqNo_++;
         sendWriteReq_<MsgT, VolumeGroupBroadcastRequest>(msgTypeId, msg, cb);
     });
@@ -480,9 +516,12 @@ void VolumeGroupHandle::sendCommitMsg(const fpi::FDSPMsgTypeId &msgTypeId,
                                      SHPTR<MsgT> &msg, const VolumeResponseCb &cb) {
     fds_assert(!closeCb_);
 
-    runSynchronized([this, msgTypeId, msg, cb]() mutable {
+    auto traceId = RequestTracer::current();
+    runSynchronized([this, msgTypeId, msg, cb, traceId]() mutable {
         GROUPHANDLE_ACCESS_CHECK_CB(true, cb, msg);
 
+        RequestTraceScope traceScope(traceId);
+        RequestTracer::record(traceId, TraceStage::VG_SEND, msgTypeId);
         opSeqNo_++;
         commitNo_++;
         msg->sequence_id = commitNo_;
@@ -4,7 +4,6 @@
 #ifndef SOURCE_INCLUDE_UTIL_BLOOMFILTER_H_
 #define SOURCE_INCLUDE_UTIL_BLOOMFILTER_H_
 
-#include <boost/dynamic_bitset.hpp>
 #include <vector>
 #include <serialize.h>
 #include <fds_types.h>
@@ -14,6 +13,15 @@ namespace fds { namespace util {
 
 /**
  * This is a non- thread safe bloom filter
+ *
+ * Bits are packed into 64 bit words and serialized as such.  Positions are
+ * derived from a single 128 bit hash of the key (double hashing), so add and
+ * lookup do not allocate.  Filters written in the older one-byte-per-bit
+ * format can still be read; they keep their original seeded hashing.
+ *
+ * The packed format carries a version.  A filter read with any other version
+ * is flagged by formatMismatch() and matches every key, so it can never cause
+ * a live object to be taken as unreferenced; the owner rebuilds it.
  */
 struct BloomFilter {
     explicit BloomFilter(uint32_t totalBits=1*MB, uint8_t bitsPerKey=8);
@@ -25,6 +33,10 @@ struct BloomFilter {
     void add(const std::vector<uint32_t>& positions);
     bool lookup(const std::vector<uint32_t>& positions) const;
 
+    /**
+     * Ors in the bits of filter.  Both filters must have the same size,
+     * number of hashes and hashing scheme.
+     */
     void merge(const BloomFilter& filter);
 
     std::vector<uint32_t> generatePositions(const void* data, uint32_t len) const;
@@ -33,10 +45,45 @@ struct BloomFilter {
     uint32_t read(serialize::Deserializer* d);
     uint32_t getEstimatedSize() const;
 
+    inline uint32_t getTotalBits() const { return totalBits; }
+    inline uint32_t getBitsPerKey() const { return bitsPerKey; }
+    /* True if the last read() found a packed format version it can't decode */
+    inline bool formatMismatch() const { return versionMismatch; }
+
+    /* Marks the packed format; never a valid legacy bitsPerKey */
+    static const int32_t PACKED_FORMAT_MAGIC = 0x42465031;
+    /* Packed format version written by write() */
+    static const int32_t FORMAT_VERSION = 1;
+
+    /**
+     * Returns the number of bits needed to hold expectedKeys at the given
+     * false positive rate, rounded up to a whole word and capped at 4G bits.
+     */
+    static uint32_t optimalTotalBits(uint64_t expectedKeys, double fpRate);
+    /**
+     * Returns the number of hashes per key that minimizes false positives
+     * for a filter of totalBits holding expectedKeys.
+     */
+    static uint8_t optimalBitsPerKey(uint32_t totalBits, uint64_t expectedKeys);
+
   protected:
+    static const uint32_t MAX_BITS_PER_KEY = 32;
+
+    void addData(const void* data, uint32_t len);
+    bool lookupData(const void* data, uint32_t len) const;
+    inline void setBit(uint32_t pos) {
+        words[pos >> 6] |= (1ULL << (pos & 63));
+    }
+    inline bool testBit(uint32_t pos) const {
+        return (words[pos >> 6] & (1ULL << (pos & 63))) != 0;
+    }
+
     uint32_t bitsPerKey = 8;
     uint32_t totalBits = 1024;
-    SHPTR<boost::dynamic_bitset<> > bits;
+    /* Set for filters read from the legacy format */
+    bool legacyHash = false;
+    bool versionMismatch = false;
+    std::vector<uint64_t> words;
 };
 
 using BloomFilterPtr = SHPTR<BloomFilter>;
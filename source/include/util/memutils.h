@@ -5,6 +5,7 @@
 #ifndef SOURCE_INCLUDE_UTIL_MEMUTILS_H_
 #define SOURCE_INCLUDE_UTIL_MEMUTILS_H_
 
+#include <cstddef>
 #include <shared/fds_types.h>
 namespace fds {
 namespace util {
@@ -12,6 +13,9 @@ namespace util {
 // get the current memory usage in Kilo Bytes
 fds_uint64_t getMemoryKB();
 
+// true if all len bytes at buf are zero; checks 64 bytes per step with SSE2
+bool isZeroFilled(const void* buf, size_t len);
+
 } // namespace util
 } // namespace fds
 
@@ -1,22 +1,123 @@
 /*
  * Copyright 2015 Formation Data Systems, Inc.
  */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <sched.h>
 #include <util/Log.h>
 #include <concurrency/LFThreadpool.h>
 
 namespace fds {
 
+/* Owns a cache for the lifetime of its thread */
+struct LFTaskCacheOwner {
+    LFTaskCacheOwner();
+    ~LFTaskCacheOwner();
+
+    LFTaskCache *cache;
+
+    /* Caches of threads that exited, with whatever tasks they still had */
+    static std::mutex unownedLock;
+    static LFTaskCache *unowned;
+};
+
+std::mutex LFTaskCacheOwner::unownedLock;
+LFTaskCache *LFTaskCacheOwner::unowned = nullptr;
+
+LFTaskCacheOwner::LFTaskCacheOwner()
+{
+    std::lock_guard<std::mutex> l(unownedLock);
+    if (unowned) {
+        cache = unowned;
+        unowned = cache->nextUnowned_;
+        cache->nextUnowned_ = nullptr;
+    } else {
+        cache = new LFTaskCache();
+    }
+}
+
+LFTaskCacheOwner::~LFTaskCacheOwner()
+{
+    /* Tasks of ours other threads still hold keep coming back to the cache,
+     * so rather than free it we hand it to the next thread */
+    std::lock_guard<std::mutex> l(unownedLock);
+    cache->nextUnowned_ = unowned;
+    unowned = cache;
+}
+
+LFTaskCache* LFTaskCache::local()
+{
+    static thread_local LFTaskCacheOwner owner;
+    return owner.cache;
+}
+
+LFTask* LFTaskCache::alloc()
+{
+    if (free_ == nullptr) {
+        free_ = remoteFree_.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (free_ == nullptr) {
+        auto task = new LFTask();
+        task->owner_ = this;
+        return task;
+    }
+    auto task = free_;
+    free_ = task->next_;
+    task->next_ = nullptr;
+    return task;
+}
+
+void LFTaskCache::free(LFTask *task)
+{
+    if (this == local()) {
+        task->next_ = free_;
+        free_ = task;
+        return;
+    }
+    /* Push only, the owner takes the whole list at once, so no ABA */
+    auto head = remoteFree_.load(std::memory_order_relaxed);
+    do {
+        task->next_ = head;
+    } while (!remoteFree_.compare_exchange_weak(head, task,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+}
+
+LFTask* LFTask::alloc()
+{
+    return LFTaskCache::local()->alloc();
+}
+
+void LFTask::free(LFTask *task)
+{
+    task->destroy_(task->fn_);
+    task->fn_ = nullptr;
+    task->owner_->free(task);
+}
+
 LockfreeWorker::LockfreeWorker(LFMQThreadpool *parent,
                                const std::string &threadpoolId, bool steal,
-                               std::vector<LockfreeWorker*> &peers)
+                               std::vector<LockfreeWorker*> &peers,
+                               int cpu)
 :  queueCnt(0),
+stealableCnt(0),
+idle(false),
+wakeWord(0),
 parent_(parent),
 id_(threadpoolId),
 steal_(steal),
 peers_(peers),
 state_(INIT),
+cpu_(cpu),
+index_(0),
 tasks(1500),
+pinnedTasks(1500),
+worker(nullptr),
 completedCntr(0),
+stolenCntr(0),
 threadCheckCntr(-1)
 {
 }
@@ -33,11 +134,10 @@ void LockfreeWorker::finish()
     }
     state_ = ABORTING;
     while (state_ == ABORTING) {
-        /* We loop here because it's possible in workLoop() to miss a wake up.
-         * when we are aborting we loop until worker thread wakes up and exits
-         * cleanly
+        /* We loop here in case the worker is busy with a task and doesn't
+         * see ABORTING before it next goes to sleep
          */
-        my_futex(&queueCnt, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        wake();
         std::this_thread::sleep_for(std::chrono::microseconds(500));
     }
     fds_assert(state_ == ABORTED);
@@ -46,180 +146,180 @@ void LockfreeWorker::finish()
     worker = nullptr;
 }
 
-void LockfreeWorker::enqueue(LockFreeTask *t)
+void LockfreeWorker::wake()
+{
+    __sync_fetch_and_add(&wakeWord, 1);
+    my_futex(&wakeWord, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void LockfreeWorker::enqueue(LFTask *t, bool pinned)
 {
     // enqueue a task.
     // The order of operation is important.
     // 1) enqueue
     // 2) increment the queue count
-    // 3) signal a waiter.
-    bool ret = tasks.push(t);
-
-    if (ret) {
-        // increment the queue count.
-        __sync_fetch_and_add(&queueCnt, 1);
-
-        // Wake up one.
-        //
-        // TODO(Sean)
-        // This is doing a supurious wakeup.  Will need a way to prevent sending
-        // signal if possible.  Will need some state/hand shake between
-        // enqueue and workLoop.  Not sure how to do it yet.
-        my_futex(&queueCnt, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    // 3) check whether the worker is idle.  The worker sets idle before it
+    //    checks the queue count for the last time, so either it sees our task
+    //    or we see it idle and wake it.
+    bool ret = pinned ? pinnedTasks.push(t) : tasks.push(t);
+    fds_verify(ret == true);
+    if (!pinned) {
+        ++stealableCnt;
+    }
+    ++queueCnt;
+
+    if (idle) {
+        wake();
+    } else if (!pinned && steal_ && parent_->idleCnt > 0) {
+        /* We're busy, have an idle peer take it */
+        for (auto peer : peers_) {
+            if (peer != this && peer->idle) {
+                peer->wake();
+                break;
+            }
+        }
     }
 }
 
-void LockfreeWorker::workLoop() {
-    /* Set id to be combination of threadpool id and this thread id */
-    std::stringstream ss;
-    ss << id_ << ":" << std::hex<< std::this_thread::get_id() << std::dec;
-    id_ = ss.str();
-
-    GLOGNOTIFY << "Starting LFThread worker id: " << id_;
-
-    for (;;)
-    {
-        LockFreeTask *task;
-        int old_queueCnt, new_queueCnt;
-
-        // TODO (Sean)
-        // This block of code and a work() block of code is the same.  Need
-        // to refactor them.  But for now, leaving them as is.
-        //
-        // The block of code in work() is better commented, so refer
-        // to it for better explanation of the code.
-        while (true) {
-            bool dequeued = false;
-
-            task = NULL;
-            if (queueCnt == 0) {
-                // block if the queueCnt is 0.  The actual value of queueCnt and
-                // expected value is atomically checked.
-                // Although we intially entered this scope due to queueCnt == 0,
-                // by the time we get here, the state can change where we don't
-                // block here.
-                my_futex(&queueCnt, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
-
-                if (state_ == ABORTING) {
-                    state_ = ABORTED;
-                    return;
-                }
-
-                // TODO(Sean)
-                // This cmpxchg loop and the the one in the next block is the same.
-                // For some reason, during the testing, when re-factored the code, it
-                // wasn't working.  Could be a bug in  how I re-factored it, but for
-                // now leave it and revisit re-factoring later.
-                //
-                // See if we  can dequeue.  The steps are (important to maintain the order):
-                // 1) try to decrement atomically in cmpxchg loop.
-                //      1.1) if successful, thene we can dequeue a task.
-                //      1.2) if unsuccessful (i.e. queue is already empty), do nothing.
-                dequeued = true;
-                uint64_t cmpxchgMissed = 0;
-                do {
-                    // This is a minor optimization to pause/yield current running logical
-                    // processor to the other logical processor on the core.
-                    // This will kick in if cmpxchg fails too many times, which implies heavy
-                    // contention on the queueCnt.
-                    if (cmpxchgMissed & CPU_RELAX_FREQ) {
-                        cpu_relax();
-                    } else {
-                        ++cmpxchgMissed;
-                    }
-
-                    old_queueCnt = queueCnt;
-                    fds_assert(old_queueCnt >= 0);
-
-                    if (old_queueCnt == 0) {
-                        // If the count is 0, then there is nothing in the queue.
-                        // Do nothing and restart the outer loop.
-                        dequeued = false;
-                        break;
-                    }
-
-                    new_queueCnt = old_queueCnt - 1;
-
-
-                } while (!__sync_bool_compare_and_swap(&queueCnt, old_queueCnt, new_queueCnt));
-
-                // the count says we found something.  Now, grab a task.
-                if (dequeued) {
-                    fds_verify(tasks.pop(task));
-                }
-            } else {
-                dequeued = true;
-                uint64_t cmpxchgMissed = 0;
-                do {
-
-                    // This is a minor optimization to pause/yield current running logical
-                    // processor to the other logical processor on the core.
-                    // This will kick in if cmpxchg fails too many times, which implies heavy
-                    // contention on the queueCnt.
-                    if (cmpxchgMissed & CPU_RELAX_FREQ) {
-                        if (state_ == ABORTING) {
-                            state_ = ABORTED;
-                            return;
-                        }
-
-                        cpu_relax();
-                    } else {
-                        ++cmpxchgMissed;
-                    }
-
-                    old_queueCnt = queueCnt;
-                    fds_assert(old_queueCnt >= 0);
+bool LockfreeWorker::reserve_()
+{
+    int cnt = queueCnt.load();
+    while (cnt > 0) {
+        if (queueCnt.compare_exchange_weak(cnt, cnt - 1)) {
+            return true;
+        }
+        cpu_relax();
+    }
+    return false;
+}
 
-                    if (old_queueCnt == 0) {
-                        dequeued = false;
-                        break;
-                    }
+LFTask* LockfreeWorker::popReserved_()
+{
+    /* The reservation leaves a task in one of the queues for us.  Peers only
+     * take from tasks with a reservation of their own, so this only loops
+     * if the queues are momentarily contended.
+     */
+    LFTask *task = nullptr;
+    while (!pinnedTasks.pop(task)) {
+        if (tasks.pop(task)) {
+            --stealableCnt;
+            break;
+        }
+        cpu_relax();
+    }
+    return task;
+}
 
-                    new_queueCnt = old_queueCnt - 1;
+bool LockfreeWorker::canSteal_() const
+{
+    for (auto peer : peers_) {
+        if (peer != this && !peer->idle && peer->stealableCnt > 0) {
+            return true;
+        }
+    }
+    return false;
+}
 
-                } while (!__sync_bool_compare_and_swap(&queueCnt, old_queueCnt, new_queueCnt));
-                if (dequeued) {
-                    fds_verify(tasks.pop(task));
-                }
-            }
+LFTask* LockfreeWorker::stealFromPeers_()
+{
+    auto n = peers_.size();
+    for (uint32_t i = 1; i < n; i++) {
+        auto peer = peers_[(index_ + i) % n];
+        /* Idle peers will get to their own tasks */
+        if (peer->idle || peer->stealableCnt <= 0 || !peer->reserve_()) {
+            continue;
+        }
+        LFTask *task = nullptr;
+        if (peer->tasks.pop(task)) {
+            --peer->stealableCnt;
+            ++stolenCntr;
+            return task;
+        }
+        /* Only pinned tasks left, give the reservation back */
+        ++peer->queueCnt;
+        if (peer->idle) {
+            peer->wake();
+        }
+    }
+    return nullptr;
+}
 
-            // If something is dequeued, then call the function.
-            if (dequeued) {
-                fds_verify(NULL != task);
-                fds_verify(task);
-                try {
-                    DBG(auto preTaskTimeMs = util::getTimeStampMillis());
-                    threadCheckCntr = parent_->threadCheckCntr;
+void LockfreeWorker::runTask_(LFTask *task)
+{
+    try {
+        DBG(auto preTaskTimeMs = util::getTimeStampMillis());
+        threadCheckCntr = parent_->threadCheckCntr;
 
-                    task->operator()();
+        task->operator()();
 
 #ifdef DEBUG
-                    auto postTaskTimeMs = util::getTimeStampMillis();
-                    if (postTaskTimeMs - preTaskTimeMs > 5000) { \
-                        GLOGWARN << logString() <<  " last task execution took: "
-                            << postTaskTimeMs - preTaskTimeMs
-                            << "ms. Consider breaking up the task";
-                    }
+        auto postTaskTimeMs = util::getTimeStampMillis();
+        if (postTaskTimeMs - preTaskTimeMs > 5000) { \
+            GLOGWARN << logString() <<  " last task execution took: "
+                << postTaskTimeMs - preTaskTimeMs
+                << "ms. Consider breaking up the task";
+        }
 #endif
-                } catch (std::bad_alloc const& e) {
-                    fds_panic("Failed allocation of memory: %s : calling %s\n", e.what(), task->target_type().name());
-                } catch (std::invalid_argument const& e) {
-                    fds_panic("invalid_argument exception : %s : calling %s\n", e.what(), task->target_type().name());
-                } catch (std::exception const& e) {
-                    fds_panic("std::exception : %s : calling %s\n", e.what(), task->target_type().name());
-                } catch (...) {
-                    fds_panic("unknown exception : calling %s !\n", task->target_type().name());
-                }
-                threadCheckCntr = -1;  // indicates thread is idle
-                delete task;
-            } else {
-                fds_assert(NULL == task);
-            }
+    } catch (std::bad_alloc const& e) {
+        fds_panic("Failed allocation of memory: %s : calling %s\n", e.what(), task->name());
+    } catch (std::invalid_argument const& e) {
+        fds_panic("invalid_argument exception : %s : calling %s\n", e.what(), task->name());
+    } catch (std::exception const& e) {
+        fds_panic("std::exception : %s : calling %s\n", e.what(), task->name());
+    } catch (...) {
+        fds_panic("unknown exception : calling %s !\n", task->name());
+    }
+    threadCheckCntr = -1;  // indicates thread is idle
+    ++completedCntr;
+    LFTask::free(task);
+}
 
-        }  // while (true)
+void LockfreeWorker::workLoop() {
+    /* Set id to be combination of threadpool id and this thread id */
+    std::stringstream ss;
+    ss << id_ << ":" << std::hex<< std::this_thread::get_id() << std::dec;
+    id_ = ss.str();
 
+    index_ = std::find(peers_.begin(), peers_.end(), this) - peers_.begin();
+    if (cpu_ >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu_, &cpuset);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (ret != 0) {
+            GLOGWARN << "Failed to pin LFThread worker id: " << id_
+                << " to cpu: " << cpu_ << " error: " << strerror(ret);
+        }
+    }
 
-    }  // for (;;)
+    GLOGNOTIFY << "Starting LFThread worker id: " << id_;
+
+    while (state_ != ABORTING) {
+        LFTask *task = nullptr;
+        if (reserve_()) {
+            task = popReserved_();
+        } else if (steal_) {
+            task = stealFromPeers_();
+        }
+        if (task) {
+            runTask_(task);
+            continue;
+        }
+
+        /* Nothing to run, sleep till woken.  Enqueuers check idle after
+         * queueing, so either they see it set and bump wakeWord, or we see
+         * their task below.
+         */
+        idle = true;
+        ++parent_->idleCnt;
+        int seq = __atomic_load_n(&wakeWord, __ATOMIC_SEQ_CST);
+        if (queueCnt == 0 && state_ != ABORTING && !(steal_ && canSteal_())) {
+            my_futex(&wakeWord, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        }
+        --parent_->idleCnt;
+        idle = false;
+    }
+    state_ = ABORTED;
 }
 
 std::string LockfreeWorker::logString() const
@@ -227,13 +327,16 @@ std::string LockfreeWorker::logString() const
     return id_;
 }
 
-LFMQThreadpool::LFMQThreadpool(const std::string &id, uint32_t sz, bool steal)
+LFMQThreadpool::LFMQThreadpool(const std::string &id, uint32_t sz, bool steal,
+                               const std::vector<int> &cpus)
 : workers(sz),
     idx(0),
-    threadCheckCntr(0)
+    threadCheckCntr(0),
+    idleCnt(0)
 {
     for (uint32_t i = 0; i < workers.size(); i++) {
-        workers[i] = new LockfreeWorker(this, id, steal, workers);
+        workers[i] = new LockfreeWorker(this, id, steal, workers,
+                                        cpus.empty() ? -1 : cpus[i % cpus.size()]);
     }
     for (uint32_t i = 0; i < workers.size(); i++) {
         workers[i]->start();
@@ -247,8 +350,11 @@ LFMQThreadpool::LFMQThreadpool(uint32_t sz, bool steal)
 
 LFMQThreadpool::~LFMQThreadpool()
 {
+    /* All of them first, as workers look at their peers to steal */
     for (auto &w : workers) {
         w->finish();
+    }
+    for (auto &w : workers) {
         delete w;
     }
 }
@@ -272,6 +378,45 @@ void LFMQThreadpool::stop()
     }
 }
 
+std::vector<int> LFMQThreadpool::parseCpuList(const std::string &cpuList)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(cpuList);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.find_first_not_of(" \t\n") == std::string::npos) {
+            continue;
+        }
+        int first, last;
+        int cnt = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (cnt == 1) {
+            last = first;
+        } else if (cnt != 2) {
+            return std::vector<int>();
+        }
+        if (first < 0 || last < first) {
+            return std::vector<int>();
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+std::vector<int> LFMQThreadpool::numaNodeCpus(int node)
+{
+    if (node < 0) {
+        return std::vector<int>();
+    }
+    std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string cpuList;
+    if (!std::getline(f, cpuList)) {
+        return std::vector<int>();
+    }
+    return parseCpuList(cpuList);
+}
+
 LFSQThreadpool::LFSQThreadpool(uint32_t sz)
 : workers(sz),
     tasks(1500),
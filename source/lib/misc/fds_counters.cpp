@@ -96,6 +96,7 @@ std::string FdsCountersMgr::export_as_graphite()
     std::time_t ts = std::time(NULL);
 
     for (auto counters : exp_counters_) {
+        counters->aggregate();
         std::string counters_id = counters->id();
         for (auto c : counters->exp_counters_) {
             bool lat = typeid(*c) == typeid(LatencyCounter);
@@ -124,6 +125,7 @@ void FdsCountersMgr::export_to_ostream(std::ostream &stream)  // NOLINT
     fds_mutex::scoped_lock lock(counters_lock_);
 
     for (auto counters : exp_counters_) {
+        counters->aggregate();
         std::string counters_id = counters->id();
         for (auto c : counters->exp_counters_) {
             bool lat = typeid(*c) == typeid(LatencyCounter);
@@ -151,6 +153,7 @@ void FdsCountersMgr::toMap(std::map<std::string, int64_t>& m)
     fds_mutex::scoped_lock lock(counters_lock_);
 
     for (auto counters : exp_counters_) {
+        counters->aggregate();
         std::string counters_id = counters->id();
         for (auto c : counters->exp_counters_) {
             c->toMap(m);
@@ -159,6 +162,26 @@ void FdsCountersMgr::toMap(std::map<std::string, int64_t>& m)
     }
 }
 
+/**
+ * Converts counters identified by id to map, without resetting them
+ * @param id
+ * @param m
+ * @return false if there are no such counters
+ */
+bool FdsCountersMgr::toMap(const std::string &id, std::map<std::string, int64_t>& m)
+{
+    fds_mutex::scoped_lock lock(counters_lock_);
+
+    for (auto counters : exp_counters_) {
+        if (counters->id() == id) {
+            counters->aggregate();
+            counters->toMap(m);
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * reset counters
  */
@@ -166,6 +189,7 @@ void FdsCountersMgr::reset()
 {
     fds_mutex::scoped_lock lock(counters_lock_);
     for (auto counters : exp_counters_) {
+        counters->aggregate();
         counters->reset();
     }
 }
@@ -625,6 +649,18 @@ void LatencyCounter::update(const uint64_t &val, uint64_t cnt /* = 1 */) {
     }
 }
 
+void LatencyCounter::merge(const uint64_t &total_latency, uint64_t cnt,
+                           uint64_t min_latency, uint64_t max_latency) {
+    total_latency_.fetch_add(total_latency);
+    cnt_.fetch_add(cnt);
+    if (min_latency < min_latency_.load()) {
+        min_latency_.store(min_latency);
+    }
+    if (max_latency > max_latency_.load()) {
+        max_latency_.store(max_latency);
+    }
+}
+
 LatencyCounter & LatencyCounter::operator +=(const LatencyCounter & rhs) {
     if (&rhs != this) {
         update(rhs.total_latency(), rhs.count());
@@ -648,6 +684,11 @@ void LatencyCounter::toMap(std::map<std::string, int64_t>& m) const {
     std::string strId = id() + (volid_enable()? "." + volString : "");
     m[strId + ".latency"] = static_cast<int64_t>(value());
     m[strId + ".count"] = static_cast<int64_t>(count());
+    m[strId + ".total"] = static_cast<int64_t>(total_latency());
+    if (count()) {
+        m[strId + ".min"] = static_cast<int64_t>(min_latency());
+        m[strId + ".max"] = static_cast<int64_t>(max_latency());
+    }
 }
 
 /*****************************************************************************
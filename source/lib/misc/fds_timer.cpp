@@ -2,6 +2,7 @@
  * Copyright 2013 Formation Data Systems, Inc.
  */
 
+#include <algorithm>
 #include <fds_globals.h>
 #include <fds_timer.h>
 #include <util/Log.h>
@@ -9,13 +10,19 @@
 namespace fds
 {
 FdsTimerTask::FdsTimerTask()
+    : state_(TASK_STATE_UNINIT),
+      gen_(0),
+      wheelPprev_(nullptr),
+      wheelNext_(nullptr),
+      wheelGen_(0),
+      wheelTick_(0),
+      wheelPeriod_(0)
 {
-    state_ = TASK_STATE_UNINIT;
 }
 
 FdsTimerTask::FdsTimerTask(FdsTimer &fds_timer)
+    : FdsTimerTask()
 {
-    state_ = TASK_STATE_UNINIT;
 }
 
 FdsTimerTask::~FdsTimerTask()
@@ -49,13 +56,30 @@ FdsTimer::FdsTimer()
 : FdsTimer("") {
 }
 
+const uint32_t FdsTimer::WHEEL_SLOT_BITS;
+const uint32_t FdsTimer::WHEEL_SLOTS;
+const uint32_t FdsTimer::WHEEL_LEVELS;
+const uint32_t FdsTimer::WHEEL_STRIPES;
+
 /**
  * Constructor
  */
 FdsTimer::FdsTimer(const std::string &id)
+: FdsTimer(id, nullptr) {
+}
+
+/**
+ * Constructor
+ */
+FdsTimer::FdsTimer(const std::string &id, const std::function<uint64_t ()> &tickSource)
 : id_(std::string("FdsTimer:") + id + std::string(": ")),
+    startTime_(std::chrono::steady_clock::now()),
+    tickSource_(tickSource),
+    curTick_(0),
+    wheelTaskCnt_(0),
+    wakeTick_(0),
+    wakeRequested_(false),
     abortCntr_(0),
-    timerThreadSleepMs_(1000),
     timerThread_(std::bind(&FdsTimer::runTimerThread_, this))
 {
 }
@@ -67,6 +91,7 @@ void FdsTimer::destroy()
 {
     int prevAbortCnt = abortCntr_++;
     if (prevAbortCnt == 0) {
+        wake();
         timerThread_.join();
     }
 }
@@ -78,23 +103,199 @@ void FdsTimer::destroy()
  */
 bool FdsTimer::cancel(const FdsTimerTaskPtr& task)
 {
-    lock_.lock();
-    /*
-       fds_assert(task->state_ == TASK_STATE_SCHEDULED_ONCE ||
-       task->state_ == TASK_STATE_SCHEDULED_REPEAT ||
-       task->state_ == TASK_STATE_COMPLETE);
-       */
-    pendingTasks_.erase(task);
     task->state_ = TASK_STATE_CANCELLED;
-    lock_.unlock();
+    auto gen = ++task->gen_;
+    /* Lets the timer thread drop the task from the wheel, and its reference */
+    pushOp_(TimerOp{task, gen, 0, std::chrono::milliseconds(0)});
     return true;
 }
 
+void FdsTimer::wake()
+{
+    {
+        std::lock_guard<std::mutex> l(wakeLock_);
+        wakeRequested_ = true;
+    }
+    wakeCond_.notify_one();
+}
+
 std::string FdsTimer::log_string()
 {
     return id_;
 }
 
+uint64_t FdsTimer::nowTick_() const
+{
+    if (tickSource_) {
+        return tickSource_();
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - startTime_).count();
+}
+
+void FdsTimer::pushOp_(TimerOp &&op)
+{
+    /* Threads are spread over the stripes in the order they first get here */
+    static std::atomic<uint32_t> nextStripe(0);
+    static thread_local uint32_t stripe = nextStripe++ % WHEEL_STRIPES;
+
+    auto tick = op.tick;
+    {
+        std::lock_guard<std::mutex> l(stripes_[stripe].lock);
+        stripes_[stripe].ops.push_back(std::move(op));
+    }
+    /* Checked after queueing, the timer thread rechecks the stripes after
+     * setting wakeTick_, so one of us sees the other */
+    if (tick != 0 && tick < wakeTick_) {
+        wake();
+    }
+}
+
+/**
+ * Applies the buffered schedules and cancels to the wheel.  Only the op of a
+ * task's latest schedule or cancel is current, any older ones are dropped.
+ * @return true if any task was added
+ */
+bool FdsTimer::applyOps_()
+{
+    bool added = false;
+    std::vector<TimerOp> ops;
+    for (auto &stripe : stripes_) {
+        {
+            std::lock_guard<std::mutex> l(stripe.lock);
+            if (stripe.ops.empty()) {
+                continue;
+            }
+            ops.swap(stripe.ops);
+        }
+        for (auto &op : ops) {
+            auto task = op.task.get();
+            if (task->wheelRef_ && task->wheelGen_ != task->gen_) {
+                unlink_(task);
+            }
+            if (op.tick == 0 || op.gen != task->gen_ || task->wheelRef_) {
+                continue;
+            }
+            task->wheelRef_ = op.task;
+            task->wheelGen_ = op.gen;
+            task->wheelTick_ = op.tick;
+            task->wheelPeriod_ = op.period;
+            link_(task);
+            added = true;
+        }
+        ops.clear();
+    }
+    return added;
+}
+
+/**
+ * Links the task into the slot for its tick, on the lowest level whose turn
+ * covers it.  Tasks due already go in the next tick's slot.
+ */
+void FdsTimer::link_(FdsTimerTask *task)
+{
+    uint64_t tick = std::max(task->wheelTick_, curTick_ + 1);
+    uint64_t delta = tick - curTick_;
+    uint32_t level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= (static_cast<uint64_t>(1) << (WHEEL_SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+    if (delta >= (static_cast<uint64_t>(1) << (WHEEL_SLOT_BITS * WHEEL_LEVELS))) {
+        /* Beyond the wheel, park it in the furthest slot and relink from there */
+        tick = curTick_ + (static_cast<uint64_t>(1) << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1;
+    }
+    auto &slot = wheel_[level][(tick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1)];
+    task->wheelNext_ = slot.head;
+    if (slot.head) {
+        slot.head->wheelPprev_ = &task->wheelNext_;
+    }
+    task->wheelPprev_ = &slot.head;
+    slot.head = task;
+    ++wheelTaskCnt_;
+}
+
+void FdsTimer::unlink_(FdsTimerTask *task)
+{
+    *task->wheelPprev_ = task->wheelNext_;
+    if (task->wheelNext_) {
+        task->wheelNext_->wheelPprev_ = task->wheelPprev_;
+    }
+    task->wheelPprev_ = nullptr;
+    task->wheelNext_ = nullptr;
+    --wheelTaskCnt_;
+    /* May drop the last reference, so last */
+    task->wheelRef_.reset();
+}
+
+/**
+ * Moves the tasks of a slot one level down, as the level below starts the
+ * turn the slot spans
+ */
+void FdsTimer::cascade_(uint32_t level, uint32_t slot)
+{
+    auto task = wheel_[level][slot].head;
+    wheel_[level][slot].head = nullptr;
+    while (task) {
+        auto next = task->wheelNext_;
+        --wheelTaskCnt_;
+        link_(task);
+        task = next;
+    }
+}
+
+/**
+ * Takes the tasks due at curTick_ off the wheel, relinking repeated ones
+ * @param due - the tasks to run, with the generation they were scheduled with
+ */
+void FdsTimer::expire_(std::vector<std::pair<FdsTimerTaskPtr, uint64_t>> &due)
+{
+    auto &slot = wheel_[0][curTick_ & (WHEEL_SLOTS - 1)];
+    auto task = slot.head;
+    slot.head = nullptr;
+    while (task) {
+        auto next = task->wheelNext_;
+        --wheelTaskCnt_;
+        task->wheelPprev_ = nullptr;
+        task->wheelNext_ = nullptr;
+        if (task->wheelGen_ != task->gen_) {
+            /* Cancelled or rescheduled, and its op not applied yet */
+            task->wheelRef_.reset();
+        } else if (task->wheelTick_ > curTick_) {
+            /* Was parked beyond the wheel */
+            link_(task);
+        } else {
+            due.emplace_back(task->wheelRef_, task->wheelGen_);
+            if (task->wheelPeriod_.count() > 0) {
+                task->wheelTick_ = curTick_ + task->wheelPeriod_.count();
+                link_(task);
+            } else {
+                task->wheelRef_.reset();
+            }
+        }
+        task = next;
+    }
+}
+
+/**
+ * @return the tick the timer thread has to wake at: the next one with tasks
+ * due on the first level, or the end of its turn to cascade from the levels
+ * above.  UINT64_MAX when the wheel is empty.
+ */
+uint64_t FdsTimer::nextDueTick_() const
+{
+    if (wheelTaskCnt_ == 0) {
+        return UINT64_MAX;
+    }
+    uint64_t turnEnd = (curTick_ | (WHEEL_SLOTS - 1)) + 1;
+    for (uint64_t tick = curTick_ + 1; tick < turnEnd; ++tick) {
+        if (wheel_[0][tick & (WHEEL_SLOTS - 1)].head) {
+            return tick;
+        }
+    }
+    return turnEnd;
+}
+
 void FdsTimer::runTimerThread_()
 {
     /* This wait is needed because of races in initializing g_fdslog.  There are global
@@ -108,25 +309,30 @@ void FdsTimer::runTimerThread_()
 
     GLOGNORMAL << log_string() << " Timer thread started...";
 
+    std::vector<std::pair<FdsTimerTaskPtr, uint64_t>> due;
     while (abortCntr_ == 0) {
-        // TODO(Rao): Improve this sleep below so that it services tasks
-        // more promptly than every timerThreadSleepMs_
-        auto cur_time_pt = std::chrono::system_clock::now();
-        /* drain the expired tasks */
-        lock_.lock();
-        while (pendingTasks_.size() > 0) {
-            auto task = *(pendingTasks_.begin());
-            if (task->getExpiryTime() <= cur_time_pt) {
-                pendingTasks_.erase(pendingTasks_.begin());
-                fds_assert(task->state_ == TASK_STATE_SCHEDULED_ONCE ||
-                           task->state_ == TASK_STATE_SCHEDULED_REPEAT);
-                if (task->state_ == TASK_STATE_SCHEDULED_REPEAT) {
-                    task->expTime_ = std::chrono::system_clock::now() + task->durationMs_;
-                    pendingTasks_.insert(task);
-                } else {
-                    task->state_ = TASK_STATE_COMPLETE;
+        applyOps_();
+        auto now = nowTick_();
+        while (curTick_ < now) {
+            ++curTick_;
+            /* Each level wrapping around starts the next slot's turn above it */
+            uint64_t tick = curTick_;
+            for (uint32_t level = 1;
+                 level < WHEEL_LEVELS && (tick & (WHEEL_SLOTS - 1)) == 0;
+                 ++level) {
+                tick >>= WHEEL_SLOT_BITS;
+                cascade_(level, tick & (WHEEL_SLOTS - 1));
+            }
+            expire_(due);
+
+            for (auto &d : due) {
+                auto &task = d.first;
+                if (task->gen_ != d.second) {
+                    /* Cancelled while we were running the ones before it */
+                    continue;
                 }
-                lock_.unlock();
+                auto scheduledOnce = TASK_STATE_SCHEDULED_ONCE;
+                task->state_.compare_exchange_strong(scheduledOnce, TASK_STATE_COMPLETE);
 
                 try {
                     task->runTimerTask();
@@ -137,21 +343,45 @@ void FdsTimer::runTimerThread_()
                     GLOGERROR << log_string() << "Unknown exception on timer thread: "
                         << ".  Ignoring and continuing timer thread";
                 }
+            }
+            due.clear();
+        }
 
-                lock_.lock();
-            } else {
-                break;
+        /* Go back to sleep till the next tick with work, unless something
+         * sooner gets scheduled meanwhile */
+        uint64_t wakeTick;
+        do {
+            wakeTick = nextDueTick_();
+            wakeTick_ = wakeTick;
+        } while (applyOps_());
+
+        std::unique_lock<std::mutex> l(wakeLock_);
+        auto woken = [this]() { return wakeRequested_ || abortCntr_ != 0; };
+        if (wakeTick == UINT64_MAX || tickSource_) {
+            wakeCond_.wait(l, woken);
+        } else {
+            wakeCond_.wait_until(l, startTime_ + std::chrono::milliseconds(wakeTick), woken);
+        }
+        wakeRequested_ = false;
+    }
+
+    /* Drop the references to the tasks still scheduled */
+    for (auto &level : wheel_) {
+        for (auto &slot : level) {
+            while (slot.head) {
+                unlink_(slot.head);
             }
         }
-        lock_.unlock();
-        /* go back to sleep */
-        std::this_thread::sleep_for(std::chrono::milliseconds(timerThreadSleepMs_));
+    }
+    for (auto &stripe : stripes_) {
+        std::lock_guard<std::mutex> l(stripe.lock);
+        stripe.ops.clear();
     }
 
     GLOGNORMAL << log_string() << "Timer thread exited...";
 }
 
-SHPTR<FdsTimerTask> FdsTimer::scheduleFunction(const std::chrono::seconds &time,
+SHPTR<FdsTimerTask> FdsTimer::scheduleFunction(const std::chrono::milliseconds &time,
                                                const std::function<void()> &f)
 {
     auto task = SHPTR<FdsTimerTask>(new FdsTimerFunctionTask(f));
@@ -159,7 +389,7 @@ SHPTR<FdsTimerTask> FdsTimer::scheduleFunction(const std::chrono::seconds &time,
     return task;
 }
 
-SHPTR<FdsTimerTask> FdsTimer::scheduledFunctionRepeated(const std::chrono::seconds &time,
+SHPTR<FdsTimerTask> FdsTimer::scheduledFunctionRepeated(const std::chrono::milliseconds &time,
                                                        const std::function<void()> &f)
 {
     auto task = SHPTR<FdsTimerTask>(new FdsTimerFunctionTask(f));
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#include <fds_trace.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <json/json.h>
+#include <util/timeutils.h>
+
+namespace fds {
+
+namespace {
+
+const char *stageNames[] = {
+    "AM_START",
+    "AM_DONE",
+    "QOS_ENQUEUE",
+    "QOS_DISPATCH",
+    "IO_DONE",
+    "VG_SEND",
+    "VG_DONE",
+    "SVC_SEND",
+    "SVC_RECV",
+    "SVC_RESP_SEND",
+    "SVC_RESP_RECV"
+};
+static_assert(sizeof(stageNames) / sizeof(stageNames[0]) ==
+              static_cast<size_t>(TraceStage::MAX), "Name every trace stage");
+
+/* Trace ids are a random per process base plus a counter */
+const uint32_t TRACE_ID_COUNTER_BITS = 40;
+
+struct TraceStateProvider : StateProvider {
+    std::string getStateInfo() override {
+        return RequestTracer::dump();
+    }
+    std::string getStateProviderId() override {
+        return "requesttrace";
+    }
+};
+
+}  // namespace
+
+const char* traceStageName(const TraceStage &stage)
+{
+    return (stage < TraceStage::MAX) ? stageNames[static_cast<size_t>(stage)] : "UNKNOWN";
+}
+
+const uint32_t RequestTracer::DEFAULT_RING_ENTRIES;
+std::atomic<uint32_t> RequestTracer::sampleEvery_(0);
+std::atomic<uint32_t> RequestTracer::ringEntries_(RequestTracer::DEFAULT_RING_ENTRIES);
+std::atomic<uint64_t> RequestTracer::requestCnt_(0);
+std::atomic<uint64_t> RequestTracer::nextTraceId_(1);
+std::atomic<uint64_t> RequestTracer::traceIdBase_(0);
+thread_local uint64_t RequestTracer::current_ = 0;
+thread_local RequestTracer::Ring *RequestTracer::threadRing_ = nullptr;
+std::mutex RequestTracer::ringsLock_;
+std::vector<std::unique_ptr<RequestTracer::Ring>> RequestTracer::rings_;
+
+RequestTracer::Ring::Ring(uint32_t entryCnt)
+    : head(0),
+      tid(static_cast<int32_t>(syscall(SYS_gettid)))
+{
+    uint64_t cnt = 1;
+    while (cnt < entryCnt) {
+        cnt <<= 1;
+    }
+    mask = cnt - 1;
+    entries.reset(new Entry[cnt]);
+    for (uint64_t i = 0; i < cnt; i++) {
+        entries[i].seq = 0;
+        entries[i].traceId = 0;
+        entries[i].ts = 0;
+        entries[i].stageDetail = 0;
+    }
+}
+
+void RequestTracer::configure(uint32_t sampleEvery, uint32_t ringEntries)
+{
+    {
+        std::lock_guard<std::mutex> l(ringsLock_);
+        if (!traceIdBase_.load(std::memory_order_relaxed)) {
+            /* Keep ids of different processes apart */
+            std::random_device rd;
+            auto base = (static_cast<uint64_t>(rd()) << 32 | rd()) << TRACE_ID_COUNTER_BITS;
+            traceIdBase_.store(base ? base : (1ULL << TRACE_ID_COUNTER_BITS),
+                               std::memory_order_relaxed);
+        }
+    }
+    ringEntries_ = std::max(ringEntries, 1u);
+    sampleEvery_ = sampleEvery;
+}
+
+uint64_t RequestTracer::sample_(uint32_t every)
+{
+    /* Counted across threads so the rate holds however requests are spread */
+    if (requestCnt_.fetch_add(1, std::memory_order_relaxed) % every != 0) {
+        return 0;
+    }
+    auto cntr = nextTraceId_.fetch_add(1, std::memory_order_relaxed);
+    return traceIdBase_.load(std::memory_order_relaxed) |
+            (cntr & ((1ULL << TRACE_ID_COUNTER_BITS) - 1));
+}
+
+RequestTracer::Ring* RequestTracer::ring_()
+{
+    if (!threadRing_) {
+        std::unique_ptr<Ring> ring(new Ring(ringEntries_.load(std::memory_order_relaxed)));
+        threadRing_ = ring.get();
+        std::lock_guard<std::mutex> l(ringsLock_);
+        rings_.push_back(std::move(ring));
+    }
+    return threadRing_;
+}
+
+void RequestTracer::record_(uint64_t traceId, TraceStage stage, int32_t detail, uint64_t ts)
+{
+    auto ring = ring_();
+    auto idx = ring->head.load(std::memory_order_relaxed);
+    auto &entry = ring->entries[idx & ring->mask];
+    /* Mark the entry as being written before overwriting it, so dump() can
+     * tell a record torn by this write from a whole one
+     */
+    entry.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.traceId.store(traceId, std::memory_order_relaxed);
+    entry.ts.store(ts ? ts : util::getTimeStampNanos(), std::memory_order_relaxed);
+    entry.stageDetail.store(static_cast<uint64_t>(stage) << 32 | static_cast<uint32_t>(detail),
+                            std::memory_order_relaxed);
+    entry.seq.store(idx + 1, std::memory_order_release);
+    /* Publishes the entry to dump() */
+    ring->head.store(idx + 1, std::memory_order_release);
+}
+
+std::string RequestTracer::dump()
+{
+    struct Stage {
+        uint64_t ts;
+        uint64_t stageDetail;
+        int32_t tid;
+    };
+    std::map<uint64_t, std::vector<Stage>> traces;
+
+    {
+        std::lock_guard<std::mutex> l(ringsLock_);
+        for (auto &ring : rings_) {
+            auto size = ring->mask + 1;
+            auto end = ring->head.load(std::memory_order_acquire);
+            auto begin = (end > size) ? end - size : 0;
+            for (auto i = begin; i < end; i++) {
+                auto &entry = ring->entries[i & ring->mask];
+                auto seq = entry.seq.load(std::memory_order_acquire);
+                auto traceId = entry.traceId.load(std::memory_order_relaxed);
+                Stage stage{entry.ts.load(std::memory_order_relaxed),
+                            entry.stageDetail.load(std::memory_order_relaxed),
+                            ring->tid};
+                /* Drop the entry if the thread overwrote it, or started to,
+                 * while we copied
+                 */
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (seq != i + 1 || entry.seq.load(std::memory_order_relaxed) != seq) {
+                    continue;
+                }
+                traces[traceId].push_back(stage);
+            }
+        }
+    }
+
+    struct Trace {
+        uint64_t span;
+        uint64_t traceId;
+        std::vector<Stage> *stages;
+    };
+    std::vector<Trace> bySpan;
+    for (auto &kv : traces) {
+        auto &stages = kv.second;
+        std::sort(stages.begin(), stages.end(),
+                  [](const Stage &a, const Stage &b) { return a.ts < b.ts; });
+        bySpan.push_back(Trace{stages.back().ts - stages.front().ts, kv.first, &stages});
+    }
+    /* Slowest first */
+    std::sort(bySpan.begin(), bySpan.end(),
+              [](const Trace &a, const Trace &b) { return a.span > b.span; });
+
+    Json::Value state;
+    state["sampleEvery"] = static_cast<Json::Value::UInt>(sampleEvery_.load());
+    state["traces"] = Json::Value(Json::arrayValue);
+    for (auto &t : bySpan) {
+        auto &stages = *t.stages;
+        Json::Value trace;
+        std::stringstream id;
+        id << std::hex << t.traceId;
+        trace["traceId"] = id.str();
+        trace["spanUs"] = static_cast<Json::Value::UInt64>(t.span / 1000);
+        trace["stages"] = Json::Value(Json::arrayValue);
+        for (auto &stage : stages) {
+            Json::Value s;
+            s["ts"] = static_cast<Json::Value::UInt64>(stage.ts);
+            s["sinceStartUs"] = static_cast<Json::Value::UInt64>(
+                (stage.ts - stages.front().ts) / 1000);
+            s["stage"] = traceStageName(static_cast<TraceStage>(stage.stageDetail >> 32));
+            s["detail"] = static_cast<Json::Value::Int>(
+                static_cast<int32_t>(stage.stageDetail & 0xffffffff));
+            s["tid"] = stage.tid;
+            trace["stages"].append(s);
+        }
+        state["traces"].append(trace);
+    }
+
+    std::stringstream ss;
+    ss << state;
+    return ss.str();
+}
+
+StateProvider* RequestTracer::stateProvider()
+{
+    static TraceStateProvider provider;
+    return &provider;
+}
+
+}  // namespace fds
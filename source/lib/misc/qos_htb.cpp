@@ -6,30 +6,41 @@
  */
 #include "qos_htb.h"
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
 namespace fds {
 
 /***** QoSHTBDispatcher implementation ******/
 QoSHTBDispatcher::QoSHTBDispatcher(FDS_QoSControl *ctrl,
                                    fds_log *log,
-                                   fds_int64_t _total_iops)
+                                   fds_int64_t _total_iops,
+                                   fds_uint32_t _dispatchers,
+                                   fds_uint32_t _dispatch_batch)
     : FDS_QoSDispatcher(ctrl, log, _total_iops),
     total_iops(_total_iops),
     total_assured_rate(0),
     max_burst_size(20),
     wait_time_microsec(DEFAULT_ASSURED_WAIT_MICROSEC),
-    avail_pool(_total_iops, max_burst_size),
-    current_throttle_level(11)
+    current_throttle_level(11),
+    dispatch_batch(std::max(_dispatch_batch, 1u))
 {
     /* TODO: we need a good per-volume burst size value, sholdn't this be a max queue size at SM/DM? */
     default_que_burst_size = 20;
 
-    last_dispatch_qid = 0; /* this should be an invalid id */
+    auto const num_shards = std::max(_dispatchers, 1u);
+    for (fds_uint32_t i = 0; num_shards > i; ++i) {
+        shards.emplace_back(new HTBShard(total_iops / num_shards, max_burst_size));
+    }
+    updateAvailRates();
 }
 
 /* Returns ERR_INVALID_ARG if _total_rate < sum of all volumes' minimum rates */
 Error
 QoSHTBDispatcher::modifyTotalRate(fds_int64_t _total_iops)
 {
+    WriteGuard wg(qda_lock);
     /* do not modify if _total_rate is below total assured_rate of all volumes */
     if (_total_iops <= total_assured_rate) {
         /* for now we are not letting total rate go below volumes' total min rate */
@@ -37,16 +48,39 @@ QoSHTBDispatcher::modifyTotalRate(fds_int64_t _total_iops)
     }
     total_iops = _total_iops;
     /* only need to modify avail rate */
-    avail_pool.modifyRate(total_iops - total_assured_rate);
+    updateAvailRates();
+    wakeShards();
     return ERR_OK;
 }
 
+/* Splits the non-guaranteed rate between the shards, caller holds qda_lock for write */
+void
+QoSHTBDispatcher::updateAvailRates()
+{
+    /* for now we allow total_min_rate to exceed total_rate, means avail rate is 0,
+     * Even if avail_pool does not generate any tokens, it still gets unused
+     * assured tokens (from min_iops reservation) and shares them with other queues */
+    fds_uint64_t avail_rate = (total_iops > total_assured_rate) ? (total_iops - total_assured_rate) : 0;
+    for (auto& shard : shards) {
+        shard->base_avail_rate = avail_rate / shards.size();
+        shard->avail_pool.modifyRate(shard->base_avail_rate + shard->idle_assured_rate);
+    }
+}
+
+void
+QoSHTBDispatcher::wakeShards()
+{
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> g(shard->lock);
+        shard->wakeup = true;
+        shard->cv.notify_one();
+    }
+}
+
 Error
 QoSHTBDispatcher::registerQueue(fds_qid_t queue_id,
                                 FDS_VolumeQueue *queue)
 {
-    fds_int64_t new_total_min_rate = 0;
-    fds_int64_t new_total_avail_rate = 0;
     fds_int64_t q_assured_rate = queue->iops_assured;
     fds_int64_t q_throttle_rate = queue->iops_throttle;
 
@@ -94,19 +128,13 @@ QoSHTBDispatcher::registerQueue(fds_qid_t queue_id,
     }
 
     /* base class already checked that queue_id is valid and not already registered */
-    /* update total assured rate and avail rate */
+    /* update total assured rate and avail rate, the queue starts out idle so
+     * its assured rate is lent to the available pool until IOs arrive */
     total_assured_rate += q_assured_rate;
-    new_total_min_rate = total_assured_rate;
-    new_total_avail_rate = avail_pool.getRate();
-    if (new_total_avail_rate > q_assured_rate) {
-        new_total_avail_rate -= q_assured_rate;
-    } else {
-        /* for now we allow total_min_rate to exceed total_rate, means avail rate is 0,
-         * Even if avail_pool does not generate any tokens, it still gets unused
-         * assured tokens (from min_iops reservation) and shares them with other queues */
-        new_total_avail_rate = 0;
-    }
-    avail_pool.modifyRate(new_total_avail_rate);
+    lendAssuredRate(shardFor(queue_id), *qstate, qstate->getEffectiveMinRate(), util::getTimeStampMicros());
+    updateAvailRates();
+    fds_int64_t new_total_min_rate = total_assured_rate;
+    fds_int64_t new_total_avail_rate = total_iops - total_assured_rate;
 
     /* add queue state to map */
     qstate_map[queue_id].swap(qstate);
@@ -129,8 +157,6 @@ QoSHTBDispatcher::modifyQueueQosParams(fds_qid_t queue_id,
                                        fds_int64_t iops_throttle,
                                        fds_uint32_t prio)
 {
-    fds_uint64_t new_total_min_rate = 0;
-    fds_int64_t new_total_avail_iops = 0;
     fds_int64_t q_assured_rate = iops_assured;
     fds_int64_t q_throttle_rate = iops_throttle;
 
@@ -182,17 +208,9 @@ QoSHTBDispatcher::modifyQueueQosParams(fds_qid_t queue_id,
     /* update total assured rate and avail rate */
     fds_verify(total_assured_rate >= qstate->assured_rate);
     total_assured_rate = total_assured_rate - qstate->assured_rate + q_assured_rate;
-    new_total_min_rate = total_assured_rate;
-    new_total_avail_iops = avail_pool.getRate() + qstate->assured_rate;
-    if (new_total_avail_iops > q_assured_rate) {
-        new_total_avail_iops -= q_assured_rate;
-    } else {
-        /* for now we allow total_min_rate to exceed total_rate, means avail rate is 0,
-         * Even if avail_pool does not generate any tokens, it still gets unused
-         * assured tokens (from min_iops reservation) and shares them with other queues */
-        new_total_avail_iops = 0;
-    }
-    avail_pool.modifyRate(new_total_avail_iops);
+    updateAvailRates();
+    fds_uint64_t new_total_min_rate = total_assured_rate;
+    fds_int64_t new_total_avail_iops = total_iops - total_assured_rate;
 
     /* modify queue state params */
     qstate->assured_rate = q_assured_rate;
@@ -202,6 +220,7 @@ QoSHTBDispatcher::modifyQueueQosParams(fds_qid_t queue_id,
      * of token bucket based on iops min and max but also a current throttle level */
     setQueueThrottleLevel(qstate, current_throttle_level);
     qda_lock.write_unlock();
+    wakeShards();
 
     LOGNOTIFY << "QosHTBDispatcher: modified queue " << queue_id
               << "new q_assured_rate=" << q_assured_rate
@@ -232,16 +251,18 @@ QoSHTBDispatcher::deregisterQueue(fds_qid_t queue_id)
     auto& qstate = qstate_it->second;
     fds_assert(qstate);
 
-    /* update total min and avail rates */
+    /* update total min and avail rates, whatever the shard's heaps still
+     * hold for the queue is skipped once it's gone from the map */
     assert(qstate->assured_rate <= total_assured_rate);
     total_assured_rate -= qstate->assured_rate;
+    lendAssuredRate(shardFor(queue_id), *qstate, 0, util::getTimeStampMicros());
+    updateAvailRates();
 
     new_total_min_rate = total_assured_rate;
     if (total_iops > total_assured_rate) {
         new_total_avail_rate = total_iops - total_assured_rate;
     }
 
-    avail_pool.modifyRate(new_total_avail_rate);
     qstate_map.erase(qstate_it);
     qda_lock.write_unlock();
 
@@ -298,6 +319,15 @@ QoSHTBDispatcher::setQueueThrottleLevel(queue_state_type& qstate, fds_int32_t co
          * all volumes are throttled down, and no sharing is happening */
     }
 
+    /* with new token rates the queue is due at other times, reschedule it */
+    auto& shard = shardFor(qstate->queue_id);
+    auto now = util::getTimeStampMicros();
+    if (TBQueueState::QUEUE_IDLE == qstate->sched_state) {
+        lendAssuredRate(shard, *qstate, qstate->getEffectiveMinRate(), now);
+    } else {
+        makeReady(shard, *qstate, now);
+    }
+
     LOGNOTIFY << "QosHTBDispatcher: setThrottleLevel(X="
               << tlevel_x <<", Y/10=" << tlevel_frac
               << ") queue " << qstate->queue_id
@@ -320,23 +350,39 @@ QoSHTBDispatcher::setThrottleLevel(float throttle_level)
               << "; X=" << tlevel_x
               << ", Y/10=" << tlevel_frac;
 
-    WriteGuard wg(qda_lock);
-    for (auto& q_pair : qstate_map) {
-        setQueueThrottleLevel(q_pair.second, tlevel_x, tlevel_frac);
+    {
+        WriteGuard wg(qda_lock);
+        for (auto& q_pair : qstate_map) {
+            setQueueThrottleLevel(q_pair.second, tlevel_x, tlevel_frac);
+        }
+        current_throttle_level = throttle_level;
     }
-    current_throttle_level = throttle_level;
+    wakeShards();
 }
 
 void
 QoSHTBDispatcher::ioProcessForEnqueue(fds_qid_t queue_id,
         FDS_IOType *io)
 {
-    auto& qstate = qstate_map[queue_id];
-    fds_assert(qstate);
-    fds_uint32_t queued_ios = qstate->handleIoEnqueue(io);
+    auto qstate_it = qstate_map.find(queue_id);
+    fds_assert(qstate_map.end() != qstate_it);
+    auto& qstate = *qstate_it->second;
+    fds_uint32_t queued_ios = qstate.handleIoEnqueue(io);
     LOGTRACE << "QoSHTBDispatcher: handling enqueue IO to queue 0x"
              << std::hex << queue_id << std::dec
-             << " ; # of queued_ios " << (queued_ios+1);
+             << " ; # of queued_ios " << queued_ios;
+
+    if (1 == queued_ios) {
+        /* the queue may have been idle, if so schedule it and let the
+         * dispatcher know there is work */
+        auto& shard = shardFor(queue_id);
+        std::lock_guard<std::mutex> g(shard.lock);
+        if (TBQueueState::QUEUE_IDLE == qstate.sched_state) {
+            makeReady(shard, qstate, util::getTimeStampMicros());
+            shard.wakeup = true;
+            shard.cv.notify_one();
+        }
+    }
 }
 
 void
@@ -345,115 +391,293 @@ QoSHTBDispatcher::ioProcessForDispatch(fds_qid_t queue_id,
 {
     /* we already updated tokens in getNextQueueForDispatch(),
      * so only update number of queued ios  */
-    auto& qstate = qstate_map[queue_id];
-    fds_assert(qstate);
-    qstate->handleIoDispatch(io);
+    auto qstate_it = qstate_map.find(queue_id);
+    fds_assert(qstate_map.end() != qstate_it);
+    auto& shard = shardFor(queue_id);
+    std::lock_guard<std::mutex> g(shard.lock);
+    queueDispatched(shard, *qstate_it->second, io, util::getTimeStampMicros());
 }
 
-/* find queue whose IO needs to be dispatched next */
-fds_qid_t
-QoSHTBDispatcher::getNextQueueForDispatch()
+void
+QoSHTBDispatcher::queueDispatched(HTBShard& shard,
+                                  TBQueueState& qstate,
+                                  FDS_IOType *io,
+                                  fds_uint64_t const now)
 {
-    fds_qid_t ret_qid = 0;
-    TBQueueState *min_wma_qstate = nullptr;
-    double min_wma {0.0};
-    uint min_wma_hiprio {0};
+    if (0 == qstate.handleIoDispatch(io)) {
+        makeIdle(shard, qstate, now);
+    }
+}
 
-    while (1) {
+TBQueueState*
+QoSHTBDispatcher::entryQueue(HTBShard::Entry const& e)
+{
+    auto qstate_it = qstate_map.find(e.queue_id);
+    return (qstate_map.end() != qstate_it) ? qstate_it->second.get() : nullptr;
+}
 
-        /* reset qstate with min wma, since we start searching from beginning */
-        min_wma_qstate = nullptr;
+void
+QoSHTBDispatcher::updateQueueTokens(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const now)
+{
+    fds_uint64_t exp_assured_toks = qstate.updateTokens(now);
+    if (exp_assured_toks > 0) {
+        /* first put expired assured tokens to the avail_pool */
+        shard.avail_pool.addTokens(exp_assured_toks);
+        LOGTRACE << "QoSHTVDispatcher: moving "
+                 << exp_assured_toks << " expired assured toks from "
+                 << "queue 0x" << std::hex << qstate.queue_id
+                 << std::dec << " to the pool of available tokens";
+    }
+}
 
-        /* all tokens are demand-driven, so make sure to update state first */
-        fds_uint64_t nowMicrosec = util::getTimeStampMicros();
-        avail_pool.updateTBState(nowMicrosec);
+void
+QoSHTBDispatcher::pushAssured(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const now)
+{
+    qstate.assured_gen = ++shard.gen_seq;
+    shard.assured.push({now + qstate.assuredDelayMicrosec(), 0, qstate.queue_id, qstate.assured_gen});
+}
 
-        /**** search if any queues has IOs that need to be dispatched to meet min_iops ****/
-        /* we will check the queue that we serviced last time last */
-        auto it = qstate_map.find(last_dispatch_qid);
+void
+QoSHTBDispatcher::pushShare(HTBShard& shard, TBQueueState& qstate)
+{
+    qstate.share_gen = ++shard.gen_seq;
+    shard.share.push({qstate.priority, qstate.vtime, qstate.queue_id, qstate.share_gen});
+}
 
-        for (auto i = qstate_map.size(); 0 < i; --i, ++it) {
-            /* next queue */
-            if (it == qstate_map.end()) {
-                it = qstate_map.begin();
-            }
+void
+QoSHTBDispatcher::makeReady(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const now)
+{
+    if (TBQueueState::QUEUE_IDLE == qstate.sched_state) {
+        lendAssuredRate(shard, qstate, 0, now);
+    }
+    qstate.sched_state = TBQueueState::QUEUE_READY;
+    /* a queue coming back does not get to make up for the time it was idle */
+    qstate.vtime = std::max(qstate.vtime, shard.vclock);
+    updateQueueTokens(shard, qstate, now);
+    pushAssured(shard, qstate, now);
+    pushShare(shard, qstate);
+}
 
-            auto& qstate = it->second;
-            fds_assert(qstate);
-
-            /* before querying any state, update tokens */
-            nowMicrosec = util::getTimeStampMicros();
-            fds_uint64_t exp_assured_toks = qstate->updateTokens(nowMicrosec);
-            if (exp_assured_toks > 0) {
-                /* first put expired assured tokens to the avail_pool */
-                avail_pool.addTokens(exp_assured_toks);
-                LOGTRACE << "QoSHTVDispatcher: moving "
-                         << exp_assured_toks << " expired assured toks from "
-                         << "queue 0x" << std::hex << qstate->queue_id
-                         << std::dec << " to the pool of available tokens";
-            }
+void
+QoSHTBDispatcher::makeIdle(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const now)
+{
+    qstate.sched_state = TBQueueState::QUEUE_IDLE;
+    qstate.assured_gen = ++shard.gen_seq;
+    qstate.share_gen = ++shard.gen_seq;
+    lendAssuredRate(shard, qstate, qstate.getEffectiveMinRate(), now);
+}
+
+void
+QoSHTBDispatcher::park(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const until)
+{
+    qstate.sched_state = TBQueueState::QUEUE_PARKED;
+    qstate.assured_gen = ++shard.gen_seq;
+    qstate.share_gen = ++shard.gen_seq;
+    shard.parked.push({until, 0, qstate.queue_id, qstate.share_gen});
+}
+
+void
+QoSHTBDispatcher::lendAssuredRate(HTBShard& shard,
+                                  TBQueueState& qstate,
+                                  fds_uint64_t const rate,
+                                  fds_uint64_t const now)
+{
+    shard.idle_assured_rate = shard.idle_assured_rate - qstate.donated_rate + rate;
+    qstate.donated_rate = rate;
+    shard.avail_pool.modifyParams(shard.base_avail_rate + shard.idle_assured_rate,
+                                  shard.avail_pool.burst_,
+                                  now);
+}
+
+/* find queue of the shard whose IO needs to be dispatched next, or 0 and
+ * shorten wait_microsec to when one may be */
+fds_qid_t
+QoSHTBDispatcher::pickQueue(HTBShard& shard, fds_uint64_t const now, fds_uint64_t& wait_microsec)
+{
+    /* queues that have throttle tokens again can go back to competing */
+    while (!shard.parked.empty() && (shard.parked.top().key <= now)) {
+        auto e = shard.parked.top();
+        shard.parked.pop();
+        auto qstate = entryQueue(e);
+        if (qstate && (TBQueueState::QUEUE_PARKED == qstate->sched_state) && (e.gen == qstate->share_gen)) {
+            makeReady(shard, *qstate, now);
+        }
+    }
 
-            /* try to see if we can serve the io from the head of queue with assured tokens */
-            TBQueueState::tbStateType state = qstate->tryToConsumeAssuredTokens(1);
-            if (state == TBQueueState::TBQUEUE_STATE_OK) {
-                /* we found a queue whose IO we will dispatch to meet its min_ios */
-                last_dispatch_qid = it->first;
+    /**** dispatch IOs of queues that need to meet their min_iops first ****/
+    while (!shard.assured.empty() && (shard.assured.top().key <= now)) {
+        auto e = shard.assured.top();
+        shard.assured.pop();
+        auto qstate = entryQueue(e);
+        if (!qstate || (e.gen != qstate->assured_gen)) {
+            continue;
+        }
+
+        updateQueueTokens(shard, *qstate, now);
+        switch (qstate->tryToConsumeAssuredTokens(1)) {
+            case TBQueueState::TBQUEUE_STATE_OK:
                 LOGTRACE << "QoSHTBDispatcher: dispatch (min_iops) io from queue 0x"
-                         << std::hex << it->first << std::dec;
-                return it->first;
-            } else if (state == TBQueueState::TBQUEUE_STATE_NO_ASSURED_TOKENS) {
-                /* queue has at least one io and available tokens (but no assured tokens) */
-                double q_wma = qstate->getIOPerfWMA();
-                if (!min_wma_qstate) {
-                    min_wma = q_wma;
-                    min_wma_qstate = qstate.get();
-                    min_wma_hiprio = qstate->priority;
-                } else if (qstate->priority < min_wma_hiprio) {
-                    /* assuming higher priority is a lower the number (highest = 1) */
-                    min_wma_hiprio = qstate->priority;
-                    min_wma = q_wma;
-                    min_wma_qstate = qstate.get();
-                } else if ((qstate->priority == min_wma_hiprio) && (q_wma < min_wma)) {
-                    min_wma = q_wma;
-                    min_wma_qstate = qstate.get();
-                }
-            }
+                         << std::hex << e.queue_id << std::dec;
+                pushAssured(shard, *qstate, now);
+                return e.queue_id;
+            case TBQueueState::TBQUEUE_STATE_NO_ASSURED_TOKENS:
+                /* token did not arrive yet, look again when it has */
+                pushAssured(shard, *qstate, now);
+                break;
+            case TBQueueState::TBQUEUE_STATE_NO_TOKENS:
+                park(shard, *qstate, now + qstate->throttleDelayMicrosec());
+                break;
+            default:
+                makeIdle(shard, *qstate, now);
+                break;
         }
+    }
 
-        /* we did not find any queue with IOs that need to meet it min_iops */
-        if (min_wma_qstate) {
-            /* we found queue that has IO, available tokens, and lowest recent ave performance */
-            /* dispatch this io if we have available tokens in the resource pool */
-            fds_bool_t bHasToks = avail_pool.tryToConsumeTokens(1);
-            if (bHasToks) {
-                min_wma_qstate->consumeTokens(1);
-                ret_qid = min_wma_qstate->queue_id;
+    /**** share the available tokens: highest priority first, then the
+     * queue that got the least of them ****/
+    shard.avail_pool.updateTBState(now);
+    while (!shard.share.empty()) {
+        auto e = shard.share.top();
+        auto qstate = entryQueue(e);
+        if (!qstate || (e.gen != qstate->share_gen)) {
+            shard.share.pop();
+            continue;
+        }
+        if (!shard.avail_pool.hasTokens(1)) {
+            wait_microsec = std::min(wait_microsec, shard.avail_pool.getDelayMicrosec(1));
+            break;
+        }
+        shard.share.pop();
+
+        updateQueueTokens(shard, *qstate, now);
+        switch (qstate->tryToConsumeAssuredTokens(1)) {
+            case TBQueueState::TBQUEUE_STATE_OK:
+                /* its assured token arrived in the meantime */
+                pushAssured(shard, *qstate, now);
+                pushShare(shard, *qstate);
+                return e.queue_id;
+            case TBQueueState::TBQUEUE_STATE_NO_ASSURED_TOKENS:
+                shard.avail_pool.tryToConsumeTokens(1);
+                qstate->consumeTokens(1);
+                shard.vclock = qstate->vtime++;
+                pushShare(shard, *qstate);
                 LOGTRACE << "QoSHTBDispatcher: dispatch (avail) io from queue 0x"
-                    << std::hex << ret_qid << std::dec;
+                         << std::hex << e.queue_id << std::dec;
+                return e.queue_id;
+            case TBQueueState::TBQUEUE_STATE_NO_TOKENS:
+                park(shard, *qstate, now + qstate->throttleDelayMicrosec());
+                break;
+            default:
+                makeIdle(shard, *qstate, now);
                 break;
+        }
+    }
+
+    /* we did not find any IOs to dispatch, wait for the next token to arrive */
+    if (!shard.assured.empty()) {
+        wait_microsec = std::min(wait_microsec, shard.assured.top().key - now);
+    }
+    if (!shard.parked.empty()) {
+        wait_microsec = std::min(wait_microsec, shard.parked.top().key - now);
+    }
+    return 0;
+}
+
+/* find queue whose IO needs to be dispatched next, for callers of the base
+ * class dispatch loop; caller holds qda_lock for read */
+fds_qid_t
+QoSHTBDispatcher::getNextQueueForDispatch()
+{
+    for (auto& shard : shards) {
+        fds_uint64_t wait_microsec = HTB_IDLE_WAIT_MICROSEC;
+        std::lock_guard<std::mutex> g(shard->lock);
+        auto queue_id = pickQueue(*shard, util::getTimeStampMicros(), wait_microsec);
+        if (0 != queue_id) {
+            return queue_id;
+        }
+    }
+    return 0;
+}
+
+Error
+QoSHTBDispatcher::dispatchIOs()
+{
+    if (bypass_dispatcher) {
+        /* nothing gets queued, the base loop just idles */
+        return FDS_QoSDispatcher::dispatchIOs();
+    }
+
+    LOGNOTIFY << "Starting " << shards.size() << " qos dispatcher thread(s)";
+    std::vector<std::thread> dispatchers;
+    for (size_t i = 1; shards.size() > i; ++i) {
+        dispatchers.emplace_back(&QoSHTBDispatcher::dispatchShard, this, i);
+    }
+    dispatchShard(0);
+    for (auto& t : dispatchers) {
+        t.join();
+    }
+    LOGNOTIFY << "Exiting qos dispatcher threads";
+    return ERR_OK;
+}
+
+void
+QoSHTBDispatcher::dispatchShard(size_t const index)
+{
+    auto& shard = *shards[index];
+    std::vector<std::pair<fds_qid_t, FDS_IOType*>> batch;
+    batch.reserve(dispatch_batch);
+
+    while (!shuttingDown) {
+        fds_uint64_t wait_microsec = HTB_IDLE_WAIT_MICROSEC;
+        fds_uint32_t limit = dispatch_batch;
+        if (max_outstanding_ios > 0) {
+            fds_uint32_t n_oios = num_outstanding_ios.load(std::memory_order_relaxed);
+            limit = (n_oios < max_outstanding_ios) ? std::min(limit, max_outstanding_ios - n_oios) : 0;
+            if (0 == limit) {
+                /* completions do not wake us, poll as the base loop does */
+                wait_microsec = 100;
             }
         }
 
-        /* we did not find any IOs to dispatch */
-        { /* wait for next guaranteed token or few non-guaranteed tokens to be created */
-            const double num_toks = 1.0;
-            fds_uint64_t assured_delay_microsec = (total_assured_rate > 0) ? (num_toks/(double)total_assured_rate)*1000000.0 : 0;
-            fds_uint64_t delay_microsec = (avail_pool.getRate() > 0) ? ((num_toks+1.0)/(double)avail_pool.getRate())*1000000.0 : 0;
-            if ((assured_delay_microsec > 0) && (delay_microsec > assured_delay_microsec))
-                delay_microsec = assured_delay_microsec;
-
-            LOGTRACE << "QoSHTBDispatcher: no tokens available, will sleep for " << delay_microsec;
-            if (delay_microsec > 0) {
-                qda_lock.read_unlock();
-                boost::this_thread::sleep(boost::posix_time::microseconds(delay_microsec));
-                qda_lock.read_lock();
+        qda_lock.read_lock();
+        {
+            std::lock_guard<std::mutex> g(shard.lock);
+            shard.wakeup = false;
+            auto now = util::getTimeStampMicros();
+            while (batch.size() < limit) {
+                auto queue_id = pickQueue(shard, now, wait_microsec);
+                if (0 == queue_id) {
+                    break;
+                }
+                auto& qstate = *qstate_map[queue_id];
+                FDS_IOType *io = queue_map[queue_id]->dequeueIO();
+                if (io == NULL) {
+                    // Most likely NULL means that the queue is not ready to serve I/O
+                    // Probably due to snapshot, try it again later
+                    LOGDEBUG << "NULL io dequeue in QOS. more than one of these messages per volume per migration means something is wrong.";
+                    park(shard, qstate, now + HTB_RETRY_WAIT_MICROSEC);
+                    continue;
+                }
+                queueDispatched(shard, qstate, io, now);
+                batch.emplace_back(queue_id, io);
             }
         }
+        qda_lock.read_unlock();
 
-    } // while (1)
+        if (!batch.empty()) {
+            for (auto& d : batch) {
+                num_pending_ios.fetch_sub(1, std::memory_order_relaxed);
+                dispatchIO(d.first, d.second);
+            }
+            batch.clear();
+            continue;
+        }
 
-    last_dispatch_qid = ret_qid;
-    return ret_qid;
+        std::unique_lock<std::mutex> l(shard.lock);
+        if (!shard.wakeup && !shuttingDown) {
+            shard.cv.wait_for(l, std::chrono::microseconds(wait_microsec));
+        }
+    }
 }
 
 /******* TBQueueState implementation ***********/
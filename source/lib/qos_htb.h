@@ -10,6 +10,11 @@
 
 #include <unordered_map>
 #include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <vector>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include "qos_tokbucket.h"
@@ -27,6 +32,9 @@
 #define HTB_MAX_WMA_LENGTH                20
 #define HTB_WMA_LENGTH                    20       /* the length of recent iops performance window in HTB_WMA_SLOT_SIZE_MICROSEC slots */
 
+#define HTB_IDLE_WAIT_MICROSEC            100000   /* longest a dispatcher sleeps without being woken */
+#define HTB_RETRY_WAIT_MICROSEC           1000     /* when to retry a queue that would not give up its IO */
+
 namespace fds {
 
   class TBQueueState;
@@ -88,6 +96,13 @@ namespace fds {
     inline fds_uint64_t getEffectiveMinRate() const { return tb_assured.getRate();}
     inline fds_uint64_t getEffectiveMaxRate() const { return tb_throttle.getRate();}
 
+    /* Uses the state from the last call to updateTokens(), microseconds until
+     * the next assured or throttle token is created */
+    inline fds_uint64_t assuredDelayMicrosec() { return tb_assured.getDelayMicrosec(1); }
+    inline fds_uint64_t throttleDelayMicrosec() { return tb_throttle.getDelayMicrosec(1); }
+
+    inline fds_uint32_t queuedIOs() const { return queued_io_counter.load(std::memory_order_relaxed); }
+
     /* Notification that IO 'io' is queued or dispatched from the queue (dequeued)
      * uses atomic operations to update state of the queue
      * both functions return resulting number of queued IOs */
@@ -137,6 +152,18 @@ namespace fds {
     fds_int64_t throttle_rate;
     fds_uint32_t priority;
 
+    /* Scheduling state, owned by the dispatcher shard the queue hashes to.
+     * An IDLE queue has no queued IOs and is in none of the shard's heaps;
+     * a READY one is in its assured and share heaps; a PARKED one waits in
+     * the timer heap for its throttle tokens. Heap entries carry the gen they
+     * were pushed with, an entry whose gen is no longer current is skipped. */
+    typedef enum { QUEUE_IDLE, QUEUE_READY, QUEUE_PARKED } schedStateType;
+    schedStateType sched_state {QUEUE_IDLE};
+    fds_uint64_t assured_gen {0};
+    fds_uint64_t share_gen {0};
+    fds_uint64_t vtime {0};          /* avail tokens received, shares them fairly within a priority */
+    fds_uint64_t donated_rate {0};   /* assured rate given to the avail pool while idle */
+
   private: /* data */
 
     /***** dynamic state *****/
@@ -180,10 +207,58 @@ namespace fds {
    * be dispatched with this dispatcher at the same time. The total burst size
    * never exceeds the sum of of queues burst sizes.
    *
+   * Dispatch is event driven rather than a scan of every queue per IO. Only
+   * queues with IOs are scheduled: each sits in a heap ordered by when its
+   * next assured token arrives and in a heap ordered by (priority, vtime) for
+   * the available tokens, or, when over its throttle rate, in a timer heap
+   * until its next throttle token. Picking a queue is O(log n) in the number
+   * of busy queues and a dispatcher with nothing to send sleeps until the
+   * earliest token arrival or until an IO arrives at an idle queue. The
+   * assured rate of idle queues is lent to the available pool, as their
+   * expired tokens were before.
+   *
+   * Queues can be split across several dispatcher threads by queue id, each
+   * with its own heaps and an equal part of the available rate, and each
+   * wakeup sends up to dispatch_batch IOs.
    */
+  /* A dispatcher thread's share of the queues, see QoSHTBDispatcher */
+  struct HTBShard {
+    struct Entry {
+      fds_uint64_t key;   /* time in microsec, or priority for the share heap */
+      fds_uint64_t key2;  /* vtime for the share heap */
+      fds_qid_t queue_id;
+      fds_uint64_t gen;
+      bool operator>(Entry const& rhs) const {
+        return (key != rhs.key) ? (key > rhs.key) : (key2 > rhs.key2);
+      }
+    };
+    using heap_type = std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>>;
+
+    HTBShard(fds_uint64_t avail_rate, fds_uint64_t burst)
+      : avail_pool(avail_rate, burst) {}
+
+    std::mutex lock;
+    std::condition_variable cv;
+    bool wakeup {false};
+
+    RecvTokenBucket avail_pool;     /* this shard's part of the non-guaranteed tokens */
+    fds_uint64_t base_avail_rate {0};
+    fds_uint64_t idle_assured_rate {0};  /* assured rate of idle queues, shared as avail tokens */
+
+    heap_type assured;  /* READY queues by when their next assured token is created */
+    heap_type share;    /* READY queues by priority, then vtime */
+    heap_type parked;   /* PARKED queues by when they have throttle tokens again */
+    fds_uint64_t vclock {0};   /* vtime of the last queue served from the avail pool */
+    fds_uint64_t gen_seq {0};
+  };
+
   class QoSHTBDispatcher: public FDS_QoSDispatcher {
   public:
-    QoSHTBDispatcher(FDS_QoSControl* ctrl, fds_log *log, fds_int64_t _total_iops);
+    QoSHTBDispatcher(FDS_QoSControl* ctrl,
+                     fds_log *log,
+                     fds_int64_t _total_iops,
+                     fds_uint32_t _dispatchers = 1,
+                     fds_uint32_t _dispatch_batch = 1);
     QoSHTBDispatcher(QoSHTBDispatcher const& rhs) = delete;
     QoSHTBDispatcher operator=(QoSHTBDispatcher const& rhs) = delete;
     ~QoSHTBDispatcher() override = default;
@@ -199,6 +274,9 @@ namespace fds {
      * this implementation consumes tokens required to dispatch IO */
     fds_qid_t getNextQueueForDispatch() override;
 
+    /* runs a dispatch loop per shard, this thread runs the first */
+    Error dispatchIOs() override;
+
     /* this implementation calls based class registerQueue first */
     Error registerQueue(fds_qid_t queue_id, FDS_VolumeQueue *queue) override;
 
@@ -221,12 +299,27 @@ namespace fds {
      * rate */
     Error modifyTotalRate(fds_int64_t _total_iops);
 
-   using FDS_QoSDispatcher::dispatchIOs;
-
   private:
    void setQueueThrottleLevel(queue_state_type& qstate, float const throttle_level);
    void setQueueThrottleLevel(queue_state_type& qstate, fds_int32_t const tlevel_x, double const tlevel_frac);
 
+   /* shard state is changed with qda_lock read and the shard's lock held,
+    * or with qda_lock write held */
+   HTBShard& shardFor(fds_qid_t queue_id) { return *shards[queue_id % shards.size()]; }
+   TBQueueState* entryQueue(HTBShard::Entry const& e);
+   void dispatchShard(size_t const index);
+   fds_qid_t pickQueue(HTBShard& shard, fds_uint64_t const now, fds_uint64_t& wait_microsec);
+   void queueDispatched(HTBShard& shard, TBQueueState& qstate, FDS_IOType *io, fds_uint64_t const now);
+   void updateQueueTokens(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const now);
+   void pushAssured(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const now);
+   void pushShare(HTBShard& shard, TBQueueState& qstate);
+   void makeReady(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const now);
+   void makeIdle(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const now);
+   void park(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const until);
+   void lendAssuredRate(HTBShard& shard, TBQueueState& qstate, fds_uint64_t const rate, fds_uint64_t const now);
+   void updateAvailRates();
+   void wakeShards();
+
     /****** configurable parameters *****/
 
     /* The total rate of IOs that will be dispatched from all the queues
@@ -254,11 +347,14 @@ namespace fds {
     /* current throttle level */
     float current_throttle_level;
 
+    /* most IOs a dispatcher sends per wakeup */
+    fds_uint32_t dispatch_batch;
+
     /***** dynamic state ******/
-    RecvTokenBucket avail_pool; /* pool of available tokens (non-guaranteed tokens + expired guaranteed tokens) */
+    /* one per dispatcher thread, each with its pool of available tokens
+     * (non-guaranteed tokens + expired guaranteed tokens) */
+    std::vector<std::unique_ptr<HTBShard>> shards;
     qstate_map_type qstate_map;  /* min and max rate control for each queue, and other queue state */
-
-    fds_qid_t last_dispatch_qid; /* queue id from which we dispatch last IO */
   };
 
 
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2016 by Formation Data Systems, Inc.
+ */
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <limits.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+}
+
+#include <boost/make_shared.hpp>
+#include <thrift/transport/TTransportException.h>
+#include <net/CoalescingTransport.h>
+
+namespace fds {
+namespace net {
+
+namespace tt = apache::thrift::transport;
+
+const uint32_t CoalescingTransport::SEGMENT_BYTES;
+
+CoalescingTransport::CoalescingTransport(boost::shared_ptr<tt::TSocket> socket,
+                                         uint32_t coalesceBytes)
+    : socket_(socket),
+      reader_(boost::make_shared<tt::TFramedTransport>(socket)),
+      coalesceBytes_(coalesceBytes)
+{
+}
+
+void CoalescingTransport::write(const uint8_t *buf, uint32_t len)
+{
+    if (!inFrame_) {
+        /* Room for the frame's length, filled in at flush */
+        inFrame_ = true;
+        frameHeader_ = scratch_.size();
+        frameSize_ = 0;
+        scratch_.append(sizeof(uint32_t), '\0');
+        segments_.push_back(Segment{nullptr, frameHeader_, sizeof(uint32_t)});
+    }
+    frameSize_ += len;
+
+    if (len >= SEGMENT_BYTES) {
+        segments_.push_back(Segment{buf, 0, len});
+        return;
+    }
+    /* Extend the last segment when it ends where we append */
+    auto &last = segments_.back();
+    if (!last.ref && (last.offset + last.len == scratch_.size())) {
+        last.len += len;
+    } else {
+        segments_.push_back(Segment{nullptr, scratch_.size(), len});
+    }
+    scratch_.append(reinterpret_cast<const char*>(buf), len);
+}
+
+void CoalescingTransport::flush()
+{
+    if (inFrame_) {
+        uint32_t frameSize = htonl(frameSize_);
+        memcpy(&scratch_[frameHeader_], &frameSize, sizeof(frameSize));
+        pendingBytes_ += sizeof(frameSize) + frameSize_;
+        frameEnds_.push_back(pendingBytes_);
+        inFrame_ = false;
+    }
+    if (!held_ || pendingBytes_ >= coalesceBytes_) {
+        writeFrames_();
+    }
+}
+
+void CoalescingTransport::release()
+{
+    held_ = false;
+    if (!inFrame_) {
+        writeFrames_();
+    }
+}
+
+void CoalescingTransport::writeFrames_()
+{
+    if (segments_.empty()) {
+        return;
+    }
+
+    std::vector<iovec> iovs;
+    iovs.reserve(segments_.size());
+    for (auto &segment : segments_) {
+        auto base = segment.ref ? segment.ref :
+            reinterpret_cast<const uint8_t*>(scratch_.data()) + segment.offset;
+        iovs.push_back(iovec{const_cast<uint8_t*>(base), segment.len});
+    }
+    /* Referenced buffers may go away once we return or throw */
+    segments_.clear();
+    scratch_.clear();
+    pendingBytes_ = 0;
+    std::vector<size_t> frameEnds;
+    frameEnds.swap(frameEnds_);
+
+    /* On failure, still count the frames that made it out whole */
+    size_t total = 0;
+    auto countWritten = [this, &frameEnds, &total]() {
+        framesWritten_ += std::upper_bound(frameEnds.begin(), frameEnds.end(), total)
+                          - frameEnds.begin();
+    };
+
+    auto fd = socket_->getSocketFD();
+    size_t next = 0;
+    while (next < iovs.size()) {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iovs[next];
+        msg.msg_iovlen = std::min(iovs.size() - next, static_cast<size_t>(IOV_MAX));
+
+        /* sendmsg() rather than writev() so a closed peer doesn't raise SIGPIPE */
+        auto n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            countWritten();
+            throw tt::TTransportException((err == EAGAIN || err == EWOULDBLOCK) ?
+                                          tt::TTransportException::TIMED_OUT :
+                                          tt::TTransportException::UNKNOWN,
+                                          "sendmsg() failed", err);
+        } else if (n == 0) {
+            countWritten();
+            throw tt::TTransportException(tt::TTransportException::NOT_OPEN,
+                                          "sendmsg() sent nothing");
+        }
+
+        /* Skip what was written */
+        total += n;
+        size_t written = n;
+        while (written > 0) {
+            auto &iov = iovs[next];
+            if (written >= iov.iov_len) {
+                written -= iov.iov_len;
+                ++next;
+            } else {
+                iov.iov_base = static_cast<uint8_t*>(iov.iov_base) + written;
+                iov.iov_len -= written;
+                written = 0;
+            }
+        }
+    }
+    framesWritten_ += frameEnds.size();
+}
+
+}  // namespace net
+}  // namespace fds
@@ -0,0 +1,543 @@
+/*
+ * Copyright 2016 by Formation Data Systems, Inc.
+ */
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+}
+
+#include <boost/make_shared.hpp>
+#include <thrift/protocol/TProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TTransportException.h>
+#include <concurrency/ThreadPool.h>
+#include <util/Log.h>
+#include <net/SvcEventServer.h>
+
+namespace fds {
+
+namespace at = apache::thrift;
+namespace tp = apache::thrift::protocol;
+namespace tt = apache::thrift::transport;
+
+/* Same limit TFramedTransport puts on frames */
+static constexpr uint32_t MAX_FRAME_SIZE = 256 * 1024 * 1024;
+/* Least we try to read at once */
+static constexpr size_t READ_SIZE = 64 * 1024;
+/* Reads per event, so one busy connection doesn't hold up the rest of its loop */
+static constexpr int MAX_READS = 16;
+
+/**
+ * A client connection.  Reads and writes happen on its loop's thread, calls
+ * are processed and replies queued on the threadpool.
+ */
+struct SvcEventServer::Connection : std::enable_shared_from_this<Connection> {
+    Connection(SvcEventServer *server, IoLoop *ioLoop, int fd, const std::string &peer)
+        : server(server), ioLoop(ioLoop), fd(fd), peer(peer)
+    {}
+
+    void ioCb(ev::io &w, int revents) { server->ioCb_(shared_from_this(), revents); }
+
+    /* Reads what's available and processes every complete frame */
+    bool read();
+    /* Writes as much of the queued replies as the socket takes */
+    bool write();
+    bool processFrame(uint8_t *frame, uint32_t size);
+    bool process(const boost::shared_ptr<tt::TTransport> &in, bool onLoop);
+    /* Processes the queued oneway calls in order, on the threadpool */
+    void processOneways();
+
+    SvcEventServer *server;
+    IoLoop *ioLoop;
+    int fd;
+    std::string peer;
+    ev::io watcher;
+    boost::shared_ptr<at::TProcessor> processor;
+    boost::shared_ptr<tp::TProtocolFactory> protocolFactory;
+    fds_threadpool *threadpool {nullptr};
+
+    /* Loop thread only */
+    std::vector<uint8_t> readBuf;
+    size_t readLen {0};
+    bool writing {false};
+
+    /* Protects the below */
+    std::mutex lock;
+    bool closed {false};
+    /* Set when a call processed on the threadpool wants the connection closed */
+    bool failed {false};
+    std::deque<std::string> replies;
+    size_t replyOffset {0};
+    /* Oneway calls waiting for processOneways(), which runs while this is set */
+    std::deque<boost::shared_ptr<tt::TMemoryBuffer>> oneways;
+    bool processingOneways {false};
+};
+
+/**
+ * One of the loops connections are served on.  Accepted sockets and
+ * connections with replies from the threadpool are queued here and the loop
+ * woken to take care of them on its own thread.
+ */
+struct SvcEventServer::IoLoop {
+    explicit IoLoop(SvcEventServer *server)
+        : server(server)
+    {
+        wakeup.set(loop);
+        wakeup.set<IoLoop, &IoLoop::wakeupCb>(this);
+        wakeup.start();
+    }
+
+    void wakeupCb(ev::async &w, int revents) { server->wakeupCb_(*this); }
+
+    /* NOTE: Assumes the connection's lock is held, so it is not closed under us */
+    void replied(ConnectionPtr conn) {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            repliedConns.push_back(std::move(conn));
+        }
+        wakeup.send();
+    }
+
+    SvcEventServer *server;
+    ev::dynamic_loop loop;
+    ev::async wakeup;
+    std::thread thread;
+
+    /* Loop thread only */
+    std::unordered_map<int, ConnectionPtr> connections;
+
+    /* Protects the below */
+    std::mutex lock;
+    std::deque<std::pair<int, std::string>> accepted;
+    std::vector<ConnectionPtr> repliedConns;
+};
+
+bool SvcEventServer::Connection::read()
+{
+    for (int reads = 0; reads < MAX_READS; ++reads) {
+        /* Room for the rest of the frame we are in, and at least READ_SIZE */
+        size_t want = READ_SIZE;
+        if (readLen >= sizeof(uint32_t)) {
+            uint32_t size;
+            memcpy(&size, readBuf.data(), sizeof(size));
+            want = std::max(want, sizeof(size) + ntohl(size) - readLen);
+        }
+        if (readBuf.size() < readLen + want) {
+            readBuf.resize(readLen + want);
+        }
+
+        auto n = ::read(fd, readBuf.data() + readLen, readBuf.size() - readLen);
+        if (n == 0) {
+            return false;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            LOGDEBUG << "Read from " << peer << " failed: " << strerror(errno);
+            return false;
+        }
+        readLen += n;
+
+        size_t offset = 0;
+        while (readLen - offset >= sizeof(uint32_t)) {
+            uint32_t size;
+            memcpy(&size, readBuf.data() + offset, sizeof(size));
+            size = ntohl(size);
+            if (size > MAX_FRAME_SIZE) {
+                LOGWARN << "Frame of " << size << " bytes from " << peer << " is too large";
+                return false;
+            }
+            if (readLen - offset - sizeof(size) < size) {
+                break;
+            }
+            if (!processFrame(readBuf.data() + offset + sizeof(size), size)) {
+                return false;
+            }
+            offset += sizeof(size) + size;
+        }
+        if (offset > 0) {
+            memmove(readBuf.data(), readBuf.data() + offset, readLen - offset);
+            readLen -= offset;
+        }
+        /* Don't hang on to what a large frame needed */
+        if (readLen == 0 && readBuf.size() > 4 * READ_SIZE) {
+            readBuf.resize(READ_SIZE);
+            readBuf.shrink_to_fit();
+        }
+    }
+    return true;
+}
+
+bool SvcEventServer::Connection::processFrame(uint8_t *frame, uint32_t size)
+{
+    auto in = boost::make_shared<tt::TMemoryBuffer>(frame, size, tt::TMemoryBuffer::OBSERVE);
+
+    /* Without a threadpool everything is processed right here */
+    if (!threadpool) {
+        return process(in, true);
+    }
+
+    /**
+     * Handlers may block (config DB lookups, locks), so nothing is processed on
+     * the loop.  Oneway calls from a connection are still processed in the
+     * order they came in, one at a time, like a thread per connection would.
+     */
+    tp::TMessageType type;
+    try {
+        std::string name;
+        int32_t seqid;
+        protocolFactory->getProtocol(in)->readMessageBegin(name, type, seqid);
+    } catch (std::exception &e) {
+        LOGWARN << "Bad frame from " << peer << ": " << e.what();
+        return false;
+    }
+
+    auto copy = boost::make_shared<tt::TMemoryBuffer>(frame, size, tt::TMemoryBuffer::COPY);
+    auto self = shared_from_this();
+    if (type != tp::T_ONEWAY) {
+        threadpool->schedule([self, copy]() { self->process(copy, false); });
+        return true;
+    }
+
+    std::lock_guard<std::mutex> g(lock);
+    oneways.push_back(std::move(copy));
+    if (!processingOneways) {
+        processingOneways = true;
+        threadpool->schedule([self]() { self->processOneways(); });
+    }
+    return true;
+}
+
+void SvcEventServer::Connection::processOneways()
+{
+    while (true) {
+        boost::shared_ptr<tt::TMemoryBuffer> call;
+        {
+            std::lock_guard<std::mutex> g(lock);
+            if (closed || oneways.empty()) {
+                oneways.clear();
+                processingOneways = false;
+                return;
+            }
+            call = std::move(oneways.front());
+            oneways.pop_front();
+        }
+        process(call, false);
+    }
+}
+
+bool SvcEventServer::Connection::process(const boost::shared_ptr<tt::TTransport> &in, bool onLoop)
+{
+    auto out = boost::make_shared<tt::TMemoryBuffer>();
+    bool ok = false;
+    try {
+        ok = processor->process(protocolFactory->getProtocol(in),
+                                protocolFactory->getProtocol(out),
+                                nullptr);
+    } catch (std::exception &e) {
+        LOGWARN << "Processing call from " << peer << " failed: " << e.what();
+    }
+
+    uint8_t *reply;
+    uint32_t size;
+    out->getBuffer(&reply, &size);
+    {
+        std::lock_guard<std::mutex> g(lock);
+        if (closed) {
+            return false;
+        }
+        if (size > 0) {
+            std::string frame(sizeof(size) + size, '\0');
+            uint32_t frameSize = htonl(size);
+            memcpy(&frame[0], &frameSize, sizeof(frameSize));
+            memcpy(&frame[sizeof(frameSize)], reply, size);
+            replies.push_back(std::move(frame));
+        }
+        if (!onLoop) {
+            /* Oneway calls have nothing to write, only wake the loop to close */
+            failed = failed || !ok;
+            if (size > 0 || !ok) {
+                ioLoop->replied(shared_from_this());
+            }
+            return ok;
+        }
+    }
+    return ok && write();
+}
+
+bool SvcEventServer::Connection::write()
+{
+    std::lock_guard<std::mutex> g(lock);
+    if (closed || failed) {
+        return false;
+    }
+    while (!replies.empty()) {
+        auto &reply = replies.front();
+        auto n = ::send(fd, reply.data() + replyOffset, reply.size() - replyOffset, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            LOGDEBUG << "Write to " << peer << " failed: " << strerror(errno);
+            return false;
+        }
+        replyOffset += n;
+        if (replyOffset == reply.size()) {
+            replies.pop_front();
+            replyOffset = 0;
+        }
+    }
+
+    /* Only watch for room to write while there's something left */
+    bool wantWrite = !replies.empty();
+    if (wantWrite != writing) {
+        watcher.set(wantWrite ? (ev::READ | ev::WRITE) : ev::READ);
+        writing = wantWrite;
+    }
+    return true;
+}
+
+SvcEventServer::SvcEventServer(const boost::shared_ptr<at::TProcessor> &processor,
+                               const boost::shared_ptr<tp::TProtocolFactory> &protocolFactory,
+                               int port,
+                               uint32_t ioThreads,
+                               fds_threadpool *threadpool)
+    : TServer(processor),
+      port_(port),
+      listenFd_(-1),
+      threadpool_(threadpool),
+      stopping_(false),
+      acceptLoop_(new ev::dynamic_loop()),
+      acceptWatcher_(new ev::io()),
+      stopWatcher_(new ev::async()),
+      nextLoop_(0)
+{
+    setInputProtocolFactory(protocolFactory);
+    setOutputProtocolFactory(protocolFactory);
+
+    acceptWatcher_->set(*acceptLoop_);
+    acceptWatcher_->set<SvcEventServer, &SvcEventServer::acceptCb_>(this);
+    stopWatcher_->set(*acceptLoop_);
+    stopWatcher_->set<SvcEventServer, &SvcEventServer::stopCb_>(this);
+    stopWatcher_->start();
+
+    for (uint32_t i = 0; i < std::max(ioThreads, 1u); ++i) {
+        ioLoops_.emplace_back(new IoLoop(this));
+    }
+}
+
+SvcEventServer::~SvcEventServer()
+{
+    if (listenFd_ >= 0) {
+        ::close(listenFd_);
+    }
+}
+
+int SvcEventServer::listen_()
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw tt::TTransportException(tt::TTransportException::NOT_OPEN,
+                                      "Could not create server socket.", errno);
+    }
+
+    /* If we crash this allows us to reuse the port before it's fully closed */
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+        LOGWARN << "Failed to set SO_REUSEADDR on port: " << port_;
+    }
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        ::listen(fd, SOMAXCONN) < 0) {
+        int err = errno;
+        ::close(fd);
+        throw tt::TTransportException(tt::TTransportException::NOT_OPEN,
+                                      "Could not bind/listen on port " + std::to_string(port_),
+                                      err);
+    }
+    return fd;
+}
+
+void SvcEventServer::serve()
+{
+    listenFd_ = listen_();
+
+    for (auto &ioLoop : ioLoops_) {
+        auto loop = ioLoop.get();
+        ioLoop->thread = std::thread([loop] { loop->loop.run(0); });
+    }
+    LOGNOTIFY << "Serving port: " << port_ << " on " << ioLoops_.size() << " io threads";
+
+    acceptWatcher_->start(listenFd_, ev::READ);
+    if (eventHandler_) {
+        eventHandler_->preServe();
+    }
+    acceptLoop_->run(0);
+
+    /* Stopped, close every connection */
+    acceptWatcher_->stop();
+    ::close(listenFd_);
+    listenFd_ = -1;
+    for (auto &ioLoop : ioLoops_) {
+        ioLoop->wakeup.send();
+    }
+    for (auto &ioLoop : ioLoops_) {
+        ioLoop->thread.join();
+    }
+}
+
+void SvcEventServer::stop()
+{
+    stopping_ = true;
+    stopWatcher_->send();
+}
+
+void SvcEventServer::stopCb_(ev::async &watcher, int revents)
+{
+    if (stopping_) {
+        acceptLoop_->break_loop(ev::ALL);
+    }
+}
+
+void SvcEventServer::acceptCb_(ev::io &watcher, int revents)
+{
+    if (EV_ERROR & revents) {
+        LOGERROR << "invalid libev event";
+        return;
+    }
+
+    while (!stopping_) {
+        sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int fd = ::accept4(listenFd_, reinterpret_cast<sockaddr*>(&addr), &len,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGWARN << "Accept on port: " << port_ << " failed: " << strerror(errno);
+            }
+            return;
+        }
+
+        int one = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+            LOGWARN << "Failed to set TCP_NODELAY on connection";
+        }
+        char ip[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+
+        /* Hand it to the next loop, which creates the connection */
+        auto &ioLoop = *ioLoops_[nextLoop_++ % ioLoops_.size()];
+        {
+            std::lock_guard<std::mutex> g(ioLoop.lock);
+            ioLoop.accepted.emplace_back(fd, std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port)));
+        }
+        ioLoop.wakeup.send();
+    }
+}
+
+void SvcEventServer::wakeupCb_(IoLoop &ioLoop)
+{
+    std::deque<std::pair<int, std::string>> accepted;
+    std::vector<ConnectionPtr> repliedConns;
+    {
+        std::lock_guard<std::mutex> g(ioLoop.lock);
+        accepted.swap(ioLoop.accepted);
+        repliedConns.swap(ioLoop.repliedConns);
+    }
+
+    if (stopping_) {
+        for (auto &a : accepted) {
+            ::close(a.first);
+        }
+        auto connections = ioLoop.connections;
+        for (auto &kv : connections) {
+            close_(ioLoop, kv.second);
+        }
+        ioLoop.loop.break_loop(ev::ALL);
+        return;
+    }
+
+    for (auto &a : accepted) {
+        auto conn = std::make_shared<Connection>(this, &ioLoop, a.first, a.second);
+        auto transport = boost::make_shared<tt::TMemoryBuffer>();
+        auto protocol = inputProtocolFactory_->getProtocol(transport);
+        conn->processor = getProcessor(protocol, protocol, transport);
+        conn->protocolFactory = inputProtocolFactory_;
+        conn->threadpool = threadpool_;
+        conn->watcher.set(ioLoop.loop);
+        conn->watcher.set<Connection, &Connection::ioCb>(conn.get());
+        conn->watcher.start(conn->fd, ev::READ);
+        ioLoop.connections[conn->fd] = conn;
+        LOGDEBUG << "New connection: " << conn->peer;
+    }
+
+    for (auto &conn : repliedConns) {
+        if (!conn->write()) {
+            close_(ioLoop, conn);
+        }
+    }
+}
+
+void SvcEventServer::ioCb_(ConnectionPtr conn, int revents)
+{
+    if (EV_ERROR & revents) {
+        LOGERROR << "invalid libev event";
+        close_(*conn->ioLoop, conn);
+        return;
+    }
+
+    bool ok = true;
+    if (revents & EV_READ) {
+        ok = conn->read();
+    }
+    if (ok && (revents & EV_WRITE)) {
+        ok = conn->write();
+    }
+    if (!ok) {
+        close_(*conn->ioLoop, conn);
+    }
+}
+
+void SvcEventServer::close_(IoLoop &ioLoop, ConnectionPtr conn)
+{
+    {
+        std::lock_guard<std::mutex> g(conn->lock);
+        if (conn->closed) {
+            return;
+        }
+        /* From here on the threadpool won't touch the loop for this connection */
+        conn->closed = true;
+        conn->replies.clear();
+        conn->oneways.clear();
+    }
+    conn->watcher.stop();
+    ioLoop.connections.erase(conn->fd);
+    ::shutdown(conn->fd, SHUT_RDWR);
+    ::close(conn->fd);
+    LOGDEBUG << "Removing connection: " << conn->peer;
+}
+
+}  // namespace fds
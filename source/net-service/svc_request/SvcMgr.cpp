@@ -1,6 +1,7 @@
 /* Copyright 2015 Formation Data Systems, Inc.
  */
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -15,10 +16,12 @@
 #include <net/PlatNetSvcHandler.h>
 #include <fdsp/OMSvc.h>
 #include <net/fdssocket.h>
+#include <net/CoalescingTransport.h>
 #include <fdsp/Streaming.h>
 #include <fdsp/ConfigurationService.h>
 #include <fdsp_utils.h>
 #include <fds_module_provider.h>
+#include <fds_trace.h>
 #include <net/SvcRequestPool.h>
 #include <net/SvcServer.h>
 #include <net/SvcMgr.h>
@@ -27,6 +30,7 @@
 #include <fiu-control.h>
 #include <util/fiu_util.h>
 #include <util/always_call.h>
+#include <util/timeutils.h>
 #include <json/json.h>
 #include <OmExtUtilApi.h>
 
@@ -73,10 +77,16 @@ template<class ClientT>
 boost::shared_ptr<ClientT> allocRpcClient(const std::string &ip, const int &port,
     const int &retryCnt,
     const std::string &thriftServiceName,
-    const boost::shared_ptr<FdsConfig> plc)
+    const boost::shared_ptr<FdsConfig> plc,
+    const uint32_t &coalesceBytes)
 {
     auto sock = bo::make_shared<net::Socket>(ip, port);
-    auto trans = bo::make_shared<tt::TFramedTransport>(sock);
+    boost::shared_ptr<tt::TTransport> trans;
+    if (coalesceBytes > 0) {
+        trans = bo::make_shared<net::CoalescingTransport>(sock, coalesceBytes);
+    } else {
+        trans = bo::make_shared<tt::TFramedTransport>(sock);
+    }
     auto proto = bo::make_shared<tp::TBinaryProtocol>(trans);
     boost::shared_ptr<ClientT> client;
     if (plc) {
@@ -112,7 +122,7 @@ template
 boost::shared_ptr<fpi::PlatNetSvcClient> allocRpcClient<fpi::PlatNetSvcClient>(
     const std::string &ip, const int &port,
     const int &retryCnt, const std::string &strServiceName,
-    const boost::shared_ptr<FdsConfig> plc);
+    const boost::shared_ptr<FdsConfig> plc, const uint32_t &coalesceBytes);
 // Adding a new service method is a backward compatible change.
 // If an old client stub is used, the consumer code can not even know about
 // the new service method. If a new client stub is used against an older
@@ -121,17 +131,17 @@ template
 boost::shared_ptr<fpi::OMSvcClient> allocRpcClient<fpi::OMSvcClient>(
     const std::string &ip, const int &port,
     const int &retryCnt, const std::string &strServiceName,
-    const boost::shared_ptr<FdsConfig> plc);
+    const boost::shared_ptr<FdsConfig> plc, const uint32_t &coalesceBytes);
 template
 boost::shared_ptr<fpi::StreamingClient> allocRpcClient<fpi::StreamingClient>(
     const std::string &ip, const int &port,
     const int &retryCnt, const std::string &strServiceName,
-    const boost::shared_ptr<FdsConfig> plc);
+    const boost::shared_ptr<FdsConfig> plc, const uint32_t &coalesceBytes);
 template
 boost::shared_ptr<apis::ConfigurationServiceClient> allocRpcClient<apis::ConfigurationServiceClient>(
     const std::string &ip, const int &port,
     const int &retryCnt, const std::string &strServiceName,
-    const boost::shared_ptr<FdsConfig> plc);
+    const boost::shared_ptr<FdsConfig> plc, const uint32_t &coalesceBytes);
 
 /*********************************************************************************
  * class methods
@@ -195,6 +205,15 @@ SvcMgr::SvcMgr(CommonModuleProviderIf *moduleProvider,
 
     taskExecutor_ = new SynchronizedTaskExecutor<uint64_t>(*MODULEPROVIDER()->proc_thrpool());
 
+    /* Send queues of the service handles are drained here, with no threads
+     * the senders write to the socket themselves
+     */
+    auto sendThreads = config.get_abs<int>("fds.common.svc_send.threads", 2);
+    sendThreadpool_ = (sendThreads > 0) ?
+        new fds_threadpool("SvcSendThreadpool", sendThreads) : nullptr;
+    sendConnections_ = std::max(config.get_abs<uint32_t>("fds.common.svc_send.connections", 1), 1u);
+    sendCoalesceBytes_ = config.get_abs<uint32_t>("fds.common.svc_send.coalesce_bytes", 65536);
+
     svcRequestMgr_ = new SvcRequestPool(MODULEPROVIDER(), getSelfSvcUuid(), asyncHandler);
     gSvcRequestPool = svcRequestMgr_;
 
@@ -286,6 +305,7 @@ fpi::SvcUuid SvcMgr::mapToSvcUuid(const NodeUuid &in,
 SvcMgr::~SvcMgr()
 {
     svcServer_->stop();
+    delete sendThreadpool_;
     delete taskExecutor_;
     delete svcRequestMgr_;
     svcRequestMgr_ = gSvcRequestPool = nullptr;
@@ -360,7 +380,9 @@ void SvcMgr::updateSvcMap(const std::vector<fpi::SvcInfo> &entries, bool forceUp
             /* New service handle entry.  Note, we don't allocate rpcClient.  We do this lazily
              * when needed to not incur the cost of socket creation.
              */
-            auto svcHandle = boost::make_shared<SvcHandle>(MODULEPROVIDER(), e);
+            auto svcHandle = boost::make_shared<SvcHandle>(MODULEPROVIDER(), e,
+                                                           sendConnections_,
+                                                           sendCoalesceBytes_);
             svcHandleMap_.emplace(std::make_pair(e.svc_id.svc_uuid, svcHandle));
             GLOGDEBUG << "svcmap update.  svcuuid: "
                 << mapToSvcUuidAndName(e.svc_id.svc_uuid)
@@ -404,6 +426,7 @@ void SvcMgr::sendAsyncSvcReqMessage(fpi::AsyncHdrPtr &header,
     LOGTRACE << "ASYNC_REQUEST_SEND  ["
              << static_cast<SvcRequestId>(header->msg_src_id) << "]: "
              << fds::logString(*header);
+    RequestTracer::record(header->traceId, TraceStage::SVC_SEND, header->msg_type_id);
 
     SvcHandlePtr svcHandle;
     fpi::SvcUuid &svcUuid = header->msg_dst_uuid;
@@ -436,6 +459,7 @@ void SvcMgr::sendAsyncSvcRespMessage(fpi::AsyncHdrPtr &header,
     LOGTRACE << "ASYNC_RESPONSE_SEND  ["
              << static_cast<SvcRequestId>(header->msg_src_id) << "]: "
              << fds::logString(*header);
+    RequestTracer::record(header->traceId, TraceStage::SVC_RESP_SEND, header->msg_type_id);
 
     SvcHandlePtr svcHandle;
     fpi::SvcUuid &svcUuid = header->msg_dst_uuid;
@@ -574,6 +598,11 @@ SvcMgr::getTaskExecutor() {
     return taskExecutor_;
 }
 
+fds_threadpool*
+SvcMgr::getSendThreadpool() {
+    return sendThreadpool_;
+}
+
 bool SvcMgr::isSvcActionableError(const Error &e)
 {
     // TODO(Rao): Implement
@@ -839,16 +868,38 @@ std::string SvcMgr::getStateInfo() {
     Json::Value state;
     state["outstandingRequestsCount"] = static_cast<Json::Value::UInt64>(svcRequestMgr_->getOutstandingRequestsCount());
 
+    SvcHandleMap map;
+    {
+        fds_scoped_lock lock(svcHandleMapLock_);
+        map = svcHandleMap_;
+    }
+    for (auto &kv : map) {
+        auto stats = kv.second->getSendStats();
+        auto &peer = state["peers"][mapToSvcUuidAndName(kv.first)];
+        peer["sendQueued"] = static_cast<Json::Value::UInt64>(stats.queued);
+        peer["sent"] = static_cast<Json::Value::UInt64>(stats.sent);
+        peer["sendBatches"] = static_cast<Json::Value::UInt64>(stats.batches);
+        peer["sendLatencyUsec"] = static_cast<Json::Value::UInt64>(stats.latencyUsec);
+        peer["maxSendLatencyUsec"] = static_cast<Json::Value::UInt64>(stats.maxLatencyUsec);
+    }
+
     std::stringstream ss;
     ss << state;
     return ss.str();
 }
 
 SvcHandle::SvcHandle(CommonModuleProviderIf *moduleProvider,
-                     const fpi::SvcInfo &info)
-: HasModuleProvider(moduleProvider)
+                     const fpi::SvcInfo &info,
+                     uint32_t connections,
+                     uint32_t coalesceBytes)
+: HasModuleProvider(moduleProvider),
+  clientGen_(0),
+  coalesceBytes_(coalesceBytes)
 {
     svcInfo_ = info;
+    for (uint32_t i = 0; i < std::max(connections, 1u); ++i) {
+        connections_.emplace_back(new SvcConnection());
+    }
     GLOGDEBUG << "Operation: new service handle";
     GLOGDEBUG << logString();
 }
@@ -861,26 +912,16 @@ SvcHandle::~SvcHandle()
 void SvcHandle::sendAsyncSvcReqMessage(fpi::AsyncHdrPtr &header,
                                     StringPtr &payload)
 {
-    bool bSendSuccess = true;
-    {
-        fds_scoped_lock lock(lock_);
-        bSendSuccess  = sendAsyncSvcMessageCommon_(true, header, payload);
-    }
-    if (!bSendSuccess) {
-        MODULEPROVIDER()->getSvcMgr()->postSvcSendError(header);
+    if (!sendAsyncSvcMessageCommon_(true, header, payload)) {
+        postSendError_(header);
     }
 }
 
 void SvcHandle::sendAsyncSvcRespMessage(fpi::AsyncHdrPtr &header,
                                         StringPtr &payload)
 {
-    bool bSendSuccess = true;
-    {
-        fds_scoped_lock lock(lock_);
-        bSendSuccess  = sendAsyncSvcMessageCommon_(false, header, payload);
-    }
-    if (!bSendSuccess) {
-        MODULEPROVIDER()->getSvcMgr()->postSvcSendError(header);
+    if (!sendAsyncSvcMessageCommon_(false, header, payload)) {
+        postSendError_(header);
     }
 }
 
@@ -888,17 +929,16 @@ void SvcHandle::sendAsyncSvcReqMessageOnPredicate(fpi::AsyncHdrPtr &header,
                                                StringPtr &payload,
                                                const SvcInfoPredicate& predicate)
 {
-    bool bSendSuccess = true;
     {
         fds_scoped_lock lock(lock_);
         /* Only send to services matching predicate */
-        if (predicate(svcInfo_)) {
-            bSendSuccess  = sendAsyncSvcMessageCommon_(true, header, payload);
+        if (!predicate(svcInfo_)) {
+            return;
         }
     }
 
-    if (!bSendSuccess) {
-        MODULEPROVIDER()->getSvcMgr()->postSvcSendError(header);
+    if (!sendAsyncSvcMessageCommon_(true, header, payload)) {
+        postSendError_(header);
     }
 }
 
@@ -906,48 +946,234 @@ bool SvcHandle::sendAsyncSvcMessageCommon_(bool isAsyncReqt,
                                            fpi::AsyncHdrPtr &header,
                                            StringPtr &payload)
 {
-    /* NOTE: This code assumes lock is held */
+    {
+        fds_scoped_lock lock(lock_);
+        if (isSvcDown_()) {
+            /* No point trying to send when service is down */
+            GLOGWARN << "No point in sending when service is down! ( "
+                      << fds::logString(svcInfo_) << ")";
+            return false;
+        }
+    }
 
-    if (isSvcDown_()) {
-        /* No point trying to send when service is down */
-        GLOGWARN << "No point in sending when service is down! ( "
-                  << fds::logString(svcInfo_) << ")";
-        return false;
+    auto conn = connections_[static_cast<uint64_t>(header->msg_src_id) % connections_.size()].get();
+    {
+        fds_scoped_lock lock(conn->lock);
+        conn->queue.push_back(SvcMessage{isAsyncReqt, header, payload, util::getTimeStampNanos()});
+        if (conn->draining) {
+            /* Whoever is draining will send it */
+            return true;
+        }
+        conn->draining = true;
     }
-    try {
-        if (!svcClient_) {
-            GLOGDEBUG << "Allocating PlatNetSvcClient for: " << logString();
-            svcClient_ = allocRpcClient<fpi::PlatNetSvcClient>(svcInfo_.ip,
-                                                               svcInfo_.svc_port,
-                                                               SvcMgr::MIN_CONN_RETRIES,
-                                                               fpi::commonConstants().PLATNET_SERVICE_NAME,
-                                                               MODULEPROVIDER()->get_fds_config());
+
+    auto sendThreadpool = getSendThreadpool_();
+    if (sendThreadpool) {
+        auto self = shared_from_this();
+        sendThreadpool->schedule([self, conn]() { self->drainConnection_(conn); });
+    } else {
+        drainConnection_(conn);
+    }
+    return true;
+}
+
+void SvcHandle::drainConnection_(SvcConnection *conn)
+{
+    auto sendThreadpool = getSendThreadpool_();
+    std::deque<SvcMessage> batch;
+    std::vector<fpi::AsyncHdrPtr> failed;
+
+    while (true) {
+        {
+            fds_scoped_lock lock(conn->lock);
+            if (conn->queue.empty()) {
+                conn->draining = false;
+                return;
+            }
+            batch.swap(conn->queue);
         }
-        if (isAsyncReqt) {
-            /**
-             * fault injection, if 'svc.fault.unreachable' is set the following lambda will execute
+
+        sendBatch_(*conn, batch, failed);
+        batch.clear();
+        for (auto &header : failed) {
+            postSendError_(header);
+        }
+        failed.clear();
+
+        if (sendThreadpool) {
+            /* Let the other connections have the thread before sending
+             * what was queued in the meantime
              */
-            fiu_do_on("svc.fault.unreachable",
-                      LOGNOTIFY << "Triggering unreachable fault"; throw "Fault injection unreachable";);
+            {
+                fds_scoped_lock lock(conn->lock);
+                if (conn->queue.empty()) {
+                    conn->draining = false;
+                    return;
+                }
+            }
+            auto self = shared_from_this();
+            sendThreadpool->schedule([self, conn]() { self->drainConnection_(conn); });
+            return;
+        }
+    }
+}
 
-            svcClient_->asyncReqt(*header, *payload);
-        } else {
-            svcClient_->asyncResp(*header, *payload);
+/**
+ * Returns the client's transport if it is a coalescing one
+ */
+static boost::shared_ptr<net::CoalescingTransport>
+getCoalescingTransport(const fpi::PlatNetSvcClientPtr &client)
+{
+    return boost::dynamic_pointer_cast<net::CoalescingTransport>(
+        client->getOutputProtocol()->getTransport());
+}
+
+void SvcHandle::sendBatch_(SvcConnection &conn,
+                           std::deque<SvcMessage> &batch,
+                           std::vector<fpi::AsyncHdrPtr> &failed)
+{
+    std::string ip;
+    int port = 0;
+    {
+        fds_scoped_lock lock(lock_);
+        if (isSvcDown_()) {
+            GLOGWARN << "No point in sending when service is down! ( "
+                      << fds::logString(svcInfo_) << ")";
+            for (auto &msg : batch) {
+                failed.push_back(msg.header);
+            }
+            return;
+        }
+        if (conn.clientGen != clientGen_) {
+            conn.client.reset();
+            conn.transport.reset();
+            conn.clientGen = clientGen_;
+            if (&conn == connections_.front().get() && svcClient_) {
+                conn.client = svcClient_;
+                conn.transport = getCoalescingTransport(conn.client);
+            }
+        }
+        if (!conn.client) {
+            ip = svcInfo_.ip;
+            port = svcInfo_.svc_port;
         }
-        return true;
+    }
+
+    /* Messages up to sent are known to have been written to the socket */
+    size_t sent = 0;
+    uint64_t framesBefore = 0;
+    std::string error;
+    try {
+        if (!conn.client) {
+            GLOGDEBUG << "Allocating PlatNetSvcClient for: " << logString();
+            conn.client = allocRpcClient<fpi::PlatNetSvcClient>(ip,
+                                                                port,
+                                                                SvcMgr::MIN_CONN_RETRIES,
+                                                                fpi::commonConstants().PLATNET_SERVICE_NAME,
+                                                                MODULEPROVIDER()->get_fds_config(),
+                                                                coalesceBytes_);
+            conn.transport = getCoalescingTransport(conn.client);
+        }
+        /* The transport only references large payloads, the batch keeps them
+         * alive until they are written at release()
+         */
+        if (conn.transport) {
+            framesBefore = conn.transport->framesWritten();
+            conn.transport->hold();
+        }
+        for (auto &msg : batch) {
+            if (msg.isAsyncReqt) {
+                /**
+                 * fault injection, if 'svc.fault.unreachable' is set the following lambda will execute
+                 */
+                fiu_do_on("svc.fault.unreachable",
+                          LOGNOTIFY << "Triggering unreachable fault"; throw "Fault injection unreachable";);
+
+                conn.client->asyncReqt(*msg.header, *msg.payload);
+            } else {
+                conn.client->asyncResp(*msg.header, *msg.payload);
+            }
+            if (!conn.transport) {
+                ++sent;
+            }
+        }
+        if (conn.transport) {
+            conn.transport->release();
+        }
+        sent = batch.size();
     } catch (std::exception &e) {
-        GLOGWARN << "allocRpcClient failed.  Exception: " << e.what() << ".  "  << header
-                 << " SvcInfo ( " << fds::logString(svcInfo_) << " )";
+        error = e.what();
+    } catch (...) {
+        error = "Unknown exception";
+    }
 
-        markSvcDown_();
+    /* The transport may have written out part of the batch before failing,
+     * each message being one frame
+     */
+    if (conn.transport && (sent < batch.size())) {
+        sent = std::min(static_cast<size_t>(conn.transport->framesWritten() - framesBefore),
+                        batch.size());
+    }
 
-    } catch (...) {
-        GLOGWARN << "allocRpcClient failed.  Unknown exception. " << header
-                 << " SvcInfo ( " << fds::logString(svcInfo_) << " )";
+    if (sent < batch.size()) {
+        GLOGWARN << "Send failed.  Exception: " << error << ".  " << fds::logString(*batch[sent].header)
+                 << " SvcInfo ( " << logString() << " )";
+        conn.client.reset();
+        conn.transport.reset();
+        {
+            fds_scoped_lock lock(lock_);
+            /* Unless the clients were replaced meanwhile */
+            if (conn.clientGen == clientGen_) {
+                markSvcDown_();
+            }
+        }
+        for (auto i = sent; i < batch.size(); ++i) {
+            failed.push_back(batch[i].header);
+        }
+    }
 
-        markSvcDown_();
+    if (sent > 0) {
+        auto now = util::getTimeStampNanos();
+        fds_scoped_lock lock(conn.lock);
+        for (size_t i = 0; i < sent; ++i) {
+            auto latencyUsec = (now > batch[i].queuedTs) ? (now - batch[i].queuedTs) / 1000 : 0;
+            conn.stats.latencyUsec += latencyUsec;
+            conn.stats.maxLatencyUsec = std::max(conn.stats.maxLatencyUsec, latencyUsec);
+        }
+        conn.stats.sent += sent;
+        ++conn.stats.batches;
     }
-    return false;
+}
+
+fds_threadpool* SvcHandle::getSendThreadpool_()
+{
+    return MODULEPROVIDER()->getSvcMgr()->getSendThreadpool();
+}
+
+void SvcHandle::postSendError_(fpi::AsyncHdrPtr &header)
+{
+    MODULEPROVIDER()->getSvcMgr()->postSvcSendError(header);
+}
+
+SvcSendStats SvcHandle::getSendStats() const
+{
+    SvcSendStats total;
+    for (auto &conn : connections_) {
+        fds_scoped_lock lock(conn->lock);
+        total.queued += conn->queue.size();
+        total.sent += conn->stats.sent;
+        total.latencyUsec += conn->stats.latencyUsec;
+        total.maxLatencyUsec = std::max(total.maxLatencyUsec, conn->stats.maxLatencyUsec);
+        total.batches += conn->stats.batches;
+    }
+    return total;
+}
+
+void SvcHandle::resetClients_(const fpi::PlatNetSvcClientPtr &client)
+{
+    /* NOTE: Assumes lock is held */
+    svcClient_ = client;
+    ++clientGen_;
 }
 
 bool
@@ -1007,15 +1233,12 @@ void SvcHandle::updateSvcHandle(const fpi::SvcInfo &newInfo,
 
     if (forceUpdate) {
       svcInfo_ = newInfo;
-      svcClient_.reset( );
-      if (client) {
-        svcClient_ = client;
-      }
+      resetClients_(client);
       GLOGNORMAL << "Operation Applied (Forced update!).";
     } else {
       if (OmExtUtilApi::isIncomingUpdateValid(*newPtr, *currentPtr, "SvcMgr")) {
          svcInfo_ = newInfo;
-         svcClient_.reset();
+         resetClients_(nullptr);
          GLOGDEBUG << "Operation Applied.";
       } else {
          GLOGDEBUG << "Operation not Applied.";
@@ -1067,7 +1290,7 @@ void SvcHandle::markSvcDown_()
                                               svcInfo_.svc_type) ) {
         /* NOTE: Assumes this function is invoked under lock */
         svcInfo_.svc_status = fpi::SVC_STATUS_INACTIVE_FAILED;
-        svcClient_.reset();
+        resetClients_(nullptr);
         GLOGDEBUG  << logString();
 
         // Don't report ON to it self.
@@ -1080,7 +1303,7 @@ void SvcHandle::markSvcDown_()
       }
     } else {
         svcInfo_.svc_status = fpi::SVC_STATUS_INACTIVE_FAILED;
-        svcClient_.reset();
+        resetClients_(nullptr);
         GLOGDEBUG << logString();
 
         // Don't report ON to it self.
@@ -18,6 +18,7 @@
 #include <net/SvcRequestPool.h>
 #include <net/SvcMgr.h>
 #include <concurrency/SynchronizedTaskExecutor.hpp>
+#include <fds_trace.h>
 #include <util/fiu_util.h>
 #include <fiu-control.h>
 #include <fds_process.h>
@@ -150,6 +151,9 @@ void PlatNetSvcHandler::asyncReqt(boost::shared_ptr<FDS_ProtocolInterface::Async
 
     fds_assert(state == ACCEPT_REQUESTS);
     // LOGDEBUG << logString(*header);
+    RequestTracer::record(header->traceId, TraceStage::SVC_RECV, header->msg_type_id);
+    /* Work the handler does on behalf of the request is part of its trace */
+    RequestTraceScope traceScope(header->traceId);
     try
     {
         /* Deserialize the message and invoke the handler.  Deserialization is performed
@@ -195,6 +199,7 @@ void PlatNetSvcHandler::asyncResp(boost::shared_ptr<FDS_ProtocolInterface::Async
     LOGTRACE << "ASYNC_RESPONSE_RCVD  ["
              << static_cast<SvcRequestId>(header->msg_src_id) << "]: "
              << fds::logString(*header);
+    RequestTracer::record(header->traceId, TraceStage::SVC_RESP_RECV, header->msg_type_id);
 
     fiu_do_on("svc.disable.schedule", asyncRespHandler(\
     MODULEPROVIDER()->getSvcMgr()->getSvcRequestTracker(), header, payload); return; );
@@ -251,6 +256,8 @@ void PlatNetSvcHandler::asyncRespHandler(SvcRequestTracker* reqTracker,
               << static_cast<SvcRequestId>(header->msg_src_id) << "]: "
               << fds::logString(*header);
 
+     /* Requests sent while handling the response continue its trace */
+     RequestTraceScope traceScope(header->traceId);
      asyncReq->handleResponse(header, payload);
 }
 
@@ -505,13 +512,7 @@ void PlatNetSvcHandler::getCounters(std::map<std::string, int64_t> & _return,
         return;
     }
 
-    auto    cntrs = MODULEPROVIDER()->get_cntrs_mgr()->get_counters(*id);
-
-    if (cntrs == nullptr)
-    {
-        return;
-    }
-    cntrs->toMap(_return);
+    MODULEPROVIDER()->get_cntrs_mgr()->toMap(*id, _return);
 }
 
 /**
@@ -30,7 +30,9 @@ SvcRequestCounters::SvcRequestCounters(const std::string &id, FdsCountersMgr *mg
     timedout("timedout", this),
     invokeerrors("invokeerrors", this),
     appsuccess("appsuccess", this),
-    apperrors("apperrors", this)
+    apperrors("apperrors", this),
+    mgr_(mgr),
+    replicaReadCntrsLock_("replica read counters")
 {
     (new SimpleNumericCounter("service.start.timestamp",this))->set(util::getTimeStampSeconds());
 }
@@ -39,6 +41,29 @@ SvcRequestCounters::~SvcRequestCounters()
 {
 }
 
+ReplicaReadCounters* SvcRequestCounters::getReplicaReadCntrs(const fpi::SvcUuid &svcUuid)
+{
+    fds_mutex::scoped_lock l(replicaReadCntrsLock_);
+    auto &cntrs = replicaReadCntrs_[svcUuid.svc_uuid];
+    if (!cntrs) {
+        cntrs.reset(new ReplicaReadCounters(svcUuid));
+        /* Export only after the counters are fully constructed.  Counters are never
+         * removed from export, there are only as many of these as DMs in the domain.
+         */
+        if (mgr_) {
+            mgr_->add_for_export(cntrs.get());
+        }
+    }
+    return cntrs.get();
+}
+
+ReplicaReadCounters::ReplicaReadCounters(const fpi::SvcUuid &svcUuid)
+    : FdsCounters("replica." + std::to_string(svcUuid.svc_uuid), nullptr),
+    reads("replica." + std::to_string(svcUuid.svc_uuid) + ".reads", this),
+    readerrors("replica." + std::to_string(svcUuid.svc_uuid) + ".readerrors", this)
+{
+}
+
 SvcRequestTimer::SvcRequestTimer(CommonModuleProviderIf* provider,
                                  const SvcRequestId &id,
                                  const fpi::FDSPMsgTypeId &msgTypeId,
@@ -118,7 +143,8 @@ SvcRequestIf::SvcRequestIf(CommonModuleProviderIf* provider,
     teidIsSet_(false),
     myEpId_(myEpId),
     fireAndForget_(false),
-    minor_version(0)
+    minor_version(0),
+    traceId_(RequestTracer::current())
 {
 }
 
@@ -219,6 +245,9 @@ void EPSvcRequest::sendPayload_()
     getSvcRequestMgr()->newSvcRequestHeaderPtr(id_, msgTypeId_, myEpId_, peerEpId_,
                                                dlt_version_, replicaId_, replicaVersion_);
     header->msg_type_id = msgTypeId_;
+    if (traceId_) {
+        header->__set_traceId(traceId_);
+    }
 
     DBG(GLOGDEBUG << fds::logString(*header));
 
@@ -459,6 +488,7 @@ void MultiEpSvcRequest::addEndpoint(const fpi::SvcUuid& peerEpId,
 {
     epReqs_.push_back(EPSvcRequestPtr(
             new EPSvcRequest(MODULEPROVIDER(), id_, myEpId_, peerEpId)));
+    epReqs_.back()->setTraceId(traceId_);
     // Tag this against a specific DLT
     epReqs_.back()->dlt_version_ = dlt_version;
     epReqs_.back()->setReplicaId(replicaId);
@@ -22,6 +22,8 @@ namespace fds {
 SvcRequestPool *gSvcRequestPool;
 
 SvcRequestId SvcRequestPool::SVC_UNTRACKED_REQ_ID = 0;
+const SvcRequestId SvcRequestPool::REQ_ID_BLOCK;
+std::atomic<uint64_t> SvcRequestPool::poolEpochs_(0);
 
 template<typename T>
 T SvcRequestPool::get_config(std::string const& option)
@@ -48,7 +50,7 @@ SvcRequestPool::SvcRequestPool(CommonModuleProviderIf *moduleProvider,
      */
     RandNumGenerator rgen(RandNumGenerator::getRandSeed());
     nextAsyncReqId_ = rgen.genNum();
-    nextAsyncReqId_ = getNextAsyncReqId_();
+    poolEpoch_ = ++poolEpochs_;
     LOGNOTIFY << "Starting service request id at: " << nextAsyncReqId_;
 
     finishTrackingCb_ = std::bind(&SvcRequestTracker::popFromTracking,
@@ -10,9 +10,21 @@
 
 namespace fds {
 
-SvcRequestTracker::SvcRequestTracker(CommonModuleProviderIf *moduleProvider)
-    : HasModuleProvider(moduleProvider)
+const uint32_t SvcRequestTracker::DEFAULT_SHARDS;
+
+SvcRequestTracker::SvcRequestTracker(CommonModuleProviderIf *moduleProvider,
+                                     uint32_t shards)
+    : HasModuleProvider(moduleProvider),
+      outstanding_(0)
 {
+    uint32_t cnt = 1;
+    while (cnt < shards) {
+        cnt <<= 1;
+    }
+    shardMask_ = cnt - 1;
+    for (uint32_t i = 0; i < cnt; i++) {
+        shards_.emplace_back(new Shard());
+    }
 }
 
 /**
@@ -25,9 +37,13 @@ bool SvcRequestTracker::addForTracking(const SvcRequestId& id,
 {
     DBG(GLOGDEBUG << req->logString());
 
-    fds_scoped_lock l(svcReqMaplock_);
+    auto &shard = shard_(id);
+    fds_scoped_lock l(shard.svcReqMaplock);
     auto pair = std::make_pair(id, req);
-    auto ret = svcReqMap_.insert(pair);
+    auto ret = shard.svcReqMap.insert(pair);
+    if (ret.second) {
+        outstanding_.fetch_add(1, std::memory_order_relaxed);
+    }
     return ret.second;
 }
 
@@ -40,11 +56,13 @@ SvcRequestTracker::popFromTracking(const SvcRequestId& id)
 {
     DBG(GLOGDEBUG << "Req Id: " << id);
 
-    fds_scoped_lock l(svcReqMaplock_);
-    auto itr = svcReqMap_.find(id);
-    if (itr != svcReqMap_.end()) {
+    auto &shard = shard_(id);
+    fds_scoped_lock l(shard.svcReqMaplock);
+    auto itr = shard.svcReqMap.find(id);
+    if (itr != shard.svcReqMap.end()) {
         auto r = itr->second;
-        svcReqMap_.erase(itr);
+        shard.svcReqMap.erase(itr);
+        outstanding_.fetch_sub(1, std::memory_order_relaxed);
         return r;
     }
     return nullptr;
@@ -58,9 +76,10 @@ SvcRequestTracker::popFromTracking(const SvcRequestId& id)
 SvcRequestIfPtr
 SvcRequestTracker::getSvcRequest(const SvcRequestId& id)
 {
-    fds_scoped_lock l(svcReqMaplock_);
-    auto itr = svcReqMap_.find(id);
-    if (itr != svcReqMap_.end()) {
+    auto &shard = shard_(id);
+    fds_scoped_lock l(shard.svcReqMaplock);
+    auto itr = shard.svcReqMap.find(id);
+    if (itr != shard.svcReqMap.end()) {
         return itr->second;
     }
     return nullptr;
@@ -71,7 +90,7 @@ SvcRequestTracker::getSvcRequest(const SvcRequestId& id)
  */
 uint64_t
 SvcRequestTracker::getOutstandingSvcReqsCount() {
-    return svcReqMap_.size();
+    return outstanding_.load(std::memory_order_relaxed);
 }
 
 }  // namespace fds
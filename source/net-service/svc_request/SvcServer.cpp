@@ -11,6 +11,7 @@
 #include <thrift/transport/TSocket.h>
 #include <thrift/transport/TServerSocket.h>
 #include <net/SvcServer.h>
+#include <net/SvcEventServer.h>
 #include <fds_error.h>
 #include "fdsp/common_constants.h"
 
@@ -49,13 +50,28 @@ SvcServer::SvcServer(int port, std::unordered_map<std::string, boost::shared_ptr
      * Tue Feb 23 15:04:17 MST 2016
      */
     bool enableMultiplexedServices = false;
+    /* Connections are served on this many event loops, 0 for a thread per connection */
+    uint32_t ioThreads = 2;
+    fds_threadpool *threadpool = nullptr;
     if (moduleProvider) {
         // The module provider might not supply the base path we want,
         // so make our own config access. This is libConfig data, not
         // to be confused with FDS configuration (platform.conf).
         FdsConfigAccessor configAccess(moduleProvider->get_fds_config(), "fds.feature_toggle.");
         enableMultiplexedServices = configAccess.get<bool>("common.enable_multiplexed_services", false);
+
+        FdsConfigAccessor serverConfig(moduleProvider->get_fds_config(), "fds.common.svc_server.");
+        ioThreads = serverConfig.get<uint32_t>("io_threads", ioThreads);
+        threadpool = moduleProvider->proc_thrpool();
     }
+    auto makeServer = [&](const boost::shared_ptr<at::TProcessor> &processor) {
+        if (ioThreads > 0) {
+            return boost::shared_ptr<ts::TServer>(
+                new SvcEventServer(processor, proto, port, ioThreads, threadpool));
+        }
+        return boost::shared_ptr<ts::TServer>(
+            new ts::TThreadedServer(processor, serverTransport_, tfact, proto));
+    };
     if (enableMultiplexedServices) {
         // Runs a processor for each service or supported major service version.
         // Please refer to:
@@ -69,16 +85,14 @@ SvcServer::SvcServer(int port, std::unordered_map<std::string, boost::shared_ptr
             processor_->registerProcessor(p.first, p.second);
         }
         // Multiplexed server
-        server_ = boost::shared_ptr<ts::TThreadedServer>(
-            new ts::TThreadedServer(processor_, serverTransport_, tfact, proto));
+        server_ = makeServer(processor_);
     } else {
         if (processors.size() == 0 || (processors.size() == 1 && !processors.begin()->second)) {
             LOGERROR << "Failed to create Thrift server. No processor.";
             throw std::runtime_error("Failed to create Thrift server. No processor");
         }
         // Non-multiplexed server
-        server_ = boost::shared_ptr<ts::TThreadedServer>(
-            new ts::TThreadedServer(processors.begin()->second, serverTransport_, tfact, proto));
+        server_ = makeServer(processors.begin()->second);
     }
     stopped_ = true;
 }
@@ -1,5 +1,6 @@
 /* Copyright 2015 Formation Data Systems, Inc.
  */
+#include <algorithm>
 #include <vector>
 #include <net/VolumeGroupHandle.h>
 #include <net/SvcRequestPool.h>
@@ -32,6 +33,7 @@ namespace fds {
 uint32_t VolumeGroupHandle::GROUPCHECK_INTERVAL_SEC = 30;
 uint32_t VolumeGroupHandle::IO_TIMEOUT_MS = 5000;                      // set low for testing
 uint32_t VolumeGroupHandle::COORDINATOR_SWITCH_TIMEOUT_MS = 5000;      // set low for testing
+uint32_t VolumeGroupHandle::READ_PROBE_INTERVAL = 64;
 
 std::ostream& operator << (std::ostream &out, const fpi::VolumeIoHdr &h)
 {
@@ -86,6 +88,8 @@ VolumeGroupHandle::VolumeGroupHandle(CommonModuleProviderIf* provider,
 
     isCoordinator_ = false;
 
+    readSelectCnt_ = 0;
+
     if (MODULEPROVIDER()->get_cntrs_mgr()) {
         MODULEPROVIDER()->get_cntrs_mgr()->add_for_export(this);
     }
@@ -397,6 +401,9 @@ std::string VolumeGroupHandle::getStateInfo()
         state[id]["version"] = h.version;
         state[id]["lasterror"] = h.lastError.GetErrName();
         state[id]["appliedopid"] = static_cast<Json::Value::Int64>(h.appliedOpId);
+        state[id]["outstandingreads"] = h.outstandingReads;
+        state[id]["readlatencyus"] = static_cast<Json::Value::UInt64>(h.readLatencyUs);
+        state[id]["readssent"] = static_cast<Json::Value::UInt64>(h.readsSent);
 #ifdef COMMITID_SUPPORTED
         state[id]["appliedsequenceid"] = static_cast<Json::Value::Int64>(h.appliedCommitId);
 #endif
@@ -898,6 +905,99 @@ VolumeReplicaHandle* VolumeGroupHandle::getFunctionalReplicaHandle()
     return &(functionalReplicas_.front());
 }
 
+/**
+* @brief Picks the replica that should serve the next read from candidates.  Replicas
+* are scored by their average read latency scaled by the # of reads already queued
+* against them.  This spreads reads across replicas while steering them away from
+* slow or busy ones.  Every READ_PROBE_INTERVAL picks, a replica is chosen round robin
+* so latency estimates of replicas that aren't getting reads are refreshed.
+*
+* @param candidates replicas to choose from.  May be a copy of the group's replica list
+* @param excluded replicas already tried
+*
+* @return index into candidates or -1 when all candidates are excluded
+*/
+int32_t VolumeGroupHandle::pickReadReplica_(const VolumeReplicaHandleList &candidates,
+                                            const std::vector<fpi::SvcUuid> &excluded)
+{
+    ASSERT_SYNCHRONIZED();
+
+    const int32_t cnt = candidates.size();
+    if (cnt == 0) {
+        return -1;
+    }
+
+    /* Rotating the start index breaks ties in a round robin manner */
+    const int32_t start = readSelectCnt_ % cnt;
+    ++readSelectCnt_;
+    const bool probe = READ_PROBE_INTERVAL > 0 && (readSelectCnt_ % READ_PROBE_INTERVAL) == 0;
+
+    int32_t picked = -1;
+    uint64_t pickedScore = 0;
+    for (int32_t i = 0; i < cnt; i++) {
+        int32_t idx = (start + i) % cnt;
+        const auto &candidate = candidates[idx];
+        if (std::find(excluded.begin(), excluded.end(), candidate.svcUuid) != excluded.end()) {
+            continue;
+        }
+        if (probe) {
+            picked = idx;
+            break;
+        }
+        /* Read stats are maintained on the group's handles, candidates may be stale */
+        auto live = getVolumeReplicaHandle_(candidate.svcUuid);
+        const VolumeReplicaHandle &h = (live == INVALID_REAPLICA_HANDLE()) ? candidate : *live;
+        uint64_t score = std::max(h.readLatencyUs, static_cast<uint64_t>(1)) *
+            (h.outstandingReads + 1);
+        if (picked == -1 || score < pickedScore) {
+            picked = idx;
+            pickedScore = score;
+        }
+    }
+    return picked;
+}
+
+void VolumeGroupHandle::onReadSent_(const fpi::SvcUuid &svcUuid)
+{
+    ASSERT_SYNCHRONIZED();
+
+    GET_VOLUMEREPLICA_HANDLE(volumeHandle, svcUuid);
+    volumeHandle->outstandingReads++;
+    volumeHandle->readsSent++;
+}
+
+void VolumeGroupHandle::onReadResponse_(const fpi::SvcUuid &svcUuid,
+                                        const uint64_t &latencyNs,
+                                        const Error &e)
+{
+    ASSERT_SYNCHRONIZED();
+
+    bool isError = isVolumeGroupError(e);
+    auto cntrs = MODULEPROVIDER()->getSvcMgr()->getSvcRequestCntrs()->getReplicaReadCntrs(svcUuid);
+    cntrs->reads.update(latencyNs);
+    if (isError) {
+        cntrs->readerrors.incr();
+    }
+
+    auto volumeHandle = getVolumeReplicaHandle_(svcUuid);
+    if (volumeHandle == INVALID_REAPLICA_HANDLE()) {
+        /* Replica is no longer part of the group */
+        return;
+    }
+    if (volumeHandle->outstandingReads > 0) {
+        volumeHandle->outstandingReads--;
+    }
+    /* Errors and timeouts are charged the time they took, so replicas that fail reads
+     * end up getting fewer of them.  Moving average gives 1/4 weight to the new sample.
+     */
+    uint64_t latencyUs = latencyNs / 1000;
+    if (volumeHandle->readLatencyUs == 0) {
+        volumeHandle->readLatencyUs = latencyUs;
+    } else {
+        volumeHandle->readLatencyUs = (volumeHandle->readLatencyUs * 3 + latencyUs) / 4;
+    }
+}
+
 std::vector<fpi::SvcUuid> VolumeGroupHandle::getAllReplicas() const
 {
     std::vector<fpi::SvcUuid> svcs;
@@ -1143,6 +1243,7 @@ void VolumeGroupRequest::invoke()
 
 void VolumeGroupRequest::complete(const Error& error)
 {
+    RequestTracer::record(traceId_, TraceStage::VG_DONE, msgTypeId_);
     groupHandle_->decRef();
     MultiEpSvcRequest::complete(error);
 }
@@ -1228,23 +1329,38 @@ void VolumeGroupBroadcastRequest::handleResponse(SHPTR<fpi::AsyncHdr>& header,
 void VolumeGroupFailoverRequest::invokeWork_()
 {
     /* First try and get the next replica from availableReplicas_,
-     * otherwise check with VolumeGroupHandle
+     * otherwise check with VolumeGroupHandle.  In both cases the least loaded replica
+     * that hasn't been tried yet is picked.
      */
     if (availableReplicas_.size() > 0) {
         fds_assert(!groupHandle_->isCoordinator_);
-        addEndpoint(availableReplicas_.front().svcUuid,
+        auto idx = groupHandle_->pickReadReplica_(availableReplicas_, triedReplicas_);
+        fds_verify(idx >= 0);
+        auto replica = availableReplicas_.begin() + idx;
+        addEndpoint(replica->svcUuid,
                     groupHandle_->getDmtVersion(),
                     groupHandle_->getGroupId(),
-                    availableReplicas_.front().version);
-        availableReplicas_.erase(availableReplicas_.begin());
+                    replica->version);
+        triedReplicas_.push_back(replica->svcUuid);
+        availableReplicas_.erase(replica);
     } else {
         fds_assert(groupHandle_->isCoordinator_);
-        auto replica = groupHandle_->getFunctionalReplicaHandle();
+        auto idx = groupHandle_->pickReadReplica_(groupHandle_->functionalReplicas_,
+                                                  triedReplicas_);
+        /* Replicas that failed are moved out of functional list, so there is always
+         * an untried functional replica here.  Fallback to the first one just in case.
+         */
+        auto replica = (idx >= 0) ?
+            &(groupHandle_->functionalReplicas_[idx]) :
+            groupHandle_->getFunctionalReplicaHandle();
         addEndpoint(replica->svcUuid,
                     groupHandle_->getDmtVersion(),
                     groupHandle_->getGroupId(),
                     replica->version);
+        triedReplicas_.push_back(replica->svcUuid);
     }
+    groupHandle_->onReadSent_(triedReplicas_.back());
+    sendTs_ = util::getTimeStampNanos();
 
     auto &ep = epReqs_.back();
     ep->setPayloadBuf(msgTypeId_, payloadBuf_);
@@ -1271,6 +1387,10 @@ void VolumeGroupFailoverRequest::handleResponse(SHPTR<fpi::AsyncHdr>& header,
     }
     epReq->completeReq(header->msg_code, header, payload);
 
+    groupHandle_->onReadResponse_(header->msg_src_uuid,
+                                  util::getTimeStampNanos() - sendTs_,
+                                  header->msg_code);
+
     ++nAcked_;
     fds_assert(nAcked_ <= groupHandle_->size());
 
@@ -101,6 +101,15 @@ class ObjectStore : public Module, public boost::noncopyable {
                                              boost::shared_ptr<const std::string> objData,
                                              diskio::DataTier &useTier);
 
+    /**
+     * Adds a volume reference to an object that is already stored,
+     * the put-by-reference counterpart of putObject for a duplicate.
+     * Returns ERR_NOT_FOUND if the data must be sent after all.
+     */
+    Error putObjectRef(fds_volid_t volId,
+                       const ObjectID &objId,
+                       diskio::DataTier &useTier);
+
     /// Current state of the object store
     std::atomic<ObjectStoreState> currentState;
 
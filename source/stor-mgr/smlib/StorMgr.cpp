@@ -812,13 +812,22 @@ ObjectStorMgr::putObjectInternal(SmIoPutObjectReq *putReq)
         // latency of ObjectStore layer
         PerfTracer::tracePointBegin(putReq->opLatencyCtx);
 
-        // TODO(Andrew): Remove this copy. The network should allocated
-        // a shared ptr structure so that we can directly store that, even
-        // after the network message is freed.
-        err = objectStore->putObject(volId,
-                                     objId,
-                                     boost::make_shared<std::string>(putReq->putObjectNetReq->data_obj),
-                                     putReq->forwardedReq, useTier);
+        if (putReq->putObjectNetReq->data_by_ref) {
+            // The sender expects us to have the data already. We can't vouch
+            // for the destination of a migrating token, so have it send the
+            // data in that case.
+            err = migrationMgr->isMigrationInProgress()
+                ? ERR_NOT_FOUND
+                : objectStore->putObjectRef(volId, objId, useTier);
+        } else {
+            // TODO(Andrew): Remove this copy. The network should allocated
+            // a shared ptr structure so that we can directly store that, even
+            // after the network message is freed.
+            err = objectStore->putObject(volId,
+                                         objId,
+                                         boost::make_shared<std::string>(putReq->putObjectNetReq->data_obj),
+                                         putReq->forwardedReq, useTier);
+        }
 
         qosCtrl->markIODone(*putReq);
 
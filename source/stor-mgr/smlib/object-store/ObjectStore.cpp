@@ -1195,6 +1195,51 @@ ObjectStore::copyAssociation(fds_volid_t srcVolId,
     return err;
 }
 
+Error
+ObjectStore::putObjectRef(fds_volid_t volId,
+                          const ObjectID &objId,
+                          diskio::DataTier &useTier) {
+    Error err = checkAvailability();
+    if (!err.ok()) {
+        return err;
+    }
+
+    useTier = diskio::maxTier;
+    LOGTRACE << "Referencing object " << objId << " volume " << std::hex << volId
+             << std::dec;
+
+    ObjMetaData::const_ptr objMeta = metaStore->getObjectMetadata(volId, objId, err, &useTier);
+    if (!err.ok()) {
+        return err;
+    }
+
+    // Anything but a plain duplicate goes through the full put path, which
+    // has the data to reconcile or report corruption with
+    if (objMeta->isObjCorrupted()
+        || objMeta->isObjReconcileRequired()
+        || !objMeta->dataPhysicallyExists()) {
+        LOGDEBUG << "Not referencing object " << objId << " " << objMeta->logString();
+        return ERR_NOT_FOUND;
+    }
+
+    ObjMetaData::ptr updatedMeta(new ObjMetaData(objMeta));
+    std::map<fds_volid_t, fds_uint64_t> vols_refcnt;
+    updatedMeta->getVolsRefcnt(vols_refcnt);
+    updatedMeta->updateAssocEntry(objId, volId);
+    volumeTbl->updateDupObj(volId,
+                            objId,
+                            updatedMeta->getObjSize(),
+                            true,
+                            vols_refcnt);
+    PerfTracer::incr(PerfEventType::SM_PUT_DUPLICATE_OBJ, volId);
+
+    updatedMeta->updateTimestamp();
+    updatedMeta->resetDeleteCount();
+    err = metaStore->putObjectMetadata(volId, objId, updatedMeta, &useTier);
+    useTier = metaStore->getMetadataTier();
+    return err;
+}
+
 /**
  * Verify if objId matches SHA of(data corresponding to objId)
  * If not, set err and updated on-disk metadata of the object.
@@ -1989,8 +2034,16 @@ ObjectStore::evaluateObjectSets(const fds_token_id& smToken,
         serialize::Deserializer* d = serialize::getFileDeserializer(eachFile);
         BloomFilter bf;
         bf.read(d);
-        objectSets.push_back(bf);
         delete d;
+        if (bf.formatMismatch()) {
+            // Drop this token's object sets so the DMs' next scan sends
+            // rebuilt ones; until then nothing here is evaluated.
+            LOGWARN << "Token : " << smToken << " object set: " << eachFile
+                    << " has an unknown format, discarding object sets";
+            removeObjectSet(smToken);
+            return;
+        }
+        objectSets.push_back(std::move(bf));
     }
 
     TimeStamp ts;
@@ -63,6 +63,12 @@ class SMMain : public SvcProcess
         setupSigHandler();
     }
 
+    void setupSvcInfo_() override {
+        SvcProcess::setupSvcInfo_();
+        // Lets AM send puts of objects we already store by reference
+        svcInfo_.props[FDS_ProtocolInterface::commonConstants().SM_PROP_PUT_BY_REF] = "true";
+    }
+
     static void SIGSEGVHandler(int sigNum, siginfo_t *sigInfo, void *context) {
         GLOGCRITICAL << "SIGSEGV at address: " << std::hex << sigInfo->si_addr
                      << " with code " << std::dec << sigInfo->si_code;
@@ -3,6 +3,11 @@
  */
 #include <PerfTrace.h>
 
+#include <sched.h>
+#include <sys/sysinfo.h>
+
+#include <algorithm>
+#include <limits>
 #include <stdexcept>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
@@ -12,9 +17,6 @@
 #include <string>
 #include <vector>
 
-// XXX: uncomment if name space for context is limited
-// #define CACHE_REGEX_MATCH_RESULTS
-
 // XXX: uncomment this to use rdtsc()
 // #define USE_RDTSC_TIME
 
@@ -40,17 +42,10 @@ void createLatencyCounter(fds::PerfContext & ctx) {
     ctx.data.reset(plc);
 }
 
-// FIXME(matteo): ctx may be useless here
 template <typename T>
-void initializeCounter(fds::PerfContext * ctx, fds::FdsCounters * parent,
-                    const fds::PerfEventType & type, const fds::fds_volid_t volid,
-                    std::string const& name) {
-    fds_assert(ctx);
-    fds_assert(0 == ctx->data.get());
-    GLOGTRACE << "Creating performance counter for type='" << ctx->type
-              << "' volid='" << ctx->volid
-              << "' name='" << ctx->name
-              << "' from type='" << type
+T * createCounter(fds::FdsCounters * parent, const fds::PerfEventType & type,
+                  const fds::fds_volid_t volid, std::string const& name) {
+    GLOGTRACE << "Creating performance counter for type='" << type
               << "' volid='" << volid
               << "' name='" << name << "' ";
 
@@ -59,7 +54,7 @@ void initializeCounter(fds::PerfContext * ctx, fds::FdsCounters * parent,
         counterName += "." + name;
     }
 
-    ctx->data.reset(new T(counterName, volid, parent));
+    return new T(counterName, volid, parent);
 }
 
 void stringToEventsFilter(const std::string & str, std::bitset<fds_enum::get_size<fds::PerfEventType>()> & filter) {
@@ -109,8 +104,28 @@ namespace fds {
 const std::string PERF_COUNTERS_NAME("perf");
 
 const unsigned PERF_CONTEXT_TIMEOUT = 1800;  // in seconds (30 mins)
-PerfTracer::PerfTracer() : aggregateCounters_(fds_enum::get_size<PerfEventType>()),
-                           namedCounters_(fds_enum::get_size<PerfEventType>()),
+
+const uint32_t PerfTracer::CHUNK_SLOTS;
+const uint32_t PerfTracer::MAX_CHUNKS;
+
+/**
+ * Perf counters are kept in the tracer's per cpu cells, which are summed into
+ * the exported counters whenever the counter manager exports them
+ */
+class PerfTracer::ExportedCounters : public FdsCounters {
+  public:
+    explicit ExportedCounters(PerfTracer & tracer)
+            : FdsCounters(PERF_COUNTERS_NAME, nullptr), tracer_(tracer) {}
+
+    void aggregate() override {
+        tracer_.aggregate(this);
+    }
+
+  private:
+    PerfTracer & tracer_;
+};
+
+PerfTracer::PerfTracer() : numCpus_(std::max(get_nprocs_conf(), 1)),
                            enable_(true),
                            useEventsFilter_(false),
                            nameFilter_("^$"),
@@ -121,9 +136,15 @@ PerfTracer::PerfTracer() : aggregateCounters_(fds_enum::get_size<PerfEventType>(
 
     GLOGDEBUG << "Instantiating PerfTracer";
 
-    exportedCounters.reset(new FdsCounters(PERF_COUNTERS_NAME, g_cntrs_mgr.get()));
+    for (auto & chunk : cellChunks_) {
+        chunk.store(nullptr, std::memory_order_relaxed);
+    }
+    exportedCounters.reset(new ExportedCounters(*this));
 
     reconfig();
+
+    // Only export once there is a tracer to aggregate
+    g_cntrs_mgr->add_for_export(exportedCounters.get());
 }
 
 PerfTracer::~PerfTracer() {
@@ -132,17 +153,14 @@ PerfTracer::~PerfTracer() {
     }
     latencyMap_.clear();
 
-    for (auto & e : namedCounters_) {
-        for (auto& kv : e) {
-            for (auto& kvv : kv.second) {
-                // TODO(matteo): exportedCounters->remove_from_export(kv.second.data);
-                delete kvv.second;
-            }
-            kv.second.clear();
-        }
-        e.clear();
+    // TODO(matteo): exportedCounters->remove_from_export() the slot counters
+    for (auto& kv : handles_) {
+        delete kv.second;
+    }
+    handles_.clear();
+    for (auto & chunk : cellChunks_) {
+        delete [] chunk.load(std::memory_order_relaxed);
     }
-    namedCounters_.clear();
 }
 
 PerfTracer & PerfTracer::instance() {
@@ -186,16 +204,23 @@ void PerfTracer::reconfig() {
 
     FDSGUARD(config_mutex_);
 
-    // update name filter config
-    if (tmpUseNameFilter) {
-        try {
-            nameFilter_ = exprStr;
-        } catch(boost::bad_expression & ex) {
-            GLOGWARN << "Invalid expression in name filter, ignoring configuration";
-            tmpUseNameFilter = false;
+    // update name filter config, and the filter decisions cached in the handles
+    {
+        FDSGUARD(registry_mutex_);
+        if (tmpUseNameFilter) {
+            try {
+                nameFilter_ = exprStr;
+            } catch(boost::bad_expression & ex) {
+                GLOGWARN << "Invalid expression in name filter, ignoring configuration";
+                tmpUseNameFilter = false;
+            }
+        }
+        useNameFilter_ = tmpUseNameFilter;
+
+        for (auto & kv : handles_) {
+            kv.second->namedSlot.store(namedSlot(*kv.second), std::memory_order_relaxed);
         }
     }
-    useNameFilter_ = tmpUseNameFilter;
 
     // update events filter config
     if (tmpUseEventsFilter) {
@@ -209,70 +234,188 @@ void PerfTracer::reconfig() {
     enable_ = tmpEnable;
 }
 
-void PerfTracer::updateCounter(PerfContext & ctx, const PerfEventType & type,
-        const uint64_t & val,  const uint64_t cnt, const fds_volid_t volid,
-        const std::string& name) {
-    GLOGTRACE << "Updating performance counter for type='" << ctx.type
-              << "' val='" << val << "' count='" << cnt << "' name='"
-              << ctx.name << "'";
-    FdsCounters * counterParent = ctx.enabled ? exportedCounters.get() : 0;
-    // update counter
-    if (cnt) {
-        std::call_once(ctx.once, initializeCounter<LatencyCounter>,
-                       &ctx, counterParent, type, volid, name);
-        LatencyCounter * plc = static_cast<LatencyCounter *>(ctx.data.get());  //NOLINT
-        plc->update(val, cnt);
-    } else {
-        std::call_once(ctx.once, initializeCounter<NumericCounter>,
-                       &ctx, counterParent, type, volid, name);
-        NumericCounter * pnc = static_cast<NumericCounter *>(ctx.data.get()); //NOLINT
-        pnc->incr(val);
-    }
+PerfCounterHandle * PerfTracer::counterHandle(const PerfEventType & type,
+        fds_volid_t volid, std::string const& name /* = "" */) {
+    fds_assert(fds_enum::get_index<PerfEventType>(type) < fds_enum::get_size<PerfEventType>());
+    return instance().registerHandle(type, volid, name);
 }
 
-void PerfTracer::upsert(const PerfEventType & type, fds_volid_t volid,
-            uint64_t val, uint64_t cnt, const std::string & name) {
-    PerfContext * ctx = 0;
+PerfCounterHandle * PerfTracer::registerHandle(const PerfEventType & type,
+        fds_volid_t volid, const std::string & name) {
+    CounterKey key{type, volid, name};
+
+    FDSGUARD(registry_mutex_);
+
+    auto pos = handles_.find(key);
+    if (handles_.end() != pos) {
+        return pos->second;
+    }
+
+    PerfCounterHandle * handle = new PerfCounterHandle(type, volid, name,
+                                                       slot(CounterKey{type, volid, ""}));
+    handle->namedSlot.store(namedSlot(*handle), std::memory_order_relaxed);
+    handles_[key] = handle;
+    return handle;
+}
 
-    FDSGUARD(ptrace_mutex_named_);
+int32_t PerfTracer::slot(const CounterKey & key) {
+    auto pos = slotIds_.find(key);
+    if (slotIds_.end() != pos) {
+        return pos->second;
+    }
 
-    PerfContextMap::iterator pos = namedCounters_[fds_enum::get_index<PerfEventType>(type)][volid].find(name);
-    if (namedCounters_[fds_enum::get_index<PerfEventType>(type)][volid].end() != pos) {
-        if (!pos->second->enabled) {
-            return;  // disabled for this name
+    uint32_t id = slots_.size();
+    if (id >= CHUNK_SLOTS * MAX_CHUNKS) {
+        GLOGWARN << "Out of performance counter slots, not counting type='"
+                 << key.type << "' volid='" << key.volid << "' name='" << key.name << "'";
+        return -1;
+    }
+    if (0 == id % CHUNK_SLOTS) {
+        CounterCell * chunk = new CounterCell[CHUNK_SLOTS * numCpus_];
+        for (uint32_t i = 0; i < CHUNK_SLOTS * numCpus_; ++i) {
+            chunk[i].val = 0;
+            chunk[i].cnt = 0;
+            chunk[i].min = std::numeric_limits<uint64_t>::max();
+            chunk[i].max = 0;
         }
+        cellChunks_[id / CHUNK_SLOTS].store(chunk, std::memory_order_release);
+    }
 
-        ctx = pos->second;
-    } else {
-        ctx = new PerfContext(type, volid, name);
-        if (!name.empty()) {
-#ifdef CACHE_REGEX_MATCH_RESULTS
-            if (!regex_match(name, nameFilter_)) {
-                ctx->enabled = false;
+    slots_.push_back(CounterSlot{key, nullptr});
+    slotIds_[key] = id;
+    return id;
+}
+
+int32_t PerfTracer::namedSlot(const PerfCounterHandle & handle) {
+    if (handle.name.empty() || !useNameFilter_ || !regex_match(handle.name, nameFilter_)) {
+        return -1;
+    }
+    return slot(CounterKey{handle.type, handle.volid, handle.name});
+}
+
+PerfCounterHandle * PerfTracer::lookup(const PerfEventType & type, fds_volid_t volid,
+        const std::string & name) {
+    // Handles are never freed, so each thread can keep the ones it used
+    static thread_local std::unordered_map<CounterKey, PerfCounterHandle *, CounterKeyHash> cache;
+
+    CounterKey key{type, volid, name};
+    auto pos = cache.find(key);
+    if (cache.end() != pos) {
+        return pos->second;
+    }
+
+    PerfCounterHandle * handle = registerHandle(type, volid, name);
+    cache.emplace(std::move(key), handle);
+    return handle;
+}
+
+void PerfTracer::updateSlot(int32_t slot, uint32_t cpu, uint64_t val, uint64_t cnt) {
+    CounterCell & c = cell(slot, cpu);
+    c.val.fetch_add(val, std::memory_order_relaxed);
+    if (cnt) {
+        c.cnt.fetch_add(cnt, std::memory_order_relaxed);
+        if (1 == cnt) {
+            // Threads sharing the cpu, or migrating meanwhile, race on the cell
+            uint64_t cur = c.min.load(std::memory_order_relaxed);
+            while (val < cur && !c.min.compare_exchange_weak(cur, val, std::memory_order_relaxed)) {
+            }
+            cur = c.max.load(std::memory_order_relaxed);
+            while (val > cur && !c.max.compare_exchange_weak(cur, val, std::memory_order_relaxed)) {
             }
-#endif
         }
+    }
+}
 
-        namedCounters_[fds_enum::get_index<PerfEventType>(type)][volid][name] = ctx;
+void PerfTracer::update(const PerfCounterHandle & handle, uint64_t val, uint64_t cnt) {
+    GLOGTRACE << "Updating performance counter for type='" << handle.type
+              << "' val='" << val << "' count='" << cnt << "' name='"
+              << handle.name << "'";
+    if (handle.aggregateSlot < 0) {
+        return;
     }
 
-    // update counter
-    updateCounter(*ctx, type, val, cnt, volid, name);
+    // Cells of other cpus are only touched when a thread migrates meanwhile
+    int cpu = sched_getcpu();
+    uint32_t idx = (cpu < 0) ? 0 : static_cast<uint32_t>(cpu) % numCpus_;
+
+    updateSlot(handle.aggregateSlot, idx, val, cnt);
+    int32_t named = handle.namedSlot.load(std::memory_order_relaxed);
+    if (named >= 0) {
+        updateSlot(named, idx, val, cnt);
+    }
 }
 
-void PerfTracer::decrement(const PerfEventType & type, fds_volid_t volid,
-            uint64_t val, const std::string & name) {
-    FDSGUARD(ptrace_mutex_named_);
+void PerfTracer::decrement(const PerfCounterHandle & handle, uint64_t val) {
+    if (handle.aggregateSlot < 0) {
+        return;
+    }
+
+    int cpu = sched_getcpu();
+    uint32_t idx = (cpu < 0) ? 0 : static_cast<uint32_t>(cpu) % numCpus_;
 
-    PerfContextMap::iterator pos = namedCounters_[fds_enum::get_index<PerfEventType>(type)][volid].find(name);
-    fds_assert(pos != namedCounters_[fds_enum::get_index<PerfEventType>(type)][volid].end());
-    if (!pos->second->enabled) {
-        return;  // disabled for this name
+    cell(handle.aggregateSlot, idx).val.fetch_sub(val, std::memory_order_relaxed);
+    int32_t named = handle.namedSlot.load(std::memory_order_relaxed);
+    if (named >= 0) {
+        cell(named, idx).val.fetch_sub(val, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Folds the cells of each slot into its exported counter, resetting them.
+ * Cells are exchanged one at a time while updates go on, so an update racing
+ * the fold may have its value, count, min or max land in the next export
+ * instead; none is lost.
+ */
+void PerfTracer::aggregate(FdsCounters * counterParent) {
+    FDSGUARD(registry_mutex_);
+
+    for (uint32_t id = 0; id < slots_.size(); ++id) {
+        uint64_t val = 0;
+        uint64_t cnt = 0;
+        uint64_t min = std::numeric_limits<uint64_t>::max();
+        uint64_t max = 0;
+        for (uint32_t cpu = 0; cpu < numCpus_; ++cpu) {
+            CounterCell & c = cell(id, cpu);
+            val += c.val.exchange(0, std::memory_order_relaxed);
+            cnt += c.cnt.exchange(0, std::memory_order_relaxed);
+            min = std::min(min, c.min.exchange(std::numeric_limits<uint64_t>::max(),
+                                               std::memory_order_relaxed));
+            max = std::max(max, c.max.exchange(0, std::memory_order_relaxed));
+        }
+        if (!val && !cnt) {
+            continue;
+        }
+
+        // The first update decides whether it is a latency or a numeric counter
+        CounterSlot & slot = slots_[id];
+        if (!slot.exported) {
+            if (cnt) {
+                slot.exported.reset(createCounter<LatencyCounter>(
+                        counterParent, slot.key.type, slot.key.volid, slot.key.name));
+            } else {
+                slot.exported.reset(createCounter<NumericCounter>(
+                        counterParent, slot.key.type, slot.key.volid, slot.key.name));
+            }
+        }
+
+        LatencyCounter * plc = dynamic_cast<LatencyCounter *>(slot.exported.get());
+        if (plc) {
+            plc->merge(val, cnt, min, max);
+            continue;
+        }
+        // Increments less decrements, wrapped around if it went down
+        NumericCounter * pnc = static_cast<NumericCounter *>(slot.exported.get()); //NOLINT
+        if (static_cast<int64_t>(val) >= 0) {
+            pnc->incr(val);
+        } else {
+            pnc->decr(-val);
+        }
     }
-    PerfContext * ctx = pos->second;
-    // update counter
-    NumericCounter * pnc = static_cast<NumericCounter *>(ctx->data.get()); //NOLINT
-    pnc->decr(val);
+}
+
+bool PerfTracer::isFiltered(const PerfEventType & type) {
+    return instance().useEventsFilter_  && !instance().eventsFilter_[
+                                fds_enum::get_index<PerfEventType>(type)];
 }
 
 void PerfTracer::incr(const PerfEventType & type, fds_volid_t volid, std::string const& name /* = "" */) {
@@ -288,27 +431,10 @@ void PerfTracer::incr(const PerfEventType & type, fds_volid_t volid,
     if (!isEnabled()) return;
     fds_assert(fds_enum::get_index<PerfEventType>(type) < fds_enum::get_size<PerfEventType>());
 
-    if (instance().useEventsFilter_  && !instance().eventsFilter_[
-                                fds_enum::get_index<PerfEventType>(type)]) {
+    if (isFiltered(type)) {
         return;
     }
-
-    // update aggregate counter first
-    {
-        FDSGUARD(instance().ptrace_mutex_aggregate_);
-        instance().updateCounter(instance().aggregateCounters_[
-                                fds_enum::get_index<PerfEventType>(type)][volid],
-                                 type, val, cnt, volid, name);
-    }
-    if (!name.empty() && instance().useNameFilter_) {
-#ifndef CACHE_REGEX_MATCH_RESULTS
-        if (regex_match(name, instance().nameFilter_)) {
-#endif
-            instance().upsert(type, volid, val, cnt, name);
-#ifndef CACHE_REGEX_MATCH_RESULTS
-        }
-#endif
-    }
+    instance().update(*instance().lookup(type, volid, name), val, cnt);
 }
 
 void PerfTracer::decr(const PerfEventType & type, fds_volid_t volid,
@@ -316,29 +442,33 @@ void PerfTracer::decr(const PerfEventType & type, fds_volid_t volid,
     if (!isEnabled()) return;
     fds_assert(fds_enum::get_index<PerfEventType>(type) < fds_enum::get_size<PerfEventType>());
 
-    if (instance().useEventsFilter_  && !instance().eventsFilter_[
-                        fds_enum::get_index<PerfEventType>(type)]) {
+    if (isFiltered(type)) {
         return;
     }
+    instance().decrement(*instance().lookup(type, volid, name), val);
+}
 
-    // update aggregate counter first
-    {
-        FDSGUARD(instance().ptrace_mutex_aggregate_);
-        PerfContext & ctx = instance().aggregateCounters_[
-                        fds_enum::get_index<PerfEventType>(type)][volid];
-        NumericCounter * pnc = static_cast<NumericCounter *>(ctx.data.get()); //NOLINT
-        pnc->decr(val);
-    }
-    if (!name.empty() && instance().useNameFilter_) {
-#ifndef CACHE_REGEX_MATCH_RESULTS
-        if (regex_match(name, instance().nameFilter_)) {
-#endif
-            instance().decrement(type, volid, val, name);
-#ifndef CACHE_REGEX_MATCH_RESULTS
-        }
-#endif
+void PerfTracer::incr(PerfCounterHandle * handle, uint64_t val /* = 1 */,
+        uint64_t cnt /* = 0 */) {
+    if (!isEnabled()) return;
+    fds_assert(handle);
+
+    if (isFiltered(handle->type)) {
+        return;
     }
+    instance().update(*handle, val, cnt);
 }
+
+void PerfTracer::decr(PerfCounterHandle * handle, uint64_t val /* = 1 */) {
+    if (!isEnabled()) return;
+    fds_assert(handle);
+
+    if (isFiltered(handle->type)) {
+        return;
+    }
+    instance().decrement(*handle, val);
+}
+
 void PerfTracer::tracePointBegin(const std::string & id,
         const PerfEventType & type, fds_volid_t volid,
         std::string name /* = "" */) {
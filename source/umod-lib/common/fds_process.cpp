@@ -25,6 +25,7 @@
 #include "util/process.h"  // For print_stacktrace().
 #include "util/stringutils.h"
 #include "fds_assert.h"
+#include "fds_trace.h"
 
 // Class include.
 #include "fds_process.h"
@@ -243,6 +244,15 @@ void FdsProcess::init(int argc, char *argv[],
 
         /* Process wide counters setup */
         setup_cntrs_mgr(net::get_my_hostname() + "."  + proc_id);
+
+        /* Request tracing, sampled traces are exported as "requesttrace" state */
+        auto fdsConfig = conf_helper_.get_fds_config();
+        RequestTracer::configure(
+            fdsConfig->get<uint32_t>("fds.common.request_trace.sample_every", 0),
+            fdsConfig->get<uint32_t>("fds.common.request_trace.ring_entries",
+                                     RequestTracer::DEFAULT_RING_ENTRIES));
+        cntrs_mgrPtr_->add_for_export(RequestTracer::stateProvider());
+
         properties.set("hostname", net::get_my_hostname());
         properties.set("build.version",util::strformat("%s-%s",versDate,versRev));
         properties.set("build.os", machineArch);
@@ -276,7 +286,14 @@ void FdsProcess::init(int argc, char *argv[],
         if (conf_helper_.exists("threadpool")) {
             int num_thr = conf_helper_.get<int>("threadpool.num_threads", 10);
             bool use_lfthreadpool = conf_helper_.get<bool>("threadpool.use_lftp");
-            proc_thrp   = new fds_threadpool("ProcessThreadpool", num_thr, use_lfthreadpool);
+            /* Optionally pin the threads, to a cpu list or a numa node's cpus */
+            auto cpus = LFMQThreadpool::parseCpuList(
+                conf_helper_.get<std::string>("threadpool.cpus", ""));
+            if (cpus.empty()) {
+                cpus = LFMQThreadpool::numaNodeCpus(
+                    conf_helper_.get<int>("threadpool.numa_node", -1));
+            }
+            proc_thrp   = new fds_threadpool("ProcessThreadpool", num_thr, use_lfthreadpool, cpus);
             proc_thrp->enableThreadpoolCheck(timer_servicePtr_.get(),
                                              std::chrono::seconds(30));
         }
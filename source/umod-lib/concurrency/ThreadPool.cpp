@@ -220,7 +220,8 @@ thpool_worker::wk_loop(void)
 /** \fds_threadpool constructor
  * ----------------------------
  */
-fds_threadpool::fds_threadpool(const std::string &id, int num_thr, bool use_lftp)
+fds_threadpool::fds_threadpool(const std::string &id, int num_thr, bool use_lftp,
+                               const std::vector<int> &cpus)
     : thp_mutex("thpool mtx"),
       thp_state(RUNNING),
       thp_total_tasks(0),
@@ -231,7 +232,7 @@ fds_threadpool::fds_threadpool(const std::string &id, int num_thr, bool use_lftp
       use_lftp_instead(use_lftp)
 {
     if (use_lftp) {
-        lfthreadpool = new LFMQThreadpool(id, thp_num_threads);
+        lfthreadpool = new LFMQThreadpool(id, thp_num_threads, true, cpus);
     } else {
         int            i;
         // dlist_t       *iter;
@@ -7,6 +7,13 @@
 #include "./dm_utils.h"
 
 #include <testlib/SvcMsgFactory.h>
+#include <DmMigrationExecutor.h>
+#include <dm-vol-cat/DmPersistVolDB.h>
+#include <dm-vol-cat/DmVolumeCatalog.h>
+#include <util/path.h>
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <map>
 #include <vector>
 #include <string>
 #include <thread>
@@ -200,6 +207,63 @@ void putBlobOnce(){
     taskCount.await();
 }
 
+/* Commits the same update with the same sequence id on each volume, as forwarding does */
+void putBlobOnceTo(const std::vector<fds_volid_t>& volIds, const std::string& blobName) {
+    DEFINE_SHARED_PTR(AsyncHdr, asyncHdr);
+    DEFINE_SHARED_PTR(UpdateCatalogOnceMsg, blobMsg);
+    blobMsg->blob_name = blobName;
+    blobMsg->dmt_version = 1;
+    blobMsg->sequence_id = ++_global_seq_id;
+    fds::UpdateBlobInfoNoData(blobMsg, MAX_OBJECT_SIZE, BLOB_SIZE);
+
+    for (auto volId : volIds) {
+        auto updcatMsg = boost::make_shared<fpi::UpdateCatalogOnceMsg>(*blobMsg);
+        updcatMsg->volume_id = volId.get();
+        updcatMsg->txId = dmTester->getNextTxnId();
+
+        DMCallback cb;
+        auto dmCommitBlobOnceReq = new DmIoCommitBlobOnce<DmIoUpdateCatOnce>(volId,
+                                    updcatMsg->blob_name,
+                                    updcatMsg->blob_version,
+                                    updcatMsg->dmt_version,
+                                    updcatMsg->sequence_id,
+                                    0);
+        dmCommitBlobOnceReq->ioBlobTxDesc = BlobTxId::ptr(new BlobTxId(updcatMsg->txId));
+        dmCommitBlobOnceReq->cb = BIND_OBJ_CALLBACK(cb, DMCallback::handler, asyncHdr);
+
+        auto dmUpdCatReq = new DmIoUpdateCatOnce(updcatMsg, dmCommitBlobOnceReq);
+        dmCommitBlobOnceReq->parent = dmUpdCatReq;
+        dataMgr->handlers[FDS_CAT_UPD_ONCE]->handleQueueItem(dmUpdCatReq);
+        cb.wait();
+        EXPECT_EQ(ERR_OK, cb.e);
+    }
+}
+
+/* Same blobs, sequence ids, descriptors and offsets on both volumes */
+void expectSameCatalog(fds_volid_t volId1, fds_volid_t volId2) {
+    auto blobs1 = std::map<std::string, int64_t>();
+    auto blobs2 = std::map<std::string, int64_t>();
+    dataMgr->timeVolCat_->queryIface()->getAllBlobsWithSequenceId(volId1, blobs1, NULL);
+    dataMgr->timeVolCat_->queryIface()->getAllBlobsWithSequenceId(volId2, blobs2, NULL);
+    EXPECT_EQ(blobs1, blobs2);
+
+    for (auto& blob : blobs1) {
+        BlobMetaDesc blobDesc1, blobDesc2;
+        fpi::FDSP_BlobObjectList objList1, objList2;
+        EXPECT_EQ(ERR_OK, dataMgr->timeVolCat_->queryIface()->
+                  getBlobAndMetaFromSnapshot(volId1, blob.first, blobDesc1, objList1, NULL));
+        EXPECT_EQ(ERR_OK, dataMgr->timeVolCat_->queryIface()->
+                  getBlobAndMetaFromSnapshot(volId2, blob.first, blobDesc2, objList2, NULL));
+        EXPECT_EQ(blobDesc1, blobDesc2) << blob.first;
+        EXPECT_EQ(objList1, objList2) << blob.first;
+    }
+
+    sequence_id_t seqId1, seqId2;
+    dataMgr->timeVolCat_->queryIface()->getVolumeSequenceId(volId1, seqId1);
+    dataMgr->timeVolCat_->queryIface()->getVolumeSequenceId(volId2, seqId2);
+    EXPECT_EQ(seqId1, seqId2);
+}
+
 TEST_F(SeqIdTest, SequenceIncrementPutOnce){
     sequence_id_t tmp_seq_id;
 
@@ -718,6 +782,103 @@ TEST_F(SeqIdTest, MigrateBlobPutTruncate){
     }
 }
 
+/**
+ * Full resync of a volume as the destination DM sees it: the bulk catalog copy,
+ * then the delta between the copy and the source, then forwarded commits.
+ */
+TEST_F(SeqIdTest, BulkCatalogMigration){
+    MAX_OBJECT_SIZE = 2 * 1024 * 1024;    // 2MB
+    BLOB_SIZE = 4 * 1024 * 1024;   // 4 MB
+    NUM_BLOBS = 100;
+
+    auto srcId = dmTester->TESTVOLID;
+    putBlobOnce();
+
+    // the copy the source ships
+    std::string archiveName = util::strformat("%ld_bulk_catalog.tgz", srcId.get());
+    auto copyBlobs = std::map<std::string, int64_t>();
+    Error err = dataMgr->getPersistDB(srcId)->archive(dmutil::getTempDir(), archiveName,
+                                                      &copyBlobs);
+    ASSERT_EQ(ERR_OK, err);
+    EXPECT_EQ(NUM_BLOBS, copyBlobs.size());
+
+    // the source moves on while the copy is in flight: overwrites, deletes, new blobs
+    for (uint i = 0; i < 30; i++) {
+        putBlobOnceTo({srcId}, dmTester->getBlobName(i));
+    }
+    for (uint i = 90; i < NUM_BLOBS; i++) {
+        err = dataMgr->timeVolCat_->migrateDescriptor(srcId, dmTester->getBlobName(i), "");
+        EXPECT_EQ(ERR_OK, err);
+    }
+    for (uint i = NUM_BLOBS; i < NUM_BLOBS + 10; i++) {
+        putBlobOnceTo({srcId}, dmTester->getBlobName(i));
+    }
+
+    // bulk copy
+    SetUp();
+    auto dstId = dmTester->TESTVOLID;
+    auto dstDesc = *std::find_if(dmTester->volumes.begin(), dmTester->volumes.end(),
+                                 [dstId](boost::shared_ptr<VolumeDesc>& vdesc) {
+                                     return vdesc->volUUID == dstId;
+                                 });
+    std::string stageDir;
+    err = DmMigrationExecutor::unpackCatalog(dmutil::getTempDir() + "/" + archiveName, stageDir);
+    ASSERT_EQ(ERR_OK, err);
+    EXPECT_FALSE(util::fileExists(dmutil::getTempDir() + "/" + archiveName));
+
+    auto volCat = boost::dynamic_pointer_cast<DmVolumeCatalog>(
+        dataMgr->timeVolCat_->queryIface());
+    ASSERT_TRUE(volCat != nullptr);
+    err = volCat->replaceCatalog(*dstDesc, stageDir + util::strformat("/%ld_vcat.ldb", srcId.get()));
+    ASSERT_EQ(ERR_OK, err);
+    boost::filesystem::remove_all(stageDir);
+    EXPECT_EQ(ERR_OK, dataMgr->getVolumeMeta(dstId)->initState());
+
+    auto dstBlobs = std::map<std::string, int64_t>();
+    dataMgr->timeVolCat_->queryIface()->getAllBlobsWithSequenceId(dstId, dstBlobs, NULL);
+    EXPECT_EQ(copyBlobs, dstBlobs);
+
+    // delta between the copy and the source
+    auto srcBlobs = std::map<std::string, int64_t>();
+    dataMgr->timeVolCat_->queryIface()->getAllBlobsWithSequenceId(srcId, srcBlobs, NULL);
+    auto update_list = std::vector<std::string>();
+    auto delete_list = std::vector<std::string>();
+    err = DmMigrationClient::diffBlobLists(dstBlobs, srcBlobs, update_list, delete_list);
+    EXPECT_EQ(ERR_OK, err);
+    EXPECT_EQ(40, update_list.size());
+    EXPECT_EQ(10, delete_list.size());
+
+    for (auto& blobName : update_list) {
+        BlobMetaDesc blobDesc;
+        fpi::FDSP_BlobObjectList objList;
+        err = dataMgr->timeVolCat_->queryIface()->
+            getBlobAndMetaFromSnapshot(srcId, blobName, blobDesc, objList, NULL);
+        EXPECT_EQ(ERR_OK, err);
+
+        BlobObjList blobList(objList);
+        err = dataMgr->timeVolCat_->queryIface()->putObject(dstId, blobName, blobList);
+        EXPECT_EQ(ERR_OK, err);
+
+        std::string blobString;
+        EXPECT_EQ(ERR_OK, blobDesc.getSerialized(blobString));
+        err = dataMgr->timeVolCat_->migrateDescriptor(dstId, blobName, blobString);
+        EXPECT_EQ(ERR_OK, err);
+    }
+    for (auto& blobName : delete_list) {
+        err = dataMgr->timeVolCat_->migrateDescriptor(dstId, blobName, "");
+        EXPECT_EQ(ERR_OK, err);
+    }
+    expectSameCatalog(srcId, dstId);
+
+    // forwarded commits, to blobs from the copy, from the delta and new ones
+    for (uint i = 20; i < 40; i++) {
+        putBlobOnceTo({srcId, dstId}, dmTester->getBlobName(i));
+    }
+    putBlobOnceTo({srcId, dstId}, dmTester->getBlobName(NUM_BLOBS + 5));
+    putBlobOnceTo({srcId, dstId}, dmTester->getBlobName(2 * NUM_BLOBS));
+    expectSameCatalog(srcId, dstId);
+}
+
 int main(int argc, char** argv) {
     // The following line must be executed to initialize Google Mock
     // (and Google Test) before running the tests.
@@ -5,10 +5,16 @@
 #include "./dm_mocks.h"
 #include "./dm_gtest.h"
 #include "./dm_utils.h"
+#include <atomic>
+#include <fstream>
 #include <vector>
 #include <string>
 #include <thread>
 
+#include <boost/filesystem.hpp>
+
+#include <dm-vol-cat/DmPersistVolDB.h>
+#include <dm-vol-cat/DmPersistVolFile.h>
 #include <dm-vol-cat/DmVolumeCatalog.h>
 #include <util/color.h>
 #include <PerfTrace.h>
@@ -287,6 +293,235 @@ TEST_F(DmVolumeCatalogTest, all_ops) {
     std::this_thread::yield();
 }
 
+/**
+ * Point lookups on a block volume's offset map, leveldb vs. flat catalog,
+ * with a reader hammering the map while the writer fills it.
+ */
+TEST_F(DmVolumeCatalogTest, flat_block_catalog) {
+    const fds_uint32_t objSize = 4096;
+    const fds_uint32_t numObjs = 100000;
+    const std::string blobName("BlockBlob");
+
+    DmPersistVolCat::ptr engines[] = {
+        DmPersistVolCat::ptr(new DmPersistVolDB(mockDm, fds_volid_t(9001), objSize,
+                                                false, false, false, false)),
+        DmPersistVolCat::ptr(new DmPersistVolFile(mockDm, fds_volid_t(9002), objSize,
+                                                  false, false, false))
+    };
+
+    for (auto & vol : engines) {
+        ASSERT_TRUE(vol->activate().ok());
+
+        std::atomic<bool> done(false);
+        std::atomic<fds_uint64_t> readerHits(0);
+        std::thread reader([&]() {
+            ObjectID oid;
+            for (fds_uint32_t i = 0; !done; i = (i + 7919) % numObjs) {
+                if (vol->getObject(blobName, static_cast<fds_uint64_t>(i) * objSize, oid).ok()) {
+                    // a torn read would not decode back to the offset it was written at
+                    EXPECT_EQ(ObjectID(i + 1), oid);
+                    ++readerHits;
+                }
+            }
+        });
+
+        fds_uint64_t startTs = util::getTimeStampNanos();
+        for (fds_uint32_t i = 0; i < numObjs; ++i) {
+            BlobObjList puts;
+            puts[static_cast<fds_uint64_t>(i) * objSize].oid = ObjectID(i + 1);
+            EXPECT_TRUE(vol->putObject(blobName, puts).ok());
+        }
+        fds_uint64_t putNs = util::getTimeStampNanos() - startTs;
+        done = true;
+        reader.join();
+
+        startTs = util::getTimeStampNanos();
+        ObjectID oid;
+        for (fds_uint32_t i = 0; i < numObjs; ++i) {
+            EXPECT_TRUE(vol->getObject(blobName, static_cast<fds_uint64_t>(i) * objSize, oid).ok());
+            EXPECT_EQ(ObjectID(i + 1), oid);
+        }
+        fds_uint64_t getNs = util::getTimeStampNanos() - startTs;
+
+        std::cout << Color::Yellow << "[" << (dynamic_cast<DmPersistVolFile*>(vol.get()) ?
+                                               "flat" : "leveldb")
+                  << "] put " << std::fixed << std::setprecision(3)
+                  << (static_cast<double>(putNs) / numObjs) << "ns/op  get "
+                  << (static_cast<double>(getNs) / numObjs) << "ns/op  concurrent reads "
+                  << readerHits << Color::End << std::endl;
+
+        vol->markDeleted();
+    }
+}
+
+TEST_F(DmVolumeCatalogTest, flat_catalog_log_replay) {
+    const fds_uint32_t objSize = 4096;
+    const fds_uint32_t numObjs = 1000;
+    const std::string blobName("BlockBlob");
+    const fds_volid_t volId(9003);
+    const std::string dir = dmutil::getLevelDBFile(g_fdsprocess->proc_fdsroot(), volId);
+    const std::string logFile = dir + "/" + DmPersistVolFile::LOG_FILENAME;
+    const std::string oldLogFile = dir + "/" + DmPersistVolFile::OLD_LOG_FILENAME;
+    boost::filesystem::remove_all(dir);
+
+    // Drops the catalog as a crash would: no checkpoint on close, and the
+    // files left as they are. markDeleted() is what skips the checkpoint, but
+    // it also removes the volume dir, so the files are put back after it.
+    auto crash = [&dir](std::unique_ptr<DmPersistVolFile> & vol) {
+        boost::filesystem::path saved = boost::filesystem::temp_directory_path() /
+                boost::filesystem::unique_path("flat_catalog_crash-%%%%-%%%%");
+        boost::filesystem::create_directories(saved);
+        for (boost::filesystem::directory_iterator it(dir), end; it != end; ++it) {
+            boost::filesystem::copy_file(it->path(), saved / it->path().filename());
+        }
+        vol->markDeleted();
+        vol.reset();
+        boost::filesystem::create_directories(dir);
+        for (boost::filesystem::directory_iterator it(saved), end; it != end; ++it) {
+            boost::filesystem::copy_file(it->path(), dir + "/" + it->path().filename().string());
+        }
+        boost::filesystem::remove_all(saved);
+    };
+
+    std::unique_ptr<DmPersistVolFile> vol(new DmPersistVolFile(mockDm, volId, objSize,
+                                                               false, false, false));
+    ASSERT_TRUE(vol->activate().ok());
+    for (fds_uint32_t i = 0; i < numObjs; ++i) {
+        BlobObjList puts;
+        puts[static_cast<fds_uint64_t>(i) * objSize].oid = ObjectID(i + 1);
+        ASSERT_TRUE(vol->putObject(blobName, puts).ok());
+    }
+
+    // Crash, with none of the mapped file made it out
+    crash(vol);
+    ASSERT_EQ(0, truncate((dir + "/" + DmPersistVolFile::OBJ_FILENAME).c_str(), 0));
+
+    // ... in the middle of a checkpoint, with the log under both names
+    ASSERT_EQ(0, link(logFile.c_str(), oldLogFile.c_str()));
+
+    // ... and of an append: magic and part of a header
+    {
+        std::ofstream log(logFile, std::ios::out | std::ios::app | std::ios::binary);
+        log.write("\x7a\xca\xa7\xf1\x10\x00", 6);
+    }
+
+    vol.reset(new DmPersistVolFile(mockDm, volId, objSize, false, false, false));
+    ASSERT_TRUE(vol->activate().ok());
+    ObjectID oid;
+    for (fds_uint32_t i = 0; i < numObjs; ++i) {
+        EXPECT_TRUE(vol->getObject(blobName, static_cast<fds_uint64_t>(i) * objSize, oid).ok());
+        EXPECT_EQ(ObjectID(i + 1), oid);
+    }
+    EXPECT_FALSE(vol->getObject(blobName, static_cast<fds_uint64_t>(numObjs) * objSize, oid).ok());
+
+    // Replay ends in a checkpoint, which drops the torn tail and the old log
+    EXPECT_EQ(0u, boost::filesystem::file_size(logFile));
+    EXPECT_FALSE(boost::filesystem::exists(oldLogFile));
+
+    // Updates after recovery go to the log again
+    BlobObjList puts;
+    puts[0].oid = ObjectID(numObjs + 1);
+    ASSERT_TRUE(vol->putObject(blobName, puts).ok());
+    crash(vol);
+
+    vol.reset(new DmPersistVolFile(mockDm, volId, objSize, false, false, false));
+    ASSERT_TRUE(vol->activate().ok());
+    EXPECT_TRUE(vol->getObject(blobName, 0, oid).ok());
+    EXPECT_EQ(ObjectID(numObjs + 1), oid);
+    EXPECT_TRUE(vol->getObject(blobName, objSize, oid).ok());
+    EXPECT_EQ(ObjectID(2), oid);
+
+    vol->markDeleted();
+    vol.reset();
+    boost::filesystem::remove_all(dir);
+}
+
+TEST_F(DmVolumeCatalogTest, flat_catalog_snapshot) {
+    const fds_uint32_t objSize = 4096;
+    const fds_uint32_t numObjs = 10;
+    const std::string blobName("BlockBlob");
+    const fds_volid_t volId(9004);
+    const std::string dir = dmutil::getLevelDBFile(g_fdsprocess->proc_fdsroot(), volId);
+    boost::filesystem::remove_all(dir);
+
+    // Drops the catalog as a crash would: no checkpoint on close, and the
+    // files left as they are. markDeleted() is what skips the checkpoint, but
+    // it also removes the volume dir, so the files are put back after it.
+    auto crash = [&dir](std::unique_ptr<DmPersistVolFile> & vol) {
+        boost::filesystem::path saved = boost::filesystem::temp_directory_path() /
+                boost::filesystem::unique_path("flat_catalog_crash-%%%%-%%%%");
+        boost::filesystem::create_directories(saved);
+        for (boost::filesystem::directory_iterator it(dir), end; it != end; ++it) {
+            boost::filesystem::copy_file(it->path(), saved / it->path().filename());
+        }
+        vol->markDeleted();
+        vol.reset();
+        boost::filesystem::create_directories(dir);
+        for (boost::filesystem::directory_iterator it(saved), end; it != end; ++it) {
+            boost::filesystem::copy_file(it->path(), dir + "/" + it->path().filename().string());
+        }
+        boost::filesystem::remove_all(saved);
+    };
+
+    std::unique_ptr<DmPersistVolFile> vol(new DmPersistVolFile(mockDm, volId, objSize,
+                                                               false, false, false));
+    ASSERT_TRUE(vol->activate().ok());
+    BlobObjList puts;
+    for (fds_uint32_t i = 0; i < numObjs; ++i) {
+        puts[static_cast<fds_uint64_t>(i) * objSize].oid = ObjectID(i + 1);
+    }
+    ASSERT_TRUE(vol->putObject(blobName, puts).ok());
+
+    Catalog::MemSnap snap = NULL;
+    ASSERT_TRUE(vol->getInMemorySnapshot(snap).ok());
+    ASSERT_TRUE(snap != NULL);
+    EXPECT_EQ(1u, vol->getNumInMemorySnapshots());
+
+    // Overwrite half of the objects twice, delete one, and add one
+    for (fds_uint32_t round = 1; round <= 2; ++round) {
+        BlobObjList overwrites;
+        for (fds_uint32_t i = 0; i < numObjs / 2; ++i) {
+            overwrites[static_cast<fds_uint64_t>(i) * objSize].oid =
+                    ObjectID(round * 100 + i);
+        }
+        ASSERT_TRUE(vol->putObject(blobName, overwrites).ok());
+    }
+    ASSERT_TRUE(vol->deleteObject(blobName, (numObjs - 1) * objSize).ok());
+    BlobObjList append;
+    append[static_cast<fds_uint64_t>(numObjs) * objSize].oid = ObjectID(numObjs + 1);
+    ASSERT_TRUE(vol->putObject(blobName, append).ok());
+
+    fpi::FDSP_BlobObjectList objList;
+    ASSERT_TRUE(vol->getObject(blobName, 0, 2 * numObjs * objSize, objList, snap).ok());
+    ASSERT_EQ(numObjs, objList.size());
+    for (fds_uint32_t i = 0; i < numObjs; ++i) {
+        EXPECT_EQ(static_cast<int64_t>(i) * objSize, objList[i].offset);
+        EXPECT_EQ(ObjectID(i + 1), ObjectID(objList[i].data_obj_id.digest));
+    }
+
+    std::unique_ptr<Catalog::catalog_iterator_t> itr;
+    std::list<ObjectID> objects;
+    vol->getObjectIds(2 * numObjs, snap, itr, objects);
+    ASSERT_EQ(numObjs, objects.size());
+    fds_uint32_t expected = 1;
+    for (auto & obj : objects) {
+        EXPECT_EQ(ObjectID(expected++), obj);
+    }
+
+    // The live map has moved on
+    ObjectID oid;
+    EXPECT_TRUE(vol->getObject(blobName, 0, oid).ok());
+    EXPECT_EQ(ObjectID(200), oid);
+    EXPECT_FALSE(vol->getObject(blobName, (numObjs - 1) * objSize, oid).ok());
+
+    ASSERT_TRUE(vol->freeInMemorySnapshot(snap).ok());
+    EXPECT_EQ(0u, vol->getNumInMemorySnapshots());
+
+    vol->markDeleted();
+    vol.reset();
+    boost::filesystem::remove_all(dir);
+}
+
 int main(int argc, char** argv) {
     // The following line must be executed to initialize Google Mock
     // (and Google Test) before running the tests.
@@ -12,6 +12,12 @@
 #include <thread>
 #include <google/profiler.h>
 
+#include <boost/filesystem.hpp>
+#include <catalogKeys/BlobObjectKey.h>
+#include <db/log_writer.h>
+#include <db/write_batch_internal.h>
+#include <leveldb/env.h>
+#include <timeline/journalmanager.h>
 #include <timeline/timelinedb.h>
 
 fds::DMTester* dmTester = NULL;
@@ -56,6 +62,87 @@ TEST_F(DmUnitTest, Timelinedb) {
     EXPECT_EQ(fds_volid_t(3), snapshotId);
 }
 
+struct JournalRecord {
+    fds_uint64_t ts;
+    std::vector<fds_uint32_t> puts;
+    std::vector<fds_uint32_t> deletes;
+};
+
+static leveldb::Slice journalKey(fds_uint32_t index, std::string & buf) {
+    buf = static_cast<leveldb::Slice>(BlobObjectKey("blob", index)).ToString();
+    return buf;
+}
+
+/**
+ * Writes a journal the way the catalog logs its updates: one write batch per
+ * record, stamped with the time and putting the time as the value.
+ */
+static void writeJournal(const std::string & file, const std::vector<JournalRecord> & records) {
+    leveldb::WritableFile * wf = nullptr;
+    ASSERT_TRUE(leveldb::Env::Default()->NewWritableFile(file, &wf).ok());
+    {
+        leveldb::log::Writer writer(wf);
+        for (auto & rec : records) {
+            leveldb::WriteBatch wb;
+            std::string key;
+            std::string value = std::to_string(rec.ts);
+            wb.Put(OP_TIMESTAMP_REC,
+                   leveldb::Slice(reinterpret_cast<const char *>(&rec.ts), sizeof(rec.ts)));
+            for (auto index : rec.puts) {
+                wb.Put(journalKey(index, key), value);
+            }
+            for (auto index : rec.deletes) {
+                wb.Delete(journalKey(index, key));
+            }
+            ASSERT_TRUE(writer.AddRecord(leveldb::WriteBatchInternal::Contents(&wb)).ok());
+        }
+    }
+    ASSERT_TRUE(wf->Close().ok());
+    delete wf;
+}
+
+TEST_F(DmUnitTest, JournalReplay) {
+    const std::string dir = "/tmp/dm_journal_replay_test";
+    boost::filesystem::remove_all(dir);
+    boost::filesystem::create_directories(dir);
+
+    // The second file has a record past the cut-off before the third file's
+    // first one: every file is read up to the cut-off. Keys 11 and 12 are
+    // written in several records of every file and end up put and deleted.
+    std::vector<std::string> files = {dir + "/1.journal", dir + "/2.journal",
+                                      dir + "/3.journal"};
+    writeJournal(files[0], {{100, {1, 2}, {}}, {110, {3, 4, 11, 12}, {}},
+                            {120, {5, 11}, {3}}});
+    writeJournal(files[1], {{200, {1, 6, 11, 12}, {}}, {230, {7, 8, 12}, {}}});
+    writeJournal(files[2], {{220, {2, 9, 11}, {12}}, {240, {10, 11}, {}}});
+
+    // Batches of one write still keep each record whole
+    for (fds_uint32_t batchSize : {1u, 4096u}) {
+        boost::filesystem::remove_all(dir + "/dest.ldb");
+        Catalog destCat(dir + "/dest.ldb");
+        ASSERT_EQ(ERR_OK, fds::timeline::JournalManager::replayJournals(destCat, files,
+                                                                         105, 225, 2,
+                                                                         batchSize));
+
+        std::map<fds_uint32_t, std::string> expected = {
+            {1, "200"}, {2, "220"}, {4, "110"}, {5, "120"}, {6, "200"}, {9, "220"},
+            {11, "220"}};
+        for (fds_uint32_t index = 1; index <= 12; ++index) {
+            std::string value;
+            Error err = destCat.Query(BlobObjectKey("blob", index), &value);
+            auto it = expected.find(index);
+            if (it == expected.end()) {
+                EXPECT_EQ(ERR_CAT_ENTRY_NOT_FOUND, err) << "index " << index;
+            } else {
+                EXPECT_EQ(ERR_OK, err) << "index " << index;
+                EXPECT_EQ(it->second, value) << "index " << index;
+            }
+        }
+    }
+
+    boost::filesystem::remove_all(dir);
+}
+
 int main(int argc, char** argv) {
     // The following line must be executed to initialize Google Mock
     // (and Google Test) before running the tests.
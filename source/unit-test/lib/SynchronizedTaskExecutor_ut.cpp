@@ -5,8 +5,13 @@
 #define GTEST_USE_OWN_TR1_TUPLE 0
 #include <cstdlib>
 #include <ctime>
+#include <future>
+#include <memory>
 #include <set>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <concurrency/ThreadPool.h>
@@ -31,6 +36,12 @@ uint32_t nReps = 10000;
 
 fds::fds_threadpool tp;
 fds::SynchronizedTaskExecutor<int> executor(tp);
+/* A key's run loop still uses its executor after the last task returns, so
+ * the executors below outlive the tests
+ */
+fds::SynchronizedTaskExecutor<int> shardedExecutor(tp, false, 4);
+fds::SynchronizedTaskExecutor<int> twoKeyExecutor(tp, false, 4);
+fds::SynchronizedTaskExecutor<int> queuedTaskExecutor(tp, false, 4);
 fds::fds_mutex locks[nQCnt];
 
 struct PutReq {
@@ -178,6 +189,204 @@ TEST(SynchronizedTaskExecutor, putreq) {
     }
 }
 
+/**
+ * Waits for cond to hold, for up to a few seconds
+ */
+template <class CondT>
+bool waitFor(CondT cond)
+{
+    for (int i = 0; i < 5000 && !cond(); i++) {
+        usleep(1000);
+    }
+    return cond();
+}
+
+/**
+ * Tasks on the same key run one at a time, with several producers scheduling
+ * on every key and keys spread over a few shards
+ */
+TEST(SynchronizedTaskExecutor, keyOrdering) {
+    const int nKeys = 4;
+    const int nProducers = 4;
+    const int nTasksPerKey = 1000;
+    /* Only ever touched by a key's own tasks, so no locking of their own */
+    std::vector<int> seq(nKeys, 0);
+    std::vector<std::atomic<int>> running(nKeys);
+    std::atomic<int> outOfOrder(0);
+    std::atomic<int> done(0);
+    std::atomic<int> held(0);
+    std::promise<void> release;
+    std::shared_future<void> gate(release.get_future());
+
+    /* Keep every key busy until all tasks are scheduled, so they queue up */
+    for (int k = 0; k < nKeys; k++) {
+        running[k] = 0;
+        shardedExecutor.scheduleOnHashKey(k, [&, k]() {
+            running[k]++;
+            held++;
+            gate.wait();
+            running[k]--;
+        });
+    }
+    ASSERT_TRUE(waitFor([&]() { return held == nKeys; }));
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < nProducers; p++) {
+        producers.emplace_back([&]() {
+            for (int i = 0; i < nTasksPerKey; i++) {
+                for (int k = 0; k < nKeys; k++) {
+                    shardedExecutor.scheduleOnHashKey(k, [&, k]() {
+                        if (running[k]++ != 0) {
+                            outOfOrder++;
+                        }
+                        int next = seq[k] + 1;
+                        std::this_thread::yield();
+                        seq[k] = next;
+                        running[k]--;
+                        done++;
+                    });
+                }
+            }
+        });
+    }
+    for (auto &producer : producers) {
+        producer.join();
+    }
+    release.set_value();
+    ASSERT_TRUE(waitFor([&]() { return done == nKeys * nProducers * nTasksPerKey; }));
+
+    ASSERT_EQ(0, outOfOrder);
+    for (int k = 0; k < nKeys; k++) {
+        EXPECT_EQ(nProducers * nTasksPerKey, seq[k]);
+    }
+
+    auto stats = shardedExecutor.getContentionStats();
+    EXPECT_GT(stats.queued, 0u);
+    std::cout << "lock acquisitions: " << stats.acquisitions
+              << " contended: " << stats.contended
+              << " queued: " << stats.queued << std::endl;
+}
+
+/**
+ * A task on two keys runs while no other task on either key does, mixed with
+ * single key tasks and two key tasks on the same key twice
+ */
+TEST(SynchronizedTaskExecutor, twoKeyExclusion) {
+    const int nKeys = 4;
+    const int nProducers = 4;
+    const int nRounds = 500;
+    std::vector<int> seq(nKeys, 0);
+    std::vector<std::atomic<int>> running(nKeys);
+    std::atomic<int> overlapped(0);
+    std::atomic<int> done(0);
+    for (auto &r : running) {
+        r = 0;
+    }
+
+    auto enter = [&](int k) {
+        if (running[k]++ != 0) {
+            overlapped++;
+        }
+        int next = seq[k] + 1;
+        std::this_thread::yield();
+        seq[k] = next;
+    };
+    auto leave = [&](int k) {
+        running[k]--;
+    };
+
+    /* Two key tasks always take the lower key first, as callers must */
+    std::vector<std::thread> producers;
+    for (int p = 0; p < nProducers; p++) {
+        producers.emplace_back([&]() {
+            for (int i = 0; i < nRounds; i++) {
+                for (int k = 0; k < nKeys; k++) {
+                    twoKeyExecutor.scheduleOnHashKey(k, [&, k]() {
+                        enter(k);
+                        leave(k);
+                        done++;
+                    });
+                    twoKeyExecutor.scheduleOnHashKeys(k, k, [&, k]() {
+                        enter(k);
+                        leave(k);
+                        done++;
+                    });
+                    if (k + 1 < nKeys) {
+                        twoKeyExecutor.scheduleOnHashKeys(k, k + 1, [&, k]() {
+                            enter(k);
+                            enter(k + 1);
+                            leave(k + 1);
+                            leave(k);
+                            done++;
+                        });
+                    }
+                }
+            }
+        });
+    }
+    for (auto &producer : producers) {
+        producer.join();
+    }
+    const int nTasks = nProducers * nRounds * (3 * nKeys - 1);
+    ASSERT_TRUE(waitFor([&]() { return done == nTasks; }));
+
+    ASSERT_EQ(0, overlapped);
+    /* Each key sees its single key and same key tasks, and the two key tasks
+     * on either side of it
+     */
+    for (int k = 0; k < nKeys; k++) {
+        int expected = 2 + (k > 0) + (k + 1 < nKeys);
+        EXPECT_EQ(nProducers * nRounds * expected, seq[k]);
+    }
+}
+
+/**
+ * A two key task that has to wait for its first key is queued and run after
+ * scheduling returned, so it must hold its own copy of the task and keys
+ */
+TEST(SynchronizedTaskExecutor, twoKeyQueuedTask) {
+    std::atomic<bool> held(false);
+    std::atomic<bool> ran(false);
+    std::atomic<bool> sawPayload(false);
+    std::atomic<bool> secondKeyFree(true);
+    std::promise<void> release;
+    std::shared_future<void> gate(release.get_future());
+    std::weak_ptr<std::string> payloadRef;
+
+    queuedTaskExecutor.scheduleOnHashKey(1, [&]() {
+        held = true;
+        gate.wait();
+    });
+    ASSERT_TRUE(waitFor([&]() { return held.load(); }));
+
+    {
+        auto payload = std::make_shared<std::string>("two keys");
+        payloadRef = payload;
+        queuedTaskExecutor.scheduleOnHashKeys(1, 2, [&, payload]() {
+            sawPayload = ("two keys" == *payload);
+            ran = true;
+        });
+    }
+    /* Queued behind the first task, with only the queued copy left */
+    ASSERT_TRUE(waitFor([&]() { return queuedTaskExecutor.getContentionStats().queued > 0; }));
+    ASSERT_TRUE(waitFor([&]() { return payloadRef.use_count() == 1; }));
+    EXPECT_FALSE(ran);
+
+    /* While the two key task is queued, key 2 is still free */
+    std::atomic<bool> secondKeyRan(false);
+    queuedTaskExecutor.scheduleOnHashKey(2, [&]() {
+        secondKeyFree = !ran;
+        secondKeyRan = true;
+    });
+    ASSERT_TRUE(waitFor([&]() { return secondKeyRan.load(); }));
+
+    release.set_value();
+    ASSERT_TRUE(waitFor([&]() { return ran.load(); }));
+    EXPECT_TRUE(sawPayload);
+    EXPECT_TRUE(secondKeyFree);
+    ASSERT_TRUE(waitFor([&]() { return payloadRef.expired(); }));
+}
+
 #if 0
 /**
  * Tests schedule function of SynchronizedTaskExecutor
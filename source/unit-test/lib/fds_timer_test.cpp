@@ -1,5 +1,7 @@
 #include <iostream>
 #include <ctime>
+#include <thread>
+#include <vector>
 #include <fds_timer.h>
 
 using namespace fds;  // NOLINT
@@ -133,10 +135,223 @@ void test_fds_repeated_timer1() {
     timer.destroy();
 }
 
+/* Test sub-second timers and rescheduling a pending task */
+void test_fds_timer_subsecond() {
+    FdsTimer timer;
+    boost::shared_ptr<FdsTimerTask> taskPtr(new TimerTaskImpl(timer, 1));
+    TimerTaskImpl *taskImplPtr = (TimerTaskImpl*) taskPtr.get();
+    bool ret;
+
+    /* Millisecond timers fire well within a second */
+    ret = timer.schedule(taskPtr, std::chrono::milliseconds(5));
+    fds_verify(ret == true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fds_verify(taskImplPtr->run_cnt == 1);
+
+    /* Rescheduling a pending task replaces its expiry */
+    ret = timer.schedule(taskPtr, std::chrono::seconds(60));
+    fds_verify(ret == true);
+    ret = timer.schedule(taskPtr, std::chrono::milliseconds(5));
+    fds_verify(ret == true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    fds_verify(taskImplPtr->run_cnt == 2);
+
+    timer.destroy();
+}
+
+/* Counts its runs quietly, for tests running many tasks */
+class CountingTask : public FdsTimerTask {
+ public:
+  virtual void runTimerTask() {
+      run_cnt++;
+  }
+  std::atomic<int> run_cnt {0};
+};
+
+/* Timer on ticks moved on by hand, so tests don't depend on the clock */
+class ManualTimer {
+ public:
+  ManualTimer()
+      : ticks(0),
+        timer("manual", [this]() { return ticks.load(); })
+  {
+  }
+
+  /**
+   * Returns once every task due by tick has run.  Leaves the ticks at tick + 1,
+   * so tasks due then may have run too.
+   */
+  void runUntil(uint64_t tick) {
+      fds_verify(tick > ticks);
+      /* Due at tick + 1, so it runs after everything due by tick */
+      boost::shared_ptr<FdsTimerTask> lastPtr(new CountingTask());
+      CountingTask *last = (CountingTask*) lastPtr.get();
+      timer.schedule(lastPtr, std::chrono::milliseconds(tick - ticks));
+      ticks = tick + 1;
+      timer.wake();
+      for (int i = 0; i < 10000 && last->run_cnt == 0; i++) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      fds_verify(last->run_cnt == 1);
+  }
+
+  /* The tick a task scheduled now for delay ms is due at */
+  uint64_t dueTick(uint64_t delay) {
+      return ticks + delay + 1;
+  }
+
+  std::atomic<uint64_t> ticks;
+  FdsTimer timer;
+};
+
+/* Cancelled tasks don't run, once or repeated */
+void test_fds_timer_cancel() {
+    ManualTimer m;
+    boost::shared_ptr<FdsTimerTask> taskPtr(new CountingTask());
+    CountingTask *taskImplPtr = (CountingTask*) taskPtr.get();
+    bool ret;
+
+    auto due = m.dueTick(50);
+    ret = m.timer.schedule(taskPtr, std::chrono::milliseconds(50));
+    fds_verify(ret == true);
+    m.runUntil(due - 10);
+    fds_verify(taskImplPtr->run_cnt == 0);
+    ret = m.timer.cancel(taskPtr);
+    fds_verify(ret == true);
+    m.runUntil(due + 10);
+    fds_verify(taskImplPtr->run_cnt == 0);
+
+    /* A repeated task stops running once cancelled */
+    ret = m.timer.scheduleRepeated(taskPtr, std::chrono::milliseconds(10));
+    fds_verify(ret == true);
+    m.runUntil(m.ticks + 35);
+    fds_verify(taskImplPtr->run_cnt == 3);
+    ret = m.timer.cancel(taskPtr);
+    fds_verify(ret == true);
+    m.runUntil(m.ticks + 100);
+    fds_verify(taskImplPtr->run_cnt == 3);
+
+    /* And can be scheduled again */
+    due = m.dueTick(10);
+    ret = m.timer.schedule(taskPtr, std::chrono::milliseconds(10));
+    fds_verify(ret == true);
+    m.runUntil(due);
+    fds_verify(taskImplPtr->run_cnt == 4);
+}
+
+/* Rescheduling a pending task drops its earlier schedule, sooner or later */
+void test_fds_timer_reschedule() {
+    ManualTimer m;
+    boost::shared_ptr<FdsTimerTask> taskPtr(new CountingTask());
+    CountingTask *taskImplPtr = (CountingTask*) taskPtr.get();
+
+    /* Sooner */
+    auto late = m.dueTick(100);
+    m.timer.schedule(taskPtr, std::chrono::milliseconds(100));
+    auto soon = m.dueTick(10);
+    m.timer.schedule(taskPtr, std::chrono::milliseconds(10));
+    m.runUntil(soon - 2);
+    fds_verify(taskImplPtr->run_cnt == 0);
+    m.runUntil(soon);
+    fds_verify(taskImplPtr->run_cnt == 1);
+    m.runUntil(late + 10);
+    fds_verify(taskImplPtr->run_cnt == 1);
+
+    /* Later, after the timer thread put the first schedule on the wheel */
+    soon = m.dueTick(10);
+    m.timer.schedule(taskPtr, std::chrono::milliseconds(10));
+    m.runUntil(soon - 5);
+    late = m.dueTick(100);
+    m.timer.schedule(taskPtr, std::chrono::milliseconds(100));
+    m.runUntil(late - 2);
+    fds_verify(taskImplPtr->run_cnt == 1);
+    m.runUntil(late);
+    fds_verify(taskImplPtr->run_cnt == 2);
+
+    /* Cancelled and scheduled again before the timer thread saw either */
+    soon = m.dueTick(10);
+    m.timer.schedule(taskPtr, std::chrono::milliseconds(10));
+    m.timer.cancel(taskPtr);
+    m.timer.schedule(taskPtr, std::chrono::milliseconds(10));
+    m.runUntil(soon + 50);
+    fds_verify(taskImplPtr->run_cnt == 3);
+}
+
+/* Tasks beyond a level's turn are moved down level by level, and run when due */
+void test_fds_timer_cascade() {
+    ManualTimer m;
+    /* On the first, second and third level of the wheel */
+    std::vector<uint64_t> delays = {200, 300, 1000, 65535, 70000, 200000};
+    std::vector<FdsTimerTaskPtr> tasks;
+    std::vector<uint64_t> dues;
+    for (auto delay : delays) {
+        tasks.emplace_back(new CountingTask());
+        dues.push_back(m.dueTick(delay));
+        m.timer.schedule(tasks.back(), std::chrono::milliseconds(delay));
+    }
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+        m.runUntil(dues[i] - 2);
+        for (size_t j = 0; j < tasks.size(); j++) {
+            fds_verify(((CountingTask*) tasks[j].get())->run_cnt == (j < i ? 1 : 0));
+        }
+        m.runUntil(dues[i]);
+        fds_verify(((CountingTask*) tasks[i].get())->run_cnt == 1);
+    }
+
+    /* A repeated task keeps its period across turns of the first level */
+    boost::shared_ptr<FdsTimerTask> taskPtr(new CountingTask());
+    CountingTask *taskImplPtr = (CountingTask*) taskPtr.get();
+    auto first = m.dueTick(300);
+    m.timer.scheduleRepeated(taskPtr, std::chrono::milliseconds(300));
+    m.runUntil(first + 3 * 300 - 2);
+    fds_verify(taskImplPtr->run_cnt == 3);
+    m.runUntil(first + 3 * 300);
+    fds_verify(taskImplPtr->run_cnt == 4);
+    m.timer.cancel(taskPtr);
+}
+
+/* Schedules and cancels from more threads than there are op buffers all apply */
+void test_fds_timer_threads() {
+    const int thread_cnt = 24;
+    const int task_cnt = 500;
+    ManualTimer m;
+    std::vector<std::vector<FdsTimerTaskPtr>> tasks(thread_cnt);
+    auto start = m.ticks.load();
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_cnt; t++) {
+        threads.emplace_back([&m, &tasks, t, task_cnt]() {
+            for (int i = 0; i < task_cnt; i++) {
+                tasks[t].emplace_back(new CountingTask());
+                m.timer.schedule(tasks[t].back(), std::chrono::milliseconds(i % 300));
+                if (i % 10 == 0) {
+                    m.timer.cancel(tasks[t].back());
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    m.runUntil(start + 302);
+    for (auto &thread_tasks : tasks) {
+        for (int i = 0; i < task_cnt; i++) {
+            fds_verify(((CountingTask*) thread_tasks[i].get())->run_cnt == (i % 10 ? 1 : 0));
+        }
+    }
+}
+
 int main()
 {
     TimerTaskImpl::total_run = 0;
     test_fds_timer2();
     test_fds_repeated_timer1();
+    test_fds_timer_subsecond();
+    test_fds_timer_cancel();
+    test_fds_timer_reschedule();
+    test_fds_timer_cascade();
+    test_fds_timer_threads();
     return 0;
 }
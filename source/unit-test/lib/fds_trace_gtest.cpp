@@ -0,0 +1,194 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <json/json.h>
+
+#include <fds_trace.h>
+
+using namespace fds;  // NOLINT
+
+namespace {
+
+const uint32_t RING_ENTRIES = 64;
+const uint32_t THREADS = 4;
+const uint32_t DUMPS = 50;
+const uint32_t STAGES = 6;
+
+/* Ids, details and timestamps are all derived from the thread, trace and
+ * stage, so a record mixing parts of two others can be told apart
+ */
+uint64_t traceIdOf(uint32_t thread, uint64_t n) {
+    return (static_cast<uint64_t>(thread + 1) << 40) | (n + 1);
+}
+int32_t detailOf(uint64_t traceId) {
+    return static_cast<int32_t>(traceId & 0x7fffffff);
+}
+uint64_t tsOf(uint64_t traceId, uint32_t stage) {
+    return traceId * 16 + stage + 1;
+}
+
+/* Records traces until told to stop, counting in lapped once its ring was
+ * gone round.  Returns the number of traces recorded.
+ */
+uint64_t recordTraces(uint32_t thread, const std::atomic<bool> &stop,
+                      std::atomic<uint32_t> &lapped) {
+    uint64_t n = 0;
+    for (; !stop; n++) {
+        auto traceId = traceIdOf(thread, n);
+        for (uint32_t s = 0; s < STAGES; s++) {
+            RequestTracer::record(traceId, static_cast<TraceStage>(s),
+                                  detailOf(traceId), tsOf(traceId, s));
+        }
+        if (n == RING_ENTRIES / STAGES + 1) {
+            lapped++;
+        }
+    }
+    return n;
+}
+
+uint32_t stageIndex(const std::string &name) {
+    for (uint32_t s = 0; s < static_cast<uint32_t>(TraceStage::MAX); s++) {
+        if (name == traceStageName(static_cast<TraceStage>(s))) {
+            return s;
+        }
+    }
+    return static_cast<uint32_t>(TraceStage::MAX);
+}
+
+/* Checks every trace in a dump holds whole stages, in the order recorded.
+ * Returns the number of stages dumped.
+ */
+uint64_t checkDump(const std::string &dump) {
+    Json::Value state;
+    Json::Reader reader;
+    EXPECT_TRUE(reader.parse(dump, state));
+
+    uint64_t stageCnt = 0;
+    std::set<uint64_t> seen;
+    for (auto &trace : state["traces"]) {
+        auto traceId = std::stoull(trace["traceId"].asString(), nullptr, 16);
+        EXPECT_TRUE(seen.insert(traceId).second);
+        auto &stages = trace["stages"];
+        EXPECT_LE(stages.size(), STAGES);
+        int64_t prev = -1;
+        for (auto &stage : stages) {
+            auto s = stageIndex(stage["stage"].asString());
+            EXPECT_LT(s, STAGES);
+            EXPECT_EQ(tsOf(traceId, s), stage["ts"].asUInt64());
+            EXPECT_EQ(detailOf(traceId), stage["detail"].asInt());
+            EXPECT_LT(prev, static_cast<int64_t>(s));
+            prev = s;
+            stageCnt++;
+        }
+    }
+    return stageCnt;
+}
+
+}  // namespace
+
+/* Dumps taken while threads record past the end of their rings only show
+ * whole records, and the last ring full of them once recording stops
+ */
+TEST(RequestTracer, dumpWhileRecording) {
+    RequestTracer::configure(0, RING_ENTRIES);
+
+    /* Rings of threads from earlier runs are still dumped, keep apart from them */
+    static uint32_t firstThread = 0;
+    auto first = firstThread;
+    firstThread += THREADS;
+    auto earlierStages = checkDump(RequestTracer::dump());
+
+    std::atomic<bool> stop(false);
+    std::atomic<uint32_t> lapped(0);
+    std::vector<uint64_t> recorded(THREADS);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < THREADS; t++) {
+        threads.emplace_back([&stop, &lapped, &recorded, first, t]() {
+            recorded[t] = recordTraces(first + t, stop, lapped);
+        });
+    }
+    while (lapped < THREADS) {
+        std::this_thread::yield();
+    }
+    for (uint32_t i = 0; i < DUMPS; i++) {
+        checkDump(RequestTracer::dump());
+    }
+    stop = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    auto dump = RequestTracer::dump();
+    EXPECT_EQ(earlierStages + THREADS * RING_ENTRIES, checkDump(dump));
+
+    /* The last trace of each thread is all there */
+    Json::Value state;
+    Json::Reader reader;
+    ASSERT_TRUE(reader.parse(dump, state));
+    std::set<uint64_t> complete;
+    for (auto &trace : state["traces"]) {
+        if (trace["stages"].size() == STAGES) {
+            complete.insert(std::stoull(trace["traceId"].asString(), nullptr, 16));
+        }
+    }
+    for (uint32_t t = 0; t < THREADS; t++) {
+        EXPECT_EQ(1u, complete.count(traceIdOf(first + t, recorded[t] - 1)));
+    }
+}
+
+/* No request gets a trace id while sampling is off */
+TEST(RequestTracer, sampling) {
+    auto sampleIds = [](uint32_t cnt) {
+        std::vector<uint64_t> ids;
+        for (uint32_t i = 0; i < cnt; i++) {
+            auto id = RequestTracer::sample();
+            if (id) {
+                ids.push_back(id);
+            }
+        }
+        return ids;
+    };
+
+    RequestTracer::configure(0, RequestTracer::DEFAULT_RING_ENTRIES);
+    EXPECT_TRUE(sampleIds(1000).empty());
+
+    /* Every 4th of all requests, however they are spread over threads, with
+     * ids unique across threads
+     */
+    RequestTracer::configure(4, RequestTracer::DEFAULT_RING_ENTRIES);
+    std::vector<uint64_t> otherIds;
+    std::thread other([&]() { otherIds = sampleIds(100); });
+    auto ids = sampleIds(100);
+    other.join();
+    EXPECT_EQ(50u, ids.size() + otherIds.size());
+    std::set<uint64_t> unique(ids.begin(), ids.end());
+    unique.insert(otherIds.begin(), otherIds.end());
+    EXPECT_EQ(50u, unique.size());
+
+    /* Also when one thread makes most of the requests */
+    otherIds.clear();
+    std::thread few([&]() { otherIds = sampleIds(3); });
+    ids = sampleIds(197);
+    few.join();
+    EXPECT_EQ(50u, ids.size() + otherIds.size());
+
+    /* And none again once it's turned back off */
+    RequestTracer::configure(0, RequestTracer::DEFAULT_RING_ENTRIES);
+    EXPECT_TRUE(sampleIds(1000).empty());
+    std::thread off([&]() { otherIds = sampleIds(1000); });
+    off.join();
+    EXPECT_TRUE(otherIds.empty());
+}
+
+int
+main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
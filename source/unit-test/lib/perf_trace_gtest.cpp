@@ -0,0 +1,188 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fds_process.h>
+#include <PerfTrace.h>
+
+#include <gtest/gtest.h>
+
+using namespace fds;  // NOLINT
+
+namespace {
+
+const unsigned THREADS = 8;
+const uint64_t UPDATES = 10000;
+const std::string MATCH_KEY("fds.perf_ut.perf.match");
+
+/* What the perf counters export, without resetting them */
+std::map<std::string, int64_t> exported() {
+    std::map<std::string, int64_t> m;
+    EXPECT_TRUE(g_cntrs_mgr->toMap(PERF_COUNTERS_NAME, m));
+    return m;
+}
+
+/* Exported value of key, 0 when not exported */
+int64_t exported(const std::string &key) {
+    auto m = exported();
+    auto pos = m.find(key);
+    return m.end() == pos ? 0 : pos->second;
+}
+
+bool isExported(const std::string &key) {
+    return exported().count(key) > 0;
+}
+
+/* Runs update(thread) on THREADS threads at once, exporting meanwhile */
+void runThreads(const std::function<void (unsigned thread)> &update) {
+    std::atomic<unsigned> running(THREADS);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&update, &running, t]() {
+            update(t);
+            --running;
+        });
+    }
+    while (running) {
+        exported();
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+/* The exported counter of type, volid and name, see createCounter() */
+std::string key(PerfEventType type, fds_volid_t volid, const std::string &name = "") {
+    return EnumToString(type) + (name.empty() ? "" : "." + name) + "." +
+            std::to_string(volid.get());
+}
+
+void setNameFilter(const std::string &match) {
+    g_fdsprocess->get_fds_config()->set(MATCH_KEY, match);
+    PerfTracer::refresh();
+}
+
+}  // namespace
+
+/* Increments less decrements of every thread, however the cells were folded */
+TEST(PerfTracer, numericTotals) {
+    fds_volid_t volid(1001);
+    auto handle = PerfTracer::counterHandle(PerfEventType::AM_PUT_BY_REF, volid);
+    runThreads([&](unsigned t) {
+        for (uint64_t i = 0; i < UPDATES; ++i) {
+            PerfTracer::incr(PerfEventType::AM_DESC_CACHE_HIT, volid, 3);
+            PerfTracer::decr(PerfEventType::AM_DESC_CACHE_HIT, volid);
+            PerfTracer::incr(handle);
+            PerfTracer::decr(handle, 2);
+        }
+    });
+    EXPECT_EQ(static_cast<int64_t>(2 * THREADS * UPDATES),
+              exported(key(PerfEventType::AM_DESC_CACHE_HIT, volid)));
+    /* Went down, which wraps around */
+    EXPECT_EQ(-static_cast<int64_t>(THREADS * UPDATES),
+              exported(key(PerfEventType::AM_PUT_BY_REF, volid)));
+
+    /* Later updates add to what was exported */
+    PerfTracer::incr(PerfEventType::AM_DESC_CACHE_HIT, volid, 5);
+    PerfTracer::incr(handle, 3 * THREADS * UPDATES);
+    EXPECT_EQ(static_cast<int64_t>(2 * THREADS * UPDATES + 5),
+              exported(key(PerfEventType::AM_DESC_CACHE_HIT, volid)));
+    EXPECT_EQ(static_cast<int64_t>(2 * THREADS * UPDATES),
+              exported(key(PerfEventType::AM_PUT_BY_REF, volid)));
+}
+
+/* Every latency of every thread is counted once, with the extremes kept */
+TEST(PerfTracer, latencyFold) {
+    fds_volid_t volid(1002);
+    runThreads([&](unsigned t) {
+        for (uint64_t i = 0; i < UPDATES; ++i) {
+            /* Each thread goes over its own range, from both ends at once */
+            uint64_t latency = (i % 2) ? 100 + t * UPDATES + i : 100 + (t + 1) * UPDATES - i;
+            PerfTracer::incr(PerfEventType::AM_GET_SM, volid, latency, 1);
+        }
+    });
+    uint64_t n = THREADS * UPDATES;
+    auto k = key(PerfEventType::AM_GET_SM, volid);
+    auto m = exported();
+    EXPECT_EQ(static_cast<int64_t>(n), m[k + ".count"]);
+    EXPECT_EQ(static_cast<int64_t>(100 * n + n * (n + 1) / 2), m[k + ".total"]);
+    EXPECT_EQ(101, m[k + ".min"]);
+    EXPECT_EQ(static_cast<int64_t>(100 + n), m[k + ".max"]);
+    EXPECT_EQ(static_cast<int64_t>(100 + (n + 1) / 2), m[k + ".latency"]);
+
+    /* Counts batched up front take no part in min and max */
+    PerfTracer::incr(PerfEventType::AM_GET_SM, volid, 1000 * n, 10);
+    PerfTracer::incr(PerfEventType::AM_GET_SM, volid, 50, 1);
+    m = exported();
+    EXPECT_EQ(static_cast<int64_t>(n + 11), m[k + ".count"]);
+    EXPECT_EQ(static_cast<int64_t>(1100 * n + n * (n + 1) / 2 + 50), m[k + ".total"]);
+    EXPECT_EQ(50, m[k + ".min"]);
+    EXPECT_EQ(static_cast<int64_t>(100 + n), m[k + ".max"]);
+}
+
+/* Names matching the filter get their own counter, from the refresh() that made them match */
+TEST(PerfTracer, namedSlots) {
+    fds_volid_t volid(1003);
+    const std::string name("perf-gtest-read");
+    auto handle = PerfTracer::counterHandle(PerfEventType::AM_GET_DM, volid, name);
+    auto update = [&](unsigned t) {
+        for (uint64_t i = 0; i < UPDATES; ++i) {
+            PerfTracer::incr(PerfEventType::AM_OBJECT_CACHE_HIT, volid, 1, 0, name);
+            PerfTracer::incr(handle, 10 + t, 1);
+        }
+    };
+    auto numeric = key(PerfEventType::AM_OBJECT_CACHE_HIT, volid);
+    auto namedNumeric = key(PerfEventType::AM_OBJECT_CACHE_HIT, volid, name);
+    auto latency = key(PerfEventType::AM_GET_DM, volid) + ".count";
+    auto namedLatency = key(PerfEventType::AM_GET_DM, volid, name);
+
+    /* Nothing matches yet, only the volume's counters are kept */
+    runThreads(update);
+    EXPECT_EQ(static_cast<int64_t>(THREADS * UPDATES), exported(numeric));
+    EXPECT_EQ(static_cast<int64_t>(THREADS * UPDATES), exported(latency));
+    EXPECT_FALSE(isExported(namedNumeric));
+    EXPECT_FALSE(isExported(namedLatency + ".count"));
+
+    /* Handles and names looked up before the refresh follow the new filter */
+    setNameFilter(".*perf-gtest-.*");
+    runThreads(update);
+    auto m = exported();
+    EXPECT_EQ(static_cast<int64_t>(2 * THREADS * UPDATES), m[numeric]);
+    EXPECT_EQ(static_cast<int64_t>(THREADS * UPDATES), m[namedNumeric]);
+    EXPECT_EQ(static_cast<int64_t>(2 * THREADS * UPDATES), m[latency]);
+    EXPECT_EQ(static_cast<int64_t>(THREADS * UPDATES), m[namedLatency + ".count"]);
+    EXPECT_EQ(10, m[namedLatency + ".min"]);
+    EXPECT_EQ(static_cast<int64_t>(10 + THREADS - 1), m[namedLatency + ".max"]);
+
+    /* Named counters stop once the filter is dropped, and keep what they had */
+    setNameFilter("");
+    runThreads(update);
+    m = exported();
+    EXPECT_EQ(static_cast<int64_t>(3 * THREADS * UPDATES), m[numeric]);
+    EXPECT_EQ(static_cast<int64_t>(THREADS * UPDATES), m[namedNumeric]);
+    EXPECT_EQ(static_cast<int64_t>(3 * THREADS * UPDATES), m[latency]);
+    EXPECT_EQ(static_cast<int64_t>(THREADS * UPDATES), m[namedLatency + ".count"]);
+}
+
+class PerfTraceTestProc : public FdsProcess {
+  public:
+    PerfTraceTestProc(int argc, char * argv[])
+            : FdsProcess(argc, argv, "perf_ut.conf", "fds.perf_ut.", nullptr) {}
+    int run() override {
+        return 0;
+    }
+};
+
+int main(int argc, char * argv[]) {
+    PerfTraceTestProc proc(argc, argv);
+    /* The tracer exports its counters from when it is first used */
+    PerfTracer::refresh();
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -115,9 +115,14 @@ void PerfTraceUTProc::task(int id) {
             // use dynamic PerfContext
             PerfTracer::tracePointBegin(jobs_[id].id, jobs_[id].type, jobs_[id].volid, jobs_[id].id);
         }
-    } else {
+    } else if (y == 1) {
         // all odd numbered event use Numeric counter
         PerfTracer::incr(jobs_[id].type, jobs_[id].volid, jobs_[id].id);
+    } else {
+        // through a registered handle
+        PerfCounterHandle * handle = PerfTracer::counterHandle(jobs_[id].type,
+                jobs_[id].volid, jobs_[id].id);
+        PerfTracer::incr(handle);
     }
 
     // task is executed here
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "fds_process.h"
+#include "qos_ctrl.h"
+#include "lib/qos_htb.h"
+
+/**
+ * Checks what the HTB dispatcher hands out to queues that always have IOs
+ * waiting: each queue is kept backlogged by re-enqueuing an IO as soon as
+ * it's dispatched, and the IOs dispatched per queue are counted over a few
+ * seconds. The bounds allow for the burst sizes and timer slack.
+ */
+using namespace fds;  // NOLINT
+
+namespace {
+
+constexpr fds_uint32_t IOS_PER_QUEUE = 64;
+constexpr fds_uint64_t RUN_SECONDS = 2;
+constexpr fds_uint64_t QUEUE_BURST = 20;
+
+struct QueueSpec {
+    fds_int64_t assured;
+    fds_int64_t throttle;
+    fds_uint32_t priority;
+};
+
+struct CountingQoSCtrl : public FDS_QoSControl {
+    explicit CountingQoSCtrl(size_t const num_queues)
+        : FDS_QoSControl(1, FDS_QoSControl::FDS_DISPATCH_HIER_TOKEN_BUCKET, nullptr, "test"),
+          dispatched(num_queues + 1)
+    {
+        for (auto& d : dispatched) {
+            d = 0;
+        }
+    }
+
+    Error processIO(FDS_IOType* io) override {
+        dispatcher->markIODone(io);
+        auto queue_id = io->io_vol_id.get();
+        ++dispatched[queue_id];
+        dispatcher->enqueueIO(queue_id, io);
+        return ERR_OK;
+    }
+
+    std::vector<std::atomic<fds_uint64_t>> dispatched;
+};
+
+/* Runs the dispatcher over backlogged queues 1..n, returns IOs dispatched per queue */
+std::vector<fds_uint64_t> runQueues(std::vector<QueueSpec> const& specs,
+                                    fds_int64_t const total_iops,
+                                    fds_uint32_t const dispatchers = 1) {
+    CountingQoSCtrl ctrl(specs.size());
+    std::unique_ptr<QoSHTBDispatcher> htb(new QoSHTBDispatcher(&ctrl, g_fdslog, total_iops,
+                                                               dispatchers, 8));
+    ctrl.dispatcher = htb.get();
+
+    std::vector<std::unique_ptr<FDS_VolumeQueue>> queues;
+    for (fds_qid_t queue_id = 1; specs.size() >= queue_id; ++queue_id) {
+        auto const& spec = specs[queue_id - 1];
+        queues.emplace_back(new FDS_VolumeQueue(IOS_PER_QUEUE, spec.throttle, spec.assured, spec.priority));
+        queues.back()->activate();
+        EXPECT_TRUE(htb->registerQueue(queue_id, queues.back().get()).ok());
+    }
+
+    std::vector<FDS_IOType> ios(specs.size() * IOS_PER_QUEUE);
+    for (size_t i = 0; ios.size() > i; ++i) {
+        auto queue_id = (i / IOS_PER_QUEUE) + 1;
+        ios[i].io_module = FDS_IOType::STOR_MGR_IO;
+        ios[i].io_vol_id = fds_volid_t(queue_id);
+        htb->enqueueIO(queue_id, &ios[i]);
+    }
+
+    std::thread dispatch_thread([&htb] { htb->dispatchIOs(); });
+    std::this_thread::sleep_for(std::chrono::seconds(RUN_SECONDS));
+    htb->stop();
+    dispatch_thread.join();
+
+    std::vector<fds_uint64_t> counts;
+    for (fds_qid_t queue_id = 1; specs.size() >= queue_id; ++queue_id) {
+        counts.push_back(ctrl.dispatched[queue_id]);
+        htb->deregisterQueue(queue_id);
+    }
+    ctrl.dispatcher = nullptr;
+    return counts;
+}
+
+}  // namespace
+
+/* A low priority queue still gets its assured rate while a higher priority
+ * one takes all of the available rate */
+TEST(QoSHTB, assuredRate) {
+    auto counts = runQueues({{20, 0, 1}, {400, 0, 9}}, 2000);
+    EXPECT_GE(counts[1], 400 * RUN_SECONDS * 8 / 10);
+    EXPECT_LE(counts[1], 400 * RUN_SECONDS * 12 / 10 + QUEUE_BURST);
+    EXPECT_GT(counts[0], counts[1]);
+}
+
+/* A queue never goes over its throttle rate, however much is available */
+TEST(QoSHTB, throttleCap) {
+    auto counts = runQueues({{50, 200, 1}}, 2000);
+    EXPECT_GE(counts[0], 200 * RUN_SECONDS * 8 / 10);
+    EXPECT_LE(counts[0], 200 * RUN_SECONDS * 11 / 10 + QUEUE_BURST);
+}
+
+/* The available rate goes to the highest priority (lowest number) queue,
+ * the other is left with its assured rate */
+TEST(QoSHTB, priorityOrdering) {
+    auto counts = runQueues({{20, 0, 5}, {20, 0, 1}}, 2000);
+    EXPECT_LE(counts[0], 20 * RUN_SECONDS * 15 / 10 + QUEUE_BURST);
+    EXPECT_GT(counts[1], 10 * counts[0]);
+}
+
+/* Queues of the same priority share the available rate evenly, and all
+ * of them together don't go over the total rate */
+TEST(QoSHTB, equalPriorityShare) {
+    auto counts = runQueues({{20, 0, 3}, {20, 0, 3}, {20, 0, 3}}, 3000);
+    fds_uint64_t total = 0;
+    for (auto count : counts) {
+        total += count;
+    }
+    EXPECT_GE(total, 3000 * RUN_SECONDS * 8 / 10);
+    EXPECT_LE(total, 3000 * RUN_SECONDS * 11 / 10 + counts.size() * QUEUE_BURST);
+    for (auto count : counts) {
+        EXPECT_GE(count, total / counts.size() * 8 / 10);
+        EXPECT_LE(count, total / counts.size() * 12 / 10);
+    }
+}
+
+/* With a dispatcher thread per shard, assured rates and the total rate
+ * still hold for queues in different shards */
+TEST(QoSHTB, shardedDispatch) {
+    auto counts = runQueues({{20, 0, 1}, {400, 0, 9}, {20, 300, 1}, {300, 0, 9}}, 3000, 2);
+    EXPECT_GE(counts[1], 400 * RUN_SECONDS * 8 / 10);
+    EXPECT_GE(counts[3], 300 * RUN_SECONDS * 8 / 10);
+    EXPECT_LE(counts[2], 300 * RUN_SECONDS * 11 / 10 + QUEUE_BURST);
+    fds_uint64_t total = counts[0] + counts[1] + counts[2] + counts[3];
+    EXPECT_LE(total, 3000 * RUN_SECONDS * 11 / 10 + counts.size() * QUEUE_BURST);
+}
+
+class QoSHTBTestProc : public FdsProcess {
+  public:
+    QoSHTBTestProc(int argc, char * argv[])
+            : FdsProcess(argc, argv, "platform.conf", "fds.am.", "qos-htb-test.log", nullptr) {}
+    int run() override {
+        return 0;
+    }
+};
+
+int main(int argc, char * argv[]) {
+    QoSHTBTestProc proc(argc, argv);
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
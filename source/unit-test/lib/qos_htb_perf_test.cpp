@@ -0,0 +1,164 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "boost/program_options.hpp"
+
+#include "fds_process.h"
+#include "qos_ctrl.h"
+#include "lib/qos_htb.h"
+
+/**
+ * Micro benchmark of the HTB dispatcher with many volume queues.
+ *
+ * A fixed number of IOs circulate: each is enqueued to a random one of the
+ * active queues and, once dispatched, completed and enqueued again. The
+ * control does no work of its own, so the rate reported is what the
+ * dispatcher itself can sustain with that many queues.
+ */
+using namespace fds;  // NOLINT
+
+namespace {
+
+struct Options {
+    fds_uint32_t queues;
+    fds_uint32_t active;
+    fds_uint32_t ios;
+    fds_uint32_t dispatchers;
+    fds_uint32_t batch;
+    fds_int64_t total_iops;
+    fds_uint32_t seconds;
+} opts;
+
+struct BenchQoSCtrl : public FDS_QoSControl {
+    BenchQoSCtrl()
+        : FDS_QoSControl(1, FDS_QoSControl::FDS_DISPATCH_HIER_TOKEN_BUCKET, nullptr, "bench"),
+          gen(42),
+          queue_dist(1, opts.active)
+    {}
+
+    Error processIO(FDS_IOType* io) override {
+        dispatcher->markIODone(io);
+        wait_nanos += io->dispatch_ts - io->enqueue_ts;
+        ++dispatched;
+        enqueue(io);
+        return ERR_OK;
+    }
+
+    void enqueue(FDS_IOType* io) {
+        fds_qid_t queue_id;
+        {
+            std::lock_guard<std::mutex> g(gen_lock);
+            queue_id = queue_dist(gen);
+        }
+        io->io_vol_id = fds_volid_t(queue_id);
+        dispatcher->enqueueIO(queue_id, io);
+    }
+
+    std::atomic<fds_uint64_t> dispatched {0};
+    std::atomic<fds_uint64_t> wait_nanos {0};
+
+  private:
+    std::mutex gen_lock;
+    std::mt19937_64 gen;
+    std::uniform_int_distribution<fds_qid_t> queue_dist;
+};
+
+}  // namespace
+
+class QoSHTBPerfProc : public FdsProcess {
+  public:
+    QoSHTBPerfProc(int argc, char * argv[], const std::string & config,
+                   const std::string & basePath, Module * vec[])
+            : FdsProcess(argc, argv, config, basePath, vec) {}
+    virtual ~QoSHTBPerfProc() {}
+
+    int run() override {
+        BenchQoSCtrl ctrl;
+        auto htb = new QoSHTBDispatcher(&ctrl, GetLog(), opts.total_iops,
+                                        opts.dispatchers, opts.batch);
+        ctrl.dispatcher = htb;
+
+        std::vector<std::unique_ptr<FDS_VolumeQueue>> queues;
+        for (fds_qid_t queue_id = 1; opts.queues >= queue_id; ++queue_id) {
+            queues.emplace_back(new FDS_VolumeQueue(opts.ios, 0, 0, (queue_id % 10) + 1));
+            queues.back()->activate();
+            auto err = htb->registerQueue(queue_id, queues.back().get());
+            if (!err.ok()) {
+                std::cout << "failed to register queue " << queue_id << ": " << err << std::endl;
+                return -1;
+            }
+        }
+
+        std::vector<FDS_IOType> ios(opts.ios);
+        for (auto& io : ios) {
+            io.io_module = FDS_IOType::STOR_MGR_IO;
+            ctrl.enqueue(&io);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::thread dispatch_thread([htb] { htb->dispatchIOs(); });
+        std::this_thread::sleep_for(std::chrono::seconds(opts.seconds));
+        htb->stop();
+        dispatch_thread.join();
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        fds_uint64_t dispatched = ctrl.dispatched;
+        std::cout << "queues=" << opts.queues << " active=" << opts.active
+                  << " ios=" << opts.ios << " dispatchers=" << opts.dispatchers
+                  << " batch=" << opts.batch << " total_iops=" << opts.total_iops << std::endl
+                  << "  dispatched=" << dispatched
+                  << " iops=" << std::fixed << dispatched / secs
+                  << " avg wait (usec)=" << (dispatched ? (ctrl.wait_nanos / dispatched) / 1000.0 : 0.0)
+                  << std::endl;
+
+        for (fds_qid_t queue_id = 1; opts.queues >= queue_id; ++queue_id) {
+            htb->deregisterQueue(queue_id);
+        }
+        ctrl.dispatcher = nullptr;
+        delete htb;
+        return (0 < dispatched) ? 0 : -1;
+    }
+};
+
+int main(int argc, char * argv[]) {
+    namespace po = boost::program_options;
+    po::options_description desc("QoS HTB dispatcher benchmark");
+    desc.add_options()
+            ("help,h", "Print this help message")
+            ("queues", po::value<fds_uint32_t>(&opts.queues)->default_value(10000),
+             "Volume queues registered")
+            ("active", po::value<fds_uint32_t>(&opts.active)->default_value(10000),
+             "Queues IOs are sent to")
+            ("ios", po::value<fds_uint32_t>(&opts.ios)->default_value(4096),
+             "IOs in circulation")
+            ("dispatchers", po::value<fds_uint32_t>(&opts.dispatchers)->default_value(1),
+             "Dispatcher threads")
+            ("batch", po::value<fds_uint32_t>(&opts.batch)->default_value(8),
+             "Most IOs dispatched per wakeup")
+            ("total-iops", po::value<fds_int64_t>(&opts.total_iops)->default_value(1000000),
+             "Total rate of the dispatcher")
+            ("seconds", po::value<fds_uint32_t>(&opts.seconds)->default_value(10),
+             "Seconds to run for");
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).allow_unregistered().run(), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    opts.queues = std::max(opts.queues, 1u);
+    opts.active = std::min(std::max(opts.active, 1u), opts.queues);
+
+    QoSHTBPerfProc p(argc, argv, "platform.conf", "fds.am.", NULL);
+    return p.main();
+}
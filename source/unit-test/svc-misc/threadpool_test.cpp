@@ -5,6 +5,7 @@
 
 #include <chrono>
 #include <atomic>
+#include <future>
 #include <thread>
 #include <string>
 #include <vector>
@@ -47,7 +48,7 @@ enum WorkType {
 
 struct Producer {
     Producer(std::function<void (Producer*, util::TimeStamp)> dispFunc,  // NOLINT
-            int workType, int dispCnt, uint64_t workIterCnt);
+            int workType, int dispCnt, uint64_t workIterCnt, int heavyEvery);
     virtual ~Producer() {}
     void produce();
     void workDoneCb();
@@ -83,6 +84,9 @@ struct Producer {
     std::function<void (Producer*, util::TimeStamp)> dispFunc_;  // NOLINT
     int dispCnt_;
     uint64_t workIterCnt_;
+    /* Every heavyEvery_ th task does 100x the work, to make the load uneven */
+    int heavyEvery_;
+    std::atomic<int> workCnt_;
 
     RandDataGenerator<> dataGen_;
 
@@ -90,7 +94,7 @@ struct Producer {
 };
 
 Producer::Producer(std::function<void (Producer*, util::TimeStamp)> dispFunc,  // NOLINT
-        int workType, int dispCnt, uint64_t workIterCnt)
+        int workType, int dispCnt, uint64_t workIterCnt, int heavyEvery)
 : issued_(0),
     completed_(0),
     workTime_(0),
@@ -99,6 +103,8 @@ Producer::Producer(std::function<void (Producer*, util::TimeStamp)> dispFunc,  /
     workType_(workType),
     dispCnt_(dispCnt),
     workIterCnt_(workIterCnt),
+    heavyEvery_(heavyEvery),
+    workCnt_(0),
     dataGen_(1024, 1024),
     t_(std::bind(&Producer::produce, this))
 {
@@ -137,9 +143,13 @@ void Producer::work(util::TimeStamp dispTs)
     util::TimeStamp workStartTs = util::getTimeStampNanos();
     util::TimeStamp workEndTs;
     std::unordered_map<int, std::string> map;
+    uint64_t iterCnt = workIterCnt_;
+    if (heavyEvery_ > 0 && (workCnt_++ % heavyEvery_) == 0) {
+        iterCnt *= 100;
+    }
     if (workType_ == CPUBOUND) {
-        uint64_t sum = 0;
-        for (uint64_t i = 0; i < workIterCnt_; i++) {
+        volatile uint64_t sum = 0;
+        for (uint64_t i = 0; i < iterCnt; i++) {
             sum += i * i * i;
         }
     } else if (workType_ == HASHTABLE) {
@@ -215,11 +225,12 @@ struct ThreadPoolTest: BaseTestFixture
         auto nProducers = this->getArg<int>("producers");
         auto dispCnt = this->getArg<int>("cnt");
         uint64_t workIterCnt = this->getArg<uint64_t>("iter-cnt");
+        auto heavyEvery = this->getArg<int>("heavy-every");
         producers_.resize(nProducers);
 
         /* Start producers */
         for (uint32_t i = 0; i < producers_.size(); i++) {
-            producers_[i] = new Producer(dispFunc, workType, dispCnt, workIterCnt);
+            producers_[i] = new Producer(dispFunc, workType, dispCnt, workIterCnt, heavyEvery);
         }
 
         /* Join all producer threads */
@@ -257,7 +268,8 @@ TEST_F(ThreadPoolTest, singlethread)
 TEST_F(ThreadPoolTest, fdsthreadpool)
 {
     int tpSize = this->getArg<int>("tp-size");
-    std::unique_ptr<fds_threadpool> tp(new fds_threadpool(tpSize));
+    /* The locked threadpool, by default fds_threadpool runs on LFMQThreadpool */
+    std::unique_ptr<fds_threadpool> tp(new fds_threadpool(tpSize, false));
     runWorkload(std::bind(&Producer::fdsTpDispFunc, tp.get(),
                 std::placeholders::_1, std::placeholders::_2));
 }
@@ -268,6 +280,129 @@ TEST_F(ThreadPoolTest, ithreadpool)
     std::unique_ptr<LFMQThreadpool> tp(new LFMQThreadpool(tpSize, true));
     runWorkload(std::bind(&Producer::ITpDispFunc, tp.get(),
                 std::placeholders::_1, std::placeholders::_2));
+    uint64_t stolen = 0;
+    for (auto w : tp->workers) {
+        stolen += w->stolenCntr;
+    }
+    std::cout << "Stolen: " << stolen << "\n";
+}
+
+TEST_F(ThreadPoolTest, ithreadpool_nosteal)
+{
+    int tpSize = this->getArg<int>("tp-size");
+    std::unique_ptr<LFMQThreadpool> tp(new LFMQThreadpool(tpSize, false));
+    runWorkload(std::bind(&Producer::ITpDispFunc, tp.get(),
+                std::placeholders::_1, std::placeholders::_2));
+}
+
+/* Schedules cnt tasks from several producers, with every 8th task doing
+ * more work so that idle workers have something to steal.  Returns how
+ * many times each task ran.
+ */
+static std::vector<int> runEachTask(bool steal, int cnt)
+{
+    std::unique_ptr<LFMQThreadpool> tp(new LFMQThreadpool(4, steal));
+    std::vector<std::atomic<int>> runs(cnt);
+    for (auto &r : runs) {
+        r = 0;
+    }
+    std::atomic<int> completed(0);
+    auto task = [&runs, &completed](int i) {
+        volatile uint64_t sum = 0;
+        uint64_t iters = (i % 8 == 0) ? 100000 : 1000;
+        for (uint64_t j = 0; j < iters; j++) {
+            sum += j;
+        }
+        ++runs[i];
+        ++completed;
+    };
+
+    const int nProducers = 4;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < nProducers; p++) {
+        producers.emplace_back([&tp, &task, p, cnt]() {
+            for (int i = p; i < cnt; i += nProducers) {
+                tp->schedule(task, i);
+            }
+        });
+    }
+    for (auto &t : producers) {
+        t.join();
+    }
+    POLL_MS((completed >= cnt), 10, 30000);
+    /* Workers are joined, nothing runs after this */
+    tp->stop();
+
+    std::vector<int> result;
+    for (auto &r : runs) {
+        result.push_back(r);
+    }
+    return result;
+}
+
+TEST_F(ThreadPoolTest, ithreadpool_runs_once)
+{
+    for (bool steal : {true, false}) {
+        auto runs = runEachTask(steal, 20000);
+        for (size_t i = 0; i < runs.size(); i++) {
+            ASSERT_EQ(1, runs[i]) << "task " << i << " steal " << steal;
+        }
+    }
+}
+
+TEST_F(ThreadPoolTest, ithreadpool_affinity)
+{
+    std::unique_ptr<LFMQThreadpool> tp(new LFMQThreadpool(4, true));
+    const int cnt = 10000;
+    std::atomic<int> completed(0);
+    std::atomic<int> misplaced(0);
+    /* Mostly on one worker, so the others are idle and looking to steal */
+    for (int i = 0; i < cnt; i++) {
+        uint64_t affinity = (i % 10 == 0) ? i : 7;
+        auto expected = tp->getThreadId(affinity);
+        tp->scheduleWithAffinity(affinity, [&completed, &misplaced, expected]() {
+            volatile uint64_t sum = 0;
+            for (uint64_t j = 0; j < 1000; j++) {
+                sum += j;
+            }
+            if (std::this_thread::get_id() != expected) {
+                ++misplaced;
+            }
+            ++completed;
+        });
+    }
+    POLL_MS((completed == cnt), 10, 30000);
+    EXPECT_EQ(cnt, completed);
+    EXPECT_EQ(0, misplaced);
+}
+
+TEST_F(ThreadPoolTest, ithreadpool_stop_with_queued_tasks)
+{
+    std::unique_ptr<LFMQThreadpool> tp(new LFMQThreadpool(2, true));
+    std::promise<void> gate;
+    auto gateFuture = gate.get_future().share();
+    std::atomic<bool> started(false);
+    std::atomic<int> ran(0);
+    const int cnt = 100;
+
+    /* The first task holds the worker while the rest queue up behind it */
+    for (int i = 0; i < cnt; i++) {
+        tp->scheduleWithAffinity(0, [gateFuture, &started, &ran]() {
+            started = true;
+            gateFuture.wait();
+            ++ran;
+        });
+    }
+    POLL_MS(started.load(), 10, 5000);
+
+    auto stopped = std::async(std::launch::async, [&tp]() { tp->stop(); });
+    POLL_MS((tp->workers[0]->state_ != LockfreeWorker::STARTED), 10, 5000);
+    ASSERT_EQ(LockfreeWorker::ABORTING, tp->workers[0]->state_.load());
+    gate.set_value();
+
+    ASSERT_EQ(std::future_status::ready, stopped.wait_for(std::chrono::seconds(10)));
+    /* Only the task that was running when the pool stopped got to run */
+    EXPECT_EQ(1, ran);
 }
 
 TEST_F(ThreadPoolTest, lfsqthreadpool)
@@ -288,7 +423,9 @@ int main(int argc, char** argv) {
         ("type", po::value<int>()->default_value(0), "work type [0=cpuboudn, 1=hashtable]")
         ("cnt", po::value<int>()->default_value(10000), "cnt")
         ("profile", po::value<bool>()->default_value(false), "profile")
-        ("iter-cnt", po::value<uint64_t>()->default_value(10000), "iter-cnt");
+        ("iter-cnt", po::value<uint64_t>()->default_value(10000), "iter-cnt")
+        ("heavy-every", po::value<int>()->default_value(0),
+         "every nth task does 100x iter-cnt, 0 for even work");
     ThreadPoolTest::init(argc, argv, opts);
     std::cout << std::fixed;
     return RUN_ALL_TESTS();
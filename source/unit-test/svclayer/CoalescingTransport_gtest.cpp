@@ -0,0 +1,257 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+}
+
+#include <boost/make_shared.hpp>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TSocket.h>
+#include <thrift/transport/TTransportException.h>
+#include <net/CoalescingTransport.h>
+
+#include <gtest/gtest.h>
+
+using namespace fds::net;  // NOLINT
+namespace tt = apache::thrift::transport;
+
+namespace {
+
+const uint32_t SEGMENT_BYTES = CoalescingTransport::SEGMENT_BYTES;
+
+/* Each frame is the writes that make it up */
+using Frames = std::vector<std::vector<std::string>>;
+
+/* Bytes that differ from one payload to the next */
+std::string payload(size_t len) {
+    static char next = 0;
+    std::string data(len, '\0');
+    for (auto &c : data) {
+        c = next++;
+    }
+    return data;
+}
+
+template <class TransportT>
+void writeFrame(TransportT &transport, const std::vector<std::string> &frame) {
+    for (auto &piece : frame) {
+        transport.write(reinterpret_cast<const uint8_t *>(piece.data()), piece.size());
+    }
+    transport.flush();
+}
+
+/* Reads fd until the other end closes */
+std::string readAll(int fd) {
+    std::string bytes;
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = ::recv(fd, buf, sizeof(buf), 0)) > 0) {
+        bytes.append(buf, n);
+    }
+    return bytes;
+}
+
+/**
+ * What write() sends over a socket pair, read on another thread meanwhile.
+ * write() is given its end of the pair, to wrap in a TSocket that closes it.
+ */
+std::string capture(const std::function<void (int fd)> &write) {
+    int sv[2];
+    EXPECT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    std::string bytes;
+    std::thread reader([&bytes, &sv]() { bytes = readAll(sv[1]); });
+    try {
+        write(sv[0]);
+    } catch (tt::TTransportException &e) {
+        ADD_FAILURE() << "write failed: " << e.what();
+    }
+    reader.join();
+    ::close(sv[1]);
+    return bytes;
+}
+
+/* The frames as TFramedTransport writes them */
+std::string framed(const Frames &frames) {
+    return capture([&frames](int fd) {
+        tt::TFramedTransport transport(boost::make_shared<tt::TSocket>(fd));
+        for (auto &frame : frames) {
+            writeFrame(transport, frame);
+        }
+    });
+}
+
+/* The frames as written by a CoalescingTransport, held for the whole batch if asked */
+std::string coalesced(const Frames &frames, uint32_t coalesceBytes, bool hold) {
+    return capture([&](int fd) {
+        CoalescingTransport transport(boost::make_shared<tt::TSocket>(fd), coalesceBytes);
+        if (hold) {
+            transport.hold();
+        }
+        for (auto &frame : frames) {
+            writeFrame(transport, frame);
+        }
+        transport.release();
+        EXPECT_EQ(frames.size(), transport.framesWritten());
+    });
+}
+
+/* Whole frames at the start of bytes */
+uint64_t countFrames(const std::string &bytes) {
+    uint64_t frames = 0;
+    size_t offset = 0;
+    while (bytes.size() - offset >= sizeof(uint32_t)) {
+        uint32_t size;
+        memcpy(&size, bytes.data() + offset, sizeof(size));
+        offset += sizeof(size) + ntohl(size);
+        if (offset > bytes.size()) {
+            break;
+        }
+        ++frames;
+    }
+    return frames;
+}
+
+}  // namespace
+
+/* Writes just under the segment size are copied, the rest referenced; the bytes don't change */
+TEST(CoalescingTransport, segmentSizes) {
+    for (uint32_t len : {SEGMENT_BYTES - 1, SEGMENT_BYTES, SEGMENT_BYTES + 1}) {
+        Frames frames = {{"header", payload(len), "trailer"},
+                         {payload(len)},
+                         {payload(len), payload(len), "x"},
+                         {"a", "b"}};
+        EXPECT_EQ(framed(frames), coalesced(frames, 0, false)) << "len " << len;
+        EXPECT_EQ(framed(frames), coalesced(frames, 0, true)) << "len " << len;
+    }
+}
+
+/* Held frames go out once coalesceBytes are pending, the rest at release() */
+TEST(CoalescingTransport, heldBatches) {
+    const uint32_t coalesceBytes = 3 * SEGMENT_BYTES;
+    Frames frames;
+    for (uint32_t i = 0; i < 10; ++i) {
+        frames.push_back({"header", payload(i % 2 ? SEGMENT_BYTES + 1 : SEGMENT_BYTES - 1)});
+    }
+
+    auto bytes = capture([&](int fd) {
+        CoalescingTransport transport(boost::make_shared<tt::TSocket>(fd), coalesceBytes);
+        transport.hold();
+        uint64_t pendingBytes = 0, pendingFrames = 0, written = 0;
+        for (auto &frame : frames) {
+            writeFrame(transport, frame);
+            pendingBytes += sizeof(uint32_t) + frame[0].size() + frame[1].size();
+            ++pendingFrames;
+            if (pendingBytes >= coalesceBytes) {
+                written += pendingFrames;
+                pendingBytes = pendingFrames = 0;
+            }
+            EXPECT_EQ(written, transport.framesWritten());
+        }
+        EXPECT_LT(written, frames.size());
+        transport.release();
+        EXPECT_EQ(frames.size(), transport.framesWritten());
+    });
+    EXPECT_EQ(framed(frames), bytes);
+}
+
+/* A batch of more segments than one sendmsg() takes goes out in several */
+TEST(CoalescingTransport, moreSegmentsThanIovMax) {
+    Frames frames(1);
+    for (uint32_t i = 0; i < IOV_MAX; ++i) {
+        frames[0].push_back("s");
+        frames[0].push_back(payload(SEGMENT_BYTES));
+    }
+    for (uint32_t i = 0; i < IOV_MAX; ++i) {
+        frames.push_back({payload(SEGMENT_BYTES)});
+    }
+    EXPECT_EQ(framed(frames), coalesced(frames, 0, false));
+    EXPECT_EQ(framed(frames), coalesced(frames, UINT32_MAX, true));
+}
+
+/* A send interrupted part way through carries on from where it stopped */
+TEST(CoalescingTransport, partialWrites) {
+    struct sigaction ignore, old;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = [](int) {};
+    ASSERT_EQ(0, sigaction(SIGUSR1, &ignore, &old));
+
+    Frames frames = {{"header", payload(4 * 1024 * 1024)}, {"header", payload(SEGMENT_BYTES)}};
+    int sv[2];
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    std::thread writer([&frames, &sv]() {
+        CoalescingTransport transport(boost::make_shared<tt::TSocket>(sv[0]), 0);
+        try {
+            for (auto &frame : frames) {
+                writeFrame(transport, frame);
+            }
+        } catch (tt::TTransportException &e) {
+            ADD_FAILURE() << "write failed: " << e.what();
+        }
+    });
+
+    /* Nothing is read yet, so the writer is stuck part way through the first frame */
+    for (int i = 0; i < 3; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        pthread_kill(writer.native_handle(), SIGUSR1);
+    }
+    auto bytes = readAll(sv[1]);
+    writer.join();
+    ::close(sv[1]);
+    sigaction(SIGUSR1, &old, nullptr);
+
+    EXPECT_EQ(framed(frames), bytes);
+}
+
+/* Frames that went out whole before a write failed are counted, the rest not */
+TEST(CoalescingTransport, framesWrittenAfterFailure) {
+    int sv[2];
+    ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    /* A small buffer nobody reads: the batch times out part way through */
+    int sndbuf = 4096;
+    ASSERT_EQ(0, setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)));
+    timeval timeout {0, 100 * 1000};
+    ASSERT_EQ(0, setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)));
+
+    Frames frames;
+    for (uint32_t i = 0; i < 64; ++i) {
+        frames.push_back({"header", payload(1000)});
+    }
+    uint64_t written;
+    {
+        CoalescingTransport transport(boost::make_shared<tt::TSocket>(sv[0]), UINT32_MAX);
+        transport.hold();
+        for (auto &frame : frames) {
+            writeFrame(transport, frame);
+        }
+        EXPECT_EQ(0u, transport.framesWritten());
+        EXPECT_THROW(transport.release(), tt::TTransportException);
+        written = transport.framesWritten();
+    }
+
+    auto bytes = readAll(sv[1]);
+    ::close(sv[1]);
+    EXPECT_GT(written, 0u);
+    EXPECT_LT(written, frames.size());
+    EXPECT_EQ(countFrames(bytes), written);
+    EXPECT_EQ(framed(frames).substr(0, bytes.size()), bytes);
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+}
+
+#include <boost/make_shared.hpp>
+#include <thrift/TProcessor.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <concurrency/ThreadPool.h>
+#include <net/SvcEventServer.h>
+
+#include <gtest/gtest.h>
+
+using namespace fds;  // NOLINT
+namespace at = apache::thrift;
+namespace tp = apache::thrift::protocol;
+namespace tt = apache::thrift::transport;
+
+namespace {
+
+const int PORT = 10100;
+/* How long the tests wait for a call or a reply */
+const int WAIT_SECS = 10;
+
+/**
+ * Echoes the argument of calls with a reply back and keeps the arguments of
+ * every call in the order processed.  Calls named "block" wait for release().
+ */
+struct EchoProcessor : at::TProcessor {
+    bool process(boost::shared_ptr<tp::TProtocol> in,
+                 boost::shared_ptr<tp::TProtocol> out,
+                 void *connectionContext) override {
+        std::string name;
+        std::string arg;
+        tp::TMessageType type;
+        int32_t seqid;
+        in->readMessageBegin(name, type, seqid);
+        in->readString(arg);
+        in->readMessageEnd();
+        {
+            std::unique_lock<std::mutex> l(lock);
+            if (name == "block") {
+                ++blocked;
+                cv.notify_all();
+                cv.wait(l, [this]() { return released; });
+            }
+            args.push_back(arg);
+            cv.notify_all();
+        }
+
+        if (type == tp::T_CALL) {
+            out->writeMessageBegin(name, tp::T_REPLY, seqid);
+            out->writeString(arg);
+            out->writeMessageEnd();
+            out->getTransport()->writeEnd();
+            out->getTransport()->flush();
+        }
+        return true;
+    }
+
+    bool waitFor(const std::function<bool ()> &done) {
+        std::unique_lock<std::mutex> l(lock);
+        return cv.wait_for(l, std::chrono::seconds(WAIT_SECS), done);
+    }
+
+    bool waitForArg(const std::string &arg) {
+        return waitFor([this, &arg]() {
+            return std::find(args.begin(), args.end(), arg) != args.end();
+        });
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> g(lock);
+        released = true;
+        cv.notify_all();
+    }
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<std::string> args;
+    uint32_t blocked {0};
+    bool released {false};
+};
+
+std::string frame(const std::string &name, tp::TMessageType type, int32_t seqid,
+                  const std::string &arg) {
+    auto buf = boost::make_shared<tt::TMemoryBuffer>();
+    tp::TBinaryProtocol proto(buf);
+    proto.writeMessageBegin(name, type, seqid);
+    proto.writeString(arg);
+    proto.writeMessageEnd();
+    auto payload = buf->getBufferAsString();
+    uint32_t size = htonl(payload.size());
+    return std::string(reinterpret_cast<char *>(&size), sizeof(size)) + payload;
+}
+
+std::string call(int32_t seqid, const std::string &arg) {
+    return frame("echo", tp::T_CALL, seqid, arg);
+}
+
+std::string oneway(const std::string &arg, const std::string &name = "echo") {
+    return frame(name, tp::T_ONEWAY, 0, arg);
+}
+
+/* Connects to the server, retrying while it starts listening */
+int connectServer() {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(PORT);
+    for (int i = 0; i < WAIT_SECS * 100; ++i) {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0) {
+            timeval tv {WAIT_SECS, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+void sendAll(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        auto n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        ASSERT_GT(n, 0);
+        sent += n;
+    }
+}
+
+/* Reads a whole reply, false when the connection was closed or timed out */
+bool readAll(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        auto n = ::recv(fd, buf + got, len - got, 0);
+        if (n <= 0) {
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+bool readReply(int fd, int32_t &seqid, std::string &arg) {
+    uint32_t size;
+    if (!readAll(fd, reinterpret_cast<char *>(&size), sizeof(size))) {
+        return false;
+    }
+    std::string payload(ntohl(size), '\0');
+    if (!readAll(fd, &payload[0], payload.size())) {
+        return false;
+    }
+    auto buf = boost::make_shared<tt::TMemoryBuffer>(
+        reinterpret_cast<uint8_t *>(&payload[0]), payload.size());
+    tp::TBinaryProtocol proto(buf);
+    std::string name;
+    tp::TMessageType type;
+    proto.readMessageBegin(name, type, seqid);
+    proto.readString(arg);
+    proto.readMessageEnd();
+    return type == tp::T_REPLY;
+}
+
+/* Checks the next reply on fd is for seqid and echoes arg */
+void expectReply(int fd, int32_t seqid, const std::string &arg) {
+    int32_t gotSeqid = -1;
+    std::string gotArg;
+    ASSERT_TRUE(readReply(fd, gotSeqid, gotArg));
+    EXPECT_EQ(seqid, gotSeqid);
+    EXPECT_EQ(arg, gotArg);
+}
+
+/* Checks the server closed fd */
+void expectClosed(int fd) {
+    char c;
+    EXPECT_EQ(0, ::recv(fd, &c, 1, 0));
+}
+
+}  // namespace
+
+/* Serves on a single IO loop, so a call blocking the loop holds up every connection */
+struct SvcEventServerTest : ::testing::Test {
+    void SetUp() override {
+        processor = boost::make_shared<EchoProcessor>();
+        server.reset(new SvcEventServer(processor,
+                                        boost::make_shared<tp::TBinaryProtocolFactory>(),
+                                        PORT, 1, &threadpool));
+        serveThread = std::thread([this]() { server->serve(); });
+    }
+
+    void TearDown() override {
+        processor->release();
+        server->stop();
+        serveThread.join();
+        server.reset();
+    }
+
+    fds_threadpool threadpool {4};
+    boost::shared_ptr<EchoProcessor> processor;
+    boost::shared_ptr<SvcEventServer> server;
+    std::thread serveThread;
+};
+
+/* A frame arriving over several reads is processed once it is all there */
+TEST_F(SvcEventServerTest, frameSplitAcrossReads) {
+    int fd = connectServer();
+    ASSERT_GE(fd, 0);
+
+    auto small = call(1, "split");
+    for (auto &piece : {small.substr(0, 2), small.substr(2, 5), small.substr(7)}) {
+        sendAll(fd, piece);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    expectReply(fd, 1, "split");
+
+    /* Larger than what the server reads at once */
+    std::string large(1024 * 1024, 'x');
+    auto big = call(2, large);
+    sendAll(fd, big.substr(0, big.size() / 2));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    sendAll(fd, big.substr(big.size() / 2));
+    expectReply(fd, 2, large);
+    ::close(fd);
+}
+
+/* Every frame of a read is processed, oneway calls in the order sent */
+TEST_F(SvcEventServerTest, severalFramesInOneRead) {
+    int fd = connectServer();
+    ASSERT_GE(fd, 0);
+
+    sendAll(fd, oneway("a") + oneway("b") + call(1, "c") + oneway("d") + call(2, "e"));
+    expectReply(fd, 1, "c");
+    expectReply(fd, 2, "e");
+    ASSERT_TRUE(processor->waitFor([this]() { return processor->args.size() == 5; }));
+
+    std::vector<std::string> oneways;
+    for (auto &arg : processor->args) {
+        if (arg == "a" || arg == "b" || arg == "d") {
+            oneways.push_back(arg);
+        }
+    }
+    EXPECT_EQ(std::vector<std::string>({"a", "b", "d"}), oneways);
+    ::close(fd);
+}
+
+/* A frame over the size limit closes the connection, others are still served */
+TEST_F(SvcEventServerTest, oversizedFrame) {
+    int fd = connectServer();
+    ASSERT_GE(fd, 0);
+    uint32_t size = htonl(256 * 1024 * 1024 + 1);
+    sendAll(fd, std::string(reinterpret_cast<char *>(&size), sizeof(size)));
+    expectClosed(fd);
+    ::close(fd);
+
+    fd = connectServer();
+    ASSERT_GE(fd, 0);
+    sendAll(fd, call(1, "after"));
+    expectReply(fd, 1, "after");
+    ::close(fd);
+}
+
+/**
+ * A blocked oneway call holds up the later oneway calls of its connection
+ * only; the loop keeps serving the other connections.
+ */
+TEST_F(SvcEventServerTest, blockingOnewayCall) {
+    int blockedFd = connectServer();
+    ASSERT_GE(blockedFd, 0);
+    sendAll(blockedFd, oneway("blocked", "block") + oneway("behind"));
+    ASSERT_TRUE(processor->waitFor([this]() { return processor->blocked == 1; }));
+
+    int fd = connectServer();
+    ASSERT_GE(fd, 0);
+    sendAll(fd, oneway("other") + call(1, "served"));
+    expectReply(fd, 1, "served");
+    EXPECT_TRUE(processor->waitForArg("other"));
+    {
+        std::lock_guard<std::mutex> g(processor->lock);
+        EXPECT_EQ(processor->args.end(),
+                  std::find(processor->args.begin(), processor->args.end(), "behind"));
+    }
+
+    processor->release();
+    ASSERT_TRUE(processor->waitForArg("behind"));
+    auto &args = processor->args;
+    EXPECT_LT(std::find(args.begin(), args.end(), "blocked"),
+              std::find(args.begin(), args.end(), "behind"));
+    ::close(blockedFd);
+    ::close(fd);
+}
+
+/* A reply from the threadpool for a connection that was closed meanwhile is dropped */
+TEST_F(SvcEventServerTest, replyAfterClose) {
+    int fd = connectServer();
+    ASSERT_GE(fd, 0);
+    sendAll(fd, frame("block", tp::T_CALL, 1, "closed"));
+    ASSERT_TRUE(processor->waitFor([this]() { return processor->blocked == 1; }));
+    ::close(fd);
+    /* Give the loop time to see the close */
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    processor->release();
+    ASSERT_TRUE(processor->waitForArg("closed"));
+
+    fd = connectServer();
+    ASSERT_GE(fd, 0);
+    sendAll(fd, call(2, "after"));
+    expectReply(fd, 2, "after");
+    ::close(fd);
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -4,12 +4,28 @@
 #define GTEST_USE_OWN_TR1_TUPLE 0
 
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <iostream>
 #include <stdexcept>
+#include <vector>
 #include <boost/make_shared.hpp>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TSocket.h>
+#include <concurrency/ThreadPool.h>
 #include <fds_module_provider.h>
+#include <fdsp/PlatNetSvc.h>
 #include <net/net_utils.h>
+#include <net/CoalescingTransport.h>
 #include <net/SvcRequestPool.h>
 #include <net/SvcMgr.h>
 #include <fdsp_utils.h>
@@ -43,6 +59,248 @@ TEST_F(SvcMgrTest, svcmapUdpate) {
     }
 }
 
+namespace tp = apache::thrift::protocol;
+namespace tt = apache::thrift::transport;
+
+/* Errors a TestSvcHandle posted, kept apart so they outlive it */
+struct PostedErrors {
+    fds_mutex lock;
+    std::vector<int64_t> ids;
+
+    size_t size() {
+        fds_scoped_lock l(lock);
+        return ids.size();
+    }
+};
+
+/**
+* @brief Service handle that sends on a socket we give it, drains its queues on a
+* threadpool of ours and keeps the errors it posts instead of failing requests
+*/
+struct TestSvcHandle : SvcHandle {
+    TestSvcHandle(fds_threadpool *threadpool, const std::shared_ptr<PostedErrors> &errors)
+        : SvcHandle(nullptr, activeSvcInfo()), threadpool(threadpool), errors(errors)
+    {
+    }
+
+    static fpi::SvcInfo activeSvcInfo() {
+        fpi::SvcInfo info;
+        info.svc_id.svc_uuid.svc_uuid = 0x100;
+        info.ip = "127.0.0.1";
+        info.svc_status = fpi::SVC_STATUS_ACTIVE;
+        return info;
+    }
+
+    /* Sends on fd, through a coalescing transport */
+    void connect(int fd, uint32_t coalesceBytes) {
+        auto transport = boost::make_shared<net::CoalescingTransport>(
+            boost::make_shared<tt::TSocket>(fd), coalesceBytes);
+        auto client = boost::make_shared<fpi::PlatNetSvcClient>(
+            boost::make_shared<tp::TBinaryProtocol>(transport));
+        fpi::SvcInfo info;
+        getSvcInfo(info);
+        updateSvcHandle(info, true, client);
+    }
+
+    void send(int64_t id, size_t payloadBytes = 16) {
+        /* With one connection every message is queued on the same one */
+        auto header = boost::make_shared<fpi::AsyncHdr>();
+        header->msg_src_id = id;
+        auto payload = boost::make_shared<std::string>(payloadBytes, 'p');
+        sendAsyncSvcReqMessage(header, payload);
+    }
+
+    fds_threadpool* getSendThreadpool_() override { return threadpool; }
+
+    void postSendError_(fpi::AsyncHdrPtr &header) override {
+        fds_scoped_lock l(errors->lock);
+        errors->ids.push_back(header->msg_src_id);
+    }
+
+    void markSvcDown_() override {
+        svcInfo_.svc_status = fpi::SVC_STATUS_INACTIVE_FAILED;
+        ++markedDown;
+    }
+
+    fds_threadpool *threadpool;
+    std::shared_ptr<PostedErrors> errors;
+    std::atomic<uint32_t> markedDown {0};
+};
+
+/* Holds up the only thread of a threadpool until it goes out of scope */
+struct ThreadpoolGate {
+    explicit ThreadpoolGate(fds_threadpool &threadpool)
+        : state(std::make_shared<State>())
+    {
+        /* The task may only wake after we are gone */
+        auto s = state;
+        threadpool.schedule([s]() {
+            std::unique_lock<std::mutex> l(s->lock);
+            s->cv.wait(l, [s]() { return s->open; });
+        });
+    }
+    ~ThreadpoolGate() {
+        std::lock_guard<std::mutex> g(state->lock);
+        state->open = true;
+        state->cv.notify_all();
+    }
+
+    struct State {
+        std::mutex lock;
+        std::condition_variable cv;
+        bool open {false};
+    };
+    std::shared_ptr<State> state;
+};
+
+static bool waitFor(const std::function<bool ()> &done) {
+    for (int i = 0; i < 1000 && !done(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return done();
+}
+
+/* Ids of the asyncReqt messages read from fd until the other end closes */
+static std::vector<int64_t> readIds(int fd) {
+    auto transport = boost::make_shared<tt::TFramedTransport>(
+        boost::make_shared<tt::TSocket>(fd));
+    tp::TBinaryProtocol proto(transport);
+    std::vector<int64_t> ids;
+    try {
+        while (true) {
+            std::string name;
+            tp::TMessageType type;
+            int32_t seqid;
+            proto.readMessageBegin(name, type, seqid);
+            fpi::PlatNetSvc_asyncReqt_args args;
+            args.read(&proto);
+            proto.readMessageEnd();
+            transport->readEnd();
+            ids.push_back(args.asyncHdr.msg_src_id);
+        }
+    } catch (tt::TTransportException &e) {
+        /* Closed */
+    }
+    return ids;
+}
+
+static std::vector<int64_t> idRange(int64_t first, int64_t end) {
+    std::vector<int64_t> ids;
+    for (auto id = first; id < end; ++id) {
+        ids.push_back(id);
+    }
+    return ids;
+}
+
+/**
+* @brief Messages queued on a connection go out in the order queued
+*/
+TEST(SvcHandle, sendOrder) {
+    const int64_t MSGS = 2000;
+    fds_threadpool threadpool(2);
+    auto errors = std::make_shared<PostedErrors>();
+    int sv[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    auto handle = boost::make_shared<TestSvcHandle>(&threadpool, errors);
+    handle->connect(sv[0], 4096);
+
+    std::vector<int64_t> ids;
+    std::thread reader([&ids, &sv]() { ids = readIds(sv[1]); });
+    for (int64_t id = 0; id < MSGS; ++id) {
+        handle->send(id);
+    }
+    ASSERT_TRUE(waitFor([&handle]() { return handle->getSendStats().sent == MSGS; }));
+    ::shutdown(sv[0], SHUT_WR);
+    reader.join();
+
+    EXPECT_EQ(idRange(0, MSGS), ids);
+    auto stats = handle->getSendStats();
+    EXPECT_EQ(0u, stats.queued);
+    EXPECT_LE(stats.batches, static_cast<uint64_t>(MSGS));
+    EXPECT_EQ(0u, errors->size());
+    EXPECT_EQ(0u, handle->markedDown);
+}
+
+/**
+* @brief A batch failing part way through counts what went out as sent and fails
+* the rest, in order
+*/
+TEST(SvcHandle, failMidBatch) {
+    const int64_t MSGS = 64;
+    fds_threadpool threadpool(1);
+    auto errors = std::make_shared<PostedErrors>();
+    int sv[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    /* A small buffer nobody reads: the batch times out part way through */
+    int sndbuf = 4096;
+    ASSERT_EQ(0, setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)));
+    timeval timeout {0, 100 * 1000};
+    ASSERT_EQ(0, setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)));
+    auto handle = boost::make_shared<TestSvcHandle>(&threadpool, errors);
+    /* Every message is written out as soon as it is serialized */
+    handle->connect(sv[0], 1);
+
+    {
+        /* All of them are queued before the drain runs, making one batch */
+        ThreadpoolGate gate(threadpool);
+        for (int64_t id = 0; id < MSGS; ++id) {
+            handle->send(id, 1000);
+        }
+        EXPECT_EQ(static_cast<uint64_t>(MSGS), handle->getSendStats().queued);
+    }
+    ASSERT_TRUE(waitFor([&handle, &errors]() {
+        return handle->getSendStats().sent + errors->size() == MSGS;
+    }));
+
+    auto stats = handle->getSendStats();
+    EXPECT_GT(stats.sent, 0u);
+    EXPECT_LT(stats.sent, static_cast<uint64_t>(MSGS));
+    EXPECT_EQ(1u, stats.batches);
+    EXPECT_EQ(0u, stats.queued);
+    EXPECT_EQ(1u, handle->markedDown);
+    EXPECT_EQ(idRange(stats.sent, MSGS), errors->ids);
+
+    /* What the peer got is what was counted sent */
+    ::shutdown(sv[0], SHUT_WR);
+    EXPECT_EQ(idRange(0, stats.sent), readIds(sv[1]));
+
+    /* The service is down now, later messages fail right away */
+    handle->send(MSGS);
+    EXPECT_EQ(static_cast<size_t>(MSGS - stats.sent + 1), errors->size());
+}
+
+/**
+* @brief Messages still queued when the service goes down and its handle is
+* dropped fail instead of being lost
+*/
+TEST(SvcHandle, queuedWhenShutDown) {
+    const int64_t MSGS = 10;
+    fds_threadpool threadpool(1);
+    auto errors = std::make_shared<PostedErrors>();
+    int sv[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    auto handle = boost::make_shared<TestSvcHandle>(&threadpool, errors);
+    handle->connect(sv[0], 4096);
+
+    {
+        ThreadpoolGate gate(threadpool);
+        for (int64_t id = 0; id < MSGS; ++id) {
+            handle->send(id);
+        }
+        fpi::SvcInfo info;
+        handle->getSvcInfo(info);
+        info.svc_status = fpi::SVC_STATUS_INACTIVE_FAILED;
+        handle->updateSvcHandle(info, true);
+        /* Only the pending drain holds on to it now */
+        handle.reset();
+    }
+    ASSERT_TRUE(waitFor([&errors]() { return errors->size() == MSGS; }));
+    EXPECT_EQ(idRange(0, MSGS), errors->ids);
+
+    /* Dropping the client closed the socket with nothing written */
+    EXPECT_TRUE(readIds(sv[1]).empty());
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     po::options_description opts("Allowed options");
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2016 Formation Data Systems, Inc.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boost/program_options.hpp"
+
+#include <net/SvcRequest.h>
+#include <net/SvcRequestTracker.h>
+
+/**
+ * Micro benchmark of SvcRequestTracker.
+ *
+ * Each thread keeps a window of requests outstanding, the way a service
+ * issuing requests does: it adds a request for tracking, looks it up as a
+ * response handler would and pops it, for as long as the benchmark runs.
+ * Run with increasing --threads to see how the tracker scales.
+ */
+using namespace fds;  // NOLINT
+
+namespace {
+
+const SvcRequestId ID_BLOCK = 1024;
+
+struct Options {
+    uint32_t threads;
+    uint32_t shards;
+    uint32_t window;
+    uint32_t seconds;
+} opts;
+
+struct BenchSvcRequest : SvcRequestIf {
+    std::string logString() override { return "BenchSvcRequest"; }
+    void handleResponse(boost::shared_ptr<fpi::AsyncHdr>& header,
+                        boost::shared_ptr<std::string>& payload) override {}
+
+ protected:
+    void invokeWork_() override {}
+};
+
+}  // namespace
+
+int main(int argc, char * argv[]) {
+    namespace po = boost::program_options;
+    po::options_description desc("SvcRequestTracker benchmark");
+    desc.add_options()
+            ("help,h", "Print this help message")
+            ("threads", po::value<uint32_t>(&opts.threads)->default_value(4),
+             "Threads adding and popping requests")
+            ("shards", po::value<uint32_t>(&opts.shards)->default_value(
+                    SvcRequestTracker::DEFAULT_SHARDS),
+             "Tracker shards, 1 for a single map and lock")
+            ("window", po::value<uint32_t>(&opts.window)->default_value(256),
+             "Requests each thread keeps outstanding")
+            ("seconds", po::value<uint32_t>(&opts.seconds)->default_value(5),
+             "Seconds to run for");
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).allow_unregistered().run(), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    opts.threads = std::max(opts.threads, 1u);
+    opts.window = std::max(opts.window, 1u);
+
+    SvcRequestTracker tracker(nullptr, opts.shards);
+    std::atomic<SvcRequestId> nextId(1);
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> completed(0);
+
+    auto work = [&]() {
+        std::vector<SvcRequestIfPtr> reqs;
+        for (uint32_t i = 0; i < opts.window; i++) {
+            reqs.emplace_back(new BenchSvcRequest());
+        }
+        /* Ids come in blocks per thread, like the request pool hands them out */
+        SvcRequestId blockNext = 0, blockEnd = 0;
+        auto newId = [&]() {
+            if (blockNext == blockEnd) {
+                blockNext = nextId.fetch_add(ID_BLOCK);
+                blockEnd = blockNext + ID_BLOCK;
+            }
+            return blockNext++;
+        };
+        std::vector<SvcRequestId> ids(opts.window);
+        for (auto &id : ids) {
+            id = newId();
+        }
+
+        uint64_t done = 0;
+        uint32_t slot = 0;
+        for (uint32_t i = 0; i < opts.window; i++) {
+            tracker.addForTracking(ids[i], reqs[i]);
+        }
+        while (!stop.load(std::memory_order_relaxed)) {
+            auto id = ids[slot];
+            if (!tracker.getSvcRequest(id) || !tracker.popFromTracking(id)) {
+                std::cout << "request " << id << " went missing" << std::endl;
+                abort();
+            }
+            ids[slot] = newId();
+            tracker.addForTracking(ids[slot], reqs[slot]);
+            slot = (slot + 1) % opts.window;
+            ++done;
+        }
+        for (auto id : ids) {
+            tracker.popFromTracking(id);
+        }
+        completed += done;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < opts.threads; i++) {
+        threads.emplace_back(work);
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(opts.seconds));
+    stop = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t total = completed;
+    std::cout << "threads=" << opts.threads << " shards=" << opts.shards
+              << " window=" << opts.window << std::endl
+              << "  requests=" << total
+              << " requests/sec=" << std::fixed << total / secs
+              << " per thread=" << total / secs / opts.threads
+              << " outstanding=" << tracker.getOutstandingSvcReqsCount()
+              << std::endl;
+    return (0 < total && 0 == tracker.getOutstandingSvcReqsCount()) ? 0 : -1;
+}
@@ -8,6 +8,7 @@
 #include <iostream>
 
 #include <util/bloomfilter.h>
+#include <hash/MurmurHash2.h>
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -62,6 +63,99 @@ TEST_F(BFTest, basic) {
 
 }
 
+TEST_F(BFTest, sizing) {
+    uint32_t bits = fds::util::BloomFilter::optimalTotalBits(100000, 0.01);
+    uint8_t k = fds::util::BloomFilter::optimalBitsPerKey(bits, 100000);
+    EXPECT_EQ(bits % 64, 0u);
+    EXPECT_NEAR(bits / 100000.0, 9.59, 0.1);
+    EXPECT_EQ(k, 7);
+
+    fds::util::BloomFilter bf(bits, k);
+    for (int i = 0; i < 100000; i++) {
+        bf.add(std::to_string(i));
+    }
+    uint32_t falsePositives = 0;
+    for (int i = 100000; i < 200000; i++) {
+        if (bf.lookup(std::to_string(i))) falsePositives++;
+    }
+    EXPECT_LT(falsePositives, 1500u);
+
+    /* Packed format is about a word per 64 bits */
+    serialize::Serializer* s = serialize::getMemSerializer();
+    uint32_t size = bf.write(s);
+    EXPECT_LT(size, bits / 8 + 64);
+    std::string buffer = s->getBufferAsString();
+    delete s;
+
+    fds::util::BloomFilter bf1;
+    serialize::Deserializer* d = serialize::getMemDeserializer(buffer);
+    bf1.read(d);
+    delete d;
+    for (int i = 0; i < 100000; i += 97) {
+        EXPECT_TRUE(bf1.lookup(std::to_string(i)));
+    }
+}
+
+TEST_F(BFTest, legacyFormat) {
+    /* One char per bit, highest bit first, seeded hashes */
+    uint32_t totalBits = 4096;
+    uint32_t bitsPerKey = 4;
+    uint32_t seeds[] = { 0xABABABAB, 0xABCBCBCB, 0xDBDBDBDB, 0xEBAFAFAB };
+    std::string data(totalBits, '0');
+    for (uint32_t i = 0; i < bitsPerKey; i++) {
+        uint32_t pos = MurmurHash2("test1", 5, seeds[i]) % totalBits;
+        data[totalBits - 1 - pos] = '1';
+    }
+
+    serialize::Serializer* s = serialize::getMemSerializer();
+    s->writeI32(bitsPerKey);
+    s->writeI32(totalBits);
+    s->writeString(data);
+    std::string buffer = s->getBufferAsString();
+    delete s;
+
+    fds::util::BloomFilter bf;
+    serialize::Deserializer* d = serialize::getMemDeserializer(buffer);
+    bf.read(d);
+    delete d;
+    EXPECT_EQ(bf.getTotalBits(), totalBits);
+    EXPECT_TRUE(bf.lookup("test1"));
+    EXPECT_FALSE(bf.lookup("test2"));
+}
+
+TEST_F(BFTest, formatVersion) {
+    fds::util::BloomFilter bf(4096, 4);
+    bf.add("test1");
+    serialize::Serializer* s = serialize::getMemSerializer();
+    bf.write(s);
+    std::string buffer = s->getBufferAsString();
+    delete s;
+
+    fds::util::BloomFilter bf1;
+    serialize::Deserializer* d = serialize::getMemDeserializer(buffer);
+    bf1.read(d);
+    delete d;
+    EXPECT_FALSE(bf1.formatMismatch());
+    EXPECT_TRUE(bf1.lookup("test1"));
+    EXPECT_FALSE(bf1.lookup("test2"));
+
+    /* Same filter behind another version */
+    s = serialize::getMemSerializer();
+    s->writeI32(fds::util::BloomFilter::PACKED_FORMAT_MAGIC);
+    s->writeI32(fds::util::BloomFilter::FORMAT_VERSION + 1);
+    std::string header = s->getBufferAsString();
+    delete s;
+    buffer.replace(0, header.size(), header);
+
+    d = serialize::getMemDeserializer(buffer);
+    bf1.read(d);
+    delete d;
+    EXPECT_TRUE(bf1.formatMismatch());
+    /* Matches everything, so nothing reads as unreferenced */
+    EXPECT_TRUE(bf1.lookup("test1"));
+    EXPECT_TRUE(bf1.lookup("test2"));
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -1,5 +1,11 @@
 
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <fds_assert.h>
 #include <hash/MurmurHash2.h>
+#include <hash/MurmurHash3.h>
+#include <util/Log.h>
 #include <util/bloomfilter.h>
 namespace fds { namespace util {
 
@@ -14,83 +20,193 @@ uint32_t seed[] = {
     0xB097878F, 0xB899078A, 0xB98636BE, 0xB630873F
 };
 
+static const uint32_t doubleHashSeed = 0xABABABAB;
+
+/**
+ * Calls fn with each of the bitsPerKey positions for data.  Double hashing:
+ * position i is h1 + i * h2, with h2 forced odd so the probes never collapse.
+ */
+template <typename Fn>
+static inline bool forEachPosition(const void* data, uint32_t len,
+                                   uint32_t bitsPerKey, uint32_t totalBits,
+                                   bool legacyHash, Fn fn) {
+    if (legacyHash) {
+        for (uint32_t i = 0; i < bitsPerKey; i++) {
+            if (!fn(MurmurHash2(data, len, seed[i]) % totalBits)) return false;
+        }
+        return true;
+    }
+    uint64_t h[2];
+    MurmurHash3_x64_128(data, len, doubleHashSeed, h);
+    uint64_t h1 = h[0] % totalBits;
+    uint64_t h2 = (h[1] | 1) % totalBits;
+    for (uint32_t i = 0; i < bitsPerKey; i++) {
+        if (!fn(static_cast<uint32_t>(h1))) return false;
+        h1 += h2;
+        if (h1 >= totalBits) h1 -= totalBits;
+    }
+    return true;
+}
 
 BloomFilter::BloomFilter(uint32_t totalBits, uint8_t bitsPerKey) :
         totalBits(totalBits), bitsPerKey(bitsPerKey) {
-    bits.reset(new boost::dynamic_bitset<>(totalBits));
+    fds_verify(totalBits > 0);
+    fds_verify(bitsPerKey > 0 && bitsPerKey <= MAX_BITS_PER_KEY);
+    words.resize((static_cast<uint64_t>(totalBits) + 63) / 64, 0);
+}
+
+uint32_t BloomFilter::optimalTotalBits(uint64_t expectedKeys, double fpRate) {
+    if (expectedKeys == 0) expectedKeys = 1;
+    if (fpRate <= 0.0 || fpRate >= 1.0) fpRate = 0.01;
+    double bits = -static_cast<double>(expectedKeys) * std::log(fpRate) / (M_LN2 * M_LN2);
+    /* Round up to a whole word */
+    double maxBits = static_cast<double>(std::numeric_limits<uint32_t>::max() & ~63U);
+    bits = std::min(std::ceil(bits / 64.0) * 64.0, maxBits);
+    return std::max(static_cast<uint32_t>(bits), 64U);
+}
+
+uint8_t BloomFilter::optimalBitsPerKey(uint32_t totalBits, uint64_t expectedKeys) {
+    if (expectedKeys == 0) expectedKeys = 1;
+    double k = std::round(static_cast<double>(totalBits) / expectedKeys * M_LN2);
+    k = std::max(1.0, std::min(k, static_cast<double>(MAX_BITS_PER_KEY)));
+    return static_cast<uint8_t>(k);
+}
+
+void BloomFilter::addData(const void* data, uint32_t len) {
+    forEachPosition(data, len, bitsPerKey, totalBits, legacyHash,
+                    [this](uint32_t pos) { setBit(pos); return true; });
+}
+
+bool BloomFilter::lookupData(const void* data, uint32_t len) const {
+    return forEachPosition(data, len, bitsPerKey, totalBits, legacyHash,
+                           [this](uint32_t pos) { return testBit(pos); });
 }
 
 void BloomFilter::add(const ObjectID& objID) {
-    std::vector<uint32_t> positions = generatePositions(objID.GetId(), objID.getDigestLength());
-    add(positions);
+    addData(objID.GetId(), objID.getDigestLength());
 }
 
 void BloomFilter::add(const std::string& data) {
-    std::vector<uint32_t> positions = generatePositions(data.data(), data.length());
-    add(positions);
+    addData(data.data(), data.length());
 }
 
 bool BloomFilter::lookup(const ObjectID& objID) const {
-    std::vector<uint32_t> positions = generatePositions(objID.GetId(), objID.getDigestLength());
-    return lookup(positions);
+    return lookupData(objID.GetId(), objID.getDigestLength());
 }
 
 bool BloomFilter::lookup(const std::string& data) const {
-    std::vector<uint32_t> positions = generatePositions(data.data(), data.length());
-    return lookup(positions);
+    return lookupData(data.data(), data.length());
 }
 
 void BloomFilter::add(const std::vector<uint32_t>& positions) {
     for (uint i = 0 ; i < bitsPerKey ; i++) {
-        bits->set(positions[i], true);
+        setBit(positions[i]);
     }
 }
 
 bool BloomFilter::lookup(const std::vector<uint32_t>& positions) const {
     for (uint i = 0 ; i < bitsPerKey ; i++) {
-        if (!bits->test(positions[i])) return false;
+        if (!testBit(positions[i])) return false;
     }
     return true;
 }
 
 void BloomFilter::merge(const BloomFilter& filter) {
-   *bits |= *(filter.bits); 
+    fds_verify(totalBits == filter.totalBits);
+    fds_verify(bitsPerKey == filter.bitsPerKey);
+    fds_verify(legacyHash == filter.legacyHash);
+    for (size_t i = 0; i < words.size(); i++) {
+        words[i] |= filter.words[i];
+    }
 }
 
 std::vector<uint32_t> BloomFilter::generatePositions(const void* data, uint32_t len) const {
     std::vector<uint32_t> positions;
     positions.reserve(bitsPerKey);
-    for (uint i = 0 ; i < bitsPerKey ; i++) {
-        positions.push_back(MurmurHash2(data, len, seed[i]) % totalBits);
-    }
+    forEachPosition(data, len, bitsPerKey, totalBits, legacyHash,
+                    [&positions](uint32_t pos) { positions.push_back(pos); return true; });
     return positions;
 }
 
+/**
+ * Packed format:
+ *   magic, version, bitsPerKey, totalBits, word count, words (host byte order)
+ */
 uint32_t BloomFilter::write(serialize::Serializer*  s) const {
+    fds_verify(!legacyHash);
+    fds_verify(!versionMismatch);
     uint32_t bytes = 0;
-    std::string data;
+    bytes += s->writeI32(PACKED_FORMAT_MAGIC);
+    bytes += s->writeI32(FORMAT_VERSION);
     bytes += s->writeI32(bitsPerKey);
     bytes += s->writeI32(totalBits);
-    boost::to_string(*bits, data);
-    bytes += s->writeString(data);
+    bytes += s->writeI32(words.size());
+    bytes += s->writeBuffer(reinterpret_cast<const int8_t*>(words.data()),
+                            words.size() * sizeof(uint64_t));
     return bytes;
 }
 
 uint32_t BloomFilter::read(serialize::Deserializer* d) {
     uint32_t bytes = 0;
-    std::string data;
+    int32_t first;
+    versionMismatch = false;
+    bytes += d->readI32(first);
+    if (first != PACKED_FORMAT_MAGIC) {
+        /* Legacy format: bitsPerKey, totalBits, then one '0'/'1' char per bit
+         * with the highest bit first */
+        std::string data;
+        bitsPerKey = first;
+        bytes += d->readI32(totalBits);
+        bytes += d->readString(data);
+        fds_assert(data.length() == totalBits);
+        legacyHash = true;
+        words.assign((static_cast<uint64_t>(totalBits) + 63) / 64, 0);
+        for (uint32_t i = 0; i < data.length(); i++) {
+            if (data[i] == '1') {
+                setBit(totalBits - 1 - i);
+            }
+        }
+        return bytes;
+    }
+
+    int32_t version;
+    bytes += d->readI32(version);
+    legacyHash = false;
+    if (version != FORMAT_VERSION) {
+        /* Nothing past the version can be trusted.  Match every key until
+         * the owner replaces this filter. */
+        GLOGWARN << "bloom filter format version " << version
+                 << " does not match " << FORMAT_VERSION;
+        versionMismatch = true;
+        bitsPerKey = 1;
+        totalBits = 64;
+        words.assign(1, ~0ULL);
+        return bytes;
+    }
+
+    uint32_t wordCnt;
     bytes += d->readI32(bitsPerKey);
     bytes += d->readI32(totalBits);
-    bytes += d->readString(data);
-    fds_assert(data.length() == totalBits);
-    bits.reset(new boost::dynamic_bitset<>(data));
+    bytes += d->readI32(wordCnt);
+    fds_assert(wordCnt == (static_cast<uint64_t>(totalBits) + 63) / 64);
+    words.assign(wordCnt, 0);
+    /* The transport may return a large buffer in pieces */
+    int8_t* buf = reinterpret_cast<int8_t*>(words.data());
+    uint32_t want = wordCnt * sizeof(uint64_t);
+    uint32_t got = 0;
+    while (got < want) {
+        uint32_t n = d->readBuffer(buf + got, want - got);
+        if (n == 0) break;
+        got += n;
+    }
+    fds_assert(got == want);
+    bytes += got;
     return bytes;
-    
 }
 
 uint32_t BloomFilter::getEstimatedSize() const {
     uint32_t bytes = 0;
-    bytes += bits->size() + 10*4 ;
+    bytes += words.size() * sizeof(uint64_t) + 10*4 ;
     return bytes;
 }
 }  // namespace util
@@ -3,6 +3,11 @@
  */
 
 #include <sys/resource.h>
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <util/memutils.h>
 
 namespace fds {
@@ -14,5 +19,38 @@ fds_uint64_t getMemoryKB() {
     return usage.ru_maxrss;
 }
 
+bool isZeroFilled(const void* buf, size_t len) {
+    auto p = static_cast<const uint8_t*>(buf);
+
+    // Walk up to a 16 byte boundary
+    while (len && (reinterpret_cast<uintptr_t>(p) & 15)) {
+        if (*p) return false;
+        ++p; --len;
+    }
+
+#ifdef __SSE2__
+    auto const zero = _mm_setzero_si128();
+    while (len >= 64) {
+        auto v = reinterpret_cast<const __m128i*>(p);
+        auto acc = _mm_or_si128(_mm_or_si128(_mm_load_si128(v), _mm_load_si128(v + 1)),
+                                _mm_or_si128(_mm_load_si128(v + 2), _mm_load_si128(v + 3)));
+        if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero))) return false;
+        p += 64; len -= 64;
+    }
+#endif
+
+    while (len >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (word) return false;
+        p += sizeof(word); len -= sizeof(word);
+    }
+    while (len) {
+        if (*p) return false;
+        ++p; --len;
+    }
+    return true;
+}
+
 }  // namespace util
 }  // namespace fds